@@ -0,0 +1,110 @@
+#define _GNU_SOURCE            // cpu_set_t, pthread_setaffinity_np, getcpu
+#include "affinity.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// -- < Implementation > ---------------------------------------------------------
+
+int affinity_parse(const char * text, cpu_set_t * cpus)
+{
+    CPU_ZERO(cpus);
+
+    while (*text != '\0')
+    {
+        char * end;
+        long first = strtol(text, &end, 10);
+        long last = first;
+        if (end == text || first < 0)
+            return 1;
+
+        if (*end == '-')
+        {
+            text = end + 1;
+            last = strtol(text, &end, 10);
+            if (end == text || last < first)
+                return 1;
+        }
+        if (last >= CPU_SETSIZE)
+            return 1;
+
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, cpus);
+
+        if (*end == ',')
+            end++;
+        else if (*end != '\0')
+            return 1;
+        text = end;
+    }
+
+    return CPU_COUNT(cpus) == 0;
+}
+
+int affinity_count(const cpu_set_t * cpus)
+{
+    return CPU_COUNT(cpus);
+}
+
+void affinity_current(cpu_set_t * cpus)
+{
+    if (sched_getaffinity(0, sizeof(cpu_set_t), cpus) != 0)
+        CPU_ZERO(cpus);
+}
+
+int affinity_allowed(const cpu_set_t * cpus)
+{
+    cpu_set_t current, common;
+    affinity_current(&current);
+    CPU_AND(&common, &current, cpus);
+    return CPU_EQUAL(&common, cpus);
+}
+
+void affinity_format(const cpu_set_t * cpus, char * buf, size_t size)
+{
+    size_t len = 0;
+    buf[0] = '\0';
+
+    for (int cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++)
+    {
+        if (!CPU_ISSET(cpu, cpus))
+            continue;
+
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus))
+            last++;
+
+        len += snprintf(buf + len, size - len, last > cpu ? "%s%d-%d" : "%s%d", len ? "," : "", cpu, last);
+        cpu = last;
+    }
+}
+
+void affinity_nth(const cpu_set_t * cpus, int index, cpu_set_t * cpu)
+{
+    int n = index % CPU_COUNT(cpus);
+
+    CPU_ZERO(cpu);
+    for (int i = 0; i < CPU_SETSIZE; i++)
+    {
+        if (CPU_ISSET(i, cpus) && n-- == 0)
+        {
+            CPU_SET(i, cpu);
+            return;
+        }
+    }
+}
+
+int affinity_pin(pthread_t thread, const cpu_set_t * cpus)
+{
+    return pthread_setaffinity_np(thread, sizeof(cpu_set_t), cpus);
+}
+
+int affinity_set_attr(pthread_attr_t * attr, const cpu_set_t * cpus)
+{
+    return pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), cpus);
+}
+
+int affinity_current_node(void)
+{
+    unsigned cpu, node;
+    return getcpu(&cpu, &node) == 0 ? (int) node : 0;
+}
@@ -0,0 +1,70 @@
+/*
+    CPU pinning of server threads.
+
+    On machines with several NUMA nodes a thread that migrates to another
+    socket keeps using memory of the node it started on, and every access
+    to it crosses the interconnect. Pinning the acceptor, the workers and
+    the logger writer keeps each of them on chosen CPUs.
+
+    Memory follows through the kernel's default first-touch policy: a page
+    is placed on the node of the thread that first writes it. Threads are
+    pinned before they allocate their own state (coroutine stacks, metrics
+    shards, log rings, thread stacks), so that state is local without
+    binding any memory explicitly. Memory shared by every thread, like the
+    variables, stays wherever it was first touched.
+
+    CPU lists use the usual kernel syntax: "0-3,8,10-11". The CPU_* macros
+    need _GNU_SOURCE, which csapp.h can't be built with, so sets are only
+    handled through the functions below.
+*/
+
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+
+/// Summary:
+///     Parse a CPU list
+/// Return:
+///     0 on success, anything else if the list is invalid or empty
+int affinity_parse(const char * text, cpu_set_t * cpus);
+
+/// Summary:
+///     Amount of CPUs in a set, 0 meaning no pinning was asked for
+int affinity_count(const cpu_set_t * cpus);
+
+/// Summary:
+///     CPUs the calling thread may currently run on
+void affinity_current(cpu_set_t * cpus);
+
+/// Summary:
+///     Tell if the calling thread may run on every CPU of a set
+int affinity_allowed(const cpu_set_t * cpus);
+
+/// Summary:
+///     Write a CPU set as a CPU list, for logs
+void affinity_format(const cpu_set_t * cpus, char * buf, size_t size);
+
+/// Summary:
+///     The index-th CPU of a set, wrapping around, as a set of its own
+void affinity_nth(const cpu_set_t * cpus, int index, cpu_set_t * cpu);
+
+/// Summary:
+///     Restrict a thread to a set of CPUs. It moves there right away.
+/// Return:
+///     0 on success, an errno value otherwise
+int affinity_pin(pthread_t thread, const cpu_set_t * cpus);
+
+/// Summary:
+///     Make the threads created with attr start on a set of CPUs
+/// Return:
+///     0 on success, an errno value otherwise
+int affinity_set_attr(pthread_attr_t * attr, const cpu_set_t * cpus);
+
+/// Summary:
+///     NUMA node of the CPU the calling thread runs on, 0 if it can't be told
+int affinity_current_node(void);
+
+#endif // AFFINITY_H
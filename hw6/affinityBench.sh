@@ -0,0 +1,116 @@
+#!/bin/bash
+#
+# Thread placement benchmark: drives the same calcBench workload against
+# calcServer with its threads left to the scheduler, then pinned to one
+# NUMA node (the acceptor and the log writer on its first CPU, the
+# workers on the others), and compares throughput, p99 latency and the
+# allocations the kernel had to serve from another node than the one
+# asked for (other_node in numastat). Every placement runs several times
+# against a fresh server and its median is kept.
+#
+# Usage: ./affinityBench.sh [-s <seconds>] [-n <runs>] [-N <node>]
+#                           [-t <coroutine threads>] [-o <calcBench options>]
+#
+# -t 0 runs sessions on threads instead of coroutines. By default there is
+# one coroutine thread per worker CPU. On a machine with a single node
+# there is no remote memory to avoid, so both placements should be even.
+#
+
+PORT=15800
+DURATION=3
+RUNS=3
+NODE=0
+CORO_THREADS=
+BENCH_OPTIONS="-c 8 -d 4 -m 50,25,25"
+server=
+
+while getopts "s:n:N:t:o:" opt; do
+	case $opt in
+		s) DURATION=$OPTARG ;;
+		n) RUNS=$OPTARG ;;
+		N) NODE=$OPTARG ;;
+		t) CORO_THREADS=$OPTARG ;;
+		o) BENCH_OPTIONS=$OPTARG ;;
+		*) sed -n '/^# Usage/,/^#$/p' "$0"; exit 2 ;;
+	esac
+done
+
+cleanup() {
+	[ -n "$server" ] && kill "$server" 2> /dev/null
+	wait 2> /dev/null
+}
+trap cleanup EXIT
+
+# CPUs of the node, e.g. "0-7,16-23", and the first and the rest of them one by one
+cpulist=$(cat /sys/devices/system/node/node$NODE/cpulist 2> /dev/null || echo "0-$(($(nproc) - 1))")
+cpus=$(echo "$cpulist" | tr ',' '\n' | awk -F- '{ for (i = $1; i <= ($2 == "" ? $1 : $2); i++) print i }')
+first=$(echo "$cpus" | head -n 1)
+rest=$(echo "$cpus" | tail -n +2 | paste -sd, -)
+workers=${rest:-$first}
+[ -z "$CORO_THREADS" ] && CORO_THREADS=$(echo "$workers" | tr ',' '\n' | wc -l)
+nodes=$(ls -d /sys/devices/system/node/node* 2> /dev/null | wc -l)
+
+# value of a numeric field of a calcBench JSON result
+field() {
+	local json=$1 name=$2
+	printf '%s' "$json" | grep -o "\"$name\":[0-9.]*" | head -n 1 | cut -d: -f2
+}
+
+median() {
+	sort -n | awk '{ v[NR] = $1 } END { print (NR % 2) ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2 }'
+}
+
+# pages allocated off their preferred node so far, over every node
+other_node() {
+	cat /sys/devices/system/node/node*/numastat 2> /dev/null | awk '$1 == "other_node" { n += $2 } END { print n + 0 }'
+}
+
+# run one placement once, prints "<throughput_rps> <p99_us> <remote pages>"
+run_placement() {
+	local before after json errors
+	before=$(other_node)
+
+	./calcServer $PORT --log-level error --coro-threads "$CORO_THREADS" $1 > /dev/null 2>&1 &
+	server=$!
+	sleep 0.3
+
+	json=$(./calcBench -p $PORT -t "$DURATION" $BENCH_OPTIONS 2> /dev/null)
+
+	kill -INT $server 2> /dev/null
+	wait $server 2> /dev/null
+	server=
+	after=$(other_node)
+
+	errors=$(field "$json" errors)
+	if [ -z "$json" ] || [ "${errors:-1}" != "0" ]; then
+		return 1
+	fi
+	echo "$(field "$json" throughput_rps) $(field "$json" p99) $((after - before))"
+}
+
+echo "$nodes NUMA node(s), pinning to node $NODE: acceptor and logger on CPU $first, workers on CPUs $workers"
+
+declare -A rps p99 remote
+for placement in unpinned pinned; do
+	options=
+	[ $placement == pinned ] && options="--pin-acceptor $first --pin-logger $first --pin-workers $workers"
+
+	results=()
+	for ((run = 0; run < RUNS; run++)); do
+		if ! result=$(run_placement "$options"); then
+			echo "$placement...failed: calcBench reported errors"
+			exit 1
+		fi
+		results+=("$result")
+	done
+
+	rps[$placement]=$(printf '%s\n' "${results[@]}" | cut -d' ' -f1 | median)
+	p99[$placement]=$(printf '%s\n' "${results[@]}" | cut -d' ' -f2 | median)
+	remote[$placement]=$(printf '%s\n' "${results[@]}" | cut -d' ' -f3 | median)
+	echo "$placement...${rps[$placement]} rps, p99 ${p99[$placement]}us, ${remote[$placement]} remote pages"
+done
+
+awk -v rps="${rps[pinned]}" -v base_rps="${rps[unpinned]}" -v p99="${p99[pinned]}" -v base_p99="${p99[unpinned]}" 'BEGIN {
+	printf "pinned vs unpinned: throughput %+.1f%%, p99 %+.1f%%\n",
+		100 * (rps - base_rps) / base_rps, (base_p99 > 0 ? 100 * (p99 - base_p99) / base_p99 : 0)
+}'
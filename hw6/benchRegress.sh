@@ -0,0 +1,158 @@
+#!/bin/bash
+#
+# End-to-end regression benchmark: starts calcServer on localhost, drives
+# a fixed set of calcBench workload profiles against it and compares
+# throughput and p99 latency with the numbers in a baseline file. Every
+# profile runs several times against a fresh server and its median is
+# kept, to smooth out noise.
+#
+# Usage: ./benchRegress.sh [-t <throughput %>] [-l <latency %>] [-s <seconds>]
+#                          [-n <runs>] [-b <baseline file>] [-u]
+#
+# Exits with 1 if a profile lost more than -t percent of its throughput or
+# its p99 latency grew by more than -l percent. -u records the current
+# numbers as the new baseline instead of comparing. Baselines only make
+# sense on the machine they were recorded on.
+#
+
+PORT=15100
+THRESHOLD=15
+LATENCY_THRESHOLD=50
+DURATION=3
+RUNS=3
+BASELINE=benchBaseline.txt
+UPDATE=0
+failures=0
+server=
+
+# name and calcBench options of every profile
+PROFILES=(
+	"literal|-c 4 -m 100,0,0"
+	"mixed|-c 4 -m 50,25,25"
+	"assign|-c 8 -m 0,100,0"
+	"pipelined-read|-c 4 -d 16 -m 0,0,100 -k 1000"
+	"open-loop|-c 8 -r 20000 -m 50,25,25"
+)
+
+while getopts "t:l:s:n:b:u" opt; do
+	case $opt in
+		t) THRESHOLD=$OPTARG ;;
+		l) LATENCY_THRESHOLD=$OPTARG ;;
+		s) DURATION=$OPTARG ;;
+		n) RUNS=$OPTARG ;;
+		b) BASELINE=$OPTARG ;;
+		u) UPDATE=1 ;;
+		*) sed -n '/^# Usage/,/^#$/p' "$0"; exit 2 ;;
+	esac
+done
+
+cleanup() {
+	[ -n "$server" ] && kill "$server" 2> /dev/null
+	wait 2> /dev/null
+}
+trap cleanup EXIT
+
+# value of a numeric field of a calcBench JSON result, e.g. field "$json" p99
+field() {
+	local json=$1 name=$2
+	# latency_us comes before latency_uncorrected_us, so the first match is the corrected one
+	printf '%s' "$json" | grep -o "\"$name\":[0-9.]*" | head -n 1 | cut -d: -f2
+}
+
+median() {
+	sort -n | awk '{ v[NR] = $1 } END { print (NR % 2) ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2 }'
+}
+
+# run one profile once, prints "<throughput_rps> <p99_us>"
+run_profile() {
+	./calcServer $PORT --log-level error > /dev/null 2>&1 &
+	server=$!
+	sleep 0.3
+
+	local json
+	json=$(./calcBench -p $PORT -t "$DURATION" $1 2> /dev/null)
+
+	kill -INT $server 2> /dev/null
+	wait $server 2> /dev/null
+	server=
+
+	local errors
+	errors=$(field "$json" errors)
+	if [ -z "$json" ] || [ "${errors:-1}" != "0" ]; then
+		return 1
+	fi
+	echo "$(field "$json" throughput_rps) $(field "$json" p99)"
+}
+
+if [ $UPDATE -eq 1 ]; then
+	{
+		echo "# calcServer regression baseline, written by ./benchRegress.sh -u on $(uname -n)"
+		echo "# profile throughput_rps p99_us"
+	} > "$BASELINE.tmp"
+elif [ ! -f "$BASELINE" ]; then
+	echo "No baseline $BASELINE, record one with $0 -u"
+	exit 2
+fi
+
+for profile in "${PROFILES[@]}"; do
+	name=${profile%%|*}
+	options=${profile#*|}
+
+	results=()
+	for ((run = 0; run < RUNS; run++)); do
+		if ! result=$(run_profile "$options"); then
+			echo "$name...failed: calcBench reported errors"
+			failures=$((failures + 1))
+			continue 2
+		fi
+		results+=("$result")
+	done
+
+	rps=$(printf '%s\n' "${results[@]}" | cut -d' ' -f1 | median)
+	p99=$(printf '%s\n' "${results[@]}" | cut -d' ' -f2 | median)
+
+	if [ $UPDATE -eq 1 ]; then
+		echo "$name $rps $p99" >> "$BASELINE.tmp"
+		echo "$name...recorded $rps rps, p99 ${p99}us"
+		continue
+	fi
+
+	read -r base_rps base_p99 <<< "$(awk -v name="$name" '$1 == name { print $2, $3 }' "$BASELINE")"
+	if [ -z "$base_rps" ]; then
+		echo "$name...no baseline, $rps rps, p99 ${p99}us"
+		continue
+	fi
+
+	verdict=$(awk -v rps="$rps" -v p99="$p99" -v base_rps="$base_rps" -v base_p99="$base_p99" \
+		-v t="$THRESHOLD" -v l="$LATENCY_THRESHOLD" 'BEGIN {
+		drps = 100 * (rps - base_rps) / base_rps
+		dp99 = base_p99 > 0 ? 100 * (p99 - base_p99) / base_p99 : 0
+		status = (drps < -t || dp99 > l) ? "REGRESSED" : "ok"
+		printf "%s %.0f rps (%+.1f%%), p99 %.1fus (%+.1f%%)", status, rps, drps, p99, dp99
+	}')
+
+	if [ "${verdict%% *}" == "REGRESSED" ]; then
+		echo "$name...failed: $verdict"
+		failures=$((failures + 1))
+	else
+		echo "$name...passed: ${verdict#ok }"
+	fi
+done
+
+if [ $UPDATE -eq 1 ]; then
+	if [ $failures -eq 0 ]; then
+		mv "$BASELINE.tmp" "$BASELINE"
+		echo "Baseline written to $BASELINE"
+	else
+		rm -f "$BASELINE.tmp"
+		echo "Baseline not written"
+	fi
+	exit $((failures > 0))
+fi
+
+if [ $failures -eq 0 ]; then
+	echo "No regressions!"
+else
+	echo "$failures profile(s) regressed"
+	exit 1
+fi
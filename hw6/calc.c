@@ -2,49 +2,158 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include "logger.h"
 #include <assert.h>
 #include "calc.h"
 
-#define SIZE_OF_MAP 10
+#define INITIAL_SIZE_OF_MAP 16 // Must be a power of two
+#define MAX_LOAD_PERCENT 75    // Grow the map when used + deleted slots go over this
+#define STORE_MAGIC "CALCMAP1"    // First bytes of a store file
+#define STORE_HEADER_SIZE 128     // The slots follow the header, at a fixed offset
+#define EVICTION_SAMPLES 5        // Variables compared to choose one to evict
+#define EVICTED_LOAD_PERCENT 60   // A map at the memory limit evicts down to this load, then rehashes in place
+#define MULTI_BATCH 16            // Names of calc_mget and calc_mset hashed and prefetched together
+
+/// State of a slot in the variables map
+enum SlotState
+{
+    SLOT_EMPTY = 0,
+    SLOT_USED,
+    SLOT_DELETED
+};
+
+/// An overwritten value of a variable, kept while an open snapshot may still read it
+struct Version
+{
+    unsigned long version;
+    int value;
+    struct Version *older;
+};
 
 /// This struct contains a node of a dictionary that maps a string to an int.
+/// It holds no pointers, so a store file can map the slots at any address.
 struct Map
 {
-    char key[20];
+    char key[CALC_KEY_SIZE];
     int value;
+    int state;
+    uint32_t access;              // Seconds since the epoch of the last access, for eviction
+    unsigned long version;        // Store version of the last write, 0 for a slot not written yet
+    int64_t expires;              // Milliseconds since the epoch at which it expires, 0 for never
+};
+
+/// First bytes of a store file, followed by the slots
+struct StoreHeader
+{
+    char magic[8];
+    uint32_t slot_size;           // sizeof(struct Map), a different layout can't be mapped
+    uint32_t clean;               // 1 when closed by calc_destroy, 0 while open
+    uint64_t epoch;               // Bumped at every open
+    uint64_t size;
+    uint64_t used;
+    uint64_t deleted;
+    uint64_t version;
+    uint64_t removed;
+    uint32_t checksum;            // FNV-1a of the fields above
 };
+_Static_assert(sizeof(struct StoreHeader) <= STORE_HEADER_SIZE, "the store header overlaps the slots");
 
 /// This struct contains the general program state
 struct Calc
 {
-    struct Map variables[SIZE_OF_MAP];
+    struct Map *variables;        // Open addressing hash map, linear probing
+    size_t size;                  // Amount of slots in variables
+    size_t used;                  // Slots holding a variable
+    size_t deleted;               // Slots holding a tombstone
+    calc_assign_hook assign_hook; // Called after every assignment, may be NULL
+    void *assign_hook_ctx;        // Opaque argument for assign_hook
+    calc_delete_hook delete_hook; // Called after every removal, may be NULL
+    void *delete_hook_ctx;
+    unsigned long version;        // Bumped by every change to the variables
+    unsigned long removed;        // Version of the last delete or clear
+    unsigned long *snapshots;     // Versions of the open snapshots, unordered
+    size_t snapshot_count;
+    size_t snapshot_capacity;
+    size_t history_count;         // Versions kept for snapshots, in every slot
+    struct Version **history;     // Older values of every slot, newest first; NULL until needed
+    struct StoreHeader *store;    // Mapping of the store file, NULL for a calculator in memory
+    int store_fd;
+    char *store_path;
+    int expiring;                 // A variable got a TTL at some point, so calc_expire has work
+    size_t expire_cursor;         // Next slot calc_expire looks at
+    uint64_t random;              // xorshift state, picks the slots sampled for eviction
+    int scratch;                  // Not counted in mapBytes and never evicts
 };
 
-// -- < Auxiliar functions > ---------------
+/// Kind of a token in an expression
+enum TokenKind
+{
+    TOKEN_END,
+    TOKEN_NUMBER,
+    TOKEN_NAME,
+    TOKEN_OPERATOR,
+    TOKEN_INVALID
+};
 
-///     Returns true if precedence of operator o1 is more or equal than the one of o2
-int precedence(char o1, char o2)
+/// A token read from an expression
+struct Token
 {
-    if (((o1 == '+') || (o1 == '-')) && ((o2 == '*') || (o2 == '/')))
-        return 0;
-    else if (o1 == '=' && ((o2 == '+') || (o2 == '-') || (o2 == '*') || (o2 == '/')))
-        return 0;
-    else
-        return 1;
-}
+    enum TokenKind kind;
+    const char *start;
+    size_t length;
+    int number;
+};
+
+/// State of the parser while evaluating an expression
+struct Parser
+{
+    struct Calc *calc;
+    const char *next; // Next character to read
+    struct Token current;
+    size_t ops;       // Operations evaluated so far
+    const char *end;  // Where the expression stops before a "ttl" suffix, NULL at the terminator
+    int64_t expires;  // Expiration of the variables assigned, 0 for never
+    size_t assigned;  // Assignments evaluated so far, a TTL needs at least one
+};
+
+// Reason of the last failed evaluation on this thread
+static __thread enum calc_error lastError = CALC_ERROR_NONE;
+
+// Operations evaluated by the last evaluation on this thread
+static __thread size_t lastCost = 0;
+
+// Most operations a single expression may evaluate, 0 for no limit
+static size_t opBudget = 0;
+
+// Most bytes the maps of every calculator may take together, 0 for no limit
+static size_t memoryLimit = 0;
+
+// Bytes the maps of every calculator take, and variables removed by expiration or eviction (atomic)
+static size_t mapBytes = 0;
+static unsigned long expiredTotal = 0;
+static unsigned long evictedTotal = 0;
+
+// -- < Auxiliar functions > ---------------
 
 ///     Performs arithmethic operations and returns the result.
 int arithmethicOp(int n1, int n2, char op)
 {
+    // Use unsigned arithmetic so overflow wraps around instead of being undefined
     switch (op)
     {
     case '+':
-        return n1 + n2;
+        return (int)((unsigned)n1 + (unsigned)n2);
     case '-':
-        return n1 - n2;
+        return (int)((unsigned)n1 - (unsigned)n2);
     case '*':
-        return n1 * n2;
+        return (int)((unsigned)n1 * (unsigned)n2);
     case '/':
         return n1 / n2;
     }
@@ -53,224 +162,1292 @@ int arithmethicOp(int n1, int n2, char op)
     return 0;
 }
 
-int getHash(char *key)
+///     FNV-1a hash of a variable name
+size_t getHash(const char *key)
 {
-    size_t k = 0;
+    size_t k = 14695981039346656037UL;
 
-    for (size_t i = 0; i < strlen(key); i++)
+    for (; *key != '\0'; key++)
     {
-        k = k + (size_t)key[i];
+        k ^= (unsigned char)*key;
+        k *= 1099511628211UL;
     }
-    return (k % SIZE_OF_MAP);
+    return k;
 }
 
-// -- < State manipulation functions > ---------------
+///     Current time in milliseconds since the epoch, the clock of expirations
+int64_t nowMs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
-/// Summary:
-///     Create a Calc object and initialize it
+///     Tells if a variable is past its expiration
+int slotExpired(const struct Map *slot)
+{
+    return slot->expires != 0 && slot->expires <= nowMs();
+}
 
-struct Calc *calc_create()
+///     Find the slot holding a variable, expired or not, given the hash of its name
+struct Map *lookupHashedSlot(struct Calc *calc, const char *name, size_t hash)
 {
-    LOG_INFO("Creating Calc Object\n\n");
-    return (struct Calc *)malloc(sizeof(struct Calc));
+    size_t mask = calc->size - 1;
+
+    for (size_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        struct Map *slot = &calc->variables[i];
+        if (slot->state == SLOT_EMPTY)
+            return NULL;
+        if (slot->state == SLOT_USED && strcmp(slot->key, name) == 0)
+            return slot;
+    }
 }
 
-///     Destroy Calc object
-void calc_destroy(struct Calc *calc)
+///     Find the slot holding a variable, expired or not
+struct Map *lookupSlot(struct Calc *calc, const char *name)
 {
-    LOG_INFO("Destroying Calc Object\n\n");
-    free(calc);
+    return lookupHashedSlot(calc, name, getHash(name));
 }
 
-///     Given an expression, evaluates it on the calculator and return the result
-int calc_eval(struct Calc *calc, const char *expr, int *result)
+///     Find the slot of a variable, or NULL if it does not exist or expired. An expired
+///     variable stays in its slot until a write, calc_expire or eviction removes it,
+///     since readers may share the calculator.
+struct Map *findHashedVariable(struct Calc *calc, const char *name, size_t hash)
 {
-    LOG_INFO("Evaluating Expression in Calc Object\n\n");
+    struct Map *slot = lookupHashedSlot(calc, name, hash);
+    if (slot == NULL || slotExpired(slot))
+        return NULL;
+
+    // Readers race on the access time, any of their clocks is good enough
+    if (memoryLimit != 0)
+    {
+        uint32_t now = (uint32_t)time(NULL);
+        if (__atomic_load_n(&slot->access, __ATOMIC_RELAXED) != now)
+            __atomic_store_n(&slot->access, now, __ATOMIC_RELAXED);
+    }
+    return slot;
+}
+
+///     Find the slot of a variable, or NULL if it does not exist or expired
+struct Map *findVariable(struct Calc *calc, const char *name)
+{
+    return findHashedVariable(calc, name, getHash(name));
+}
+
+///     Hash a batch of names and prefetch their first slots, so the cache misses of
+///     the batch overlap instead of being paid one probe at a time
+void prefetchBatch(struct Calc *calc, const char *const *names, size_t count, size_t *hashes)
+{
+    size_t mask = calc->size - 1;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        hashes[i] = getHash(names[i]);
+        __builtin_prefetch(&calc->variables[hashes[i] & mask]);
+    }
+}
+
+///     Tells if a name could be assigned by an expression: letters only, short enough
+int validName(const char *name)
+{
+    size_t length = 0;
+    while (isalpha((unsigned char)name[length]))
+        length++;
+    return length > 0 && length < CALC_KEY_SIZE && name[length] == '\0';
+}
+
+///     FNV-1a of the header of a store file, up to the checksum
+uint32_t storeChecksum(const struct StoreHeader *header)
+{
+    const unsigned char *p = (const unsigned char *)header;
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < offsetof(struct StoreHeader, checksum); i++)
+        h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+///     Write the counters of the calculator in the store header
+void storeWriteHeader(struct Calc *calc, int clean)
+{
+    struct StoreHeader *header = calc->store;
+
+    header->size = calc->size;
+    header->used = calc->used;
+    header->deleted = calc->deleted;
+    header->version = calc->version;
+    header->removed = calc->removed;
+    header->clean = clean;
+    header->checksum = storeChecksum(header);
+}
+
+///     Map a store file holding the given amount of slots, NULL on failure
+struct StoreHeader *storeMap(int fd, size_t size)
+{
+    void *map = mmap(NULL, STORE_HEADER_SIZE + size * sizeof(struct Map), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+///     Unmap a store file and close it
+void storeUnmap(struct StoreHeader *store, int fd)
+{
+    munmap(store, STORE_HEADER_SIZE + store->size * sizeof(struct Map));
+    close(fd);
+}
 
-    char operatorStack[20];
-    int numberStack[25];
-    char variablesStack[5][25];
-    char first = ' ';
+///     Create an empty store file with room for the given amount of slots, NULL on failure
+struct StoreHeader *storeCreate(const char *path, size_t size, uint64_t epoch, int *fd)
+{
+    struct StoreHeader *store = NULL;
 
-    int head = -1;
-    int headOp = -1;
-    int headVariable = -1;
+    *fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (*fd < 0)
+        return NULL;
 
-    size_t i = 0;
-    while (expr[i] != '\0') // Iterate character by character until the expression ends
+    // Reserve the blocks now: running out of space later would be a SIGBUS on some write
+    if (posix_fallocate(*fd, 0, STORE_HEADER_SIZE + size * sizeof(struct Map)) == 0)
+        store = storeMap(*fd, size);
+    if (store == NULL)
     {
+        close(*fd);
+        unlink(path);
+        return NULL;
+    }
+
+    memcpy(store->magic, STORE_MAGIC, sizeof(store->magic));
+    store->slot_size = sizeof(struct Map);
+    store->clean = 1;
+    store->epoch = epoch;
+    store->size = size;
+    return store;
+}
+
+///     Rebuild the map with the given amount of slots, dropping tombstones.
+///     Returns FAILURE, keeping the old map, if a store file can't grow.
+int resizeMap(struct Calc *calc, size_t size)
+{
+    struct Map *old = calc->variables;
+    struct Version **old_history = calc->history;
+    struct StoreHeader *old_store = calc->store;
+    int old_fd = calc->store_fd;
+    size_t old_size = calc->size;
+    char tmp[old_store != NULL ? strlen(calc->store_path) + 5 : 1];
 
-        if (isspace(expr[i]) != 0) // As long as the character is different from space
+    if (old_store != NULL)
+    {
+        // Rehash into a new file and rename it over the old one, which stays valid until then
+        snprintf(tmp, sizeof(tmp), "%s.tmp", calc->store_path);
+        calc->store = storeCreate(tmp, size, old_store->epoch, &calc->store_fd);
+        if (calc->store == NULL)
         {
-            i++;
-            continue;
+            LOG_ERROR("Can't grow the store %s to %zu variables\n", calc->store_path, size);
+            calc->store = old_store;
+            calc->store_fd = old_fd;
+            return FAILURE;
         }
+        calc->variables = (struct Map *)((char *)calc->store + STORE_HEADER_SIZE);
+    }
+    else
+        calc->variables = calloc(size, sizeof(struct Map));
 
-        if (isalpha(expr[i]) != 0) // If it is a letter of the alphabet
-        {
+    if (!calc->scratch)
+        __atomic_add_fetch(&mapBytes, (size - old_size) * sizeof(struct Map), __ATOMIC_RELAXED);
+    calc->history = old_history != NULL ? calloc(size, sizeof(struct Version *)) : NULL;
+    calc->size = size;
+    calc->deleted = 0;
 
-            char l[20] = "";
+    for (size_t i = 0; i < old_size; i++)
+    {
+        if (old[i].state != SLOT_USED)
+            continue;
 
-            while (i < strlen(expr) && isalpha(expr[i]) != 0) // Iterate character by character until the variable name is complete.
-            {
-                strncat(l, &expr[i], 1);
-                i++;
-            }
+        size_t j = getHash(old[i].key) & (size - 1);
+        while (calc->variables[j].state != SLOT_EMPTY)
+            j = (j + 1) & (size - 1);
+        calc->variables[j] = old[i];
+        if (old_history != NULL)
+            calc->history[j] = old_history[i];
+    }
+    free(old_history);
 
-            if (strlen(expr) - i == 2 && strcmp(calc->variables[getHash(l)].key, l) != 0) // If there is no operator but a variable
-            {
-                LOG_ERROR("Undefined variable error: The given variable does not exist in the calculator. \n");
-                return FAILURE;
-            }
+    if (old_store != NULL)
+    {
+        // The new file must be complete on disk before it replaces the old one
+        storeWriteHeader(calc, 0);
+        msync(calc->store, STORE_HEADER_SIZE + size * sizeof(struct Map), MS_SYNC);
+        rename(tmp, calc->store_path);
+        storeUnmap(old_store, old_fd);
+    }
+    else
+        free(old);
+    return SUCCESS;
+}
 
-            if (strcmp(calc->variables[getHash(l)].key, l) != 0 && i < strlen(expr))
-            {
-                strcpy(calc->variables[getHash(l)].key, l); // store variable name in the calculator
-                headVariable++;
-                strcpy(variablesStack[headVariable], l);
-            }
-            else
-            {
+///     Older values of a slot, the history array must exist
+struct Version **slotHistory(struct Calc *calc, struct Map *slot)
+{
+    return &calc->history[slot - calc->variables];
+}
 
-                if (headVariable < 0)
-                {
-                    headVariable++;
-                    strcpy(variablesStack[headVariable], l);
-                    head++;
-                    numberStack[head] = calc->variables[getHash(l)].value;
-                }
-                else
-                {
-                    head++;
-                    numberStack[head] = calc->variables[getHash(l)].value;
-                }
-            }
+///     Free the whole history of a slot
+void dropHistory(struct Calc *calc, struct Map *slot)
+{
+    if (calc->history == NULL)
+        return;
 
-            i--;
-        }
-        else if (expr[i] >= '0' && expr[i] <= '9') // If it is a number
-        {
-            int n = 0;
+    struct Version **history = slotHistory(calc, slot);
+    while (*history != NULL)
+    {
+        struct Version *older = (*history)->older;
+        free(*history);
+        *history = older;
+        calc->history_count--;
+    }
+}
 
-            while (i < strlen(expr) && expr[i] >= '0' && expr[i] <= '9') // Iterate digit by digit until the number is complete.
-            {
-                n = (n * 10) + (expr[i] - '0');
-                i++;
-            }
-            numberStack[++head] = n; // store variable name in a stack of numbers
-            i--;
-        }
-        else
-        {
-            if (headOp >= 0 && expr[i] == '=') // If there is no operator but a variable
-            {
-                LOG_ERROR("Assignation error: cannot assign value to an operation \n");
-                return FAILURE;
-            }
+///     Oldest open snapshot, the version counter if there is none
+unsigned long oldestSnapshot(struct Calc *calc)
+{
+    unsigned long oldest = calc->version;
+    for (size_t i = 0; i < calc->snapshot_count; i++)
+        if (calc->snapshots[i] < oldest)
+            oldest = calc->snapshots[i];
+    return oldest;
+}
 
-            while (headOp >= 0 && precedence(operatorStack[headOp], expr[i])) // If there is an operator and its precedence is bigger that the one of the current character in the expression.
-            {
+///     Change the value of a slot, keeping the old one if an open snapshot can still read it
+void writeVariable(struct Calc *calc, struct Map *slot, int value)
+{
+    if (calc->snapshot_count > 0 && slot->version != 0)
+    {
+        if (calc->history == NULL)
+            calc->history = calloc(calc->size, sizeof(struct Version *));
 
-                if (operatorStack[headOp] != '=') // If there are no variables in the operation, performs arithmethic operation.
-                {
+        struct Version **history = slotHistory(calc, slot);
+        struct Version *old = malloc(sizeof(struct Version));
+        old->version = slot->version;
+        old->value = slot->value;
+        old->older = *history;
+        *history = old;
+        calc->history_count++;
 
-                    if ((head < 0 && headVariable < 0) || (head == headOp && headVariable < 0 && headOp >= 0) || (head < 0 && headVariable == headOp && headOp >= 0))
-                    {
-                        LOG_ERROR("Arity error: there is a binary arity operator. An argument is missing.\n");
-                        return FAILURE;
-                    }
-
-                    int n2 = numberStack[head--];
-                    int n1 = numberStack[head--];
-                    first = operatorStack[headOp--];
-
-                    if (n2 == 0 && first == '/')
-                    {
-                        LOG_ERROR("Arithmetic error: Cannot divide by zero.\n");
-                        return FAILURE;
-                    }
-                    head++;
-                    numberStack[head] = arithmethicOp(n1, n2, first);
-                }
-                else
+        // Only the newest value at or before the oldest snapshot is still readable
+        unsigned long oldest = oldestSnapshot(calc);
+        for (struct Version *v = *history; v != NULL; v = v->older)
+        {
+            if (v->version <= oldest)
+            {
+                struct Version *rest = v->older;
+                v->older = NULL;
+                while (rest != NULL)
                 {
-                    headOp--;
-                    int n1;
-                    if (headVariable == 0) // If a value is assigned to a variable directly
-                    {
-                        n1 = numberStack[head];
-                    }
-                    else //If a value is assigned to a variable by means of another variable stored in the calculator
-                    {
-                        n1 = calc->variables[getHash(variablesStack[headVariable])].value;
-                        numberStack[head++] = n1;
-                    }
-                    calc->variables[getHash(variablesStack[headVariable - 2])].value = n1;
+                    struct Version *older = rest->older;
+                    free(rest);
+                    rest = older;
+                    calc->history_count--;
                 }
+                break;
             }
-            operatorStack[++headOp] = expr[i];
         }
-
-        i++;
     }
+    else if (calc->history_count > 0)
+        dropHistory(calc, slot);
+
+    slot->value = value;
+    slot->version = ++calc->version;
+}
+
+///     Remove the variable of a slot, leaving a tombstone
+void removeSlot(struct Calc *calc, struct Map *slot)
+{
+    dropHistory(calc, slot);
+    slot->state = SLOT_DELETED;
+    calc->used--;
+    calc->deleted++;
+    calc->removed = ++calc->version;
+    if (calc->delete_hook != NULL)
+        calc->delete_hook(calc->delete_hook_ctx, slot->key);
+}
+
+///     Next pseudo random number of a calculator
+uint64_t nextRandom(struct Calc *calc)
+{
+    if (calc->random == 0)
+        calc->random = (uint64_t)(uintptr_t)calc | 1;
+
+    calc->random ^= calc->random << 13;
+    calc->random ^= calc->random >> 7;
+    calc->random ^= calc->random << 17;
+    return calc->random;
+}
+
+///     Remove the least recently used of a few variables picked at random, or an expired one
+void evictVariable(struct Calc *calc)
+{
+    size_t mask = calc->size - 1;
+    struct Map *victim = NULL;
 
-    while (headOp >= 0) // When there are no preceding operators left
+    for (int n = 0; n < EVICTION_SAMPLES; n++)
     {
-        if (operatorStack[headOp] != '=')
+        size_t i = nextRandom(calc) & mask;
+        while (calc->variables[i].state != SLOT_USED)
+            i = (i + 1) & mask;
+
+        struct Map *slot = &calc->variables[i];
+        if (slotExpired(slot))
         {
-            if ((head < 0 && headVariable < 0) || (head == headOp && headVariable < 0 && headOp >= 0) || (head < 0 && headVariable == headOp && headOp >= 0))
-            {
-                LOG_ERROR("Arity error: there is a binary arity operator. An argument is missing.\n");
-                return FAILURE;
-            }
+            victim = slot;
+            break;
+        }
+        if (victim == NULL || slot->access < victim->access)
+            victim = slot;
+    }
 
-            int n2 = numberStack[head--];
-            int n1 = numberStack[head--];
-            first = operatorStack[headOp--];
+    __atomic_add_fetch(slotExpired(victim) ? &expiredTotal : &evictedTotal, 1, __ATOMIC_RELAXED);
+    removeSlot(calc, victim);
+}
 
-            if (n2 == 0 && first == '/')
-            {
-                LOG_ERROR("Arithmetic error: Cannot divide by zero.\n");
-                return FAILURE;
-            }
+///     Find the slot of a variable, creating it if it does not exist
+struct Map *insertVariable(struct Calc *calc, const char *name)
+{
+    struct Map *slot = lookupSlot(calc, name);
+    if (slot != NULL && !slotExpired(slot))
+        return slot;
 
-            if (n2 == 0 && first == '/')
-            {
-                LOG_ERROR("Arithmetic error: Cannot divide by zero.\n");
-                return FAILURE;
-            }
+    // Writers clean up expired variables as they find them
+    if (slot != NULL)
+    {
+        removeSlot(calc, slot);
+        __atomic_add_fetch(&expiredTotal, 1, __ATOMIC_RELAXED);
+    }
 
-            numberStack[++head] = arithmethicOp(n1, n2, first);
-        }
-        else
+    if ((calc->used + calc->deleted + 1) * 100 > calc->size * MAX_LOAD_PERCENT)
+    {
+        size_t size = calc->used * 2 >= calc->size ? calc->size * 2 : calc->size;
+
+        // At the memory limit the map makes room by evicting instead of growing. Evicting a
+        // batch keeps the rehash in place it needs to one every few inserts.
+        if (size > calc->size && memoryLimit != 0 && !calc->scratch &&
+            __atomic_load_n(&mapBytes, __ATOMIC_RELAXED) + (size - calc->size) * sizeof(struct Map) > memoryLimit)
         {
-            headOp--;
-            int n1;
-            if (headVariable == 0) // If a value is assigned to a variable directly
-            {
-                n1 = numberStack[head];
-            }
-            else //If a value is assigned to a variable by means of another variable stored in the calculator
-            {
-                n1 = calc->variables[getHash(variablesStack[headVariable])].value;
-                numberStack[head++] = n1;
-            }
-            calc->variables[getHash(variablesStack[0])].value = n1;
+            while (calc->used > 0 && calc->used * 100 > calc->size * EVICTED_LOAD_PERCENT)
+                evictVariable(calc);
+            size = calc->size;
         }
+
+        // Over the load factor probing gets slower, but it still works until no slot is empty
+        if (!resizeMap(calc, size) && calc->used + calc->deleted + 2 > calc->size)
+            abort();
+    }
+
+    size_t mask = calc->size - 1;
+    size_t i = getHash(name) & mask;
+    while (calc->variables[i].state == SLOT_USED)
+        i = (i + 1) & mask;
+
+    slot = &calc->variables[i];
+    if (slot->state == SLOT_DELETED)
+        calc->deleted--;
+    strcpy(slot->key, name);
+    slot->value = 0;
+    slot->state = SLOT_USED;
+    slot->access = (uint32_t)time(NULL);
+    slot->version = 0;
+    slot->expires = 0;
+    calc->used++;
+    return slot;
+}
+
+///     Store a value in a variable during evaluation and notify the assign hook
+struct Map *assignVariable(struct Calc *calc, const char *name, int value)
+{
+    struct Map *slot = insertVariable(calc, name);
+    writeVariable(calc, slot, value);
+
+    if (calc->assign_hook != NULL)
+        calc->assign_hook(calc->assign_hook_ctx, slot->key, value);
+    return slot;
+}
+
+///     Read the next token of the expression into parser->current
+void nextToken(struct Parser *parser)
+{
+    const char *c = parser->next;
+    struct Token *token = &parser->current;
+
+    while (isspace((unsigned char)*c))
+        c++;
+
+    token->start = c;
+    token->number = 0;
+
+    if (*c == '\0' || c == parser->end)
+        token->kind = TOKEN_END;
+    else if (isalpha((unsigned char)*c))
+    {
+        token->kind = TOKEN_NAME;
+        while (isalpha((unsigned char)*c))
+            c++;
+    }
+    else if (isdigit((unsigned char)*c))
+    {
+        unsigned n = 0;
+        token->kind = TOKEN_NUMBER;
+        while (isdigit((unsigned char)*c))
+            n = (n * 10) + (unsigned)(*c++ - '0');
+        token->number = (int)n;
+    }
+    else if (*c == '+' || *c == '-' || *c == '*' || *c == '/' || *c == '=')
+    {
+        token->kind = TOKEN_OPERATOR;
+        c++;
+
+        // Compound assignment: "+=", "-=" or "*="
+        if (*c == '=' && (c[-1] == '+' || c[-1] == '-' || c[-1] == '*'))
+            c++;
+    }
+    else
+    {
+        token->kind = TOKEN_INVALID;
+        c++;
+    }
+
+    token->length = (size_t)(c - token->start);
+    parser->next = c;
+}
+
+///     Tells if the current token is the given operator
+int isOperator(struct Parser *parser, char op)
+{
+    return parser->current.kind == TOKEN_OPERATOR && parser->current.length == 1 && parser->current.start[0] == op;
+}
+
+///     Tells if the current token is a compound assignment, returning its arithmetic operator
+char compoundOperator(struct Parser *parser)
+{
+    return parser->current.kind == TOKEN_OPERATOR && parser->current.length == 2 ? parser->current.start[0] : '\0';
+}
+
+///     Copy the current token (a name) into a null terminated buffer
+int tokenName(struct Parser *parser, char name[CALC_KEY_SIZE])
+{
+    if (parser->current.length >= CALC_KEY_SIZE)
+    {
+        LOG_ERROR("Name error: variable names can't be longer than %d characters. \n", CALC_KEY_SIZE - 1);
+        lastError = CALC_ERROR_NAME;
+        return FAILURE;
+    }
+
+    memcpy(name, parser->current.start, parser->current.length);
+    name[parser->current.length] = '\0';
+    return SUCCESS;
+}
+
+///     Count operations about to be evaluated, failing once the expression goes over the budget
+int chargeOps(struct Parser *parser, size_t ops)
+{
+    parser->ops += ops;
+    if (opBudget != 0 && parser->ops > opBudget)
+    {
+        LOG_ERROR("Budget error: the expression evaluates more than %zu operations.\n", opBudget);
+        lastError = CALC_ERROR_BUDGET;
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+///     factor := number | name
+int parseFactor(struct Parser *parser, int *result)
+{
+    if (chargeOps(parser, 1) == FAILURE)
+        return FAILURE;
+
+    if (parser->current.kind == TOKEN_NUMBER)
+    {
+        *result = parser->current.number;
+        nextToken(parser);
+        return SUCCESS;
     }
 
-    if (first != '=' && headVariable >= 0 && head < 0) // If there is no operator but a variable
+    if (parser->current.kind == TOKEN_NAME)
     {
-        if (strcmp(calc->variables[getHash(variablesStack[headVariable])].key, variablesStack[headVariable]) != 0)
+        char name[CALC_KEY_SIZE];
+        if (tokenName(parser, name) == FAILURE)
+            return FAILURE;
+
+        struct Map *slot = findVariable(parser->calc, name);
+        if (slot == NULL)
         {
             LOG_ERROR("Undefined variable error: The given variable does not exist in the calculator. \n");
+            lastError = CALC_ERROR_UNDEFINED;
             return FAILURE;
         }
 
-        *result = calc->variables[getHash(variablesStack[headVariable])].value;
+        // Counter updates may run concurrently with read only expressions
+        *result = __atomic_load_n(&slot->value, __ATOMIC_RELAXED);
+        nextToken(parser);
         return SUCCESS;
     }
 
-    *result = numberStack[head];
+    LOG_ERROR("Arity error: there is a binary arity operator. An argument is missing.\n");
+    lastError = CALC_ERROR_ARITY;
+    return FAILURE;
+}
+
+///     term := factor (('*' | '/') factor)*
+int parseTerm(struct Parser *parser, int *result)
+{
+    if (parseFactor(parser, result) == FAILURE)
+        return FAILURE;
+
+    while (isOperator(parser, '*') || isOperator(parser, '/'))
+    {
+        char op = parser->current.start[0];
+        int n2;
+
+        nextToken(parser);
+        if (chargeOps(parser, 1) == FAILURE || parseFactor(parser, &n2) == FAILURE)
+            return FAILURE;
+
+        if (op == '/' && n2 == 0)
+        {
+            LOG_ERROR("Arithmetic error: Cannot divide by zero.\n");
+            lastError = CALC_ERROR_DIVIDE_BY_ZERO;
+            return FAILURE;
+        }
+        if (op == '/' && n2 == -1 && *result == INT_MIN)
+        {
+            LOG_ERROR("Arithmetic error: Division overflow.\n");
+            lastError = CALC_ERROR_OVERFLOW;
+            return FAILURE;
+        }
+
+        *result = arithmethicOp(*result, n2, op);
+    }
+
     return SUCCESS;
-}
\ No newline at end of file
+}
+
+///     sum := term (('+' | '-') term)*
+int parseSum(struct Parser *parser, int *result)
+{
+    if (parseTerm(parser, result) == FAILURE)
+        return FAILURE;
+
+    while (isOperator(parser, '+') || isOperator(parser, '-'))
+    {
+        char op = parser->current.start[0];
+        int n2;
+
+        nextToken(parser);
+        if (chargeOps(parser, 1) == FAILURE || parseTerm(parser, &n2) == FAILURE)
+            return FAILURE;
+
+        *result = arithmethicOp(*result, n2, op);
+    }
+
+    return SUCCESS;
+}
+
+///     assignment := name ('=' | '+=' | '-=' | '*=') assignment | sum
+int parseAssignment(struct Parser *parser, int *result)
+{
+    if (parser->current.kind == TOKEN_NAME)
+    {
+        // Look ahead one token to know if this name is being assigned
+        struct Parser lookahead = *parser;
+        nextToken(&lookahead);
+        char op = compoundOperator(&lookahead);
+
+        if (isOperator(&lookahead, '=') || op != '\0')
+        {
+            // Charged before the right side, so an expression over the budget assigns nothing
+            char name[CALC_KEY_SIZE];
+            if (tokenName(parser, name) == FAILURE || chargeOps(parser, op != '\0' ? 2 : 1) == FAILURE)
+                return FAILURE;
+
+            lookahead.ops = parser->ops;
+            *parser = lookahead;
+            nextToken(parser);
+            if (parseAssignment(parser, result) == FAILURE)
+                return FAILURE;
+
+            if (op != '\0')
+            {
+                struct Map *slot = findVariable(parser->calc, name);
+                if (slot == NULL)
+                {
+                    LOG_ERROR("Undefined variable error: The given variable does not exist in the calculator. \n");
+                    lastError = CALC_ERROR_UNDEFINED;
+                    return FAILURE;
+                }
+                *result = arithmethicOp(slot->value, *result, op);
+            }
+
+            // A plain assignment replaces the TTL, a compound one keeps it unless given a new one
+            struct Map *slot = assignVariable(parser->calc, name, *result);
+            if (op == '\0' || parser->expires != 0)
+                slot->expires = parser->expires;
+            if (parser->expires != 0)
+                parser->calc->expiring = 1;
+            parser->assigned++;
+            return SUCCESS;
+        }
+    }
+
+    return parseSum(parser, result);
+}
+
+// -- < State manipulation functions > ---------------
+
+/// Summary:
+///     Create a Calc object and initialize it
+
+struct Calc *calc_create()
+{
+    LOG_INFO("Creating Calc Object\n\n");
+    struct Calc *calc = (struct Calc *)calloc(1, sizeof(struct Calc));
+    calc->size = INITIAL_SIZE_OF_MAP;
+    calc->variables = calloc(calc->size, sizeof(struct Map));
+    __atomic_add_fetch(&mapBytes, calc->size * sizeof(struct Map), __ATOMIC_RELAXED);
+    return calc;
+}
+
+/// Summary:
+///     Create a Calc object left out of the memory limit
+
+struct Calc *calc_create_scratch()
+{
+    struct Calc *calc = (struct Calc *)calloc(1, sizeof(struct Calc));
+    calc->size = INITIAL_SIZE_OF_MAP;
+    calc->variables = calloc(calc->size, sizeof(struct Map));
+    calc->scratch = 1;
+    return calc;
+}
+
+///     Check a store left open by a crash: recount the slots and drop the ones a torn write left invalid
+int storeRecover(struct Calc *calc)
+{
+    unsigned long version = calc->version;
+
+    calc->used = 0;
+    calc->deleted = 0;
+    for (size_t i = 0; i < calc->size; i++)
+    {
+        struct Map *slot = &calc->variables[i];
+        if (slot->state == SLOT_USED && memchr(slot->key, '\0', CALC_KEY_SIZE) == NULL)
+            slot->state = SLOT_DELETED;
+        else if (slot->state != SLOT_EMPTY && slot->state != SLOT_USED)
+            slot->state = SLOT_DELETED;
+
+        calc->used += slot->state == SLOT_USED;
+        calc->deleted += slot->state == SLOT_DELETED;
+        if (slot->state == SLOT_USED && slot->version > version)
+            version = slot->version;
+    }
+
+    // Lookups stop at an empty slot, a full table can't be searched
+    if (calc->used + calc->deleted == calc->size)
+        return FAILURE;
+
+    // Deletes after the last header write are unknown, treat everything as removed just now
+    calc->version = version + 1;
+    calc->removed = calc->version;
+    return SUCCESS;
+}
+
+/// Summary:
+///     Create a Calc object whose variables live in a memory mapped store file.
+///     An existing file is mapped as is and paged in lazily, so opening it takes
+///     the same time whatever its size; only a file left open by a crash is
+///     scanned once to recount it. Returns NULL if the file can't be used.
+
+struct Calc *calc_open(const char *path)
+{
+    struct Calc *calc = (struct Calc *)calloc(1, sizeof(struct Calc));
+    struct StoreHeader header;
+    struct stat st;
+    int fd = open(path, O_RDWR);
+
+    calc->store_path = strdup(path);
+    if (fd < 0)
+    {
+        calc->size = INITIAL_SIZE_OF_MAP;
+        calc->store = storeCreate(path, calc->size, 1, &calc->store_fd);
+        if (calc->store == NULL)
+        {
+            LOG_ERROR("Can't create the store %s\n", path);
+            goto fail;
+        }
+        LOG_INFO("Created the store %s\n", path);
+    }
+    else
+    {
+        if (fstat(fd, &st) < 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+            memcmp(header.magic, STORE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.slot_size != sizeof(struct Map) || header.checksum != storeChecksum(&header) ||
+            header.size < INITIAL_SIZE_OF_MAP || (header.size & (header.size - 1)) != 0 ||
+            (uint64_t)st.st_size != STORE_HEADER_SIZE + header.size * sizeof(struct Map))
+        {
+            LOG_ERROR("%s is not a valid store file\n", path);
+            close(fd);
+            goto fail;
+        }
+
+        calc->store = storeMap(fd, header.size);
+        calc->store_fd = fd;
+        if (calc->store == NULL)
+        {
+            LOG_ERROR("Can't map the store %s\n", path);
+            close(fd);
+            goto fail;
+        }
+        calc->store->epoch++;
+        calc->size = header.size;
+        calc->used = header.used;
+        calc->deleted = header.deleted;
+        calc->version = header.version;
+        calc->removed = header.removed;
+    }
+    calc->variables = (struct Map *)((char *)calc->store + STORE_HEADER_SIZE);
+
+    if (!calc->store->clean)
+    {
+        LOG_WARN("The store %s was not closed, checking it\n", path);
+        if (!storeRecover(calc))
+        {
+            LOG_ERROR("%s is not a valid store file\n", path);
+            storeUnmap(calc->store, calc->store_fd);
+            goto fail;
+        }
+    }
+
+    // Mark the file open before any slot changes, so a crash from now on is noticed
+    storeWriteHeader(calc, 0);
+    msync(calc->store, STORE_HEADER_SIZE, MS_SYNC);
+    __atomic_add_fetch(&mapBytes, calc->size * sizeof(struct Map), __ATOMIC_RELAXED);
+
+    // Variables may have been given a TTL in a previous run
+    calc->expiring = 1;
+    LOG_INFO("Opened the store %s: %zu variables, epoch %lu\n", path, calc->used, (unsigned long)calc->store->epoch);
+    return calc;
+
+fail:
+    free(calc->store_path);
+    free(calc);
+    return NULL;
+}
+
+///     Destroy Calc object
+void calc_destroy(struct Calc *calc)
+{
+    LOG_INFO("Destroying Calc Object\n\n");
+    if (!calc->scratch)
+        __atomic_sub_fetch(&mapBytes, calc->size * sizeof(struct Map), __ATOMIC_RELAXED);
+    if (calc->store != NULL)
+    {
+        // Keep the variables in the file, it is clean once all of them reached the disk
+        for (size_t i = 0; calc->history_count > 0 && i < calc->size; i++)
+            dropHistory(calc, &calc->variables[i]);
+        msync(calc->store, STORE_HEADER_SIZE + calc->size * sizeof(struct Map), MS_SYNC);
+        storeWriteHeader(calc, 1);
+        msync(calc->store, STORE_HEADER_SIZE, MS_SYNC);
+        storeUnmap(calc->store, calc->store_fd);
+        free(calc->store_path);
+    }
+    else
+    {
+        calc_clear(calc);
+        free(calc->variables);
+    }
+    free(calc->history);
+    free(calc->snapshots);
+    free(calc);
+}
+
+///     Set the function to be called after every assignment done by calc_eval
+void calc_set_assign_hook(struct Calc *calc, calc_assign_hook hook, void *ctx)
+{
+    calc->assign_hook = hook;
+    calc->assign_hook_ctx = ctx;
+}
+
+///     Set the function to be called after every removal of a variable
+void calc_set_delete_hook(struct Calc *calc, calc_delete_hook hook, void *ctx)
+{
+    calc->delete_hook = hook;
+    calc->delete_hook_ctx = ctx;
+}
+
+///     Read a variable, returns FAILURE if it does not exist
+int calc_get(struct Calc *calc, const char *name, int *value)
+{
+    struct Map *slot = findVariable(calc, name);
+
+    if (slot == NULL)
+        return FAILURE;
+
+    *value = slot->value;
+    return SUCCESS;
+}
+
+///     Write a variable without notifying the assign hook
+int calc_set(struct Calc *calc, const char *name, int value)
+{
+    if (name[0] == '\0' || strlen(name) >= CALC_KEY_SIZE)
+        return FAILURE;
+
+    writeVariable(calc, insertVariable(calc, name), value);
+    return SUCCESS;
+}
+
+///     Write a variable and notify the assign hook, as if assigned by calc_eval
+int calc_assign(struct Calc *calc, const char *name, int value)
+{
+    if (name[0] == '\0' || strlen(name) >= CALC_KEY_SIZE)
+        return FAILURE;
+
+    assignVariable(calc, name, value);
+    return SUCCESS;
+}
+
+///     Remove a variable, returns FAILURE if it does not exist or already expired
+int calc_delete(struct Calc *calc, const char *name)
+{
+    struct Map *slot = lookupSlot(calc, name);
+
+    if (slot == NULL)
+        return FAILURE;
+
+    int expired = slotExpired(slot);
+    removeSlot(calc, slot);
+    if (expired)
+        __atomic_add_fetch(&expiredTotal, 1, __ATOMIC_RELAXED);
+    return expired ? FAILURE : SUCCESS;
+}
+
+///     Remove every variable
+void calc_clear(struct Calc *calc)
+{
+    for (size_t i = 0; calc->history_count > 0 && i < calc->size; i++)
+        dropHistory(calc, &calc->variables[i]);
+
+    memset(calc->variables, 0, calc->size * sizeof(struct Map));
+    calc->used = 0;
+    calc->deleted = 0;
+    calc->removed = ++calc->version;
+}
+
+///     Amount of defined variables
+size_t calc_count(struct Calc *calc)
+{
+    return calc->used;
+}
+
+///     Heap or mapped bytes of the variables, the versions kept for snapshots and the calculator itself
+size_t calc_memory(struct Calc *calc)
+{
+    size_t bytes = sizeof(struct Calc) + calc->size * sizeof(struct Map);
+    if (calc->history)
+        bytes += calc->size * sizeof(struct Version *);
+    return bytes + calc->history_count * sizeof(struct Version) + calc->snapshot_capacity * sizeof(unsigned long);
+}
+
+///     Call fn for every defined variable, skipping the expired ones without removing them
+void calc_foreach(struct Calc *calc, void (*fn)(void *ctx, const char *name, int value), void *ctx)
+{
+    for (size_t i = 0; i < calc->size; i++)
+    {
+        if (calc->variables[i].state == SLOT_USED && !slotExpired(&calc->variables[i]))
+            fn(ctx, calc->variables[i].key, calc->variables[i].value);
+    }
+}
+
+///     Open a snapshot of the current state of the variables
+unsigned long calc_snapshot_open(struct Calc *calc)
+{
+    if (calc->snapshot_count == calc->snapshot_capacity)
+    {
+        calc->snapshot_capacity = calc->snapshot_capacity * 2 + 8;
+        calc->snapshots = realloc(calc->snapshots, calc->snapshot_capacity * sizeof(unsigned long));
+    }
+
+    calc->snapshots[calc->snapshot_count++] = calc->version;
+    return calc->version;
+}
+
+///     Close a snapshot, the values only it could read are freed by later writes
+void calc_snapshot_close(struct Calc *calc, unsigned long snapshot)
+{
+    for (size_t i = 0; i < calc->snapshot_count; i++)
+    {
+        if (calc->snapshots[i] == snapshot)
+        {
+            calc->snapshots[i] = calc->snapshots[--calc->snapshot_count];
+            break;
+        }
+    }
+
+    // Without snapshots no history is needed, free it now rather than on the next writes
+    for (size_t i = 0; calc->snapshot_count == 0 && calc->history_count > 0 && i < calc->size; i++)
+        dropHistory(calc, &calc->variables[i]);
+}
+
+///     Read a variable as it was when a snapshot was opened
+int calc_get_at(struct Calc *calc, const char *name, unsigned long snapshot, int *value)
+{
+    struct Map *slot = findVariable(calc, name);
+
+    if (slot != NULL)
+    {
+        if (slot->version <= snapshot)
+        {
+            *value = slot->value;
+            return SUCCESS;
+        }
+        for (struct Version *v = calc->history != NULL ? *slotHistory(calc, slot) : NULL; v != NULL; v = v->older)
+        {
+            if (v->version <= snapshot)
+            {
+                *value = v->value;
+                return SUCCESS;
+            }
+        }
+    }
+
+    // A delete drops the history, so a variable removed since the snapshot can't be told apart
+    return calc->removed > snapshot ? CALC_SNAPSHOT_LOST : FAILURE;
+}
+
+///     Version of the last change to a variable
+unsigned long calc_version_of(struct Calc *calc, const char *name)
+{
+    struct Map *slot = findVariable(calc, name);
+    return slot != NULL ? slot->version : calc->removed;
+}
+
+///     Tells if counter updates can run concurrently: nothing else must observe every write
+int calc_shared_updates(struct Calc *calc)
+{
+    return calc->snapshot_count == 0 && calc->assign_hook == NULL && calc->delete_hook == NULL;
+}
+
+///     Apply "name op= operand" to an existing variable
+int calc_update(struct Calc *calc, const char *name, char op, int operand, int *result)
+{
+    struct Map *slot = findVariable(calc, name);
+    lastCost = 1;
+    if (slot == NULL)
+    {
+        lastError = CALC_ERROR_UNDEFINED;
+        return FAILURE;
+    }
+    lastError = CALC_ERROR_NONE;
+
+    if (!calc_shared_updates(calc))
+    {
+        *result = arithmethicOp(slot->value, operand, op);
+        writeVariable(calc, slot, *result);
+        if (calc->assign_hook != NULL)
+            calc->assign_hook(calc->assign_hook_ctx, slot->key, *result);
+        return SUCCESS;
+    }
+
+    // No snapshot is open, so the slot version can stay: any later snapshot is newer than it
+    switch (op)
+    {
+    case '+':
+        *result = __atomic_add_fetch(&slot->value, operand, __ATOMIC_RELAXED);
+        break;
+    case '-':
+        *result = __atomic_sub_fetch(&slot->value, operand, __ATOMIC_RELAXED);
+        break;
+    default:
+    {
+        int old = __atomic_load_n(&slot->value, __ATOMIC_RELAXED);
+        do
+            *result = arithmethicOp(old, operand, op);
+        while (!__atomic_compare_exchange_n(&slot->value, &old, *result, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+    }
+    return SUCCESS;
+}
+
+///     Set an existing variable to desired if it holds expected
+int calc_cas(struct Calc *calc, const char *name, int expected, int desired, int *swapped)
+{
+    struct Map *slot = findVariable(calc, name);
+    lastCost = 1;
+    if (slot == NULL)
+    {
+        lastError = CALC_ERROR_UNDEFINED;
+        return FAILURE;
+    }
+    lastError = CALC_ERROR_NONE;
+
+    if (calc_shared_updates(calc))
+    {
+        *swapped = __atomic_compare_exchange_n(&slot->value, &expected, desired, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        return SUCCESS;
+    }
+
+    *swapped = slot->value == expected;
+    if (*swapped)
+    {
+        writeVariable(calc, slot, desired);
+        if (calc->assign_hook != NULL)
+            calc->assign_hook(calc->assign_hook_ctx, slot->key, desired);
+    }
+    return SUCCESS;
+}
+
+///     Read many variables, setting found[i] for each. Returns how many were found.
+size_t calc_mget(struct Calc *calc, const char *const *names, size_t count, int *values, int *found)
+{
+    size_t hashes[MULTI_BATCH];
+    size_t hits = 0;
+
+    for (size_t start = 0; start < count; start += MULTI_BATCH)
+    {
+        size_t batch = count - start < MULTI_BATCH ? count - start : MULTI_BATCH;
+        prefetchBatch(calc, names + start, batch, hashes);
+
+        for (size_t i = 0; i < batch; i++)
+        {
+            struct Map *slot = findHashedVariable(calc, names[start + i], hashes[i]);
+            found[start + i] = slot != NULL ? SUCCESS : FAILURE;
+            if (slot != NULL)
+            {
+                // Counter updates may run at the same time under the shared lock
+                values[start + i] = __atomic_load_n(&slot->value, __ATOMIC_RELAXED);
+                hits++;
+            }
+        }
+    }
+
+    lastCost = count;
+    lastError = hits == count ? CALC_ERROR_NONE : CALC_ERROR_UNDEFINED;
+    return hits;
+}
+
+///     Assign many variables like "name = value" expressions, setting assigned[i] for each.
+///     Returns how many were assigned.
+size_t calc_mset(struct Calc *calc, const char *const *names, const int *values, size_t count, int *assigned)
+{
+    size_t hashes[MULTI_BATCH];
+    size_t done = 0;
+
+    for (size_t start = 0; start < count; start += MULTI_BATCH)
+    {
+        size_t batch = count - start < MULTI_BATCH ? count - start : MULTI_BATCH;
+        prefetchBatch(calc, names + start, batch, hashes);
+
+        for (size_t i = 0; i < batch; i++)
+        {
+            assigned[start + i] = validName(names[start + i]) ? SUCCESS : FAILURE;
+            if (assigned[start + i] == FAILURE)
+                continue;
+
+            // A plain assignment, which drops any TTL
+            assignVariable(calc, names[start + i], values[start + i])->expires = 0;
+            done++;
+        }
+    }
+
+    lastCost = count;
+    lastError = done == count ? CALC_ERROR_NONE : CALC_ERROR_NAME;
+    return done;
+}
+
+///     Find a trailing "ttl <seconds>", setting where the expression ends before it.
+///     Returns the seconds, 0 without a suffix, or -1 for an invalid amount.
+long ttlSuffix(struct Parser *parser)
+{
+    struct Parser scan = { NULL, parser->next, { TOKEN_END, NULL, 0, 0 }, 0, NULL, 0, 0 };
+    int tokens = 0;
+
+    for (nextToken(&scan); scan.current.kind != TOKEN_END; nextToken(&scan), tokens++)
+    {
+        if (tokens == 0 || scan.current.kind != TOKEN_NAME || scan.current.length != 3 ||
+            memcmp(scan.current.start, "ttl", 3) != 0)
+            continue;
+
+        struct Parser seconds = scan;
+        nextToken(&seconds);
+        struct Parser rest = seconds;
+        nextToken(&rest);
+        if (seconds.current.kind != TOKEN_NUMBER || rest.current.kind != TOKEN_END)
+            continue;
+
+        parser->end = scan.current.start;
+        return seconds.current.number > 0 ? seconds.current.number : -1;
+    }
+    return 0;
+}
+
+///     Recognize "name op= number", the expressions calc_update can run
+int calc_parse_update(const char *expr, char name[CALC_KEY_SIZE], char *op, int *operand)
+{
+    struct Parser parser = { NULL, expr, { TOKEN_END, NULL, 0, 0 }, 0, NULL, 0, 0 };
+
+    nextToken(&parser);
+    if (parser.current.kind != TOKEN_NAME || parser.current.length >= CALC_KEY_SIZE)
+        return FAILURE;
+    memcpy(name, parser.current.start, parser.current.length);
+    name[parser.current.length] = '\0';
+
+    nextToken(&parser);
+    *op = compoundOperator(&parser);
+    if (*op == '\0')
+        return FAILURE;
+
+    nextToken(&parser);
+    if (parser.current.kind != TOKEN_NUMBER)
+        return FAILURE;
+    *operand = parser.current.number;
+
+    nextToken(&parser);
+    return parser.current.kind == TOKEN_END ? SUCCESS : FAILURE;
+}
+
+///     Call fn for every variable name in an expression, telling if it is assigned or read
+void calc_names(const char *expr, void (*fn)(void *ctx, const char *name, int assigned), void *ctx)
+{
+    struct Parser parser = { NULL, expr, { TOKEN_END, NULL, 0, 0 }, 0, NULL, 0, 0 };
+    ttlSuffix(&parser);
+
+    for (nextToken(&parser); parser.current.kind != TOKEN_END; nextToken(&parser))
+    {
+        if (parser.current.kind != TOKEN_NAME || parser.current.length >= CALC_KEY_SIZE)
+            continue;
+
+        char name[CALC_KEY_SIZE];
+        struct Parser lookahead = parser;
+        nextToken(&lookahead);
+
+        memcpy(name, parser.current.start, parser.current.length);
+        name[parser.current.length] = '\0';
+
+        // A compound assignment reads the variable too
+        if (compoundOperator(&lookahead) != '\0')
+            fn(ctx, name, 0);
+        fn(ctx, name, isOperator(&lookahead, '=') || compoundOperator(&lookahead) != '\0');
+    }
+}
+
+///     Given an expression, evaluates it on the calculator and return the result
+int calc_eval(struct Calc *calc, const char *expr, int *result)
+{
+    LOG_INFO("Evaluating Expression in Calc Object\n\n");
+
+    struct Parser parser = { calc, expr, { TOKEN_END, NULL, 0, 0 }, 0, NULL, 0, 0 };
+    int value;
+
+    lastError = CALC_ERROR_NONE;
+    long ttl = ttlSuffix(&parser);
+    if (ttl < 0)
+    {
+        LOG_ERROR("Syntax error: a TTL must be a positive amount of seconds. \n")
+        lastError = CALC_ERROR_SYNTAX;
+        lastCost = 0;
+        return FAILURE;
+    }
+    if (ttl > 0)
+        parser.expires = nowMs() + (int64_t)ttl * 1000;
+
+    nextToken(&parser);
+    int status = parseAssignment(&parser, &value);
+    lastCost = parser.ops;
+    if (status == FAILURE)
+        return FAILURE;
+
+    if (parser.current.kind != TOKEN_END)
+    {
+        if (isOperator(&parser, '='))
+        {
+            LOG_ERROR("Assignation error: cannot assign value to an operation \n")
+            lastError = CALC_ERROR_ASSIGNMENT;
+        }
+        else
+        {
+            LOG_ERROR("Syntax error: unexpected input after the expression. \n")
+            lastError = CALC_ERROR_SYNTAX;
+        }
+        return FAILURE;
+    }
+
+    // Nothing was assigned, so failing here leaves the calculator as it was
+    if (ttl > 0 && parser.assigned == 0)
+    {
+        LOG_ERROR("Syntax error: a TTL needs an assignment to apply to. \n")
+        lastError = CALC_ERROR_SYNTAX;
+        return FAILURE;
+    }
+
+    *result = value;
+    return SUCCESS;
+}
+
+///     Remove the expired variables of the next slots, returns how many were removed
+size_t calc_expire(struct Calc *calc, size_t slots)
+{
+    if (!calc->expiring)
+        return 0;
+
+    int64_t now = nowMs();
+    size_t removed = 0;
+    for (size_t n = 0; n < slots && n < calc->size; n++)
+    {
+        struct Map *slot = &calc->variables[calc->expire_cursor++ & (calc->size - 1)];
+        if (slot->state == SLOT_USED && slot->expires != 0 && slot->expires <= now)
+        {
+            removeSlot(calc, slot);
+            removed++;
+        }
+    }
+
+    __atomic_add_fetch(&expiredTotal, removed, __ATOMIC_RELAXED);
+    return removed;
+}
+
+///     Limit the bytes of the maps of every calculator, 0 to remove the limit
+void calc_set_memory_limit(size_t bytes)
+{
+    memoryLimit = bytes;
+}
+
+///     Bytes of the maps of every calculator, and variables expired or evicted so far
+void calc_memory_stats(size_t *map_bytes, unsigned long *expired, unsigned long *evicted)
+{
+    *map_bytes = __atomic_load_n(&mapBytes, __ATOMIC_RELAXED);
+    *expired = __atomic_load_n(&expiredTotal, __ATOMIC_RELAXED);
+    *evicted = __atomic_load_n(&evictedTotal, __ATOMIC_RELAXED);
+}
+
+///     Reason of the last failed calc_eval on this thread
+enum calc_error calc_last_error(void)
+{
+    return lastError;
+}
+
+///     Short name of an error kind, used as a metric label
+const char *calc_error_name(enum calc_error error)
+{
+    static const char *names[CALC_ERROR_COUNT] = {
+        "other", "name", "undefined_variable", "arity", "divide_by_zero", "overflow", "assignment", "syntax", "budget", "log"
+    };
+    return error < CALC_ERROR_COUNT ? names[error] : "other";
+}
+
+///     Limit the operations of every expression evaluated from now on, 0 to remove the limit
+void calc_set_op_budget(size_t ops)
+{
+    opBudget = ops;
+}
+
+///     Operations evaluated by the last calc_eval, calc_update or calc_cas on this thread
+size_t calc_last_cost(void)
+{
+    return lastCost;
+}
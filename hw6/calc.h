@@ -4,10 +4,14 @@
 #define SUCCESS 1 // Returned when everything went ok
 #define FAILURE 0 // Returned when something went wrong
 
+#define CALC_KEY_SIZE 20 // Max size of a variable name, including the null terminator
+
 /*
  * Note: you should NOT need to modify anything in this header file.
  */
 
+#include <stddef.h>
+
 /* Forward declaration of the struct Calc data type. */
 struct Calc;
 
@@ -23,8 +27,161 @@ extern "C" {
  */
 struct Calc *calc_create(void);
 void calc_destroy(struct Calc *calc);
+
+/*
+ * A calculator for short lived working copies, e.g. of a transaction.
+ * Its map does not count against the memory limit and never evicts, so
+ * what is put in it stays until it is destroyed.
+ */
+struct Calc *calc_create_scratch(void);
 int calc_eval(struct Calc *calc, const char *expr, int *result);
 
+/*
+ * A calculator whose variables live in a memory mapped file, created if
+ * missing. Reopening an existing file maps it without reading it, so it
+ * takes the same time whatever the amount of variables. calc_destroy
+ * writes everything back and marks the file clean; a file left open by a
+ * crash is checked and recounted by the next calc_open. Returns NULL if
+ * the file is not a valid store or can't be mapped.
+ */
+struct Calc *calc_open(const char *path);
+
+/*
+ * Callback invoked by calc_eval every time a variable is assigned,
+ * with the variable name and its new value. Used by the server to
+ * observe the ordered stream of assignments (e.g. for replication).
+ */
+typedef void (*calc_assign_hook)(void *ctx, const char *name, int value);
+void calc_set_assign_hook(struct Calc *calc, calc_assign_hook hook, void *ctx);
+
+/*
+ * Callback invoked every time a variable is removed: by calc_delete, or
+ * because it expired or was evicted, so removals reach the same logs as
+ * assignments. calc_clear does not invoke it.
+ */
+typedef void (*calc_delete_hook)(void *ctx, const char *name);
+void calc_set_delete_hook(struct Calc *calc, calc_delete_hook hook, void *ctx);
+
+/*
+ * Direct access to the variable table. calc_set does NOT fire the
+ * assign hook, so it can be used to apply state coming from elsewhere.
+ */
+int calc_get(struct Calc *calc, const char *name, int *value);
+int calc_set(struct Calc *calc, const char *name, int value);
+int calc_assign(struct Calc *calc, const char *name, int value); /* calc_set firing the assign hook */
+int calc_delete(struct Calc *calc, const char *name);
+void calc_clear(struct Calc *calc);
+size_t calc_count(struct Calc *calc);
+size_t calc_memory(struct Calc *calc); /* bytes taken by the variables and their history */
+void calc_foreach(struct Calc *calc, void (*fn)(void *ctx, const char *name, int value), void *ctx);
+
+/*
+ * Expiration and eviction. An assignment followed by "ttl <seconds>",
+ * e.g. "a = 5 ttl 60", gives every variable it assigns a TTL (an
+ * expression assigning nothing fails with CALC_ERROR_SYNTAX); a later
+ * plain assignment without one removes it, a compound assignment keeps
+ * it. An expired variable reads as undefined at once, and is removed by
+ * the next write that finds it, calc_delete or calc_expire, which looks
+ * at the given amount of slots from where its last call stopped.
+ * calc_foreach skips it, calc_count still counts it until then.
+ *
+ * The memory limit applies to the maps of every calculator together,
+ * scratch calculators aside. A map that would have to grow past it
+ * evicts instead: it picks a few variables at random, removes the least
+ * recently read or written (or an expired one), and repeats until it has
+ * room. Reads record their time only while a limit is set.
+ */
+size_t calc_expire(struct Calc *calc, size_t slots);
+void calc_set_memory_limit(size_t bytes);
+void calc_memory_stats(size_t *map_bytes, unsigned long *expired, unsigned long *evicted);
+
+/*
+ * Why the last failed calc_eval on the calling thread failed, for
+ * metrics. CALC_ERROR_NONE after a successful evaluation.
+ */
+enum calc_error {
+    CALC_ERROR_NONE,
+    CALC_ERROR_NAME,            /* variable name too long */
+    CALC_ERROR_UNDEFINED,       /* undefined variable */
+    CALC_ERROR_ARITY,           /* missing operand */
+    CALC_ERROR_DIVIDE_BY_ZERO,
+    CALC_ERROR_OVERFLOW,        /* INT_MIN / -1 */
+    CALC_ERROR_ASSIGNMENT,      /* assigning to an operation */
+    CALC_ERROR_SYNTAX,          /* unexpected input after the expression */
+    CALC_ERROR_BUDGET,          /* more operations than calc_set_op_budget allows */
+    CALC_ERROR_LOG,             /* write-ahead log failed, reported by the server only */
+    CALC_ERROR_COUNT
+};
+enum calc_error calc_last_error(void);
+const char *calc_error_name(enum calc_error error);
+
+/*
+ * Cost of evaluations, counted in operations: every operand, arithmetic
+ * operator and assignment is one (a compound assignment two). The budget
+ * applies to every expression of the process and stops an evaluation as
+ * soon as it goes over, before any of its assignments. calc_last_cost is
+ * the cost of the last calc_eval on the calling thread, failed or not;
+ * calc_update and calc_cas cost one.
+ */
+void calc_set_op_budget(size_t ops);
+size_t calc_last_cost(void);
+
+/*
+ * Batches of variables. calc_mget reads every name, setting found[i] to
+ * SUCCESS and values[i] to its value, or found[i] to FAILURE if it is
+ * undefined. calc_mset assigns every name like a "name = value"
+ * expression, firing the assign hook, and sets assigned[i] to FAILURE
+ * for a name an expression could not assign, without stopping. Both
+ * return the amount of names that succeeded and cost one operation per
+ * name. Names are hashed and their slots prefetched a few at a time
+ * before probing, so the cache misses of a batch overlap. The caller
+ * takes the calculator lock once for the whole batch, shared for
+ * calc_mget.
+ */
+size_t calc_mget(struct Calc *calc, const char *const *names, size_t count, int *values, int *found);
+size_t calc_mset(struct Calc *calc, const char *const *names, const int *values, size_t count, int *assigned);
+
+/*
+ * Multi-version reads, for transactions. Every change gets a version
+ * from a counter of the whole calculator. While a snapshot is open the
+ * values it can still read are kept when variables are overwritten, so
+ * it keeps seeing the state of the moment it was opened.
+ *
+ * calc_get_at returns CALC_SNAPSHOT_LOST when the variable was deleted
+ * (or the calculator cleared) after the snapshot, since deletes don't
+ * keep history. calc_version_of returns the version of the last change
+ * to a variable; for an undefined one, the version of the last delete.
+ */
+#define CALC_SNAPSHOT_LOST (-1)
+unsigned long calc_snapshot_open(struct Calc *calc);
+void calc_snapshot_close(struct Calc *calc, unsigned long snapshot);
+int calc_get_at(struct Calc *calc, const char *name, unsigned long snapshot, int *value);
+unsigned long calc_version_of(struct Calc *calc, const char *name);
+
+/*
+ * Counter updates, without going through the parser. calc_update applies
+ * "name op= operand", op being '+', '-' or '*', and calc_cas sets name to
+ * desired if it holds expected. The variable must exist. While
+ * calc_shared_updates is nonzero both are single atomic operations on the
+ * variable, so they may run concurrently with each other and with read
+ * only calc_eval calls (e.g. under a shared lock). Otherwise, because a
+ * snapshot is open or a hook is set, they must be serialized with
+ * everything else like calc_eval.
+ *
+ * calc_parse_update recognizes the expressions calc_update can run:
+ * "name += 1", "name *= 2", ... with a literal operand.
+ */
+int calc_shared_updates(struct Calc *calc);
+int calc_update(struct Calc *calc, const char *name, char op, int operand, int *result);
+int calc_cas(struct Calc *calc, const char *name, int expected, int desired, int *swapped);
+int calc_parse_update(const char *expr, char name[CALC_KEY_SIZE], char *op, int *operand);
+
+/*
+ * Call fn for every variable name appearing in expr, without evaluating it.
+ * assigned is nonzero when the name is the target of an assignment.
+ */
+void calc_names(const char *expr, void (*fn)(void *ctx, const char *name, int assigned), void *ctx);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,429 @@
+/*
+	Load generator for calcServer.
+
+	Opens N connections to a running server and sends a mix of literal,
+	assignment and variable read expressions, either as fast as the server
+	answers (closed loop) or at a fixed request rate (open loop). Results are
+	printed to stdout as a single JSON object so runs can be compared.
+
+	In open loop mode every request has an intended send time, and latency is
+	measured from that time rather than from the moment it was actually sent.
+	This corrects coordinated omission: a server stall delays the requests
+	that should have been sent during it, and their wait is counted.
+
+	Heavy connections (-x) keep a pipeline full of the longest expressions a
+	line can hold, as fast as the server answers. They are left out of the
+	latency results, which then show what they do to the other clients.
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include "csapp.h"
+
+#define MAX_CONNECTIONS 4096
+#define MAX_DEPTH 256
+#define LINEBUFF_SIZE 1024
+#define SPIN_NS 100000		// Open loop: busy wait the last 100us before a scheduled request
+#define HEAVY_DEPTH 8		// Requests in flight per heavy connection
+#define HEAVY_LENGTH 1000	// Length of a heavy expression, under the server line size
+
+// Log-linear histogram: exact below HIST_LINEAR, then 32 buckets per power of two (~3% error)
+#define HIST_LINEAR 64
+#define HIST_SUB_BUCKETS 32
+#define HIST_SIZE (HIST_LINEAR + 58 * HIST_SUB_BUCKETS)
+
+enum ExprKind { EXPR_LITERAL, EXPR_ASSIGN, EXPR_READ };
+
+/// Latency histogram in nanoseconds
+struct Histogram
+{
+	uint64_t counts[HIST_SIZE];
+	uint64_t total;
+	uint64_t max;
+	double sum;
+};
+
+/// Benchmark configuration
+struct BenchOptions
+{
+	char * host;
+	char * port;
+	int connections;
+	int depth;			// Requests in flight per connection
+	double duration;	// Seconds
+	double rate;		// Total requests per second, 0 for closed loop
+	int mix[3];			// Weights of literals, assignments and reads
+	int keys;			// Amount of distinct variables used
+	int heavy;			// Extra connections sending heavy expressions
+};
+
+/// Per connection state and results
+struct Worker
+{
+	pthread_t thread;
+	const struct BenchOptions * options;
+	int index;
+	int heavy;			// Sends heavy expressions, not part of the results
+	int fd;
+	unsigned int seed;
+	uint64_t requests;
+	uint64_t errors;
+	struct Histogram corrected;		// From intended send time
+	struct Histogram uncorrected;	// From actual send time
+};
+
+static uint64_t start_ns;
+
+// -- < Utility functions > ------------------------------------------------------
+
+static uint64_t now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static size_t hist_index(uint64_t value)
+{
+	if (value < HIST_LINEAR)
+		return value;
+
+	int msb = 63 - __builtin_clzll(value);
+	int shift = msb - 5;
+	return HIST_LINEAR + (shift - 1) * HIST_SUB_BUCKETS + ((value >> shift) - HIST_SUB_BUCKETS);
+}
+
+static uint64_t hist_value(size_t index)
+{
+	if (index < HIST_LINEAR)
+		return index;
+
+	int shift = (index - HIST_LINEAR) / HIST_SUB_BUCKETS + 1;
+	uint64_t mantissa = (index - HIST_LINEAR) % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS;
+	return (mantissa << shift) + ((1ull << shift) >> 1); // middle of the bucket
+}
+
+static void hist_record(struct Histogram * hist, uint64_t value)
+{
+	hist->counts[hist_index(value)]++;
+	hist->total++;
+	hist->sum += value;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+static void hist_merge(struct Histogram * into, const struct Histogram * from)
+{
+	for (size_t i = 0; i < HIST_SIZE; i++)
+		into->counts[i] += from->counts[i];
+	into->total += from->total;
+	into->sum += from->sum;
+	if (from->max > into->max)
+		into->max = from->max;
+}
+
+static uint64_t hist_percentile(const struct Histogram * hist, double percentile)
+{
+	uint64_t target = (uint64_t) (hist->total * percentile / 100.0 + 0.5);
+	uint64_t seen = 0;
+
+	if (target == 0)
+		target = 1;
+
+	for (size_t i = 0; i < HIST_SIZE; i++)
+	{
+		seen += hist->counts[i];
+		if (seen >= target)
+			return hist_value(i) < hist->max ? hist_value(i) : hist->max;
+	}
+	return hist->max;
+}
+
+static void hist_print_json(const char * name, const struct Histogram * hist)
+{
+	printf("\"%s\":{\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+		   name,
+		   hist->total ? hist->sum / hist->total / 1000.0 : 0.0,
+		   hist_percentile(hist, 50.0) / 1000.0,
+		   hist_percentile(hist, 90.0) / 1000.0,
+		   hist_percentile(hist, 99.0) / 1000.0,
+		   hist_percentile(hist, 99.9) / 1000.0,
+		   hist->max / 1000.0);
+}
+
+// Variable names can only have letters: k + key index in base 26
+static void key_name(int key, char * name)
+{
+	int len = 0;
+	name[len++] = 'k';
+	do
+	{
+		name[len++] = 'a' + key % 26;
+		key /= 26;
+	} while (key > 0);
+	name[len] = '\0';
+}
+
+// Write the next expression of the mix into buf, returns its length
+static int next_expression(struct Worker * worker, char * buf)
+{
+	const struct BenchOptions * options = worker->options;
+	int total = options->mix[EXPR_LITERAL] + options->mix[EXPR_ASSIGN] + options->mix[EXPR_READ];
+	int pick = rand_r(&worker->seed) % total;
+	char name[16];
+
+	key_name(rand_r(&worker->seed) % options->keys, name);
+
+	if (worker->heavy)
+	{
+		// A long sum of variables, every one of them looked up
+		int len = sprintf(buf, "%s", name);
+		while (len < HEAVY_LENGTH - 16)
+		{
+			key_name(rand_r(&worker->seed) % options->keys, name);
+			len += sprintf(buf + len, "+%s", name);
+		}
+		buf[len++] = '\n';
+		return len;
+	}
+
+	if (pick < options->mix[EXPR_LITERAL])
+		return sprintf(buf, "%d + %d * %d\n", rand_r(&worker->seed) % 1000, rand_r(&worker->seed) % 100, rand_r(&worker->seed) % 10);
+	else if (pick < options->mix[EXPR_LITERAL] + options->mix[EXPR_ASSIGN])
+		return sprintf(buf, "%s = %d + %d\n", name, rand_r(&worker->seed) % 1000, rand_r(&worker->seed) % 1000);
+	else
+		return sprintf(buf, "%s\n", name);
+}
+
+static int connect_server(const struct BenchOptions * options)
+{
+	int fd = open_clientfd(options->host, options->port);
+	if (fd < 0)
+		fprintf(stderr, "Could not connect to %s:%s\n", options->host, options->port);
+	return fd;
+}
+
+// -- < Benchmark > --------------------------------------------------------------
+
+static void * worker_thread(void * args)
+{
+	struct Worker * worker = args;
+	const struct BenchOptions * options = worker->options;
+	rio_t in;
+	char line[LINEBUFF_SIZE];
+	char batch[MAX_DEPTH * 64];
+	int depth = worker->heavy ? HEAVY_DEPTH : options->depth;
+
+	// Send times of requests in flight, responses come back in order
+	uint64_t intended[MAX_DEPTH], actual[MAX_DEPTH];
+	size_t head = 0, outstanding = 0;
+
+	uint64_t end = start_ns + (uint64_t) (options->duration * 1e9);
+	uint64_t interval = options->rate > 0 && !worker->heavy ? (uint64_t) (1e9 * options->connections / options->rate) : 0;
+	uint64_t next_send = start_ns + interval * worker->index / options->connections; // spread connections
+
+	rio_readinitb(&in, worker->fd);
+
+	for (;;)
+	{
+		uint64_t now = now_ns();
+
+		// Fill the pipeline with every request that is due
+		size_t len = 0;
+		while (now < end && outstanding < (size_t) depth && (interval == 0 || next_send <= now))
+		{
+			size_t slot = (head + outstanding) % MAX_DEPTH;
+			intended[slot] = interval ? next_send : now;
+			actual[slot] = now;
+			next_send += interval;
+			outstanding++;
+			len += next_expression(worker, batch + len);
+		}
+
+		if (len > 0 && rio_writen(worker->fd, batch, len) != (ssize_t) len)
+		{
+			fprintf(stderr, "Connection %d: write failed\n", worker->index);
+			break;
+		}
+
+		if (outstanding > 0)
+		{
+			if (rio_readlineb(&in, line, LINEBUFF_SIZE) <= 0)
+			{
+				fprintf(stderr, "Connection %d: server closed the connection\n", worker->index);
+				break;
+			}
+
+			now = now_ns();
+			hist_record(&worker->corrected, now - intended[head]);
+			hist_record(&worker->uncorrected, now - actual[head]);
+			worker->requests++;
+			if (strncmp(line, "Error", 5) == 0)
+				worker->errors++;
+
+			head = (head + 1) % MAX_DEPTH;
+			outstanding--;
+		}
+		else if (now >= end)
+			break;
+		else if (next_send > now + SPIN_NS)
+		{
+			// Open loop and nothing in flight: sleep until shortly before the next scheduled
+			// request and spin the rest, so timer slack does not show up as latency
+			uint64_t sleep_ns = next_send - now - SPIN_NS;
+			struct timespec wait = { sleep_ns / 1000000000ull, sleep_ns % 1000000000ull };
+			nanosleep(&wait, NULL);
+		}
+	}
+
+	return NULL;
+}
+
+// Define every variable, so reads don't fail
+static int populate(const struct BenchOptions * options)
+{
+	int fd = connect_server(options);
+	if (fd < 0)
+		return 1;
+
+	rio_t in;
+	char line[LINEBUFF_SIZE];
+	char name[16];
+	rio_readinitb(&in, fd);
+
+	for (int key = 0; key < options->keys; key++)
+	{
+		key_name(key, name);
+		int len = snprintf(line, LINEBUFF_SIZE, "%s = %d\n", name, key);
+		if (rio_writen(fd, line, len) != len || rio_readlineb(&in, line, LINEBUFF_SIZE) <= 0)
+		{
+			close(fd);
+			return 1;
+		}
+	}
+
+	close(fd);
+	return 0;
+}
+
+static int parse_mix(const char * str, int mix[3])
+{
+	if (sscanf(str, "%d,%d,%d", &mix[EXPR_LITERAL], &mix[EXPR_ASSIGN], &mix[EXPR_READ]) != 3)
+		return 1;
+	return mix[0] < 0 || mix[1] < 0 || mix[2] < 0 || mix[0] + mix[1] + mix[2] == 0;
+}
+
+static void usage(const char * program)
+{
+	fprintf(stderr,
+			"Usage: %s -p <port> [options]\n"
+			"  -H <host>      server host (default 127.0.0.1)\n"
+			"  -c <n>         connections (default 4)\n"
+			"  -d <n>         pipeline depth per connection (default 1)\n"
+			"  -t <seconds>   duration (default 5)\n"
+			"  -r <rps>       total request rate, open loop (default 0: closed loop)\n"
+			"  -m <l,a,r>     weights of literals, assignments and reads (default 50,25,25)\n"
+			"  -k <n>         distinct variables (default 100)\n"
+			"  -x <n>         extra connections sending heavy expressions (default 0)\n", program);
+}
+
+int main(int argc, char **argv)
+{
+	struct BenchOptions options = { "127.0.0.1", NULL, 4, 1, 5.0, 0.0, { 50, 25, 25 }, 100, 0 };
+
+	int opt;
+	while ((opt = getopt(argc, argv, "H:p:c:d:t:r:m:k:x:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'H': options.host = optarg; break;
+		case 'p': options.port = optarg; break;
+		case 'c': options.connections = atoi(optarg); break;
+		case 'd': options.depth = atoi(optarg); break;
+		case 't': options.duration = atof(optarg); break;
+		case 'r': options.rate = atof(optarg); break;
+		case 'k': options.keys = atoi(optarg); break;
+		case 'x': options.heavy = atoi(optarg); break;
+		case 'm':
+			if (parse_mix(optarg, options.mix) != 0)
+			{
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (options.port == NULL || options.connections < 1 || options.connections > MAX_CONNECTIONS ||
+		options.depth < 1 || options.depth > MAX_DEPTH || options.duration <= 0 || options.keys < 1 ||
+		options.heavy < 0 || options.connections + options.heavy > MAX_CONNECTIONS)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (populate(&options) != 0)
+	{
+		fprintf(stderr, "Could not populate variables\n");
+		return 1;
+	}
+
+	int total = options.connections + options.heavy;
+	struct Worker * workers = calloc(total, sizeof(struct Worker));
+	for (int i = 0; i < total; i++)
+	{
+		workers[i].options = &options;
+		workers[i].index = i;
+		workers[i].heavy = i >= options.connections;
+		workers[i].seed = i * 7919 + 1;
+		workers[i].fd = connect_server(&options);
+		if (workers[i].fd < 0)
+			return 1;
+	}
+
+	start_ns = now_ns();
+	for (int i = 0; i < total; i++)
+		Pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+
+	struct Histogram * corrected = calloc(1, sizeof(struct Histogram));
+	struct Histogram * uncorrected = calloc(1, sizeof(struct Histogram));
+	uint64_t requests = 0, errors = 0, heavy_requests = 0;
+	for (int i = 0; i < total; i++)
+	{
+		Pthread_join(workers[i].thread, NULL);
+		close(workers[i].fd);
+		if (workers[i].heavy)
+		{
+			heavy_requests += workers[i].requests;
+			continue;
+		}
+		hist_merge(corrected, &workers[i].corrected);
+		hist_merge(uncorrected, &workers[i].uncorrected);
+		requests += workers[i].requests;
+		errors += workers[i].errors;
+	}
+	double elapsed = (now_ns() - start_ns) / 1e9;
+
+	printf("{\"mode\":\"%s\",\"connections\":%d,\"depth\":%d,\"target_rps\":%.1f,"
+		   "\"mix\":{\"literal\":%d,\"assign\":%d,\"read\":%d},\"keys\":%d,"
+		   "\"duration_s\":%.3f,\"requests\":%lu,\"errors\":%lu,\"throughput_rps\":%.1f,"
+		   "\"heavy_connections\":%d,\"heavy_rps\":%.1f,",
+		   options.rate > 0 ? "open" : "closed", options.connections, options.depth, options.rate,
+		   options.mix[EXPR_LITERAL], options.mix[EXPR_ASSIGN], options.mix[EXPR_READ], options.keys,
+		   elapsed, requests, errors, requests / elapsed, options.heavy, heavy_requests / elapsed);
+	hist_print_json("latency_us", corrected);
+	printf(",");
+	hist_print_json("latency_uncorrected_us", uncorrected);
+	printf("}\n");
+
+	free(corrected);
+	free(uncorrected);
+	free(workers);
+	return 0;
+}
@@ -0,0 +1,311 @@
+/*
+	Microbenchmarks of calc_eval.
+
+	Times calc_eval over a corpus of short literals, long operator chains,
+	assignments, expressions reading many variables and failing inputs, using
+	the BENCH support of tctest. Every benchmark reports ns/op, allocations/op
+	(malloc, calloc and realloc are wrapped at link time) and instructions/op
+	when perf_event_open is allowed. Results are also written as JSON so runs
+	can be compared.
+
+	Logging is turned off by default so only calc_eval itself is measured,
+	"-l error" includes the cost of the error messages of failing inputs.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include "tctest.h"
+
+#include "calc.h"
+#include "logger.h"
+
+#define CHAIN_TERMS 64			// Operands of the long chain expressions
+#define DEFINED_VARIABLES 1024	// Variables defined before every benchmark
+#define READ_VARIABLES 16		// Variables read by one expression
+#define ASSIGNED_NAMES 4096		// Distinct names written by benchAssignMany
+
+typedef struct {
+	struct Calc *calc;
+	char chain[CHAIN_TERMS * 8];
+	char reads[READ_VARIABLES * 8];
+	char (*assignments)[16];
+} TestObjs;
+
+/// Results gathered for the JSON report
+struct BenchReport
+{
+	tctest_bench_result results[32];
+	int count;
+};
+
+static struct BenchReport report;
+static __thread unsigned long allocations;
+
+// -- < Allocation counting > ----------------------------------------------------
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	allocations++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+	allocations++;
+	return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	allocations++;
+	return __real_realloc(ptr, size);
+}
+
+static unsigned long allocation_count(void)
+{
+	return allocations;
+}
+
+// -- < Corpus > -----------------------------------------------------------------
+
+// Names made of letters only, as calc accepts: vaaa, vaab, ...
+static void variable_name(char *name, int index)
+{
+	sprintf(name, "v%c%c%c", 'a' + index / 676 % 26, 'a' + index / 26 % 26, 'a' + index % 26);
+}
+
+TestObjs *setup(void) {
+	TestObjs *objs = malloc(sizeof(TestObjs));
+	objs->calc = calc_create();
+
+	int result;
+	char expr[32], name[8];
+	for (int i = 0; i < DEFINED_VARIABLES; i++)
+	{
+		variable_name(name, i);
+		sprintf(expr, "%s = %d", name, i);
+		calc_eval(objs->calc, expr, &result);
+	}
+
+	// 1 + 2 * 3 - 4 / 5 + ...
+	const char ops[] = "+*-/";
+	size_t len = sprintf(objs->chain, "1");
+	for (int i = 2; i <= CHAIN_TERMS; i++)
+		len += sprintf(objs->chain + len, " %c %d", ops[i % 4], i);
+
+	len = 0;
+	for (int i = 0; i < READ_VARIABLES; i++)
+	{
+		variable_name(name, i * (DEFINED_VARIABLES / READ_VARIABLES));
+		len += sprintf(objs->reads + len, "%s%s", i ? " + " : "", name);
+	}
+
+	objs->assignments = malloc(ASSIGNED_NAMES * sizeof(*objs->assignments));
+	for (int i = 0; i < ASSIGNED_NAMES; i++)
+	{
+		variable_name(name, i);
+		sprintf(objs->assignments[i], "w%s = %d", name + 1, i);
+	}
+	return objs;
+}
+
+void cleanup(TestObjs *objs) {
+	calc_destroy(objs->calc);
+	free(objs->assignments);
+	free(objs);
+}
+
+// -- < Benchmarks > -------------------------------------------------------------
+
+void benchLiteral(TestObjs *objs, long iterations);
+void benchBinary(TestObjs *objs, long iterations);
+void benchLongChain(TestObjs *objs, long iterations);
+void benchAssign(TestObjs *objs, long iterations);
+void benchAssignExpression(TestObjs *objs, long iterations);
+void benchAssignMany(TestObjs *objs, long iterations);
+void benchReadVariable(TestObjs *objs, long iterations);
+void benchReadManyVariables(TestObjs *objs, long iterations);
+void benchUndefinedVariable(TestObjs *objs, long iterations);
+void benchDivideByZero(TestObjs *objs, long iterations);
+void benchSyntaxError(TestObjs *objs, long iterations);
+
+static void record_result(const tctest_bench_result *result)
+{
+	if (report.count < (int) (sizeof(report.results) / sizeof(report.results[0])))
+		report.results[report.count++] = *result;
+}
+
+// Unknown values (-1) are written as null
+static void write_number(FILE *out, const char *name, double value, const char *format)
+{
+	fprintf(out, ",\"%s\":", name);
+	if (value < 0)
+		fprintf(out, "null");
+	else
+		fprintf(out, format, value);
+}
+
+static int write_report(const char *path)
+{
+	FILE *out = fopen(path, "w");
+	if (out == NULL)
+		return -1;
+
+	fprintf(out, "{\"min_time_ms\":%ld,\"benchmarks\":[", tctest_bench_min_ns / 1000000);
+	for (int i = 0; i < report.count; i++)
+	{
+		tctest_bench_result *result = &report.results[i];
+		fprintf(out, "%s\n{\"name\":\"%s\",\"iterations\":%ld", i ? "," : "", result->name, result->iterations);
+		write_number(out, "ns_per_op", result->ns_per_op, "%.2f");
+		write_number(out, "allocs_per_op", result->allocs_per_op, "%.3f");
+		write_number(out, "instructions_per_op", result->instructions_per_op, "%.1f");
+		fprintf(out, "}");
+	}
+	fprintf(out, "\n]}\n");
+	return fclose(out);
+}
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "Usage: %s [-o <json file>] [-t <min ms per benchmark>] [-b <benchmark>] "
+					"[-l off|trace|info|warn|error]\n", program);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	const char *output = "calcMicroBench.json";
+	enum LogLevel level = LOG_LEVEL_OFF;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "o:t:b:l:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'o':
+				output = optarg;
+				break;
+			case 't':
+				tctest_bench_min_ns = atol(optarg) * 1000000;
+				if (tctest_bench_min_ns <= 0)
+					usage(argv[0]);
+				break;
+			case 'b':
+				tctest_testname_to_execute = optarg;
+				break;
+			case 'l':
+				if (strcmp(optarg, "off") == 0)
+					level = LOG_LEVEL_OFF;
+				else if (strcmp(optarg, "trace") == 0)
+					level = LOG_LEVEL_TRACE;
+				else if (strcmp(optarg, "info") == 0)
+					level = LOG_LEVEL_INFO;
+				else if (strcmp(optarg, "warn") == 0)
+					level = LOG_LEVEL_WARN;
+				else if (strcmp(optarg, "error") == 0)
+					level = LOG_LEVEL_ERROR;
+				else
+					usage(argv[0]);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	Logger * log = logger_get();
+	logger_set_level(level);
+	tctest_bench_alloc_count = allocation_count;
+	tctest_on_bench_executed = record_result;
+	TEST_INIT();
+
+	BENCH(benchLiteral);
+	BENCH(benchBinary);
+	BENCH(benchLongChain);
+	BENCH(benchAssign);
+	BENCH(benchAssignExpression);
+	BENCH(benchAssignMany);
+	BENCH(benchReadVariable);
+	BENCH(benchReadManyVariables);
+	BENCH(benchUndefinedVariable);
+	BENCH(benchDivideByZero);
+	BENCH(benchSyntaxError);
+
+	logger_destroy(log);
+	if (write_report(output) != 0)
+	{
+		fprintf(stderr, "Could not write %s\n", output);
+		return 1;
+	}
+
+	TEST_FINI();
+}
+
+// Evaluate the same expression, which must succeed with the given result
+static void eval_repeat(TestObjs *objs, const char *expr, int expected, long iterations)
+{
+	int result = 0;
+	for (long i = 0; i < iterations; i++)
+		ASSERT(0 != calc_eval(objs->calc, expr, &result));
+	ASSERT(expected == result);
+}
+
+// Evaluate the same expression, which must fail with the given error
+static void eval_fail_repeat(TestObjs *objs, const char *expr, enum calc_error error, long iterations)
+{
+	int result;
+	for (long i = 0; i < iterations; i++)
+		ASSERT(0 == calc_eval(objs->calc, expr, &result));
+	ASSERT(error == calc_last_error());
+}
+
+void benchLiteral(TestObjs *objs, long iterations) {
+	eval_repeat(objs, "42", 42, iterations);
+}
+
+void benchBinary(TestObjs *objs, long iterations) {
+	eval_repeat(objs, "33 + 15", 48, iterations);
+}
+
+void benchLongChain(TestObjs *objs, long iterations) {
+	int expected;
+	ASSERT(0 != calc_eval(objs->calc, objs->chain, &expected));
+	eval_repeat(objs, objs->chain, expected, iterations);
+}
+
+void benchAssign(TestObjs *objs, long iterations) {
+	eval_repeat(objs, "a = 4", 4, iterations);
+}
+
+void benchAssignExpression(TestObjs *objs, long iterations) {
+	eval_repeat(objs, "a = vaab * 2 + vaac", 4, iterations);
+}
+
+void benchAssignMany(TestObjs *objs, long iterations) {
+	int result;
+	for (long i = 0; i < iterations; i++)
+		ASSERT(0 != calc_eval(objs->calc, objs->assignments[i % ASSIGNED_NAMES], &result));
+}
+
+void benchReadVariable(TestObjs *objs, long iterations) {
+	eval_repeat(objs, "vabc", 28, iterations);
+}
+
+void benchReadManyVariables(TestObjs *objs, long iterations) {
+	// Sum of 0, 64, ..., 960
+	eval_repeat(objs, objs->reads, 7680, iterations);
+}
+
+void benchUndefinedVariable(TestObjs *objs, long iterations) {
+	eval_fail_repeat(objs, "undefined + 1", CALC_ERROR_UNDEFINED, iterations);
+}
+
+void benchDivideByZero(TestObjs *objs, long iterations) {
+	eval_fail_repeat(objs, "4 / 0", CALC_ERROR_DIVIDE_BY_ZERO, iterations);
+}
+
+void benchSyntaxError(TestObjs *objs, long iterations) {
+	eval_fail_repeat(objs, "4 4", CALC_ERROR_SYNTAX, iterations);
+}
@@ -5,9 +5,28 @@
 #include "csapp.h"
 #include "calc.h"
 #include "logger.h"
+#include "replication.h"
+#include "cluster.h"
+#include "coro.h"
+#include "trace.h"
+#include "statmutex.h"
+#include "metrics.h"
+#include "txn.h"
+#include "watch.h"
+#include "pool.h"
+#include "snapshot.h"
+#include "wal.h"
+#include "ratelimit.h"
+#include "affinity.h"
+#include "namespace.h"
+#include "expire.h"
 #include <assert.h>
+#include <limits.h>
 #include <string.h>
 #include <signal.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/timerfd.h>
 
 // Booleans
 #define TRUE 1
@@ -24,6 +43,16 @@
 // #define SERVER_ADDR INADDR_ANY   // Listen anything
 #define MAX_CONNECTION_QUEUE_SIZE 100
 #define MAX_SIMULT_SESSIONS 100 		// Max amount of simultaneous sessions
+#define MAX_EXPR_NAMES 64				// Max amount of distinct variables in a clustered expression
+#define MAX_MULTI_NAMES (LINEBUFF_SIZE / 2)	// Names of one mget or mset, as many as a line can hold
+#define NO_THREAD_INDEX ((size_t) -1)	// Thread index of sessions running as coroutines
+#define MAX_SCRAPED_LOCKS 16			// Locks reported on /metrics
+#define SESSION_THREAD_STACK_SIZE (256 * 1024) // Default stack of session threads
+#define SESSION_SLAB_OBJECTS 64			// Sessions added to the pool at once
+#define BUFFER_SLAB_OBJECTS 16			// I/O buffers added to the pool at once
+#define BUFFER_PREALLOCATED 16			// I/O buffers reserved at startup
+#define SESSION_IDLE_MS 1000			// Quiet time before a session thread releases its memory
+#define SCHED_DEFAULT_QUANTUM 64		// Operations a session runs before the others with queued work get a turn
 
 /// Server persistent data
 struct Server
@@ -33,25 +62,271 @@ struct Server
 	bool  		running;    	// If the server should stope
 	int 		socket_fd;  	// File descriptor for the server socket
 	pthread_t main_thread_id; 				// Main thread id for signals
-	pthread_mutex_t calc_mutex; 			// Mutex required to ensure thread safety with calculator operations
-	pthread_mutex_t thread_pool_mutex; 		// Mutex required to ensure thread safety with thread pool
+	StatRwLock calc_lock; 					// Exclusive for calculator changes, shared for reads and counter updates
+	StatMutex thread_pool_mutex; 			// Mutex required to ensure thread safety with thread pool
 	pthread_t threads[MAX_SIMULT_SESSIONS];	//	Pool of threads
 	bool	  thread_destroy_queue[MAX_SIMULT_SESSIONS]; // queue of threads to be destroyed
+	Replication * repl;						// Replication state, NULL when not replicating
+	Cluster * cluster;						// Consistent-hash ring, NULL when not clustered
+	CoroScheduler * coro;					// Runs sessions as coroutines, NULL for a thread per session
+	uint32_t sessions_started;				// Gives every session an id for traces
+	const char * trace_file;				// Where "trace dump" and shutdown write sampled spans
+	SlabPool * sessions;					// State of every connection
+	SlabPool * buffers;						// I/O buffers, shared by the requests in flight
+	pthread_attr_t thread_attr;				// Stack size of session threads
+	size_t thread_stack_size;
+	size_t coro_stack_size;					// 0 when sessions run on threads
+	bool snapshots;							// "save" and periodic snapshots are enabled
+	Wal * wal;								// Log of assignments, NULL when not logging
+	long sched_quantum;						// Operations added to the deficit of a session at every turn
+	RateLimit rate_limit;					// Of every connection, rate 0 for no limit
+	RateLimit ip_rate_limit;				// Of every source address, rate 0 for no limit
+	RateTable * ip_buckets;					// Buckets of source addresses, NULL without ip_rate_limit
+	cpu_set_t worker_cpus;					// CPUs of session threads, empty to leave them unpinned
+	NamespaceTable * namespaces;			// Calculators selected with "use"
+	size_t max_memory;						// Bytes of the variable tables before evicting, 0 for no limit
 };
 
-/// Arguments to pass to the session thread when creating it
-struct SessionArgs
+/// Command line options
+struct ServerOptions
+{
+	size_t port;				// port to listen to for clients
+	const char * repl_port; 	// port to listen to for replicas, NULL if not a primary
+	char replica_host[64];		// primary to follow, empty if not a replica
+	char replica_port[8];
+	const char * node_id;		// id of this node in the cluster, NULL if not clustered
+	const char * cluster_nodes[CLUSTER_MAX_NODES]; // "id=host:port" of every cluster member
+	size_t cluster_node_count;
+	int coro_threads;			// OS threads running session coroutines, 0 for a thread per session
+	size_t coro_stack_size;		// Stack size of every session coroutine
+	unsigned trace_sample;		// Trace 1 out of this many requests, 0 to disable tracing
+	const char * metrics_port;	// Local port serving /metrics, NULL to disable metrics
+	const char * trace_file;	// File the traces are dumped to
+	unsigned watch_interval;	// Milliseconds between two rounds of watch notifications
+	size_t thread_stack_size;	// Stack size of every session thread
+	const char * snapshot_file;	// Snapshot loaded at startup and written by saves, NULL to disable
+	unsigned save_interval;		// Seconds between periodic saves, 0 for "save" only
+	const char * wal_file;		// Log of assignments replayed at startup, NULL to disable
+	const char * store_file;	// Memory mapped file holding the variables, NULL to keep them in memory
+	WalSync wal_sync;			// When the log is synced
+	unsigned wal_interval;		// Milliseconds between group commits
+	size_t op_budget;			// Most operations of an expression, 0 for no limit
+	long sched_quantum;			// Operations of a session turn, see SCHED_DEFAULT_QUANTUM
+	RateLimit rate_limit;		// Requests of a connection, rate 0 for no limit
+	RateLimit ip_rate_limit;	// Requests of all connections from an address, rate 0 for no limit
+	cpu_set_t acceptor_cpus;	// CPUs of the accepting thread, empty to leave it unpinned
+	cpu_set_t worker_cpus;		// CPUs of session threads and coroutine threads, likewise
+	cpu_set_t logger_cpus;		// CPUs of the log writer thread, likewise
+	size_t max_namespaces;		// Namespaces alive at once
+	unsigned namespace_idle;	// Seconds unused before a namespace is evicted, 0 to keep them
+	size_t max_memory;			// Bytes of the variable tables before evicting, 0 for no limit
+	unsigned expire_interval;	// Milliseconds between two rounds of expiration
+};
+
+/// Variables referenced by an expression, with the node owning each one
+struct ExprNames
+{
+	Cluster * cluster;
+	size_t count;
+	bool overflow;
+	char names[MAX_EXPR_NAMES][CALC_KEY_SIZE];
+	int owners[MAX_EXPR_NAMES];
+	bool assigned[MAX_EXPR_NAMES];
+};
+
+/// Assignments done while evaluating a clustered expression on a scratch calculator
+struct ScratchAssignments
+{
+	size_t count;
+	char names[MAX_EXPR_NAMES][CALC_KEY_SIZE];
+	int values[MAX_EXPR_NAMES];
+};
+
+/// Buffers of a request being read and answered
+struct SessionBuffer
+{
+	rio_t in;
+	char line[LINEBUFF_SIZE];
+};
+
+/// State of a connection, kept in the session pool. An idle session holds nothing else
+struct Session
 {
-	int peer_socket_fd;
 	struct Server * server;
+	int peer_socket_fd;
+	uint32_t session_id;
 	size_t thread_index;
+	TraceContext trace;
+	Txn * txn;								// Open transaction, NULL outside begin/commit
+	WatchSubscriber * watches;				// NULL until the first "watch"
+	struct SessionBuffer * buffer;			// Taken from the buffer pool while a request is in flight
+	long deficit;							// Operations left in this turn, deficit round robin
+	unsigned long ops;						// Operations evaluated by all the requests of the session
+	RateBucket rate;						// Tokens of the connection
+	RateBucket * ip_rate;					// Tokens of the source address, NULL without a limit
+	int timer_fd;							// Waits for delayed requests, -1 until the first one
+	Namespace * ns;							// Selected with "use", NULL for the default calculator
 };
 
 /// Summary:
 /// 	Initialize server
 ///	Parameters:
-///		posrt = port to interact with
-void server_start(struct Server * server, size_t port);
+///		options = command line options, including the port to interact with
+void server_start(struct Server * server, const struct ServerOptions * options);
+
+/// Summary:
+///		Parse command line arguments
+///	Returns:
+///		0 on success, anything else if arguments are invalid
+int server_parse_options(int argc, char **argv, struct ServerOptions * options);
+
+/// Cost and error of an evaluation, taken before the session may be parked on the log
+/// and the thread local calc_last_cost and calc_last_error belong to someone else
+struct EvalOutcome
+{
+	size_t cost;
+	enum calc_error error;
+};
+
+/// Summary:
+///		Thread safe version of calc_eval
+///	Parameters:
+///		ns      = namespace to evaluate in, NULL for the default calculator
+///		outcome = receives the cost and error of the evaluation, CALC_ERROR_LOG if the log failed. May be NULL
+///		trace   = tracing state of the session, lock wait and eval spans are recorded to it. May be NULL
+int server_calc_eval(struct Server * server, Namespace * ns, const char *expr, int *result, struct EvalOutcome * outcome, TraceContext * trace);
+
+/// Summary:
+///		Apply "name op= operand" to a counter. Runs under the shared calc lock, as an
+///		atomic operation on the variable, unless replication or a transaction needs
+///		to see every write in order
+int server_calc_update(struct Server * server, Namespace * ns, const char *name, char op, int operand, int *result, struct EvalOutcome * outcome, TraceContext * trace);
+
+/// Summary:
+///		Handle "cas <name> <expected> <desired>": answers 1 if the variable held expected
+///		and was set to desired, 0 otherwise
+void server_cas_command(struct Server * server, Namespace * ns, int outfd, char * args);
+
+/// Summary:
+///		Handle "mget <name> ..." and "mset <name>=<value> ...", taking the calc lock once for
+///		every name. Answers one line with a value ("?" if undefined), or "Ok" or "Error", per name
+///	Returns:
+///		The operations evaluated, one per name
+size_t server_mget_command(struct Server * server, Namespace * ns, int outfd, char * args);
+size_t server_mset_command(struct Server * server, Namespace * ns, int outfd, char * args);
+
+/// Summary:
+///		Called by calc_eval on every assignment, forwards it to the replication log and the write-ahead log
+void server_on_assign(void * ctx, const char * name, int value);
+
+/// Summary:
+///		Called by the calculator on every removal, e.g. of an expired or evicted variable, forwards it to the same logs
+void server_on_delete(void * ctx, const char * name);
+
+/// Summary:
+///		Evaluate an expression in a cluster: variables owned by other nodes are fetched
+///		in one batch per node, and assignments to remote variables are forwarded to their owner
+///	Parameters:
+///		forward = if false, the expression is evaluated here even if it assigns remote variables
+int server_cluster_eval(struct Server * server, const char *expr, int *result, bool forward);
+
+/// Summary:
+///		Handle a line starting with '@', sent by another cluster node
+void server_cluster_command(struct Server * server, int outfd, char * line);
+
+/// Summary:
+///		Append the server gauges (session threads, coroutines, locks) to a /metrics response
+void server_collect_metrics(void * ctx, MetricsBuffer * out);
+
+/// Summary:
+///		Handle the "trace dump" and "trace sample <n>" commands
+void server_trace_command(struct Server * server, int outfd, char * args);
+
+/// Summary:
+///		Commit the transaction of a session and write the committed results, or the conflict
+void server_txn_commit(struct Server * server, int outfd, Txn * txn);
+
+/// Summary:
+///		Take a session from the pool for a new connection
+/// Returns:
+///		The session, or NULL if the pool is out of memory
+struct Session * server_session_create(struct Server * server, int peer_socket_fd, size_t thread_index);
+
+/// Summary:
+///		Read the next request line of a session into its buffer, taking one from the pool
+///		once the client sends something
+/// Returns:
+///		Bytes read, 0 at the end of input, -1 on error
+ssize_t server_session_read(struct Session * session);
+
+/// Summary:
+///		Give the buffer of a session back to the pool
+void server_session_release_buffer(struct Session * session);
+
+/// Summary:
+///		Take a token for the next request of a session, waiting for it in delay mode
+/// Returns:
+///		TRUE if the request is over a limit and must be rejected
+bool server_rate_limited(struct Session * session);
+
+/// Summary:
+///		Wait without blocking the other sessions of the thread
+void server_session_sleep(struct Session * session, uint64_t ns);
+
+/// Summary:
+///		Handle "use <namespace>", "use default" going back to the default calculator
+void server_use_command(struct Session * session, int outfd, char * args);
+
+/// Summary:
+///		Handle the "namespaces" command: variables, memory and requests of every namespace
+void server_namespaces_command(struct Server * server, int outfd);
+
+/// Summary:
+///		Restrict a thread to a set of CPUs, exiting if none of them can be used
+///	Parameters:
+///		what = name of the thread, for logs
+void server_pin_thread(const char * what, pthread_t thread, const cpu_set_t * cpus);
+
+/// Summary:
+///		Rotate the write-ahead log before a snapshot forks, and drop the rotated part once it is saved
+void server_snapshot_forking(void * ctx);
+void server_snapshot_saved(void * ctx, int saved);
+
+/// Summary:
+///		Handle the "walinfo" command
+void server_wal_info(struct Server * server, int outfd);
+
+/// Summary:
+///		Handle the "save" and "saveinfo" commands
+void server_save_command(struct Server * server, int outfd, bool info);
+
+/// Summary:
+///		Write the memory taken by connections, for the "memory" command
+void server_memory_report(struct Server * server, char * buf, size_t size);
+
+/// Summary:
+///		Remove expired variables from the next slots of every calculator
+/// Return:
+///		TRUE if many had expired and the next slots should be looked at at once
+int server_expire_tick(void * ctx);
+
+/// Summary:
+///		Read a variable under the shared calc lock, for the watch dispatcher
+int server_watch_read(void * ctx, const char * name, int * value);
+
+/// Summary:
+///		Handle the "watch <name>" and "unwatch <name>" commands
+/// Parameters:
+///		watches = subscriber of the session, created on its first watch
+void server_watch_command(int outfd, WatchSubscriber ** watches, char * line);
+
+/// Summary:
+///		Handle the "cluster add|remove|info" admin commands
+void server_cluster_admin(struct Server * server, int outfd, char * args);
+
+/// Summary:
+///		Hand over, in the background, the variables this node no longer owns
+void server_cluster_rebalance(struct Server * server);
 
 /// Summary:
 ///		Destroy current server object
@@ -100,6 +375,13 @@ void server_create_thread(struct Server * server, int peer_socket_fd);
 ///		Queue this thread to be destroyed
 void server_destroy_thread(struct Server* server, size_t thread_index);
 
+/// Summary
+///		Start a session as a coroutine on the server scheduler
+///	Parameters
+///		server : pointer to a server to use
+///		peer_socket_fd : file descriptor for peer socket
+void server_create_coroutine(struct Server * server, int peer_socket_fd);
+
 // Server object for our application
 struct Server server;
 
@@ -130,32 +412,19 @@ int main(int argc, char **argv) {
 	sig_act.sa_handler = sigalarm_handler;
 	sigaction(SIGALRM, &sig_act, NULL);
 
-	// Check arguments
-	if (argc <2)
-	{
-		LOG_ERROR("Not enough arguments: No port provided.\n");
-		return 1;
-	}
-	else if(argc > 2)
-		LOG_WARN("Too many arguments: taking only first argument\n");
-
-	// Read port argument 
-	size_t port = 0;
-	sscanf(argv[1], "%lu", &port);
+	// A replica or a client going away should not kill the server
+	signal(SIGPIPE, SIG_IGN);
 
-	// Error checking
-	if (port < PORT_MIN) // Check port lower bound
+	// Check arguments
+	struct ServerOptions options;
+	if (server_parse_options(argc, argv, &options) != 0)
 	{
-		LOG_ERROR("Invalid port. The given port is reserved for admin privileges. Choose a port greater or equal to 1024\n")
+		logger_destroy();	// Flush the error
 		return 1;
 	}
-	else if (port > PORT_MAX) // Check port upper bound
-	{
-		LOG_ERROR("Invalid port. The given port number is greater than the max port number: %d\n", PORT_MAX);
-	}
 
 	// Start the server
-	server_start(&server, port);
+	server_start(&server, &options);
 
 	while (server_running(&server))
 	{
@@ -176,7 +445,10 @@ int main(int argc, char **argv) {
 		LOG_TRACE("New connection established!\n");
 		
 		// Start an interactive session
-		server_create_thread(&server, peer_socket);
+		if (server.coro)
+			server_create_coroutine(&server, peer_socket);
+		else
+			server_create_thread(&server, peer_socket);
 	}
 
 	// Shut down server object
@@ -197,32 +469,482 @@ int server_running(struct Server * server)
 	return server->running;
 }
 
+// Parse command line arguments
+int server_parse_options(int argc, char **argv, struct ServerOptions * options)
+{
+	static struct option long_options[] = {
+		{"repl-port",  required_argument, NULL, 'r'},
+		{"replica-of", required_argument, NULL, 'R'},
+		{"node-id",    required_argument, NULL, 'n'},
+		{"cluster-node", required_argument, NULL, 'c'},
+		{"coro-threads", required_argument, NULL, 't'},
+		{"coro-stack-size", required_argument, NULL, 's'},
+		{"log-full", required_argument, NULL, 'l'},
+		{"log-level", required_argument, NULL, 'L'},
+		{"log-binary", required_argument, NULL, 'b'},
+		{"trace-sample", required_argument, NULL, 'T'},
+		{"trace-file", required_argument, NULL, 'F'},
+		{"metrics-port", required_argument, NULL, 'm'},
+		{"watch-interval", required_argument, NULL, 'w'},
+		{"thread-stack-size", required_argument, NULL, 'S'},
+		{"snapshot", required_argument, NULL, 'p'},
+		{"save-interval", required_argument, NULL, 'i'},
+		{"wal", required_argument, NULL, 'W'},
+		{"wal-sync", required_argument, NULL, 'y'},
+		{"wal-interval", required_argument, NULL, 'I'},
+		{"store", required_argument, NULL, 'M'},
+		{"op-budget", required_argument, NULL, 'B'},
+		{"sched-quantum", required_argument, NULL, 'Q'},
+		{"rate-limit", required_argument, NULL, 'a'},
+		{"ip-rate-limit", required_argument, NULL, 'A'},
+		{"rate-limit-mode", required_argument, NULL, 'D'},
+		{"pin-acceptor", required_argument, NULL, 'C'},
+		{"pin-workers", required_argument, NULL, 'k'},
+		{"pin-logger", required_argument, NULL, 'G'},
+		{"max-namespaces", required_argument, NULL, 'N'},
+		{"namespace-idle", required_argument, NULL, 'E'},
+		{"max-memory", required_argument, NULL, 'X'},
+		{"expire-interval", required_argument, NULL, 'e'},
+		{NULL, 0, NULL, 0}
+	};
+
+	memset(options, 0, sizeof(*options));
+	options->coro_stack_size = CORO_DEFAULT_STACK_SIZE;
+	options->trace_file = "calcServer.trace.json";
+	options->watch_interval = WATCH_DEFAULT_INTERVAL_MS;
+	options->thread_stack_size = SESSION_THREAD_STACK_SIZE;
+	options->wal_sync = WAL_SYNC_INTERVAL;
+	options->wal_interval = WAL_DEFAULT_INTERVAL_MS;
+	options->sched_quantum = SCHED_DEFAULT_QUANTUM;
+	options->max_namespaces = NAMESPACE_DEFAULT_MAX;
+	options->namespace_idle = NAMESPACE_DEFAULT_IDLE_S;
+	options->expire_interval = EXPIRE_DEFAULT_INTERVAL_MS;
+
+	RateLimitMode rate_limit_mode = RATE_LIMIT_REJECT;
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+		case 'r':
+			options->repl_port = optarg;
+			break;
+		case 'R':
+			if (sscanf(optarg, "%63[^:]:%7s", options->replica_host, options->replica_port) != 2)
+			{
+				LOG_ERROR("Invalid primary address, expected host:port\n");
+				return 1;
+			}
+			break;
+		case 'n':
+			options->node_id = optarg;
+			break;
+		case 'c':
+			if (options->cluster_node_count == CLUSTER_MAX_NODES)
+			{
+				LOG_ERROR("Too many cluster nodes, max is %d\n", CLUSTER_MAX_NODES);
+				return 1;
+			}
+			options->cluster_nodes[options->cluster_node_count++] = optarg;
+			break;
+		case 't':
+			options->coro_threads = atoi(optarg);
+			break;
+		case 's':
+			options->coro_stack_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			if (strcmp(optarg, "drop") == 0)
+				logger_set_full_policy(LOGGER_FULL_DROP);
+			else if (strcmp(optarg, "block") == 0)
+				logger_set_full_policy(LOGGER_FULL_BLOCK);
+			else
+			{
+				LOG_ERROR("Invalid --log-full policy, expected drop or block\n");
+				return 1;
+			}
+			break;
+		case 'L':
+			if (strcmp(optarg, "trace") == 0)
+				logger_set_level(LOG_LEVEL_TRACE);
+			else if (strcmp(optarg, "info") == 0)
+				logger_set_level(LOG_LEVEL_INFO);
+			else if (strcmp(optarg, "warn") == 0)
+				logger_set_level(LOG_LEVEL_WARN);
+			else if (strcmp(optarg, "error") == 0)
+				logger_set_level(LOG_LEVEL_ERROR);
+			else
+			{
+				LOG_ERROR("Invalid --log-level, expected trace, info, warn or error\n");
+				return 1;
+			}
+			break;
+		case 'b':
+			if (logger_open_binary(optarg) != 0)
+			{
+				LOG_ERROR("Could not open binary log %s: %s\n", optarg, strerror(errno));
+				return 1;
+			}
+			break;
+		case 'T':
+			options->trace_sample = strtoul(optarg, NULL, 10);
+			break;
+		case 'F':
+			options->trace_file = optarg;
+			break;
+		case 'm':
+			options->metrics_port = optarg;
+			break;
+		case 'w':
+			options->watch_interval = strtoul(optarg, NULL, 10);
+			break;
+		case 'S':
+			options->thread_stack_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			options->snapshot_file = optarg;
+			break;
+		case 'i':
+			options->save_interval = strtoul(optarg, NULL, 10);
+			break;
+		case 'W':
+			options->wal_file = optarg;
+			break;
+		case 'y':
+			if (wal_parse_sync(optarg, &options->wal_sync) != 0)
+			{
+				LOG_ERROR("Invalid --wal-sync, expected none, interval or commit\n");
+				return 1;
+			}
+			break;
+		case 'I':
+			options->wal_interval = strtoul(optarg, NULL, 10);
+			break;
+		case 'M':
+			options->store_file = optarg;
+			break;
+		case 'B':
+			options->op_budget = strtoul(optarg, NULL, 10);
+			break;
+		case 'Q':
+			options->sched_quantum = strtol(optarg, NULL, 10);
+			break;
+		case 'a':
+		case 'A':
+			if (rate_limit_parse(optarg, RATE_LIMIT_REJECT, opt == 'a' ? &options->rate_limit : &options->ip_rate_limit) != 0)
+			{
+				LOG_ERROR("Invalid rate limit, expected <requests per second>[:<burst>]\n");
+				return 1;
+			}
+			break;
+		case 'D':
+			if (rate_limit_parse_mode(optarg, &rate_limit_mode) != 0)
+			{
+				LOG_ERROR("Invalid --rate-limit-mode, expected reject or delay\n");
+				return 1;
+			}
+			break;
+		case 'N':
+			options->max_namespaces = strtoul(optarg, NULL, 10);
+			break;
+		case 'E':
+			options->namespace_idle = strtoul(optarg, NULL, 10);
+			break;
+		case 'X':
+			options->max_memory = strtoul(optarg, NULL, 10);
+			break;
+		case 'e':
+			options->expire_interval = strtoul(optarg, NULL, 10);
+			break;
+		case 'C':
+		case 'k':
+		case 'G':
+		{
+			cpu_set_t * cpus = opt == 'C' ? &options->acceptor_cpus : opt == 'k' ? &options->worker_cpus : &options->logger_cpus;
+			if (affinity_parse(optarg, cpus) != 0)
+			{
+				LOG_ERROR("Invalid CPU list '%s', expected e.g. 0-3,8\n", optarg);
+				return 1;
+			}
+			if (!affinity_allowed(cpus))
+			{
+				LOG_ERROR("CPU list '%s' has CPUs this process can't run on\n", optarg);
+				return 1;
+			}
+			break;
+		}
+		default:
+			LOG_ERROR("Usage: %s <port> [--repl-port <port>] [--replica-of <host:port>] "
+					  "[--node-id <id> --cluster-node <id>=<host>:<port> ...] "
+					  "[--thread-stack-size <bytes> | --coro-threads <n> [--coro-stack-size <bytes>]] "
+					  "[--log-full drop|block] "
+					  "[--log-level trace|info|warn|error] [--log-binary <file>] "
+					  "[--trace-sample <n> [--trace-file <file>]] [--metrics-port <port>] "
+					  "[--watch-interval <ms>] [--snapshot <file> [--save-interval <seconds>]] "
+					  "[--wal <file> [--wal-sync none|interval|commit] [--wal-interval <ms>]] [--store <file>] "
+					  "[--op-budget <ops>] [--sched-quantum <ops>] "
+					  "[--rate-limit <rps>[:<burst>]] [--ip-rate-limit <rps>[:<burst>]] [--rate-limit-mode reject|delay] "
+					  "[--pin-acceptor <cpus>] [--pin-workers <cpus>] [--pin-logger <cpus>] "
+					  "[--max-namespaces <n>] [--namespace-idle <seconds>] "
+					  "[--max-memory <bytes>] [--expire-interval <ms>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	options->rate_limit.mode = rate_limit_mode;
+	options->ip_rate_limit.mode = rate_limit_mode;
+
+	if (optind >= argc)
+	{
+		LOG_ERROR("Not enough arguments: No port provided.\n");
+		return 1;
+	}
+	else if (argc - optind > 1)
+		LOG_WARN("Too many arguments: taking only first argument\n");
+
+	// Read port argument 
+	sscanf(argv[optind], "%lu", &options->port);
+
+	// Error checking
+	if (options->port < PORT_MIN) // Check port lower bound
+	{
+		LOG_ERROR("Invalid port. The given port is reserved for admin privileges. Choose a port greater or equal to 1024\n")
+		return 1;
+	}
+	else if (options->port > PORT_MAX) // Check port upper bound
+	{
+		LOG_ERROR("Invalid port. The given port number is greater than the max port number: %d\n", PORT_MAX);
+		return 1;
+	}
+
+	if (options->repl_port && options->replica_host[0])
+	{
+		LOG_ERROR("A server can't be a primary and a replica at the same time\n");
+		return 1;
+	}
+
+	if ((options->node_id == NULL) != (options->cluster_node_count == 0))
+	{
+		LOG_ERROR("Cluster mode needs both --node-id and at least one --cluster-node\n");
+		return 1;
+	}
+
+	if (options->wal_file && options->replica_host[0])
+	{
+		LOG_ERROR("A replica is recovered from its primary, --wal can't be used with --replica-of\n");
+		return 1;
+	}
+
+	// A forked child would see the parent keep writing the shared mapping instead of a frozen copy
+	if (options->store_file && options->snapshot_file)
+	{
+		LOG_ERROR("A store file is already persistent, --snapshot can't be used with --store\n");
+		return 1;
+	}
+
+	if (options->sched_quantum <= 0)
+	{
+		LOG_ERROR("Invalid --sched-quantum, expected operations greater than 0\n");
+		return 1;
+	}
+
+	if (options->watch_interval == 0)
+	{
+		LOG_ERROR("Invalid --watch-interval, expected milliseconds greater than 0\n");
+		return 1;
+	}
+
+	if (options->coro_threads < 0 || options->coro_stack_size < 16 * 1024)
+	{
+		LOG_ERROR("Invalid coroutine options, stacks need at least 16KB\n");
+		return 1;
+	}
+
+	if (options->thread_stack_size < PTHREAD_STACK_MIN || options->thread_stack_size < 16 * 1024)
+	{
+		LOG_ERROR("Invalid --thread-stack-size, stacks need at least 16KB\n");
+		return 1;
+	}
+
+	return 0;
+}
+
 // Initializes server 
-void server_start(struct Server * server, size_t port)
+void server_start(struct Server * server, const struct ServerOptions * options)
 {
+	size_t port = options->port;
 	LOG_INFO("Starting server, listenning to port: %lu\n", port);
-	server->calc = calc_create();
+	server->calc = options->store_file != NULL ? calc_open(options->store_file) : calc_create();
+	if (server->calc == NULL)
+		exit(1);
+	calc_set_op_budget(options->op_budget);
+	calc_set_memory_limit(options->max_memory);
+	server->max_memory = options->max_memory;
+	server->sched_quantum = options->sched_quantum;
+	server->rate_limit = options->rate_limit;
+	server->ip_rate_limit = options->ip_rate_limit;
+	server->ip_buckets = options->ip_rate_limit.rate > 0 ? rate_table_create(RATE_TABLE_DEFAULT_SIZE) : NULL;
+
+	// The log writer fills its buffers after this, on the node it now runs on
+	if (affinity_count(&options->logger_cpus) > 0)
+		server_pin_thread("log writer", logger_writer_thread(), &options->logger_cpus);
+
+	// Session threads are created by the acceptor, so they need their own CPUs once it is pinned
+	server->worker_cpus = options->worker_cpus;
+	if (affinity_count(&server->worker_cpus) == 0 && affinity_count(&options->acceptor_cpus) > 0)
+		affinity_current(&server->worker_cpus);
+
+	// Pick up where the last snapshot left off, before replication or clients see the store
+	server->snapshots = options->snapshot_file != NULL;
+	if (server->snapshots)
+	{
+		long loaded = snapshot_load(server->calc, options->snapshot_file);
+		if (loaded < 0)
+		{
+			LOG_ERROR("Invalid snapshot %s\n", options->snapshot_file);
+			exit(1);
+		}
+		LOG_INFO("Loaded %ld variables from %s\n", loaded, options->snapshot_file);
+	}
+
+	// Then the assignments logged after that snapshot
+	server->wal = NULL;
+	if (options->wal_file)
+	{
+		server->wal = wal_open(options->wal_file, options->wal_sync, options->wal_interval, server->calc);
+		if (server->wal == NULL)
+			exit(1);
+		calc_set_assign_hook(server->calc, server_on_assign, server);
+		calc_set_delete_hook(server->calc, server_on_delete, server);
+	}
 	server->port = port;
+	server->repl = NULL;
 	server->running = TRUE;
 	server->main_thread_id = pthread_self();
+	server->sessions_started = 0;
+	server->trace_file = options->trace_file;
+	trace_set_sample(options->trace_sample);
 	
 	// Reset threads to 0
 	memset(server->threads, 0, sizeof(server->threads));
 
-	// init calc mutex
-	if (pthread_mutex_init(&server->calc_mutex, NULL) != 0)
+	// init calc lock
+	if (stat_rwlock_init(&server->calc_lock, "calc") != 0)
 	{
-		LOG_ERROR("Calc mutex initialization failed\n");
+		LOG_ERROR("Calc lock initialization failed\n");
 		exit(1);
 	}
 
 	// init thread pool mutex
-	if (pthread_mutex_init(&server->thread_pool_mutex, NULL) != 0)
+	if (stat_mutex_init(&server->thread_pool_mutex, "thread_pool") != 0)
 	{
 		LOG_ERROR("Thread pool mutex initialization failed\n");
 		exit(1);
 	}
 
+	// Session threads don't need the default 8MB stack reservation
+	server->thread_stack_size = options->thread_stack_size;
+	pthread_attr_init(&server->thread_attr);
+	if (pthread_attr_setstacksize(&server->thread_attr, server->thread_stack_size) != 0)
+	{
+		LOG_ERROR("Invalid session thread stack size: %lu\n", server->thread_stack_size);
+		exit(1);
+	}
+
+	// Every session thread may run on any worker CPU, the kernel balances them within the set
+	if (affinity_count(&server->worker_cpus) > 0 && !options->coro_threads)
+	{
+		char cpus[256];
+		affinity_format(&server->worker_cpus, cpus, sizeof(cpus));
+		if (affinity_set_attr(&server->thread_attr, &server->worker_cpus) != 0)
+		{
+			LOG_ERROR("Invalid worker CPUs: %s\n", cpus);
+			exit(1);
+		}
+		LOG_INFO("Session threads pinned to CPUs %s\n", cpus);
+	}
+
+	// Connection state and buffers come from pools instead of each session's stack
+	server->sessions = slab_pool_create(sizeof(struct Session), SESSION_SLAB_OBJECTS, MAX_SIMULT_SESSIONS);
+	server->buffers = slab_pool_create(sizeof(struct SessionBuffer), BUFFER_SLAB_OBJECTS, BUFFER_PREALLOCATED);
+	if (server->sessions == NULL || server->buffers == NULL)
+	{
+		LOG_ERROR("Session pools allocation failed\n");
+		exit(1);
+	}
+
+	// Start replication, every assignment and removal goes through server_on_assign and server_on_delete
+	if (options->repl_port)
+	{
+		server->repl = repl_primary_start(options->repl_port, server->calc, &server->calc_lock);
+		if (server->repl == NULL)
+			exit(1);
+		calc_set_assign_hook(server->calc, server_on_assign, server);
+		calc_set_delete_hook(server->calc, server_on_delete, server);
+	}
+	else if (options->replica_host[0])
+		server->repl = repl_replica_start(options->replica_host, options->replica_port, server->calc, &server->calc_lock);
+
+	// Join the cluster ring
+	server->cluster = NULL;
+	if (options->node_id)
+	{
+		server->cluster = cluster_create(options->node_id);
+		for (size_t i = 0; i < options->cluster_node_count; i++)
+		{
+			char id[CLUSTER_ID_SIZE], host[64], port[8];
+			if (sscanf(options->cluster_nodes[i], "%31[^=]=%63[^:]:%7s", id, host, port) != 3)
+			{
+				LOG_ERROR("Invalid cluster node '%s', expected id=host:port\n", options->cluster_nodes[i]);
+				exit(1);
+			}
+			cluster_add_node(server->cluster, id, host, port);
+		}
+	}
+
+	// Sessions run as coroutines when there are threads for them
+	server->coro = NULL;
+	server->coro_stack_size = 0;
+	if (options->coro_threads > 0)
+	{
+		server->coro_stack_size = options->coro_stack_size;
+		server->coro = coro_scheduler_create(options->coro_threads, options->coro_stack_size);
+		if (server->coro == NULL)
+			exit(1);
+
+		// One CPU each, so a thread keeps its caches and its node while sessions come and go
+		for (int i = 0; affinity_count(&server->worker_cpus) > 0 && i < options->coro_threads; i++)
+		{
+			cpu_set_t cpu;
+			affinity_nth(&server->worker_cpus, i, &cpu);
+			server_pin_thread("coroutine thread", coro_scheduler_thread(server->coro, i), &cpu);
+		}
+		rio_wait_hook = coro_wait_fd;
+	}
+
+	// Tenants get their own calculators, created by "use" and swept once idle
+	server->namespaces = namespace_table_create(options->max_namespaces, options->namespace_idle);
+	if (server->namespaces == NULL)
+		exit(1);
+
+	// Metrics are served from their own thread, sessions only bump per-thread counters
+	if (options->metrics_port && metrics_start(options->metrics_port, server_collect_metrics, server) != 0)
+		exit(1);
+
+	// Watched variables are polled and pushed from their own thread
+	if (watch_start(options->watch_interval, server_watch_read, server) != 0)
+		exit(1);
+
+	// Variables nobody touches after they expire are reclaimed a few slots at a time
+	if (expire_start(options->expire_interval, server_expire_tick, server) != 0)
+		exit(1);
+
+	// Snapshots are written by a forked child, the server only waits for fork
+	if (server->snapshots && server->wal)
+		snapshot_set_hooks(server_snapshot_forking, server_snapshot_saved, server);
+	if (server->snapshots && snapshot_start(server->calc, &server->calc_lock, options->snapshot_file, options->save_interval) != 0)
+		exit(1);
+
 	char port_str[6];
 
 	sprintf(port_str, "%u", server->port);
@@ -232,6 +954,25 @@ void server_start(struct Server * server, size_t port)
 	// Error checking 
 	if (server->socket_fd == -1 || server->socket_fd == -1)
 		LOG_ERROR("Could not get a socket using open_listenfd. Error code: %d\n", server->socket_fd);
+
+	// Last, so the helper threads started above keep every CPU
+	if (affinity_count(&options->acceptor_cpus) > 0)
+		server_pin_thread("acceptor", pthread_self(), &options->acceptor_cpus);
+}
+
+// Restrict a thread to a set of CPUs
+void server_pin_thread(const char * what, pthread_t thread, const cpu_set_t * cpus)
+{
+	char list[256];
+	affinity_format(cpus, list, sizeof(list));
+
+	int error = affinity_pin(thread, cpus);
+	if (error != 0)
+	{
+		LOG_ERROR("Could not pin %s to CPUs %s: %s\n", what, list, strerror(error));
+		exit(1);
+	}
+	LOG_INFO("Pinned %s to CPUs %s\n", what, list);
 }
 
 /// Summary
@@ -263,7 +1004,7 @@ void server_clean_destroy_queue(struct Server *server)
 void server_create_thread(struct Server * server, int peer_socket_fd)
 {
 	// Lock thread pool, not no one can access the thread pool
-	pthread_mutex_lock(&server->thread_pool_mutex);
+	stat_mutex_lock(&server->thread_pool_mutex);
 
 	// Clean pending threads 
 	server_clean_destroy_queue(server);
@@ -280,22 +1021,27 @@ void server_create_thread(struct Server * server, int peer_socket_fd)
 	// if no session was available return an error status code 
 	if (next_thread_index == MAX_SIMULT_SESSIONS)
 	{
+		stat_mutex_unlock(&server->thread_pool_mutex);
 		LOG_WARN("Could not create thread, no sessions available\n");
-		Rio_writen(peer_socket_fd, "No available sessions right now, try again later :(", 52);
+		rio_writen(peer_socket_fd, "No available sessions right now, try again later :(", 52);
+		close(peer_socket_fd);
 		return;
 	}
 
 	// Create thread
-	struct SessionArgs * args = malloc(sizeof(struct SessionArgs));
-	args->server = server;
-	args->peer_socket_fd = peer_socket_fd;
-	args->thread_index = next_thread_index;
+	struct Session * session = server_session_create(server, peer_socket_fd, next_thread_index);
+	if (session == NULL)
+	{
+		stat_mutex_unlock(&server->thread_pool_mutex);
+		close(peer_socket_fd);
+		return;
+	}
 
 	LOG_INFO("Starting new session with id: %lu\n", next_thread_index);
-	Pthread_create(&server->threads[next_thread_index], NULL, chat_with_client, (void *) args);
+	Pthread_create(&server->threads[next_thread_index], &server->thread_attr, chat_with_client, (void *) session);
 
 	// Unlock thread pool, no some process can access the thread pool
-	pthread_mutex_unlock(&server->thread_pool_mutex);
+	stat_mutex_unlock(&server->thread_pool_mutex);
 }
 
 /// Summary
@@ -306,14 +1052,14 @@ void server_destroy_thread(struct Server* server, size_t thread_index)
 	assert( thread_index < MAX_SIMULT_SESSIONS && "Thread index out of range");
 
 	// Lock thread pool
-	pthread_mutex_lock(&server->thread_pool_mutex);
+	stat_mutex_lock(&server->thread_pool_mutex);
 	LOG_INFO("Marking thread %lu for destroy\n", thread_index);
 
 	// mark it in the destroy queue
 	server->thread_destroy_queue[thread_index] = FALSE;
 
 	// Unlock thread pool
-	pthread_mutex_unlock(&server->thread_pool_mutex);
+	stat_mutex_unlock(&server->thread_pool_mutex);
 }
 
 // Shut down server
@@ -333,6 +1079,48 @@ void server_shutdown(struct Server * server)
 		}
 	}
 
+	// Wait for coroutine sessions
+	if (server->coro)
+	{
+		coro_scheduler_destroy(server->coro);
+		server->coro = NULL;
+	}
+
+	// Every session gave its namespace back
+	expire_stop();
+	namespace_table_destroy(server->namespaces);
+	server->namespaces = NULL;
+
+	// Stop replication before the calculator goes away
+	if (server->repl)
+	{
+		repl_stop(server->repl);
+		server->repl = NULL;
+	}
+
+	if (server->cluster)
+	{
+		cluster_destroy(server->cluster);
+		server->cluster = NULL;
+	}
+
+	metrics_stop();
+	watch_stop();
+
+	// Every session is gone, so the last save has every change
+	if (server->snapshots)
+		snapshot_stop(TRUE);
+
+	if (server->wal)
+	{
+		wal_close(server->wal);
+		server->wal = NULL;
+	}
+
+	// Keep the sampled requests of this run
+	if (trace_sample_every)
+		trace_dump(server->trace_file);
+
 	// Destroy server object
 	LOG_INFO("Shutting down server...\n");
 	calc_destroy(server->calc);
@@ -341,7 +1129,14 @@ void server_shutdown(struct Server * server)
 	Close(server->socket_fd); 
 
 	// Destroy mutex
-	pthread_mutex_destroy(&server->calc_mutex);
+	stat_rwlock_destroy(&server->calc_lock);
+
+	slab_pool_destroy(server->sessions);
+	slab_pool_destroy(server->buffers);
+	pthread_attr_destroy(&server->thread_attr);
+
+	if (server->ip_buckets)
+		rate_table_destroy(server->ip_buckets);
 
 	LOG_INFO("Server shutdown succesful\n");
 }
@@ -378,20 +1173,153 @@ void sigalarm_handler(int signum)
 		LOG_INFO("Shut down signal triggered\n");
 }
 
-void *chat_with_client(void *args) {
-	struct SessionArgs * session_args = (struct SessionArgs *) args;
-	rio_t in;
-	char linebuf[LINEBUFF_SIZE];
+// Take a session from the pool for a new connection
+struct Session * server_session_create(struct Server * server, int peer_socket_fd, size_t thread_index)
+{
+	struct Session * session = slab_alloc(server->sessions);
+	if (session == NULL)
+	{
+		LOG_WARN("Could not create session, out of memory\n");
+		return NULL;
+	}
 
-	int infd; // where to read from
-	int outfd;// where to write to
+	session->server = server;
+	session->peer_socket_fd = peer_socket_fd;
+	session->session_id = ++server->sessions_started;
+	session->thread_index = thread_index;
+	trace_session_init(&session->trace, session->session_id);
+	session->txn = NULL;
+	session->watches = NULL;
+	session->buffer = NULL;
+	session->deficit = server->sched_quantum;
+	session->ops = 0;
+	session->rate.full_at = 0;
+	session->ip_rate = NULL;
+	session->timer_fd = -1;
+	session->ns = NULL;
+
+	// Connections from the same address share its bucket
+	if (server->ip_buckets)
+	{
+		struct sockaddr_storage peer;
+		socklen_t length = sizeof(peer);
+		if (getpeername(peer_socket_fd, (struct sockaddr *) &peer, &length) == 0)
+			session->ip_rate = rate_table_bucket(server->ip_buckets, (struct sockaddr *) &peer, length);
+	}
+	return session;
+}
 
-	infd = outfd = session_args->peer_socket_fd;
-	struct Server * server = session_args->server;
-	size_t thread_index = session_args->thread_index;
+// Read the next request line, waiting for it without a buffer if the client is quiet
+ssize_t server_session_read(struct Session * session)
+{
+	int fd = session->peer_socket_fd;
+
+	// Sessions that stay quiet give back their buffer and the stack pages the last request
+	// touched. Threads wait a while first, coroutines can't block so they go idle at once
+	if (session->buffer == NULL || session->buffer->in.rio_cnt == 0)
+	{
+		struct pollfd ready = { fd, POLLIN, 0 };
+		int timeout = session->thread_index == NO_THREAD_INDEX ? 0 : SESSION_IDLE_MS;
+		if (poll(&ready, 1, timeout) == 0)
+		{
+			server_session_release_buffer(session);
+			coro_trim_stack();
+			coro_wait_fd(fd, 0);
+
+			// A session with nothing queued doesn't keep credit or debt for later
+			session->deficit = session->server->sched_quantum;
+		}
+	}
 
-	/* wrap standard input (which is file descriptor 0) */
-	rio_readinitb(&in, infd);
+	if (session->buffer == NULL)
+	{
+		session->buffer = slab_alloc(session->server->buffers);
+		if (session->buffer == NULL)
+			return -1;
+		rio_readinitb(&session->buffer->in, fd);
+	}
+
+	return rio_readlineb(&session->buffer->in, session->buffer->line, LINEBUFF_SIZE);
+}
+
+// Give the buffer of a session back to the pool
+void server_session_release_buffer(struct Session * session)
+{
+	if (session->buffer)
+	{
+		slab_free(session->server->buffers, session->buffer);
+		session->buffer = NULL;
+	}
+}
+
+// Take a token from the buckets of the connection and of its address
+bool server_rate_limited(struct Session * session)
+{
+	struct Server * server = session->server;
+	int64_t wait = 0;
+
+	if (server->rate_limit.rate == 0 && session->ip_rate == NULL)
+		return FALSE;
+	uint64_t now = metrics_now();
+
+	if (server->rate_limit.rate > 0 && (wait = rate_limit_take(&server->rate_limit, &session->rate, now)) < 0)
+	{
+		if (metrics_enabled)
+			metrics_count(METRIC_RATE_LIMITED_CONNECTION);
+		return TRUE;
+	}
+
+	if (session->ip_rate)
+	{
+		int64_t ip_wait = rate_limit_take(&server->ip_rate_limit, session->ip_rate, now);
+		if (ip_wait < 0)
+		{
+			// A rejected request does not count against the connection
+			if (server->rate_limit.rate > 0)
+				rate_limit_give_back(&server->rate_limit, &session->rate);
+			if (metrics_enabled)
+				metrics_count(METRIC_RATE_LIMITED_ADDRESS);
+			return TRUE;
+		}
+		wait = ip_wait > wait ? ip_wait : wait;
+	}
+
+	// Delay mode: the token is taken already, wait until it is due
+	if (wait > 0)
+	{
+		if (metrics_enabled)
+			metrics_count(METRIC_RATE_DELAYED);
+		server_session_sleep(session, (uint64_t) wait);
+	}
+	return FALSE;
+}
+
+// Sleep on a timer descriptor, which a coroutine can park on like a socket
+void server_session_sleep(struct Session * session, uint64_t ns)
+{
+	if (session->timer_fd < 0 && (session->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+	{
+		LOG_WARN("Could not create a timer, not waiting: %s\n", strerror(errno));
+		return;
+	}
+
+	struct itimerspec when = { { 0, 0 }, { ns / 1000000000ull, ns % 1000000000ull } };
+	timerfd_settime(session->timer_fd, 0, &when, NULL);
+
+	uint64_t expirations;
+	while (read(session->timer_fd, &expirations, sizeof(expirations)) < 0 && errno == EAGAIN)
+		coro_wait_fd(session->timer_fd, 0);
+}
+
+void *chat_with_client(void *args) {
+	struct Session * session = (struct Session *) args;
+
+	int outfd = session->peer_socket_fd; // where to write to
+	struct Server * server = session->server;
+	size_t thread_index = session->thread_index;
+
+	if (metrics_enabled)
+		metrics_count(METRIC_SESSIONS_OPENED);
 
 	/*
 	 * Read lines of input, evaluate them as calculator expressions,
@@ -400,7 +1328,28 @@ void *chat_with_client(void *args) {
 	 */
 	bool done = FALSE;
 	while (!done) {
-		ssize_t n = Rio_readlineb(&in, linebuf, LINEBUFF_SIZE);
+		// Deficit round robin between sessions with queued requests: one that spent its quantum
+		// goes behind the others until its turns paid its debt back, so a client sending heavy
+		// expressions gets as many operations as the others instead of starving them
+		while (session->deficit <= 0)
+		{
+			coro_yield();
+			session->deficit += server->sched_quantum;
+			if (metrics_enabled)
+				metrics_count(METRIC_SCHED_YIELDS);
+		}
+
+		// The read span includes the time waiting for the client to send the line
+		trace_start(&session->trace);
+		ssize_t n = server_session_read(session);
+		char * linebuf = session->buffer ? session->buffer->line : "";
+		trace_span(&session->trace, TRACE_READ);
+		uint64_t request_start = metrics_enabled ? metrics_now() : 0;
+		size_t cost = 0;
+
+		// No notification is pushed while the response is written
+		WatchSubscriber * output = session->watches;
+		watch_output_begin(output);
 		LOG_TRACE("peer said %s\n", linebuf);
 		if (n <= 0) {
 			/* error or end of input */
@@ -408,52 +1357,1324 @@ void *chat_with_client(void *args) {
 		} else if (strcmp(linebuf, "quit\n") == 0 || strcmp(linebuf, "quit\r\n") == 0) {
 			/* quit command */
 			done = TRUE;
+		} else if ((linebuf[0] != '@' || !server->cluster) && server_rate_limited(session)) {
+
+			// Over the limit of the connection or of its address, requests between nodes are exempt
+			rio_writen(outfd, "Error rate-limited\n", 19);
+
 		} else if (strcmp(linebuf, "shutdown\n") == 0 || strcmp(linebuf, "shutdown\r\n") == 0) {
 
 			// Stop interactive session 
 			done = TRUE;
 
 			// Write a farewell message
-			Rio_writen(outfd, "Shutting down server, have a nice day :)\n", 42);
+			rio_writen(outfd, "Shutting down server, have a nice day :)\n", 42);
 
 			// Issue a server shutdown
 			server_shutdown_start(server);
 
+		} else if (strcmp(linebuf, "replinfo\n") == 0 || strcmp(linebuf, "replinfo\r\n") == 0) {
+
+			// Report replication sequence numbers and lag
+			if (server->repl == NULL)
+				rio_writen(outfd, "role=none\n", 10);
+			else
+			{
+				char info[LINEBUFF_SIZE];
+				repl_info(server->repl, info, LINEBUFF_SIZE);
+				rio_writen(outfd, info, strlen(info));
+			}
+
+		} else if (strcmp(linebuf, "stats\n") == 0 || strcmp(linebuf, "stats\r\n") == 0) {
+
+			// Lock contention counters and wait/hold percentiles
+			char stats[LINEBUFF_SIZE];
+			stat_mutex_report(stats, LINEBUFF_SIZE);
+			if (stats[0] == '\0')
+				snprintf(stats, LINEBUFF_SIZE, "lock statistics disabled\n");
+			rio_writen(outfd, stats, strlen(stats));
+
+		} else if (strcmp(linebuf, "memory\n") == 0 || strcmp(linebuf, "memory\r\n") == 0) {
+
+			// Pools and per-connection memory
+			char report[LINEBUFF_SIZE];
+			server_memory_report(server, report, LINEBUFF_SIZE);
+			rio_writen(outfd, report, strlen(report));
+
+		} else if (strcmp(linebuf, "save\n") == 0 || strcmp(linebuf, "save\r\n") == 0) {
+
+			// Write a snapshot in the background
+			server_save_command(server, outfd, FALSE);
+
+		} else if (strcmp(linebuf, "saveinfo\n") == 0 || strcmp(linebuf, "saveinfo\r\n") == 0) {
+
+			server_save_command(server, outfd, TRUE);
+
+		} else if (strcmp(linebuf, "walinfo\n") == 0 || strcmp(linebuf, "walinfo\r\n") == 0) {
+
+			server_wal_info(server, outfd);
+
+		} else if (strcmp(linebuf, "begin\n") == 0 || strcmp(linebuf, "begin\r\n") == 0) {
+
+			// Following expressions see a snapshot and are applied together on commit
+			if (server->cluster)
+				rio_writen(outfd, "Error transactions are not supported in cluster mode\n", 53);
+			else if (session->txn)
+				rio_writen(outfd, "Error already in a transaction\n", 31);
+			else if ((session->txn = session->ns ? txn_begin(session->ns->calc, &session->ns->lock)
+												 : txn_begin(server->calc, &server->calc_lock)) == NULL)
+				rio_writen(outfd, "Error\n", 6);
+			else
+				rio_writen(outfd, "Ok\n", 3);
+
+		} else if (strcmp(linebuf, "commit\n") == 0 || strcmp(linebuf, "commit\r\n") == 0) {
+
+			if (session->txn == NULL)
+				rio_writen(outfd, "Error no transaction\n", 21);
+			else
+				server_txn_commit(server, outfd, session->txn);
+			session->txn = NULL;
+
+		} else if (strcmp(linebuf, "abort\n") == 0 || strcmp(linebuf, "abort\r\n") == 0) {
+
+			if (session->txn == NULL)
+				rio_writen(outfd, "Error no transaction\n", 21);
+			else
+			{
+				txn_abort(session->txn);
+				rio_writen(outfd, "Ok\n", 3);
+			}
+			session->txn = NULL;
+
+		} else if (strncmp(linebuf, "cas ", 4) == 0) {
+
+			// Compare and set, on the local calculator only
+			if (server->cluster || session->txn)
+				rio_writen(outfd, "Error cas is not supported in transactions or cluster mode\n", 59);
+			else if (server->repl && repl_is_replica(server->repl))
+				rio_writen(outfd, "Error read-only\n", 16);
+			else
+				server_cas_command(server, session->ns, outfd, linebuf + 4);
+
+		} else if (strncmp(linebuf, "mget ", 5) == 0 || strncmp(linebuf, "mset ", 5) == 0) {
+
+			// Many variables of the local calculator under one lock
+			if (server->cluster || session->txn)
+				rio_writen(outfd, "Error mget and mset are not supported in transactions or cluster mode\n", 70);
+			else if (linebuf[1] == 'g')
+				cost = server_mget_command(server, session->ns, outfd, linebuf + 5);
+			else if (server->repl && repl_is_replica(server->repl))
+				rio_writen(outfd, "Error read-only\n", 16);
+			else
+				cost = server_mset_command(server, session->ns, outfd, linebuf + 5);
+
+		} else if (strncmp(linebuf, "watch ", 6) == 0 || strncmp(linebuf, "unwatch ", 8) == 0) {
+
+			// Notifications for local variables only
+			if (server->cluster)
+				rio_writen(outfd, "Error watch is not supported in cluster mode\n", 45);
+			else if (session->ns)
+				rio_writen(outfd, "Error watch is not supported in namespaces\n", 43);
+			else
+				server_watch_command(outfd, &session->watches, linebuf);
+
+		} else if (strncmp(linebuf, "use ", 4) == 0) {
+
+			// Switch to the calculator of a tenant
+			server_use_command(session, outfd, linebuf + 4);
+
+		} else if (strcmp(linebuf, "namespaces\n") == 0 || strcmp(linebuf, "namespaces\r\n") == 0) {
+
+			server_namespaces_command(server, outfd);
+
+		} else if (strncmp(linebuf, "trace ", 6) == 0) {
+
+			// Dump sampled spans or change the sampling rate
+			server_trace_command(server, outfd, linebuf + 6);
+
+		} else if (strncmp(linebuf, "cluster ", 8) == 0) {
+
+			// Cluster membership administration
+			server_cluster_admin(server, outfd, linebuf + 8);
+
+		} else if (linebuf[0] == '@' && server->cluster) {
+
+			// Request from another cluster node
+			server_cluster_command(server, outfd, linebuf);
+
+		} else if (server->repl && repl_is_replica(server->repl) && strchr(linebuf, '=') != NULL) {
+
+			// Replicas only serve read only expressions
+			rio_writen(outfd, "Error read-only\n", 16);
+
 		} else {
 			/* process input line */
 			int result;
-			if (calc_eval(server->calc, linebuf, &result) == FAILURE) {
+			int status;
+			struct EvalOutcome outcome = { 0, CALC_ERROR_NONE };
+			trace_span(&session->trace, TRACE_PARSE);
+			if (session->txn)
+			{
+				status = txn_eval(session->txn, linebuf, &result);
+				outcome.cost = calc_last_cost();
+				outcome.error = calc_last_error();
+				trace_span(&session->trace, TRACE_EVAL);
+			}
+			else if (server->cluster)
+			{
+				status = server_cluster_eval(server, linebuf, &result, TRUE);
+				trace_span(&session->trace, TRACE_EVAL);
+			}
+			else
+				status = server_calc_eval(server, session->ns, linebuf, &result, &outcome, &session->trace);
+			// A clustered expression may be evaluated on another node, with nothing to count here
+			cost = outcome.cost;
+			if (session->ns)
+				namespace_count(session->ns, cost, status == FAILURE);
+
+			if (status == FAILURE) {
 				/* expression couldn't be evaluated */
-				Rio_writen(outfd, "Error\n", 6);
+				if (metrics_enabled)
+					metrics_count(METRIC_ERRORS + outcome.error);
+				rio_writen(outfd, "Error\n", 6);
 			} else {
 				/* output result */
 				int len = snprintf(linebuf, LINEBUFF_SIZE, "%d\n", result);
 				if (len < LINEBUFF_SIZE) {
-					Rio_writen(outfd, linebuf, len);
+					rio_writen(outfd, linebuf, len);
 				}
 			}
+			trace_span(&session->trace, TRACE_WRITE);
+		}
+
+		watch_output_end(output);
+
+		// Every request costs at least one operation, an expression what it evaluated
+		cost = cost > 0 ? cost : 1;
+		session->deficit -= cost;
+		session->ops += cost;
+
+		if (request_start && n > 0)
+		{
+			metrics_count(METRIC_REQUESTS);
+			metrics_add(METRIC_EVAL_OPS, cost);
+			metrics_observe_latency(metrics_now() - request_start);
 		}
 	}
+	LOG_TRACE("session %u evaluated %lu operations\n", session->session_id, session->ops);
 
-	// Queue this thread to be destroyed
-	server_destroy_thread(server, thread_index);
+	// A transaction left open is dropped
+	if (session->txn)
+		txn_abort(session->txn);
+
+	if (session->watches)
+		watch_unsubscribe(session->watches);
+
+	if (session->timer_fd >= 0)
+		close(session->timer_fd);
 
-	// Free args for this session
-	free(session_args);
+	if (session->ns)
+		namespace_release(server->namespaces, session->ns);
+
+	server_session_release_buffer(session);
+
+	if (metrics_enabled)
+		metrics_count(METRIC_SESSIONS_CLOSED);
+
+	// Queue this thread to be destroyed
+	if (thread_index != NO_THREAD_INDEX)
+		server_destroy_thread(server, thread_index);
 
 	// Close connection with peer
-	close(session_args->peer_socket_fd);
+	close(session->peer_socket_fd);
+
+	// Give the session back to the pool
+	slab_free(server->sessions, session);
 	return NULL;
 }
 
+/// Coroutine entry point for a session
+static void server_session_coroutine(void * args)
+{
+	chat_with_client(args);
+}
+
+// Start a session as a coroutine
+void server_create_coroutine(struct Server * server, int peer_socket_fd)
+{
+	// The coroutine parks itself instead of blocking when the socket is not ready
+	fcntl(peer_socket_fd, F_SETFL, fcntl(peer_socket_fd, F_GETFL) | O_NONBLOCK);
+
+	struct Session * session = server_session_create(server, peer_socket_fd, NO_THREAD_INDEX);
+	if (session == NULL)
+	{
+		close(peer_socket_fd);
+		return;
+	}
+
+	if (coro_spawn(server->coro, server_session_coroutine, session) != 0)
+	{
+		LOG_WARN("Could not create session coroutine\n");
+		slab_free(server->sessions, session);
+		close(peer_socket_fd);
+	}
+}
+
+// Take the cost and error of the calc call that just returned, then wait for its log records
+static int server_wait_log(struct Server * server, int res, struct EvalOutcome * outcome)
+{
+	if (outcome)
+	{
+		outcome->cost = calc_last_cost();
+		outcome->error = calc_last_error();
+	}
+	if (wal_wait(server->wal) == 0)
+		return res;
+	if (outcome)
+		outcome->error = CALC_ERROR_LOG;
+	return FAILURE;
+}
+
 /// Thread safe eval
-int server_calc_eval(struct Server * server, const char *expr, int *result)
+int server_calc_eval(struct Server * server, Namespace * ns, const char *expr, int *result, struct EvalOutcome * outcome, TraceContext * trace)
+{
+	char name[CALC_KEY_SIZE];
+	char op;
+	int operand;
+	StatRwLock * lock = ns ? &ns->lock : &server->calc_lock;
+
+	// Counters don't need the parser, nor the lock for themselves
+	if (calc_parse_update(expr, name, &op, &operand) == SUCCESS)
+		return server_calc_update(server, ns, name, op, operand, result, outcome, trace);
+
+	// Expressions without assignments only read, they share the lock
+	if (strchr(expr, '=') == NULL)
+		stat_rwlock_rdlock(lock);
+	else
+		stat_rwlock_wrlock(lock);
+	trace_span(trace, TRACE_LOCK_WAIT);
+
+	int res = calc_eval(ns ? ns->calc : server->calc, expr, result);
+
+	stat_rwlock_unlock(lock);
+	res = server_wait_log(server, res, outcome);
+	trace_span(trace, TRACE_EVAL);
+
+	return res;
+}
+
+/// Take the lock of a calculator for a counter update, shared if the update can be atomic
+static void server_lock_for_update(struct Calc * calc, StatRwLock * lock)
+{
+	stat_rwlock_rdlock(lock);
+	if (calc_shared_updates(calc))
+		return;
+
+	// Every write must be seen in order, e.g. by replication
+	stat_rwlock_unlock(lock);
+	stat_rwlock_wrlock(lock);
+}
+
+int server_calc_update(struct Server * server, Namespace * ns, const char *name, char op, int operand, int *result, struct EvalOutcome * outcome, TraceContext * trace)
+{
+	struct Calc * calc = ns ? ns->calc : server->calc;
+	StatRwLock * lock = ns ? &ns->lock : &server->calc_lock;
+
+	server_lock_for_update(calc, lock);
+	trace_span(trace, TRACE_LOCK_WAIT);
+
+	int res = calc_update(calc, name, op, operand, result);
+
+	stat_rwlock_unlock(lock);
+	res = server_wait_log(server, res, outcome);
+	trace_span(trace, TRACE_EVAL);
+
+	return res;
+}
+
+void server_cas_command(struct Server * server, Namespace * ns, int outfd, char * args)
+{
+	struct Calc * calc = ns ? ns->calc : server->calc;
+	StatRwLock * lock = ns ? &ns->lock : &server->calc_lock;
+	char name[CALC_KEY_SIZE];
+	int expected, desired, swapped;
+
+	if (sscanf(args, "%19s %d %d", name, &expected, &desired) != 3)
+	{
+		rio_writen(outfd, "Error usage: cas <name> <expected> <desired>\n", 45);
+		return;
+	}
+
+	server_lock_for_update(calc, lock);
+	struct EvalOutcome outcome;
+	int res = calc_cas(calc, name, expected, desired, &swapped);
+	stat_rwlock_unlock(lock);
+	res = server_wait_log(server, res, &outcome);
+	if (ns)
+		namespace_count(ns, 1, res == FAILURE);
+
+	if (res == FAILURE)
+	{
+		if (metrics_enabled)
+			metrics_count(METRIC_ERRORS + outcome.error);
+		rio_writen(outfd, "Error\n", 6);
+	}
+	else
+		rio_writen(outfd, swapped ? "1\n" : "0\n", 2);
+}
+
+/// Answer of mget and mset, sent whenever the buffer fills up so it may be longer than a line buffer
+struct MultiReply
+{
+	int outfd;
+	size_t len;
+	char buf[LINEBUFF_SIZE];
+};
+
+static void server_reply_append(struct MultiReply * reply, const char * text, size_t len)
+{
+	if (reply->len + len > sizeof(reply->buf))
+	{
+		rio_writen(reply->outfd, reply->buf, reply->len);
+		reply->len = 0;
+	}
+	memcpy(reply->buf + reply->len, text, len);
+	reply->len += len;
+}
+
+// Split the arguments of mget or mset at spaces, returns 0 if there are none
+static size_t server_split_names(char * args, char ** names)
+{
+	char * saveptr = NULL;
+	size_t count = 0;
+
+	for (char * token = strtok_r(args, " \r\n", &saveptr); token && count < MAX_MULTI_NAMES;
+		 token = strtok_r(NULL, " \r\n", &saveptr))
+		names[count++] = token;
+	return count;
+}
+
+// Count a multi-key request that failed for some names, error being the reason of the last failure
+static void server_count_multi(Namespace * ns, size_t count, size_t succeeded, enum calc_error error)
+{
+	if (ns)
+		namespace_count(ns, count, succeeded < count);
+	if (metrics_enabled && succeeded < count)
+		metrics_count(METRIC_ERRORS + error);
+}
+
+size_t server_mget_command(struct Server * server, Namespace * ns, int outfd, char * args)
+{
+	struct Calc * calc = ns ? ns->calc : server->calc;
+	StatRwLock * lock = ns ? &ns->lock : &server->calc_lock;
+	char * names[MAX_MULTI_NAMES];
+	int values[MAX_MULTI_NAMES], found[MAX_MULTI_NAMES];
+
+	size_t count = server_split_names(args, names);
+	if (count == 0)
+	{
+		rio_writen(outfd, "Error usage: mget <name> ...\n", 29);
+		return 1;
+	}
+
+	stat_rwlock_rdlock(lock);
+	size_t hits = calc_mget(calc, (const char * const *) names, count, values, found);
+	stat_rwlock_unlock(lock);
+	server_count_multi(ns, count, hits, calc_last_error());
+
+	struct MultiReply reply = { outfd, 0, { 0 } };
+	for (size_t i = 0; i < count; i++)
+	{
+		char value[16];
+		int len = found[i] ? snprintf(value, sizeof(value), "%s%d", i ? " " : "", values[i])
+						   : snprintf(value, sizeof(value), "%s?", i ? " " : "");
+		server_reply_append(&reply, value, len);
+	}
+	server_reply_append(&reply, "\n", 1);
+	rio_writen(outfd, reply.buf, reply.len);
+	return count;
+}
+
+size_t server_mset_command(struct Server * server, Namespace * ns, int outfd, char * args)
+{
+	struct Calc * calc = ns ? ns->calc : server->calc;
+	StatRwLock * lock = ns ? &ns->lock : &server->calc_lock;
+	char * names[MAX_MULTI_NAMES];
+	int values[MAX_MULTI_NAMES], assigned[MAX_MULTI_NAMES];
+
+	size_t count = server_split_names(args, names);
+	if (count == 0)
+	{
+		rio_writen(outfd, "Error usage: mset <name>=<value> ...\n", 37);
+		return 1;
+	}
+
+	// A pair that doesn't parse keeps an empty name, which calc_mset refuses alone
+	for (size_t i = 0; i < count; i++)
+	{
+		char * equal = strchr(names[i], '=');
+		char * end = NULL;
+		long value = equal ? strtol(equal + 1, &end, 10) : 0;
+		if (equal == NULL || end == equal + 1 || *end != '\0' || value < INT_MIN || value > INT_MAX)
+		{
+			names[i] = "";
+			continue;
+		}
+		*equal = '\0';
+		values[i] = (int) value;
+	}
+
+	stat_rwlock_wrlock(lock);
+	size_t done = calc_mset(calc, (const char * const *) names, values, count, assigned);
+	stat_rwlock_unlock(lock);
+	enum calc_error error = calc_last_error();
+
+	// One group commit for the whole batch, none of it is acknowledged if the log failed
+	if (wal_wait(server->wal) != 0)
+	{
+		memset(assigned, 0, sizeof(assigned));
+		done = 0;
+		error = CALC_ERROR_LOG;
+	}
+	server_count_multi(ns, count, done, error);
+
+	struct MultiReply reply = { outfd, 0, { 0 } };
+	for (size_t i = 0; i < count; i++)
+	{
+		if (i > 0)
+			server_reply_append(&reply, " ", 1);
+		server_reply_append(&reply, assigned[i] ? "Ok" : "Error", assigned[i] ? 2 : 5);
+	}
+	server_reply_append(&reply, "\n", 1);
+	rio_writen(outfd, reply.buf, reply.len);
+	return count;
+}
+
+/// Lock statistics collected for a /metrics scrape
+struct LockMetrics
+{
+	size_t count;
+	StatMutexSnapshot locks[MAX_SCRAPED_LOCKS];
+};
+
+static void server_collect_lock(void * ctx, const StatMutexSnapshot * stats)
+{
+	struct LockMetrics * metrics = (struct LockMetrics *) ctx;
+	if (metrics->count < MAX_SCRAPED_LOCKS)
+		metrics->locks[metrics->count++] = *stats;
+}
+
+// Server gauges, appended to every /metrics scrape from the admin thread
+static void server_metrics_namespace_requests(void * ctx, const NamespaceStats * stats)
+{
+	metrics_printf((MetricsBuffer *) ctx, "calc_namespace_requests_total{namespace=\"%s\"} %lu\n", stats->name, stats->requests);
+}
+
+static void server_metrics_namespace_bytes(void * ctx, const NamespaceStats * stats)
+{
+	metrics_printf((MetricsBuffer *) ctx, "calc_namespace_bytes{namespace=\"%s\"} %lu\n", stats->name, stats->bytes);
+}
+
+void server_collect_metrics(void * ctx, MetricsBuffer * out)
+{
+	struct Server * server = (struct Server *) ctx;
+
+	size_t session_threads = 0;
+	stat_mutex_lock(&server->thread_pool_mutex);
+	for (size_t i = 0; i < MAX_SIMULT_SESSIONS; i++)
+		session_threads += server->threads[i] != 0;
+	stat_mutex_unlock(&server->thread_pool_mutex);
+	metrics_printf(out, "# HELP calc_session_threads Session threads in the pool, out of calc_session_threads_max.\n"
+						"# TYPE calc_session_threads gauge\n"
+						"calc_session_threads %lu\n"
+						"calc_session_threads_max %d\n", session_threads, MAX_SIMULT_SESSIONS);
+
+	if (server->coro)
+	{
+		size_t live, queued, pooled_stacks;
+		coro_stats(server->coro, &live, &queued, &pooled_stacks);
+		metrics_printf(out, "# HELP calc_coroutines Live session coroutines.\n"
+							"# TYPE calc_coroutines gauge\n"
+							"calc_coroutines %lu\n"
+							"calc_coroutine_pooled_stacks %lu\n"
+							"# HELP calc_coroutine_run_queue Coroutines ready to run, waiting for a thread.\n"
+							"# TYPE calc_coroutine_run_queue gauge\n"
+							"calc_coroutine_run_queue %lu\n", live, pooled_stacks, queued);
+	}
+
+	metrics_printf(out, "# HELP calc_rate_limit_rate Requests per second allowed, 0 without a limit.\n"
+						"# TYPE calc_rate_limit_rate gauge\n"
+						"calc_rate_limit_rate{scope=\"connection\"} %g\n"
+						"calc_rate_limit_rate{scope=\"address\"} %g\n"
+						"# HELP calc_rate_limit_burst Requests allowed at once after being idle.\n"
+						"# TYPE calc_rate_limit_burst gauge\n"
+						"calc_rate_limit_burst{scope=\"connection\"} %u\n"
+						"calc_rate_limit_burst{scope=\"address\"} %u\n",
+				   server->rate_limit.rate, server->ip_rate_limit.rate, server->rate_limit.burst, server->ip_rate_limit.burst);
+
+	size_t table_bytes;
+	unsigned long expired_vars, evicted_vars;
+	calc_memory_stats(&table_bytes, &expired_vars, &evicted_vars);
+	metrics_printf(out, "# HELP calc_table_bytes Bytes of the variable tables of every calculator.\n"
+						"# TYPE calc_table_bytes gauge\n"
+						"calc_table_bytes %lu\n"
+						"# HELP calc_max_memory_bytes Bytes of the tables before variables are evicted, 0 without a limit.\n"
+						"# TYPE calc_max_memory_bytes gauge\n"
+						"calc_max_memory_bytes %lu\n"
+						"# HELP calc_expired_total Variables removed after their TTL.\n"
+						"# TYPE calc_expired_total counter\n"
+						"calc_expired_total %lu\n"
+						"# HELP calc_evicted_total Variables removed to stay under the memory limit.\n"
+						"# TYPE calc_evicted_total counter\n"
+						"calc_evicted_total %lu\n", table_bytes, server->max_memory, expired_vars, evicted_vars);
+
+	size_t namespaces;
+	uint64_t evicted;
+	namespace_table_stats(server->namespaces, &namespaces, &evicted);
+	metrics_printf(out, "# HELP calc_namespaces Namespaces alive.\n"
+						"# TYPE calc_namespaces gauge\n"
+						"calc_namespaces %lu\n"
+						"# HELP calc_namespaces_evicted_total Namespaces destroyed after being idle.\n"
+						"# TYPE calc_namespaces_evicted_total counter\n"
+						"calc_namespaces_evicted_total %lu\n", namespaces, evicted);
+	metrics_printf(out, "# HELP calc_namespace_requests_total Requests evaluated in a namespace.\n"
+						"# TYPE calc_namespace_requests_total counter\n");
+	namespace_foreach(server->namespaces, server_metrics_namespace_requests, out);
+	metrics_printf(out, "# HELP calc_namespace_bytes Memory taken by the variables of a namespace.\n"
+						"# TYPE calc_namespace_bytes gauge\n");
+	namespace_foreach(server->namespaces, server_metrics_namespace_bytes, out);
+
+	SlabPoolStats sessions, buffers;
+	slab_pool_stats(server->sessions, &sessions);
+	slab_pool_stats(server->buffers, &buffers);
+	metrics_printf(out, "# HELP calc_pool_objects Objects handed out by a pool.\n"
+						"# TYPE calc_pool_objects gauge\n"
+						"calc_pool_objects{pool=\"session\"} %lu\n"
+						"calc_pool_objects{pool=\"buffer\"} %lu\n", sessions.in_use, buffers.in_use);
+	metrics_printf(out, "# HELP calc_pool_bytes Memory reserved by a pool.\n"
+						"# TYPE calc_pool_bytes gauge\n"
+						"calc_pool_bytes{pool=\"session\"} %lu\n"
+						"calc_pool_bytes{pool=\"buffer\"} %lu\n",
+				   sessions.capacity * sessions.object_size, buffers.capacity * buffers.object_size);
+
+	if (server->snapshots)
+	{
+		SnapshotStats save;
+		snapshot_stats(&save);
+		metrics_printf(out, "# HELP calc_saves_total Snapshots written, or failed.\n"
+							"# TYPE calc_saves_total counter\n"
+							"calc_saves_total{result=\"ok\"} %lu\n"
+							"calc_saves_total{result=\"failed\"} %lu\n", save.saves, save.failures);
+		metrics_printf(out, "# HELP calc_save_stall_seconds_total Time the store lock was held to fork for saves.\n"
+							"# TYPE calc_save_stall_seconds_total counter\n"
+							"calc_save_stall_seconds_total %.9f\n", save.total_fork_ns / 1e9);
+		metrics_printf(out, "# HELP calc_save_stall_max_seconds Longest fork of a save.\n"
+							"# TYPE calc_save_stall_max_seconds gauge\n"
+							"calc_save_stall_max_seconds %.9f\n", save.max_fork_ns / 1e9);
+		metrics_printf(out, "# HELP calc_save_duration_seconds Time to write the last snapshot.\n"
+							"# TYPE calc_save_duration_seconds gauge\n"
+							"calc_save_duration_seconds %.9f\n"
+							"calc_save_in_progress %d\n", save.last_duration_ns / 1e9, save.saving);
+	}
+
+	if (server->wal)
+	{
+		WalStats wal;
+		wal_stats(server->wal, &wal);
+		metrics_printf(out, "# HELP calc_wal_records_total Assignments appended to the write-ahead log.\n"
+							"# TYPE calc_wal_records_total counter\n"
+							"calc_wal_records_total %lu\n", wal.records);
+		metrics_printf(out, "# HELP calc_wal_bytes_total Bytes of the write-ahead log, appended as payload or written with framing.\n"
+							"# TYPE calc_wal_bytes_total counter\n"
+							"calc_wal_bytes_total{kind=\"payload\"} %lu\n"
+							"calc_wal_bytes_total{kind=\"written\"} %lu\n", wal.payload_bytes, wal.written_bytes);
+		metrics_printf(out, "# HELP calc_wal_syncs_total Group commits synced to disk.\n"
+							"# TYPE calc_wal_syncs_total counter\n"
+							"calc_wal_syncs_total %lu\n", wal.syncs);
+		metrics_printf(out, "# HELP calc_wal_sync_seconds_total Time spent in fdatasync.\n"
+							"# TYPE calc_wal_sync_seconds_total counter\n"
+							"calc_wal_sync_seconds_total %.9f\n", wal.sync_ns / 1e9);
+		metrics_printf(out, "# HELP calc_wal_pending_records Records appended to the write-ahead log and not written or synced yet.\n"
+							"# TYPE calc_wal_pending_records gauge\n"
+							"calc_wal_pending_records %lu\n"
+							"# HELP calc_wal_pending_bytes Bytes of those records.\n"
+							"# TYPE calc_wal_pending_bytes gauge\n"
+							"calc_wal_pending_bytes %lu\n", wal.pending_records, wal.pending_bytes);
+		metrics_printf(out, "# HELP calc_wal_failed 1 once a batch of the write-ahead log could not be written or synced.\n"
+							"# TYPE calc_wal_failed gauge\n"
+							"calc_wal_failed %d\n", wal.failed);
+	}
+
+	metrics_printf(out, "# HELP calc_log_dropped_total Log messages dropped because a log ring was full.\n"
+						"# TYPE calc_log_dropped_total counter\n"
+						"calc_log_dropped_total %lu\n", logger_dropped());
+
+	// Every line of a metric family must be together, so the locks are gathered first
+	struct LockMetrics * locks = malloc(sizeof(struct LockMetrics));
+	locks->count = 0;
+	stat_mutex_foreach(server_collect_lock, locks);
+
+	metrics_printf(out, "# HELP calc_lock_acquisitions_total Times a lock was taken (needs STAT_MUTEX).\n"
+						"# TYPE calc_lock_acquisitions_total counter\n");
+	for (size_t i = 0; i < locks->count; i++)
+		metrics_printf(out, "calc_lock_acquisitions_total{lock=\"%s\"} %lu\n", locks->locks[i].name, locks->locks[i].acquisitions);
+
+	metrics_printf(out, "# HELP calc_lock_contended_total Times a lock was found taken.\n"
+						"# TYPE calc_lock_contended_total counter\n");
+	for (size_t i = 0; i < locks->count; i++)
+		metrics_printf(out, "calc_lock_contended_total{lock=\"%s\"} %lu\n", locks->locks[i].name, locks->locks[i].contended);
+
+	metrics_printf(out, "# HELP calc_lock_wait_seconds_total Time spent waiting for a lock.\n"
+						"# TYPE calc_lock_wait_seconds_total counter\n");
+	for (size_t i = 0; i < locks->count; i++)
+		metrics_printf(out, "calc_lock_wait_seconds_total{lock=\"%s\"} %.9f\n", locks->locks[i].name, locks->locks[i].wait_ns / 1e9);
+
+	metrics_printf(out, "# HELP calc_lock_hold_seconds_total Time a lock was held.\n"
+						"# TYPE calc_lock_hold_seconds_total counter\n");
+	for (size_t i = 0; i < locks->count; i++)
+		metrics_printf(out, "calc_lock_hold_seconds_total{lock=\"%s\"} %.9f\n", locks->locks[i].name, locks->locks[i].hold_ns / 1e9);
+
+	// Reader-writer locks only count shared acquisitions that waited
+	metrics_printf(out, "# HELP calc_lock_shared_contended_total Shared acquisitions that found a reader-writer lock taken.\n"
+						"# TYPE calc_lock_shared_contended_total counter\n");
+	for (size_t i = 0; i < locks->count; i++)
+		if (locks->locks[i].rwlock)
+			metrics_printf(out, "calc_lock_shared_contended_total{lock=\"%s\"} %lu\n", locks->locks[i].name, locks->locks[i].shared_contended);
+
+	metrics_printf(out, "# HELP calc_lock_shared_wait_seconds_total Time shared acquisitions spent waiting.\n"
+						"# TYPE calc_lock_shared_wait_seconds_total counter\n");
+	for (size_t i = 0; i < locks->count; i++)
+		if (locks->locks[i].rwlock)
+			metrics_printf(out, "calc_lock_shared_wait_seconds_total{lock=\"%s\"} %.9f\n", locks->locks[i].name, locks->locks[i].shared_wait_ns / 1e9);
+
+	free(locks);
+}
+
+// The records before the fork are in the snapshot, later ones go to a new log file
+void server_snapshot_forking(void * ctx)
 {
-	pthread_mutex_lock(&server->calc_mutex);
+	wal_rotate(((struct Server *) ctx)->wal);
+}
 
-	int res = calc_eval(server->calc, expr, result);
+void server_snapshot_saved(void * ctx, int saved)
+{
+	wal_checkpoint(((struct Server *) ctx)->wal, saved);
+}
 
-	pthread_mutex_unlock(&server->calc_mutex);
+// Handle the "walinfo" command
+void server_wal_info(struct Server * server, int outfd)
+{
+	char response[LINEBUFF_SIZE];
+
+	if (server->wal == NULL)
+		snprintf(response, LINEBUFF_SIZE, "Error the write-ahead log is disabled\n");
+	else
+	{
+		WalStats stats;
+		wal_stats(server->wal, &stats);
+		snprintf(response, LINEBUFF_SIZE, "records=%lu payload_bytes=%lu written_bytes=%lu writes=%lu syncs=%lu "
+										  "sync_us=%lu replayed=%lu replay_us=%lu failed=%d\n",
+				 stats.records, stats.payload_bytes, stats.written_bytes, stats.writes, stats.syncs,
+				 stats.sync_ns / 1000, stats.replayed, stats.replay_ns / 1000, stats.failed);
+	}
+
+	rio_writen(outfd, response, strlen(response));
+}
+
+// Handle the "save" and "saveinfo" commands
+void server_save_command(struct Server * server, int outfd, bool info)
+{
+	char response[LINEBUFF_SIZE];
+
+	if (!server->snapshots)
+		snprintf(response, LINEBUFF_SIZE, "Error snapshots are disabled\n");
+	else if (info)
+	{
+		SnapshotStats stats;
+		snapshot_stats(&stats);
+		snprintf(response, LINEBUFF_SIZE, "saving=%d saves=%lu failures=%lu variables=%lu "
+										  "last_fork_us=%lu max_fork_us=%lu last_duration_ms=%lu\n",
+				 stats.saving, stats.saves, stats.failures, stats.last_variables,
+				 stats.last_fork_ns / 1000, stats.max_fork_ns / 1000, stats.last_duration_ns / 1000000);
+	}
+	else if (snapshot_request() != 0)
+		snprintf(response, LINEBUFF_SIZE, "Error save in progress\n");
+	else
+		snprintf(response, LINEBUFF_SIZE, "Ok\n");
+
+	rio_writen(outfd, response, strlen(response));
+}
+
+// Write the memory taken by connections
+void server_memory_report(struct Server * server, char * buf, size_t size)
+{
+	SlabPoolStats sessions, buffers;
+	slab_pool_stats(server->sessions, &sessions);
+	slab_pool_stats(server->buffers, &buffers);
+
+	size_t table_bytes;
+	unsigned long expired, evicted;
+	calc_memory_stats(&table_bytes, &expired, &evicted);
+
+	// An idle session holds only its pooled state, plus the stack pages left after trimming
+	size_t stack = server->coro ? server->coro_stack_size : server->thread_stack_size;
+	snprintf(buf, size, "sessions=%lu session_bytes=%lu session_pool=%lu\n"
+						"buffers=%lu buffer_bytes=%lu buffer_pool=%lu\n"
+						"stack=%s stack_bytes=%lu\n"
+						"idle_heap_bytes=%lu active_heap_bytes=%lu\n"
+						"table_bytes=%lu max_memory=%lu expired=%lu evicted=%lu\n",
+			 sessions.in_use, sessions.object_size, sessions.capacity,
+			 buffers.in_use, buffers.object_size, buffers.capacity,
+			 server->coro ? "coroutine" : "thread", stack,
+			 sessions.object_size, sessions.object_size + buffers.object_size,
+			 table_bytes, server->max_memory, expired, evicted);
+}
+
+// Remove expired variables from the default calculator, then from every namespace
+int server_expire_tick(void * ctx)
+{
+	struct Server * server = (struct Server *) ctx;
+
+	stat_rwlock_wrlock(&server->calc_lock);
+	size_t removed = calc_expire(server->calc, EXPIRE_TICK_SLOTS);
+	stat_rwlock_unlock(&server->calc_lock);
+
+	size_t ns_removed = namespace_expire(server->namespaces, EXPIRE_TICK_SLOTS);
+
+	return removed * 100 > EXPIRE_TICK_SLOTS * EXPIRE_REPEAT_PERCENT ||
+		   ns_removed * 100 > EXPIRE_TICK_SLOTS * EXPIRE_REPEAT_PERCENT;
+}
+
+// Read a watched variable for the dispatcher
+int server_watch_read(void * ctx, const char * name, int * value)
+{
+	struct Server * server = (struct Server *) ctx;
+
+	stat_rwlock_rdlock(&server->calc_lock);
+	int res = calc_get(server->calc, name, value);
+	stat_rwlock_unlock(&server->calc_lock);
 
 	return res;
-}
\ No newline at end of file
+}
+
+// Handle the "watch <name>" and "unwatch <name>" commands
+void server_watch_command(int outfd, WatchSubscriber ** watches, char * line)
+{
+	char command[8], name[CALC_KEY_SIZE], rest[2];
+	if (sscanf(line, "%7s %19[a-zA-Z] %1s", command, name, rest) != 2)
+	{
+		rio_writen(outfd, "Error usage: watch <name> | unwatch <name>\n", 43);
+		return;
+	}
+
+	int status;
+	if (strcmp(command, "unwatch") == 0)
+		status = *watches ? watch_remove(*watches, name) : 1;
+	else
+	{
+		if (*watches == NULL)
+			*watches = watch_subscribe(outfd);
+		status = *watches ? watch_add(*watches, name) : 1;
+	}
+
+	if (status == 0)
+		rio_writen(outfd, "Ok\n", 3);
+	else
+		rio_writen(outfd, "Error\n", 6);
+}
+
+// Handle the "use <namespace>" command
+void server_use_command(struct Session * session, int outfd, char * args)
+{
+	struct Server * server = session->server;
+	char name[NAMESPACE_NAME_SIZE], rest[2];
+
+	if (sscanf(args, "%31s %1s", name, rest) != 1)
+	{
+		rio_writen(outfd, "Error usage: use <namespace> | use default\n", 43);
+		return;
+	}
+	if (server->cluster || session->txn)
+	{
+		rio_writen(outfd, "Error use is not supported in transactions or cluster mode\n", 59);
+		return;
+	}
+
+	Namespace * ns = NULL;
+	if (strcmp(name, "default") != 0 && (ns = namespace_acquire(server->namespaces, name)) == NULL)
+	{
+		rio_writen(outfd, "Error invalid namespace or too many namespaces\n", 47);
+		return;
+	}
+
+	// Taken before the old one is released, so switching to the same namespace can't evict it
+	if (session->ns)
+		namespace_release(server->namespaces, session->ns);
+	session->ns = ns;
+	rio_writen(outfd, "Ok\n", 3);
+}
+
+/// Text report built while the namespace shards are locked, sent after
+struct NamespaceReport
+{
+	char * data;
+	size_t len;
+	size_t capacity;
+};
+
+static void server_report_namespace(void * ctx, const NamespaceStats * stats)
+{
+	struct NamespaceReport * report = (struct NamespaceReport *) ctx;
+	char line[LINEBUFF_SIZE];
+	int len = snprintf(line, LINEBUFF_SIZE, "%s variables=%lu bytes=%lu requests=%lu ops=%lu errors=%lu sessions=%lu idle=%lu\n",
+					   stats->name, stats->variables, stats->bytes, stats->requests, stats->ops, stats->errors,
+					   stats->users, stats->idle_ns / 1000000000ul);
+
+	if (report->len + len > report->capacity)
+	{
+		size_t capacity = report->capacity * 2 + LINEBUFF_SIZE;
+		char * data = realloc(report->data, capacity);
+		if (data == NULL)
+			return;
+		report->data = data;
+		report->capacity = capacity;
+	}
+	memcpy(report->data + report->len, line, len);
+	report->len += len;
+}
+
+// Handle the "namespaces" command, one line per namespace and a summary
+void server_namespaces_command(struct Server * server, int outfd)
+{
+	struct NamespaceReport report = { NULL, 0, 0 };
+	namespace_foreach(server->namespaces, server_report_namespace, &report);
+
+	size_t alive;
+	uint64_t evicted;
+	namespace_table_stats(server->namespaces, &alive, &evicted);
+
+	char summary[LINEBUFF_SIZE];
+	int len = snprintf(summary, LINEBUFF_SIZE, "namespaces=%lu evicted=%lu\n", alive, evicted);
+	if (report.len > 0)
+		rio_writen(outfd, report.data, report.len);
+	rio_writen(outfd, summary, len);
+	free(report.data);
+}
+
+// Handle the "trace dump" and "trace sample <n>" commands
+void server_trace_command(struct Server * server, int outfd, char * args)
+{
+	char response[LINEBUFF_SIZE];
+	unsigned every;
+
+	if (strncmp(args, "dump", 4) == 0)
+	{
+		long spans = trace_dump(server->trace_file);
+		if (spans < 0)
+			snprintf(response, LINEBUFF_SIZE, "Error could not write %s\n", server->trace_file);
+		else
+			snprintf(response, LINEBUFF_SIZE, "Ok %ld spans written to %s\n", spans, server->trace_file);
+	}
+	else if (sscanf(args, "sample %u", &every) == 1)
+	{
+		trace_set_sample(every);
+		snprintf(response, LINEBUFF_SIZE, "Ok\n");
+	}
+	else
+		snprintf(response, LINEBUFF_SIZE, "Error usage: trace dump | trace sample <n>\n");
+
+	rio_writen(outfd, response, strlen(response));
+}
+
+void server_txn_commit(struct Server * server, int outfd, Txn * txn)
+{
+	TxnResult results[TXN_MAX_STATEMENTS];
+	size_t count;
+	int retries;
+	char response[LINEBUFF_SIZE];
+	int len;
+
+	int conflict = txn_commit(txn, results, &count, &retries);
+	int logged = wal_wait(server->wal) == 0;
+
+	if (conflict)
+		len = snprintf(response, LINEBUFF_SIZE, "Error conflict\n");
+	else if (!logged)
+		len = snprintf(response, LINEBUFF_SIZE, "Error\n");
+	else
+	{
+		// Statements may have been replayed, so answer with their committed results
+		len = snprintf(response, LINEBUFF_SIZE, "Ok");
+		for (size_t i = 0; i < count; i++)
+		{
+			if (results[i].status == SUCCESS)
+				len += snprintf(response + len, LINEBUFF_SIZE - len, " %d", results[i].value);
+			else
+				len += snprintf(response + len, LINEBUFF_SIZE - len, " Error");
+		}
+		len += snprintf(response + len, LINEBUFF_SIZE - len, "\n");
+	}
+
+	if (retries > 0)
+		LOG_INFO("Transaction committed after %d retries\n", retries);
+	rio_writen(outfd, response, len);
+}
+
+/// Forward assignments to the replication and write-ahead logs, called with calc_lock held exclusively
+void server_on_assign(void * ctx, const char * name, int value)
+{
+	struct Server * server = (struct Server *) ctx;
+
+	if (server->repl && !repl_is_replica(server->repl))
+		repl_primary_append(server->repl, name, value);
+	if (server->wal)
+		wal_append(server->wal, name, value);
+}
+
+/// Forward removals to the replication and write-ahead logs, called with calc_lock held exclusively
+void server_on_delete(void * ctx, const char * name)
+{
+	struct Server * server = (struct Server *) ctx;
+
+	if (server->repl && !repl_is_replica(server->repl))
+		repl_primary_delete(server->repl, name);
+	if (server->wal)
+		wal_append_delete(server->wal, name);
+}
+// -- < Cluster > -----------------------------------------------------------------
+
+/// Collect the distinct names of an expression together with their owner
+static void server_collect_name(void * ctx, const char * name, int assigned)
+{
+	struct ExprNames * names = (struct ExprNames *) ctx;
+
+	for (size_t i = 0; i < names->count; i++)
+	{
+		if (strcmp(names->names[i], name) == 0)
+		{
+			names->assigned[i] |= assigned;
+			return;
+		}
+	}
+
+	if (names->count == MAX_EXPR_NAMES)
+	{
+		names->overflow = TRUE;
+		return;
+	}
+
+	strcpy(names->names[names->count], name);
+	names->owners[names->count] = cluster_owner(names->cluster, name);
+	names->assigned[names->count] = assigned;
+	names->count++;
+}
+
+/// Remember assignments done on the scratch calculator
+static void server_collect_assignment(void * ctx, const char * name, int value)
+{
+	struct ScratchAssignments * assignments = (struct ScratchAssignments *) ctx;
+
+	if (assignments->count < MAX_EXPR_NAMES)
+	{
+		strcpy(assignments->names[assignments->count], name);
+		assignments->values[assignments->count] = value;
+		assignments->count++;
+	}
+}
+
+/// Parse the answer of a node to a request that is answered like an expression
+static int server_parse_result(const char * response, int *result)
+{
+	return sscanf(response, "%d", result) == 1 ? SUCCESS : FAILURE;
+}
+
+int server_cluster_eval(struct Server * server, const char *expr, int *result, bool forward)
+{
+	struct ExprNames * names = calloc(1, sizeof(struct ExprNames));
+	names->cluster = server->cluster;
+	calc_names(expr, server_collect_name, names);
+
+	int status = FAILURE;
+	char * request = malloc(LINEBUFF_SIZE + 16);
+	char response[LINEBUFF_SIZE];
+
+	if (names->overflow)
+	{
+		LOG_ERROR("Too many variables in a single expression\n");
+		goto done;
+	}
+
+	// Assignments are done by the owner of the assigned variables
+	int target = -1;
+	bool assigns_self = FALSE;
+	for (size_t i = 0; i < names->count; i++)
+	{
+		if (!names->assigned[i])
+			continue;
+		if (cluster_is_self(server->cluster, names->owners[i]))
+		{
+			assigns_self = TRUE;
+			continue;
+		}
+		if (target >= 0 && target != names->owners[i])
+		{
+			LOG_ERROR("Can't assign variables owned by different nodes in one expression\n");
+			goto done;
+		}
+		target = names->owners[i];
+	}
+
+	// Whoever evaluated it would store a variable it doesn't own
+	if (target >= 0 && assigns_self)
+	{
+		LOG_ERROR("Can't assign variables owned by different nodes in one expression\n");
+		goto done;
+	}
+
+	if (target >= 0 && forward)
+	{
+		snprintf(request, LINEBUFF_SIZE + 16, "@eval %s", expr);
+		if (request[strlen(request) - 1] != '\n')
+			strcat(request, "\n");
+		if (cluster_request(server->cluster, target, request, response, LINEBUFF_SIZE) == 0)
+			status = server_parse_result(response, result);
+		goto done;
+	}
+
+	// Fetch remote variables, one request per owner node
+	struct Calc * scratch = NULL;
+	for (size_t i = 0; i < names->count; i++)
+	{
+		int owner = names->owners[i];
+		bool pending = !cluster_is_self(server->cluster, owner);
+		for (size_t j = 0; j < i && pending; j++)
+			pending = names->owners[j] != owner;
+		if (!pending)
+			continue;
+
+		size_t len = snprintf(request, LINEBUFF_SIZE, "@get");
+		for (size_t j = i; j < names->count; j++)
+			if (names->owners[j] == owner)
+				len += snprintf(request + len, LINEBUFF_SIZE - len, " %s", names->names[j]);
+		strcat(request, "\n");
+
+		if (cluster_request(server->cluster, owner, request, response, LINEBUFF_SIZE) != 0)
+			goto scratch_done;
+
+		if (scratch == NULL)
+			scratch = calc_create_scratch();
+
+		// Values come back in the same order, '?' marks undefined variables
+		char * saveptr = NULL;
+		char * value = strtok_r(response, " \r\n", &saveptr);
+		for (size_t j = i; j < names->count && value; j++)
+		{
+			if (names->owners[j] != owner)
+				continue;
+			if (strcmp(value, "?") != 0)
+				calc_set(scratch, names->names[j], atoi(value));
+			value = strtok_r(NULL, " \r\n", &saveptr);
+		}
+	}
+
+	// Everything is local, no need for a scratch calculator
+	if (scratch == NULL)
+	{
+		status = server_calc_eval(server, NULL, expr, result, NULL, NULL);
+		goto done;
+	}
+
+	// Evaluate on the scratch calculator with local variables copied in, then store assignments back
+	struct ScratchAssignments assignments;
+	assignments.count = 0;
+	calc_set_assign_hook(scratch, server_collect_assignment, &assignments);
+
+	stat_rwlock_wrlock(&server->calc_lock);
+	for (size_t i = 0; i < names->count; i++)
+	{
+		int value;
+		if (cluster_is_self(server->cluster, names->owners[i]) && calc_get(server->calc, names->names[i], &value))
+			calc_set(scratch, names->names[i], value);
+	}
+
+	status = calc_eval(scratch, expr, result);
+	for (size_t i = 0; status == SUCCESS && i < assignments.count; i++)
+	{
+		calc_set(server->calc, assignments.names[i], assignments.values[i]);
+		server_on_assign(server, assignments.names[i], assignments.values[i]);
+	}
+	stat_rwlock_unlock(&server->calc_lock);
+	if (wal_wait(server->wal) != 0)
+		status = FAILURE;
+
+scratch_done:
+	if (scratch)
+		calc_destroy(scratch);
+done:
+	free(request);
+	free(names);
+	return status;
+}
+
+void server_cluster_command(struct Server * server, int outfd, char * line)
+{
+	char response[LINEBUFF_SIZE];
+	char name[CALC_KEY_SIZE];
+	int value;
+	int len = 0;
+
+	if (strncmp(line, "@get ", 5) == 0)
+	{
+		// Answer all names in one line
+		char * saveptr = NULL;
+		stat_rwlock_rdlock(&server->calc_lock);
+		for (char * token = strtok_r(line + 5, " \r\n", &saveptr); token && len < LINEBUFF_SIZE - 16;
+			 token = strtok_r(NULL, " \r\n", &saveptr))
+		{
+			if (calc_get(server->calc, token, &value))
+				len += snprintf(response + len, LINEBUFF_SIZE - len, "%s%d", len ? " " : "", value);
+			else
+				len += snprintf(response + len, LINEBUFF_SIZE - len, "%s?", len ? " " : "");
+		}
+		stat_rwlock_unlock(&server->calc_lock);
+		len += snprintf(response + len, LINEBUFF_SIZE - len, "\n");
+	}
+	else if (sscanf(line, "@set %19s %d", name, &value) == 2)
+	{
+		// Variable handed over by another node
+		stat_rwlock_wrlock(&server->calc_lock);
+		calc_set(server->calc, name, value);
+		server_on_assign(server, name, value);
+		stat_rwlock_unlock(&server->calc_lock);
+		if (wal_wait(server->wal) == 0)
+			len = snprintf(response, LINEBUFF_SIZE, "OK\n");
+		else
+			len = snprintf(response, LINEBUFF_SIZE, "Error\n");
+	}
+	else if (strncmp(line, "@eval ", 6) == 0)
+	{
+		if (server_cluster_eval(server, line + 6, &value, FALSE) == SUCCESS)
+			len = snprintf(response, LINEBUFF_SIZE, "%d\n", value);
+		else
+			len = snprintf(response, LINEBUFF_SIZE, "Error\n");
+	}
+	else
+		len = snprintf(response, LINEBUFF_SIZE, "Error unknown cluster request\n");
+
+	rio_writen(outfd, response, len);
+}
+
+void server_cluster_admin(struct Server * server, int outfd, char * args)
+{
+	char id[CLUSTER_ID_SIZE], host[64], port[8];
+	char response[LINEBUFF_SIZE];
+
+	if (server->cluster == NULL)
+		snprintf(response, LINEBUFF_SIZE, "Error not clustered\n");
+	else if (sscanf(args, "add %31[^=]=%63[^:]:%7s", id, host, port) == 3)
+	{
+		if (cluster_add_node(server->cluster, id, host, port) == 0)
+		{
+			server_cluster_rebalance(server);
+			snprintf(response, LINEBUFF_SIZE, "OK\n");
+		}
+		else
+			snprintf(response, LINEBUFF_SIZE, "Error cluster full\n");
+	}
+	else if (sscanf(args, "remove %31s", id) == 1)
+	{
+		if (cluster_remove_node(server->cluster, id) == 0)
+		{
+			server_cluster_rebalance(server);
+			snprintf(response, LINEBUFF_SIZE, "OK\n");
+		}
+		else
+			snprintf(response, LINEBUFF_SIZE, "Error unknown node\n");
+	}
+	else if (strncmp(args, "info", 4) == 0)
+	{
+		cluster_info(server->cluster, response, LINEBUFF_SIZE - 32);
+		stat_rwlock_rdlock(&server->calc_lock);
+		size_t len = strlen(response);
+		snprintf(response + len, LINEBUFF_SIZE - len, "keys=%lu\n", calc_count(server->calc));
+		stat_rwlock_unlock(&server->calc_lock);
+	}
+	else
+		snprintf(response, LINEBUFF_SIZE, "Error usage: cluster add <id>=<host>:<port> | remove <id> | info\n");
+
+	rio_writen(outfd, response, strlen(response));
+}
+
+/// Names of the local variables, collected before rebalancing
+struct NameList
+{
+	size_t count;
+	size_t capacity;
+	char (* names)[CALC_KEY_SIZE];
+};
+
+static void server_collect_local_name(void * ctx, const char * name, int value)
+{
+	struct NameList * list = (struct NameList *) ctx;
+	(void) value;
+
+	if (list->count == list->capacity)
+	{
+		list->capacity = list->capacity * 2 + 64;
+		list->names = realloc(list->names, list->capacity * CALC_KEY_SIZE);
+	}
+	strcpy(list->names[list->count++], name);
+}
+
+/// Move variables owned by other nodes, only the ones whose owner changed need to move
+static void * server_rebalance_thread(void * args)
+{
+	struct Server * server = (struct Server *) args;
+	struct NameList list = { 0, 0, NULL };
+	char request[LINEBUFF_SIZE];
+	char response[LINEBUFF_SIZE];
+	size_t moved = 0;
+
+	stat_rwlock_rdlock(&server->calc_lock);
+	calc_foreach(server->calc, server_collect_local_name, &list);
+	stat_rwlock_unlock(&server->calc_lock);
+
+	for (size_t i = 0; i < list.count; i++)
+	{
+		int owner = cluster_owner(server->cluster, list.names[i]);
+		if (owner < 0 || cluster_is_self(server->cluster, owner))
+			continue;
+
+		// Take the variable out while it travels, put it back if the owner can't take it
+		int value;
+		stat_rwlock_wrlock(&server->calc_lock);
+		int found = calc_get(server->calc, list.names[i], &value);
+		if (found)
+			calc_delete(server->calc, list.names[i]);
+		stat_rwlock_unlock(&server->calc_lock);
+		if (!found)
+			continue;
+
+		snprintf(request, LINEBUFF_SIZE, "@set %s %d\n", list.names[i], value);
+		if (cluster_request(server->cluster, owner, request, response, LINEBUFF_SIZE) == 0 && strncmp(response, "OK", 2) == 0)
+			moved++;
+		else
+		{
+			stat_rwlock_wrlock(&server->calc_lock);
+			if (!calc_get(server->calc, list.names[i], &value))
+				calc_assign(server->calc, list.names[i], value);
+			stat_rwlock_unlock(&server->calc_lock);
+		}
+	}
+
+	LOG_INFO("Rebalance finished, moved %lu of %lu variables\n", moved, list.count);
+	free(list.names);
+	return NULL;
+}
+
+void server_cluster_rebalance(struct Server * server)
+{
+	pthread_t thread;
+	Pthread_create(&thread, NULL, server_rebalance_thread, server);
+	Pthread_detach(thread);
+}
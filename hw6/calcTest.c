@@ -1,9 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "tctest.h"
 
 #include "calc.h"
 #include "logger.h"
+#include "txn.h"
 
 typedef struct {
 	struct Calc *calc;
@@ -26,6 +29,20 @@ void testComputation(TestObjs *objs);
 void testComputationAndAssignment(TestObjs *objs);
 void testUpdate(TestObjs *objs);
 void testInvalidExpr(TestObjs *objs);
+void testUndefinedVariables(TestObjs *objs);
+void testManyVariables(TestObjs *objs);
+void testDelete(TestObjs *objs);
+void testNames(TestObjs *objs);
+void testErrorKinds(TestObjs *objs);
+void testSnapshots(TestObjs *objs);
+void testCompoundAssignment(TestObjs *objs);
+void testCounterUpdates(TestObjs *objs);
+void testStore(TestObjs *objs);
+void testOpBudget(TestObjs *objs);
+void testTtl(TestObjs *objs);
+void testMemoryLimit(TestObjs *objs);
+void testScratchMemoryLimit(TestObjs *objs);
+void testMulti(TestObjs *objs);
 
 int main(void) {
 	Logger * log = logger_get();
@@ -37,6 +54,20 @@ int main(void) {
 	TEST(testComputationAndAssignment);
 	TEST(testUpdate);
 	TEST(testInvalidExpr);
+	TEST(testUndefinedVariables);
+	TEST(testManyVariables);
+	TEST(testDelete);
+	TEST(testNames);
+	TEST(testErrorKinds);
+	TEST(testSnapshots);
+	TEST(testCompoundAssignment);
+	TEST(testCounterUpdates);
+	TEST(testStore);
+	TEST(testOpBudget);
+	TEST(testTtl);
+	TEST(testMemoryLimit);
+	TEST(testScratchMemoryLimit);
+	TEST(testMulti);
 
 	TEST_FINI();
 	logger_destroy(log);
@@ -141,3 +172,434 @@ void testInvalidExpr(TestObjs *objs) {
 	/* attempt to divide by 0 */
 	ASSERT(0 == calc_eval(objs->calc, "4 / 0", &result));
 }
+
+void testUndefinedVariables(TestObjs *objs) {
+	int result;
+
+	/* reading an undefined variable fails and leaves it undefined */
+	ASSERT(0 == calc_eval(objs->calc, "x", &result));
+	ASSERT(0 == calc_get(objs->calc, "x", &result));
+	ASSERT(0 == calc_count(objs->calc));
+
+	/* assigning from an undefined variable defines neither of them */
+	ASSERT(0 == calc_eval(objs->calc, "y = x * 2", &result));
+	ASSERT(0 == calc_get(objs->calc, "y", &result));
+	ASSERT(0 == calc_get(objs->calc, "x", &result));
+
+	/* and leaves an existing target as it was */
+	ASSERT(0 != calc_eval(objs->calc, "y = 3", &result));
+	ASSERT(0 == calc_eval(objs->calc, "y = x + 1", &result));
+	result = 0;
+	ASSERT(0 != calc_get(objs->calc, "y", &result));
+	ASSERT(3 == result);
+	ASSERT(1 == calc_count(objs->calc));
+
+	/* once assigned it reads as usual */
+	ASSERT(0 != calc_eval(objs->calc, "x = 5", &result));
+	ASSERT(0 != calc_eval(objs->calc, "x + y", &result));
+	ASSERT(8 == result);
+}
+
+void testManyVariables(TestObjs *objs) {
+	char name[CALC_KEY_SIZE];
+	int result;
+
+	/* enough names to collide and grow the table several times */
+	for (int i = 0; i < 1000; i++) {
+		snprintf(name, sizeof(name), "v%c%c%c", 'a' + i % 26, 'a' + (i / 26) % 26, 'a' + i / 676);
+		ASSERT(0 != calc_set(objs->calc, name, i));
+	}
+	ASSERT(1000 == calc_count(objs->calc));
+
+	for (int i = 0; i < 1000; i++) {
+		snprintf(name, sizeof(name), "v%c%c%c", 'a' + i % 26, 'a' + (i / 26) % 26, 'a' + i / 676);
+		result = -1;
+		ASSERT(0 != calc_get(objs->calc, name, &result));
+		ASSERT(i == result);
+	}
+
+	result = 0;
+	ASSERT(0 != calc_eval(objs->calc, "vbaa + vcaa", &result));
+	ASSERT(3 == result);
+}
+
+void testDelete(TestObjs *objs) {
+	int result;
+
+	ASSERT(0 != calc_eval(objs->calc, "a = 4", &result));
+	ASSERT(0 != calc_delete(objs->calc, "a"));
+	ASSERT(0 == calc_delete(objs->calc, "a"));
+	ASSERT(0 == calc_eval(objs->calc, "a", &result));
+	ASSERT(0 == calc_count(objs->calc));
+
+	/* reading an undefined variable must not define it */
+	ASSERT(0 == calc_eval(objs->calc, "b + 1", &result));
+	ASSERT(0 == calc_get(objs->calc, "b", &result));
+}
+
+static void countNames(void *ctx, const char *name, int assigned) {
+	int *counts = ctx;
+	(void)name;
+	counts[assigned ? 1 : 0]++;
+}
+
+void testNames(TestObjs *objs) {
+	int counts[2] = { 0, 0 };
+	(void)objs;
+
+	calc_names("a = b + c * 2", countNames, counts);
+	ASSERT(2 == counts[0]);
+	ASSERT(1 == counts[1]);
+}
+
+void testErrorKinds(TestObjs *objs) {
+	int result;
+
+	ASSERT(0 == calc_eval(objs->calc, "4 +", &result));
+	ASSERT(CALC_ERROR_ARITY == calc_last_error());
+	ASSERT(0 == calc_eval(objs->calc, "a", &result));
+	ASSERT(CALC_ERROR_UNDEFINED == calc_last_error());
+	ASSERT(0 == calc_eval(objs->calc, "4 / 0", &result));
+	ASSERT(CALC_ERROR_DIVIDE_BY_ZERO == calc_last_error());
+	ASSERT(0 == calc_eval(objs->calc, "4 + 1 = 3", &result));
+	ASSERT(CALC_ERROR_ASSIGNMENT == calc_last_error());
+	ASSERT(0 == calc_eval(objs->calc, "4 4", &result));
+	ASSERT(CALC_ERROR_SYNTAX == calc_last_error());
+	ASSERT(0 != calc_eval(objs->calc, "4", &result));
+	ASSERT(CALC_ERROR_NONE == calc_last_error());
+	ASSERT(0 == strcmp("divide_by_zero", calc_error_name(CALC_ERROR_DIVIDE_BY_ZERO)));
+}
+
+void testSnapshots(TestObjs *objs) {
+	int result;
+
+	ASSERT(0 != calc_eval(objs->calc, "a = 1", &result));
+	unsigned long snapshot = calc_snapshot_open(objs->calc);
+	unsigned long a_version = calc_version_of(objs->calc, "a");
+	ASSERT(a_version <= snapshot);
+
+	// writes after the snapshot don't change what it reads
+	ASSERT(0 != calc_eval(objs->calc, "a = 2", &result));
+	ASSERT(0 != calc_eval(objs->calc, "a = 3", &result));
+	ASSERT(0 != calc_eval(objs->calc, "b = 5", &result));
+	ASSERT(0 != calc_get_at(objs->calc, "a", snapshot, &result));
+	ASSERT(1 == result);
+	ASSERT(0 == calc_get_at(objs->calc, "b", snapshot, &result));
+	ASSERT(calc_version_of(objs->calc, "a") > snapshot);
+
+	// a second, later snapshot sees the newer value
+	unsigned long later = calc_snapshot_open(objs->calc);
+	ASSERT(0 != calc_eval(objs->calc, "a = 4", &result));
+	ASSERT(0 != calc_get_at(objs->calc, "a", later, &result));
+	ASSERT(3 == result);
+	ASSERT(0 != calc_get_at(objs->calc, "a", snapshot, &result));
+	ASSERT(1 == result);
+	calc_snapshot_close(objs->calc, snapshot);
+	calc_snapshot_close(objs->calc, later);
+
+	// deleting loses the history
+	snapshot = calc_snapshot_open(objs->calc);
+	ASSERT(0 != calc_delete(objs->calc, "b"));
+	ASSERT(CALC_SNAPSHOT_LOST == calc_get_at(objs->calc, "b", snapshot, &result));
+	calc_snapshot_close(objs->calc, snapshot);
+
+	ASSERT(0 != calc_get(objs->calc, "a", &result));
+	ASSERT(4 == result);
+}
+
+void testCompoundAssignment(TestObjs *objs) {
+	int result;
+
+	ASSERT(0 != calc_eval(objs->calc, "a = 5", &result));
+	ASSERT(0 != calc_eval(objs->calc, "a += 3", &result));
+	ASSERT(8 == result);
+	ASSERT(0 != calc_eval(objs->calc, "a -= 2 * 2", &result));
+	ASSERT(4 == result);
+	ASSERT(0 != calc_eval(objs->calc, "a *= a + 1", &result));
+	ASSERT(20 == result);
+	ASSERT(0 != calc_eval(objs->calc, "b = a += 1", &result));
+	ASSERT(21 == result);
+	ASSERT(0 != calc_eval(objs->calc, "b", &result));
+	ASSERT(21 == result);
+
+	// the variable must exist, and "+ =" is not a compound operator
+	ASSERT(0 == calc_eval(objs->calc, "c += 1", &result));
+	ASSERT(CALC_ERROR_UNDEFINED == calc_last_error());
+	ASSERT(0 == calc_eval(objs->calc, "a + = 1", &result));
+}
+
+void testCounterUpdates(TestObjs *objs) {
+	int result, swapped, operand;
+	char name[CALC_KEY_SIZE], op;
+
+	ASSERT(0 != calc_parse_update(" hits += 12 ", name, &op, &operand));
+	ASSERT(0 == strcmp(name, "hits"));
+	ASSERT('+' == op);
+	ASSERT(12 == operand);
+	ASSERT(0 == calc_parse_update("hits += b", name, &op, &operand));
+	ASSERT(0 == calc_parse_update("hits = 1", name, &op, &operand));
+	ASSERT(0 == calc_parse_update("hits += 1 + 1", name, &op, &operand));
+
+	ASSERT(0 == calc_update(objs->calc, "hits", '+', 1, &result));
+	ASSERT(0 != calc_eval(objs->calc, "hits = 10", &result));
+	ASSERT(calc_shared_updates(objs->calc));
+	ASSERT(0 != calc_update(objs->calc, "hits", '+', 5, &result));
+	ASSERT(15 == result);
+	ASSERT(0 != calc_update(objs->calc, "hits", '*', 2, &result));
+	ASSERT(30 == result);
+	ASSERT(0 != calc_cas(objs->calc, "hits", 29, 0, &swapped));
+	ASSERT(!swapped);
+	ASSERT(0 != calc_cas(objs->calc, "hits", 30, 7, &swapped));
+	ASSERT(swapped);
+
+	// with a snapshot open, updates keep the old value for it
+	unsigned long snapshot = calc_snapshot_open(objs->calc);
+	ASSERT(!calc_shared_updates(objs->calc));
+	ASSERT(0 != calc_update(objs->calc, "hits", '-', 10, &result));
+	ASSERT(-3 == result);
+	ASSERT(0 != calc_get_at(objs->calc, "hits", snapshot, &result));
+	ASSERT(7 == result);
+	ASSERT(calc_version_of(objs->calc, "hits") > snapshot);
+	calc_snapshot_close(objs->calc, snapshot);
+}
+
+void testStore(TestObjs *objs) {
+	char path[] = "/tmp/calcTestStoreXXXXXX";
+	char name[CALC_KEY_SIZE];
+	int result;
+	(void)objs;
+
+	int fd = mkstemp(path);
+	ASSERT(fd >= 0);
+	close(fd);
+
+	/* an empty file is not a store */
+	ASSERT(NULL == calc_open(path));
+	unlink(path);
+
+	/* a missing file is created, growing it keeps the variables */
+	struct Calc *calc = calc_open(path);
+	ASSERT(NULL != calc);
+	for (int i = 0; i < 1000; i++) {
+		snprintf(name, sizeof(name), "v%c%c%c", 'a' + i % 26, 'a' + (i / 26) % 26, 'a' + i / 676);
+		ASSERT(0 != calc_set(calc, name, i));
+	}
+	ASSERT(0 != calc_delete(calc, "vaaa"));
+	ASSERT(0 != calc_eval(calc, "x = vbaa * 7", &result));
+	calc_destroy(calc);
+
+	/* reopening maps the same variables */
+	calc = calc_open(path);
+	ASSERT(NULL != calc);
+	ASSERT(1000 == calc_count(calc));
+	ASSERT(0 == calc_get(calc, "vaaa", &result));
+	ASSERT(0 != calc_get(calc, "vzba", &result));
+	ASSERT(51 == result);
+	ASSERT(0 != calc_eval(calc, "x + 1", &result));
+	ASSERT(8 == result);
+
+	/* versions go on from the ones in the file */
+	unsigned long snapshot = calc_snapshot_open(calc);
+	ASSERT(calc_version_of(calc, "x") <= snapshot);
+	ASSERT(0 != calc_eval(calc, "x = 0", &result));
+	ASSERT(0 != calc_get_at(calc, "x", snapshot, &result));
+	ASSERT(7 == result);
+	calc_snapshot_close(calc, snapshot);
+
+	/* a store that was never closed is recounted */
+	struct Calc *crashed = calc_open(path);
+	ASSERT(NULL != crashed);
+	ASSERT(1000 == calc_count(crashed));
+	calc_destroy(crashed);
+	calc_destroy(calc);
+
+	calc = calc_open(path);
+	ASSERT(NULL != calc);
+	ASSERT(0 != calc_get(calc, "x", &result));
+	ASSERT(0 == result);
+	calc_destroy(calc);
+	unlink(path);
+}
+
+void testOpBudget(TestObjs *objs) {
+	int result;
+
+	/* every operand, operator and assignment counts */
+	ASSERT(0 != calc_eval(objs->calc, "a = 2 + 3 * 4", &result));
+	ASSERT(6 == calc_last_cost());
+	ASSERT(0 != calc_eval(objs->calc, "a += 1", &result));
+	ASSERT(3 == calc_last_cost());
+	ASSERT(0 != calc_update(objs->calc, "a", '+', 1, &result));
+	ASSERT(1 == calc_last_cost());
+
+	/* over the budget nothing is assigned */
+	calc_set_op_budget(4);
+	ASSERT(0 == calc_eval(objs->calc, "b = a = 1 + 2", &result));
+	ASSERT(CALC_ERROR_BUDGET == calc_last_error());
+	ASSERT(0 == strcmp("budget", calc_error_name(CALC_ERROR_BUDGET)));
+	ASSERT(0 == calc_get(objs->calc, "b", &result));
+	ASSERT(0 != calc_get(objs->calc, "a", &result));
+	ASSERT(16 == result);
+	ASSERT(0 != calc_eval(objs->calc, "b = 1 + 2", &result));
+
+	calc_set_op_budget(0);
+	ASSERT(0 != calc_eval(objs->calc, "b = a = 1 + 2", &result));
+}
+
+void testTtl(TestObjs *objs) {
+	int counts[2] = { 0, 0 };
+	size_t bytes;
+	unsigned long expired, evicted, expired_before;
+	int result;
+
+	calc_memory_stats(&bytes, &expired_before, &evicted);
+
+	/* a plain assignment replaces the TTL, a compound one keeps it */
+	ASSERT(0 != calc_eval(objs->calc, "a = b = 5 ttl 1", &result));
+	ASSERT(5 == result);
+	ASSERT(0 != calc_eval(objs->calc, "a += 1", &result));
+	ASSERT(0 != calc_eval(objs->calc, "b = 7", &result));
+	ASSERT(0 != calc_eval(objs->calc, "c = 1 ttl 60", &result));
+	ASSERT(0 == calc_eval(objs->calc, "d = 1 ttl 0", &result));
+	ASSERT(CALC_ERROR_SYNTAX == calc_last_error());
+	ASSERT(0 != calc_eval(objs->calc, "ttl = 2", &result));
+	/* with nothing assigned there is nothing to expire */
+	ASSERT(0 == calc_eval(objs->calc, "b + c ttl 5", &result));
+	ASSERT(CALC_ERROR_SYNTAX == calc_last_error());
+
+	calc_names("e = ttl ttl 9", countNames, counts);
+	ASSERT(1 == counts[0]);
+	ASSERT(1 == counts[1]);
+
+	/* expired variables read as undefined, and stay counted until removed */
+	usleep(1100000);
+	ASSERT(0 == calc_get(objs->calc, "a", &result));
+	ASSERT(0 == calc_eval(objs->calc, "a + 1", &result));
+	ASSERT(0 == calc_eval(objs->calc, "a += 1", &result));
+	ASSERT(0 != calc_get(objs->calc, "b", &result));
+	ASSERT(7 == result);
+	ASSERT(0 != calc_get(objs->calc, "c", &result));
+	ASSERT(4 == calc_count(objs->calc));
+
+	ASSERT(1 == calc_expire(objs->calc, 1000));
+	ASSERT(3 == calc_count(objs->calc));
+	ASSERT(0 == calc_expire(objs->calc, 1000));
+	calc_memory_stats(&bytes, &expired, &evicted);
+	ASSERT(expired_before + 1 == expired);
+
+	/* assigning an expired variable defines it again */
+	ASSERT(0 != calc_eval(objs->calc, "c = 2 ttl 1", &result));
+	usleep(1100000);
+	ASSERT(0 == calc_delete(objs->calc, "c"));
+	calc_memory_stats(&bytes, &expired, &evicted);
+	ASSERT(expired_before + 2 == expired);
+	ASSERT(0 != calc_eval(objs->calc, "c = 3", &result));
+	ASSERT(0 != calc_get(objs->calc, "c", &result));
+	ASSERT(3 == result);
+}
+
+void testMemoryLimit(TestObjs *objs) {
+	char name[CALC_KEY_SIZE];
+	size_t bytes, limit;
+	unsigned long expired, evicted, evicted_before;
+	int result;
+	(void)objs;
+
+	/* no table may grow, so the new one evicts to make room */
+	struct Calc *calc = calc_create();
+	calc_memory_stats(&limit, &expired, &evicted_before);
+	calc_set_memory_limit(limit);
+
+	for (int i = 0; i < 1000; i++) {
+		snprintf(name, sizeof(name), "v%c%c%c", 'a' + i % 26, 'a' + (i / 26) % 26, 'a' + i / 676);
+		ASSERT(0 != calc_set(calc, name, i));
+	}
+	ASSERT(calc_count(calc) < 16);
+	ASSERT(0 != calc_get(calc, name, &result));
+	ASSERT(999 == result);
+
+	calc_memory_stats(&bytes, &expired, &evicted);
+	ASSERT(limit == bytes);
+	ASSERT(evicted_before + 1000 - calc_count(calc) == evicted);
+
+	/* without a limit it grows again */
+	calc_set_memory_limit(0);
+	for (int i = 0; i < 100; i++) {
+		snprintf(name, sizeof(name), "w%c%c", 'a' + i % 26, 'a' + i / 26);
+		ASSERT(0 != calc_set(calc, name, i));
+	}
+	calc_memory_stats(&bytes, &expired, &evicted);
+	ASSERT(bytes > limit);
+	calc_destroy(calc);
+}
+
+void testScratchMemoryLimit(TestObjs *objs) {
+	char expr[32];
+	TxnResult results[TXN_MAX_STATEMENTS];
+	size_t bytes, limit, count;
+	unsigned long expired, evicted;
+	int result;
+	StatRwLock lock;
+
+	/* the store may not grow, the working copy of a transaction is not held to that */
+	stat_rwlock_init(&lock, "store");
+	calc_memory_stats(&limit, &expired, &evicted);
+	calc_set_memory_limit(limit);
+
+	Txn *txn = txn_begin(objs->calc, &lock);
+	ASSERT(NULL != txn);
+	for (int i = 0; i < 20; i++) {
+		snprintf(expr, sizeof(expr), "t%c = %d", 'a' + i, i);
+		ASSERT(0 != txn_eval(txn, expr, &result));
+	}
+	ASSERT(0 != txn_eval(txn, "ta + tj + tt", &result));
+	ASSERT(28 == result);
+	calc_memory_stats(&bytes, &expired, &evicted);
+	ASSERT(limit == bytes);
+
+	ASSERT(0 == txn_commit(txn, results, &count, NULL));
+	ASSERT(21 == count);
+	ASSERT(SUCCESS == results[20].status);
+	ASSERT(28 == results[20].value);
+
+	calc_set_memory_limit(0);
+	stat_rwlock_destroy(&lock);
+}
+
+void testMulti(TestObjs *objs) {
+	const char *names[40];
+	char storage[40][CALC_KEY_SIZE];
+	int values[40], found[40], assigned[40];
+	int result;
+
+	/* more names than one prefetched batch */
+	for (int i = 0; i < 40; i++) {
+		snprintf(storage[i], CALC_KEY_SIZE, "m%c%c", 'a' + i % 26, 'a' + i / 26);
+		names[i] = storage[i];
+		values[i] = i * 3;
+	}
+	names[7] = "bad1";
+	names[8] = "";
+	ASSERT(38 == calc_mset(objs->calc, names, values, 40, assigned));
+	ASSERT(CALC_ERROR_NAME == calc_last_error());
+	ASSERT(40 == calc_last_cost());
+	ASSERT(0 != assigned[6] && 0 == assigned[7] && 0 == assigned[8] && 0 != assigned[39]);
+	ASSERT(0 != calc_get(objs->calc, "mnb", &result));
+	ASSERT(117 == result);
+
+	/* a plain assignment drops the TTL */
+	ASSERT(0 != calc_eval(objs->calc, "mab = 1 ttl 60", &result));
+	names[0] = "mab";
+	values[0] = 2;
+	ASSERT(1 == calc_mset(objs->calc, names, values, 1, assigned));
+
+	memset(values, 0, sizeof(values));
+	names[0] = "mjb";
+	names[1] = "nope";
+	names[2] = "mab";
+	ASSERT(2 == calc_mget(objs->calc, names, 3, values, found));
+	ASSERT(CALC_ERROR_UNDEFINED == calc_last_error());
+	ASSERT(0 != found[0] && 0 == found[1] && 0 != found[2]);
+	ASSERT(105 == values[0] && 2 == values[2]);
+	ASSERT(35 == calc_mget(objs->calc, names + 3, 37, values, found));
+}
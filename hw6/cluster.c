@@ -0,0 +1,301 @@
+#include "cluster.h"
+#include "csapp.h"
+#include "logger.h"
+#include <assert.h>
+#include <stdint.h>
+
+/// A calcServer node in the ring
+struct ClusterNode
+{
+    int used;
+    char id[CLUSTER_ID_SIZE];
+    char host[64];
+    char port[8];
+    pthread_mutex_t conn_mutex;     // Serializes requests on the connection
+    int fd;                         // Connection to the node, -1 if not connected
+    rio_t in;
+};
+
+/// A point in the ring
+struct VirtualNode
+{
+    uint32_t hash;
+    int node;
+};
+
+struct Cluster
+{
+    pthread_rwlock_t lock;          // Protects the ring and node membership
+    char self_id[CLUSTER_ID_SIZE];
+    struct ClusterNode nodes[CLUSTER_MAX_NODES];
+    struct VirtualNode ring[CLUSTER_MAX_NODES * CLUSTER_VNODES];
+    size_t ring_size;
+};
+
+// -- < Utility functions > ------------------------------------------------------
+
+// FNV-1a followed by a murmur finalizer, so close names spread over the ring
+static uint32_t _cluster_hash(const char * str)
+{
+    uint32_t h = 2166136261u;
+    for (; *str; str++)
+    {
+        h ^= (unsigned char) *str;
+        h *= 16777619u;
+    }
+
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static int _cluster_compare_vnodes(const void * a, const void * b)
+{
+    const struct VirtualNode * va = a;
+    const struct VirtualNode * vb = b;
+    return (va->hash > vb->hash) - (va->hash < vb->hash);
+}
+
+// Rebuild the ring from the node list, must be called with the write lock held
+static void _cluster_build_ring(Cluster * cluster)
+{
+    char vnode_name[CLUSTER_ID_SIZE + 16];
+
+    cluster->ring_size = 0;
+    for (int i = 0; i < CLUSTER_MAX_NODES; i++)
+    {
+        if (!cluster->nodes[i].used)
+            continue;
+
+        for (int v = 0; v < CLUSTER_VNODES; v++)
+        {
+            snprintf(vnode_name, sizeof(vnode_name), "%s#%d", cluster->nodes[i].id, v);
+            cluster->ring[cluster->ring_size].hash = _cluster_hash(vnode_name);
+            cluster->ring[cluster->ring_size].node = i;
+            cluster->ring_size++;
+        }
+    }
+
+    qsort(cluster->ring, cluster->ring_size, sizeof(struct VirtualNode), _cluster_compare_vnodes);
+}
+
+static int _cluster_find_node(Cluster * cluster, const char * id)
+{
+    for (int i = 0; i < CLUSTER_MAX_NODES; i++)
+        if (cluster->nodes[i].used && strcmp(cluster->nodes[i].id, id) == 0)
+            return i;
+    return -1;
+}
+
+// Drop the connection to a node, must be called with the node connection mutex held
+static void _cluster_disconnect(struct ClusterNode * node)
+{
+    if (node->fd >= 0)
+        close(node->fd);
+    node->fd = -1;
+}
+
+// Tell if a cached connection can still carry a request: the peer did not close it and
+// nothing unanswered is left to read
+static int _cluster_idle(struct ClusterNode * node)
+{
+    char c;
+    return node->in.rio_cnt == 0 && recv(node->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+           (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// Write a whole request, returns the amount of bytes written before an error
+static size_t _cluster_send(int fd, const char * buf, size_t len)
+{
+    size_t sent = 0;
+    while (sent < len)
+    {
+        ssize_t n = send(fd, buf + sent, len - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+    return sent;
+}
+
+// -- < Implementation > ---------------------------------------------------------
+
+Cluster * cluster_create(const char * self_id)
+{
+    Cluster * cluster = calloc(1, sizeof(Cluster));
+    snprintf(cluster->self_id, sizeof(cluster->self_id), "%s", self_id);
+    pthread_rwlock_init(&cluster->lock, NULL);
+
+    for (int i = 0; i < CLUSTER_MAX_NODES; i++)
+    {
+        cluster->nodes[i].fd = -1;
+        pthread_mutex_init(&cluster->nodes[i].conn_mutex, NULL);
+    }
+
+    return cluster;
+}
+
+void cluster_destroy(Cluster * cluster)
+{
+    for (int i = 0; i < CLUSTER_MAX_NODES; i++)
+    {
+        _cluster_disconnect(&cluster->nodes[i]);
+        pthread_mutex_destroy(&cluster->nodes[i].conn_mutex);
+    }
+
+    pthread_rwlock_destroy(&cluster->lock);
+    free(cluster);
+}
+
+int cluster_add_node(Cluster * cluster, const char * id, const char * host, const char * port)
+{
+    pthread_rwlock_wrlock(&cluster->lock);
+
+    int index = _cluster_find_node(cluster, id);
+    for (int i = 0; i < CLUSTER_MAX_NODES && index < 0; i++)
+        if (!cluster->nodes[i].used)
+            index = i;
+
+    if (index < 0)
+    {
+        pthread_rwlock_unlock(&cluster->lock);
+        LOG_ERROR("Cluster is full, can't add node %s\n", id);
+        return 1;
+    }
+
+    struct ClusterNode * node = &cluster->nodes[index];
+    pthread_mutex_lock(&node->conn_mutex);
+    _cluster_disconnect(node);
+    node->used = 1;
+    snprintf(node->id, sizeof(node->id), "%s", id);
+    snprintf(node->host, sizeof(node->host), "%s", host);
+    snprintf(node->port, sizeof(node->port), "%s", port);
+    pthread_mutex_unlock(&node->conn_mutex);
+
+    _cluster_build_ring(cluster);
+    pthread_rwlock_unlock(&cluster->lock);
+
+    LOG_INFO("Node %s (%s:%s) added to the cluster\n", id, host, port);
+    return 0;
+}
+
+int cluster_remove_node(Cluster * cluster, const char * id)
+{
+    pthread_rwlock_wrlock(&cluster->lock);
+
+    int index = _cluster_find_node(cluster, id);
+    if (index < 0)
+    {
+        pthread_rwlock_unlock(&cluster->lock);
+        return 1;
+    }
+
+    struct ClusterNode * node = &cluster->nodes[index];
+    pthread_mutex_lock(&node->conn_mutex);
+    _cluster_disconnect(node);
+    node->used = 0;
+    pthread_mutex_unlock(&node->conn_mutex);
+
+    _cluster_build_ring(cluster);
+    pthread_rwlock_unlock(&cluster->lock);
+
+    LOG_INFO("Node %s removed from the cluster\n", id);
+    return 0;
+}
+
+int cluster_owner(Cluster * cluster, const char * name)
+{
+    uint32_t hash = _cluster_hash(name);
+    int owner = -1;
+
+    pthread_rwlock_rdlock(&cluster->lock);
+    if (cluster->ring_size > 0)
+    {
+        // First virtual node with a hash >= the name hash, wrapping around
+        size_t low = 0, high = cluster->ring_size;
+        while (low < high)
+        {
+            size_t mid = (low + high) / 2;
+            if (cluster->ring[mid].hash < hash)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        owner = cluster->ring[low == cluster->ring_size ? 0 : low].node;
+    }
+    pthread_rwlock_unlock(&cluster->lock);
+
+    return owner;
+}
+
+int cluster_is_self(Cluster * cluster, int node)
+{
+    pthread_rwlock_rdlock(&cluster->lock);
+    int is_self = node >= 0 && cluster->nodes[node].used && strcmp(cluster->nodes[node].id, cluster->self_id) == 0;
+    pthread_rwlock_unlock(&cluster->lock);
+    return is_self;
+}
+
+int cluster_request(Cluster * cluster, int index, const char * request, char * response, size_t size)
+{
+    assert(index >= 0 && index < CLUSTER_MAX_NODES && "Node index out of range");
+    struct ClusterNode * node = &cluster->nodes[index];
+    size_t len = strlen(request);
+
+    pthread_mutex_lock(&node->conn_mutex);
+
+    // A request that may have reached the peer is never sent again, it could be applied twice.
+    // Only a cached connection the peer closed, found before or while writing the first byte,
+    // is replaced by a fresh one.
+    int ok = 0;
+    for (int attempt = 0; attempt < 2 && node->used; attempt++)
+    {
+        if (node->fd >= 0 && !_cluster_idle(node))
+            _cluster_disconnect(node);
+
+        int cached = node->fd >= 0;
+        if (!cached)
+        {
+            node->fd = open_clientfd(node->host, node->port);
+            if (node->fd < 0)
+                break;
+            rio_readinitb(&node->in, node->fd);
+        }
+
+        size_t sent = _cluster_send(node->fd, request, len);
+        ok = sent == len && rio_readlineb(&node->in, response, size) > 0;
+        if (ok)
+            break;
+
+        _cluster_disconnect(node);
+        if (!cached || sent > 0)
+            break;
+    }
+
+    pthread_mutex_unlock(&node->conn_mutex);
+
+    if (!ok)
+        LOG_ERROR("Request to cluster node %s failed\n", node->id);
+    return !ok;
+}
+
+void cluster_info(Cluster * cluster, char * buf, size_t size)
+{
+    size_t len = 0;
+    buf[0] = '\0';
+
+    pthread_rwlock_rdlock(&cluster->lock);
+    for (int i = 0; i < CLUSTER_MAX_NODES && len < size; i++)
+    {
+        struct ClusterNode * node = &cluster->nodes[i];
+        if (node->used)
+            len += snprintf(buf + len, size - len, "node=%s addr=%s:%s%s\n", node->id, node->host, node->port,
+                            strcmp(node->id, cluster->self_id) == 0 ? " self" : "");
+    }
+    pthread_rwlock_unlock(&cluster->lock);
+}
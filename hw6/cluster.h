@@ -0,0 +1,69 @@
+/*
+    Consistent-hash partitioning of the variable keyspace across several
+    calcServer nodes.
+
+    Every node is placed on a hash ring through CLUSTER_VNODES virtual
+    nodes, and a variable is owned by the first virtual node found going
+    clockwise from the hash of its name. Nodes talk to each other through
+    their regular client port, using lines prefixed with '@':
+
+        @get <name> <name> ...   ->  one line with the values, '?' for undefined ones
+        @set <name> <value>      ->  OK, used to hand variables over on rebalance
+        @eval <expr>             ->  evaluate locally, without forwarding again
+*/
+
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stddef.h>
+
+#define CLUSTER_VNODES 64   // Virtual nodes per node in the ring
+#define CLUSTER_MAX_NODES 32
+#define CLUSTER_ID_SIZE 32
+
+typedef struct Cluster Cluster;
+
+/// Summary:
+///     Create an empty cluster ring
+/// Parameters:
+///     self_id : id of this node in the ring
+Cluster * cluster_create(const char * self_id);
+
+/// Summary:
+///     Destroy the ring and close connections to other nodes
+void cluster_destroy(Cluster * cluster);
+
+/// Summary:
+///     Add a node (or update its address) to the ring
+/// Return:
+///     0 on success, anything else if the ring is full
+int cluster_add_node(Cluster * cluster, const char * id, const char * host, const char * port);
+
+/// Summary:
+///     Remove a node from the ring
+/// Return:
+///     0 on success, anything else if the node was not in the ring
+int cluster_remove_node(Cluster * cluster, const char * id);
+
+/// Summary:
+///     Find the owner of a variable
+/// Return:
+///     Index of the owner node, or -1 when the ring is empty
+int cluster_owner(Cluster * cluster, const char * name);
+
+/// Summary:
+///     Tells if the given node index is this node
+int cluster_is_self(Cluster * cluster, int node);
+
+/// Summary:
+///     Send a request line to a node and read one response line into response.
+///     Connections are kept open and reused between requests.
+/// Return:
+///     0 on success, anything else on network error
+int cluster_request(Cluster * cluster, int node, const char * request, char * response, size_t size);
+
+/// Summary:
+///     Write the ring members into buf
+void cluster_info(Cluster * cluster, char * buf, size_t size);
+
+#endif // CLUSTER_H
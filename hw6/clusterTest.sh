@@ -0,0 +1,85 @@
+#!/bin/bash
+#
+# Multi-process cluster test: starts three nodes sharing the keyspace on
+# localhost, checks every node sees every variable, then adds and removes
+# a node and checks nothing is lost while variables move.
+#
+
+BASE=17000
+. ./testlib.sh "$@"
+declare -A nodes
+
+# forty variable names: xa, xb, ..., ya, yb, ...
+names=()
+for first in x y; do
+	for second in a b c d e f g h i j k l m n o p q r s t; do
+		names+=("$first$second")
+	done
+done
+
+# start node <n> knowing the given members
+start_node() {
+	local n=$1; shift
+	local members=()
+	for m in "$@"; do members+=(--cluster-node "n$m=127.0.0.1:$((BASE + m))"); done
+	start_on $((BASE + n)) --node-id n$n "${members[@]}"
+	nodes[$n]=$pid
+}
+
+read_all() {
+	ask $1 "${names[@]}" | tr '\n' ' '
+}
+
+keys() {
+	ask $1 "cluster info" | grep -o 'keys=[0-9]*' | cut -d= -f2
+}
+
+start_node 1 1 2 3
+start_node 2 1 2 3
+start_node 3 1 2 3
+
+assignments=()
+expected=""
+for i in "${!names[@]}"; do
+	assignments+=("${names[$i]} = $i")
+	expected+="$i "
+done
+ask $((BASE + 1)) "${assignments[@]}" > /dev/null
+
+for n in 1 2 3; do
+	check testReadFromNode$n "$expected" "$(read_all $((BASE + n)))"
+done
+
+check testKeysSpread 40 $(( $(keys $((BASE + 1))) + $(keys $((BASE + 2))) + $(keys $((BASE + 3))) ))
+check testRemoteExpression "$(( 1 + 2 * 3 + 39 ))" "$(ask $((BASE + 2)) 'xb + xc * xd + yt')"
+check testRemoteAssignment "$(( 39 + 1 ))" "$(ask $((BASE + 3)) 'xa = yt + 1' > /dev/null; ask $((BASE + 1)) xa)"
+ask $((BASE + 3)) "xa = 0" > /dev/null
+
+# assigning a variable of node 1 and one of another node at once is refused, nothing is stored
+local_name=; remote_name=
+for name in "${names[@]}"; do
+	if [ "$(ask $((BASE + 1)) "@get $name")" == "?" ]; then remote_name=${remote_name:-$name}; else local_name=${local_name:-$name}; fi
+done
+check testMixedAssignment "Error" "$(ask $((BASE + 1)) "$local_name = $remote_name = 100")"
+check testMixedNotStored "0" "$(for n in 1 2 3; do ask $((BASE + n)) "@get $local_name $remote_name"; done | grep -c 100)"
+
+# a fourth node joins: only some variables move to it
+start_node 4 1 2 3 4
+for n in 1 2 3; do ask $((BASE + n)) "cluster add n4=127.0.0.1:$((BASE + 4))" > /dev/null; done
+sleep 0.5
+moved=$(keys $((BASE + 4)))
+check testJoinMovesSome 1 $(( moved > 0 && moved < 40 ))
+for n in 1 2 3 4; do
+	check testReadAfterJoin$n "$expected" "$(read_all $((BASE + n)))"
+done
+
+# node 2 leaves: it hands its variables over before going away
+for n in 1 2 3 4; do ask $((BASE + n)) "cluster remove n2" > /dev/null; done
+sleep 0.5
+check testLeaveEmptiesNode 0 "$(keys $((BASE + 2)))"
+kill ${nodes[2]}
+for n in 1 3 4; do
+	check testReadAfterLeave$n "$expected" "$(read_all $((BASE + n)))"
+done
+
+finish
@@ -0,0 +1,430 @@
+#define _GNU_SOURCE
+#include "coro.h"
+#include "logger.h"
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#define CORO_MAX_POOLED_STACKS 1024     // Stacks kept around for reuse
+#define CORO_EPOLL_BATCH 64             // Events handled per epoll_wait call
+#define CORO_POLL_TIMEOUT_MS 100        // So idle threads notice shutdown
+#define CORO_TRIM_MARGIN 512            // Stack kept below the caller of coro_trim_stack
+
+/// A coroutine
+typedef struct Coro
+{
+    ucontext_t context;
+    void * stack;                   // Lowest address of the mapping, including the guard page
+    void (*fn)(void *);
+    void * arg;
+    int wait_fd;                    // Descriptor to wait for after switching out, -1 if runnable
+    uint32_t wait_events;
+    int registered_fd;              // Descriptor already added to epoll, -1 if none
+    int yielding;                   // Runnable again as soon as it is off its stack
+    int done;
+    struct Coro * next;             // Run queue link
+} Coro;
+
+struct CoroScheduler
+{
+    pthread_mutex_t mutex;          // Protects everything below
+    pthread_cond_t cond;            // Signaled when a coroutine becomes runnable or one finishes
+    Coro * run_head;
+    Coro * run_tail;
+    size_t queued;                  // Coroutines in the run queue
+    void * stacks[CORO_MAX_POOLED_STACKS];
+    size_t pooled_stacks;
+    size_t live;
+    int polling;                    // A thread is inside epoll_wait
+    int running;
+
+    size_t stack_size;
+    int epoll_fd;
+    int wake_fd;                    // eventfd used to interrupt epoll_wait
+    int thread_count;
+    pthread_t * threads;
+};
+
+/// State of an OS thread running coroutines
+struct CoroThread
+{
+    ucontext_t scheduler_context;
+    Coro * current;
+};
+
+static __thread struct CoroThread coro_thread;
+
+// Accessed through a function so the thread local address is never cached
+// across a context switch, a coroutine may resume on another OS thread
+static struct CoroThread * __attribute__((noinline)) _coro_thread(void)
+{
+    return &coro_thread;
+}
+
+// -- < Stacks > -----------------------------------------------------------------
+
+static size_t _coro_page_size(void)
+{
+    return (size_t) sysconf(_SC_PAGESIZE);
+}
+
+// Must be called with the scheduler mutex held
+static void * _coro_stack_get(CoroScheduler * sched)
+{
+    if (sched->pooled_stacks > 0)
+        return sched->stacks[--sched->pooled_stacks];
+
+    // Extra guard page below the stack turns an overflow into a crash instead of corruption
+    size_t page = _coro_page_size();
+    void * stack = mmap(NULL, sched->stack_size + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED)
+        return NULL;
+    mprotect(stack, page, PROT_NONE);
+    return stack;
+}
+
+// Must be called with the scheduler mutex held
+static void _coro_stack_put(CoroScheduler * sched, void * stack)
+{
+    if (sched->pooled_stacks < CORO_MAX_POOLED_STACKS)
+        sched->stacks[sched->pooled_stacks++] = stack;
+    else
+        munmap(stack, sched->stack_size + _coro_page_size());
+}
+
+// -- < Scheduling > -------------------------------------------------------------
+
+// Must be called with the scheduler mutex held
+static void _coro_push(CoroScheduler * sched, Coro * coro)
+{
+    coro->next = NULL;
+    if (sched->run_tail)
+        sched->run_tail->next = coro;
+    else
+        sched->run_head = coro;
+    sched->run_tail = coro;
+    sched->queued++;
+    pthread_cond_signal(&sched->cond);
+}
+
+// Must be called with the scheduler mutex held
+static Coro * _coro_pop(CoroScheduler * sched)
+{
+    Coro * coro = sched->run_head;
+    if (coro)
+    {
+        sched->run_head = coro->next;
+        if (sched->run_head == NULL)
+            sched->run_tail = NULL;
+        sched->queued--;
+    }
+    return coro;
+}
+
+// Wait up to timeout_ms for descriptors and queue the coroutines they wake up.
+// Must be called with the scheduler mutex held, releases it while waiting.
+static void _coro_poll(CoroScheduler * sched, int timeout_ms)
+{
+    struct epoll_event events[CORO_EPOLL_BATCH];
+
+    sched->polling = 1;
+    pthread_mutex_unlock(&sched->mutex);
+    int n = epoll_wait(sched->epoll_fd, events, CORO_EPOLL_BATCH, timeout_ms);
+    pthread_mutex_lock(&sched->mutex);
+    sched->polling = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        if (events[i].data.ptr == NULL)
+        {
+            uint64_t value;
+            if (read(sched->wake_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+                LOG_WARN("Could not read wake up descriptor\n");
+            continue;
+        }
+        _coro_push(sched, events[i].data.ptr);
+    }
+}
+
+static void _coro_trampoline(void)
+{
+    Coro * coro = _coro_thread()->current;
+    coro->fn(coro->arg);
+    coro->done = 1;
+
+    // Back to whichever thread is running us now, never returns
+    setcontext(&_coro_thread()->scheduler_context);
+}
+
+// Run a coroutine until it finishes or parks itself
+static void _coro_resume(CoroScheduler * sched, Coro * coro)
+{
+    struct CoroThread * thread = _coro_thread();
+    thread->current = coro;
+    swapcontext(&thread->scheduler_context, &coro->context);
+    thread->current = NULL;
+
+    if (coro->done)
+    {
+        pthread_mutex_lock(&sched->mutex);
+        _coro_stack_put(sched, coro->stack);
+        sched->live--;
+        pthread_cond_broadcast(&sched->cond);
+        pthread_mutex_unlock(&sched->mutex);
+        free(coro);
+        return;
+    }
+
+    // Behind every coroutine already waiting to run, including those whose descriptor just
+    // became ready: threads only poll when the run queue is empty, which may never happen
+    if (coro->yielding)
+    {
+        coro->yielding = 0;
+        pthread_mutex_lock(&sched->mutex);
+        if (!sched->polling)
+            _coro_poll(sched, 0);
+        _coro_push(sched, coro);
+        pthread_mutex_unlock(&sched->mutex);
+        return;
+    }
+
+    // Registered only now that the coroutine is off its stack, so no other thread can resume it early
+    struct epoll_event event;
+    event.events = coro->wait_events | EPOLLONESHOT;
+    event.data.ptr = coro;
+
+    // Once epoll_ctl succeeds another thread may already be running the coroutine, don't touch it after
+    int op = coro->registered_fd == coro->wait_fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    coro->registered_fd = coro->wait_fd;
+    if (epoll_ctl(sched->epoll_fd, op, coro->wait_fd, &event) != 0 &&
+        (errno != EEXIST || epoll_ctl(sched->epoll_fd, EPOLL_CTL_MOD, coro->wait_fd, &event) != 0))
+    {
+        // Can't wait for it (e.g. it was closed), let the coroutine retry and see the error
+        LOG_WARN("Could not wait for descriptor %d: %s\n", coro->wait_fd, strerror(errno));
+        pthread_mutex_lock(&sched->mutex);
+        _coro_push(sched, coro);
+        pthread_mutex_unlock(&sched->mutex);
+        return;
+    }
+}
+
+static void * _coro_thread_main(void * args)
+{
+    CoroScheduler * sched = args;
+
+    pthread_mutex_lock(&sched->mutex);
+    while (sched->running || sched->live > 0)
+    {
+        Coro * coro = _coro_pop(sched);
+        if (coro)
+        {
+            pthread_mutex_unlock(&sched->mutex);
+            _coro_resume(sched, coro);
+            pthread_mutex_lock(&sched->mutex);
+            continue;
+        }
+
+        // Nothing to run: one thread polls for readiness, the others sleep
+        if (sched->polling)
+        {
+            pthread_cond_wait(&sched->cond, &sched->mutex);
+            continue;
+        }
+
+        _coro_poll(sched, CORO_POLL_TIMEOUT_MS);
+
+        // Let a sleeping thread take over polling
+        pthread_cond_signal(&sched->cond);
+    }
+    pthread_cond_broadcast(&sched->cond);
+    pthread_mutex_unlock(&sched->mutex);
+
+    return NULL;
+}
+
+// Interrupt a thread blocked in epoll_wait
+static void _coro_wake_poller(CoroScheduler * sched)
+{
+    uint64_t one = 1;
+    if (write(sched->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        LOG_WARN("Could not write wake up descriptor\n");
+}
+
+// -- < Implementation > ---------------------------------------------------------
+
+CoroScheduler * coro_scheduler_create(int threads, size_t stack_size)
+{
+    assert(threads > 0 && "A scheduler needs at least one thread");
+
+    size_t page = _coro_page_size();
+    CoroScheduler * sched = calloc(1, sizeof(CoroScheduler));
+    sched->stack_size = (stack_size + page - 1) / page * page;
+    sched->running = 1;
+    sched->thread_count = threads;
+    pthread_mutex_init(&sched->mutex, NULL);
+    pthread_cond_init(&sched->cond, NULL);
+
+    sched->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    sched->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sched->epoll_fd < 0 || sched->wake_fd < 0)
+    {
+        LOG_ERROR("Could not create coroutine scheduler: %s\n", strerror(errno));
+        free(sched);
+        return NULL;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(sched->epoll_fd, EPOLL_CTL_ADD, sched->wake_fd, &event);
+
+    sched->threads = calloc(threads, sizeof(pthread_t));
+    for (int i = 0; i < threads; i++)
+        pthread_create(&sched->threads[i], NULL, _coro_thread_main, sched);
+
+    LOG_INFO("Coroutine scheduler started with %d threads and %lu byte stacks\n", threads, sched->stack_size);
+    return sched;
+}
+
+void coro_scheduler_destroy(CoroScheduler * sched)
+{
+    pthread_mutex_lock(&sched->mutex);
+    sched->running = 0;
+    pthread_cond_broadcast(&sched->cond);
+    pthread_mutex_unlock(&sched->mutex);
+    _coro_wake_poller(sched);
+
+    for (int i = 0; i < sched->thread_count; i++)
+        pthread_join(sched->threads[i], NULL);
+
+    for (size_t i = 0; i < sched->pooled_stacks; i++)
+        munmap(sched->stacks[i], sched->stack_size + _coro_page_size());
+
+    close(sched->epoll_fd);
+    close(sched->wake_fd);
+    pthread_mutex_destroy(&sched->mutex);
+    pthread_cond_destroy(&sched->cond);
+    free(sched->threads);
+    free(sched);
+}
+
+pthread_t coro_scheduler_thread(CoroScheduler * sched, int index)
+{
+    assert(index >= 0 && index < sched->thread_count && "No such scheduler thread");
+    return sched->threads[index];
+}
+
+int coro_spawn(CoroScheduler * sched, void (*fn)(void *), void * arg)
+{
+    Coro * coro = calloc(1, sizeof(Coro));
+    coro->fn = fn;
+    coro->arg = arg;
+    coro->wait_fd = -1;
+    coro->registered_fd = -1;
+
+    pthread_mutex_lock(&sched->mutex);
+    coro->stack = _coro_stack_get(sched);
+    pthread_mutex_unlock(&sched->mutex);
+
+    if (coro->stack == NULL)
+    {
+        LOG_ERROR("Could not allocate a coroutine stack\n");
+        free(coro);
+        return 1;
+    }
+
+    size_t page = _coro_page_size();
+    getcontext(&coro->context);
+    coro->context.uc_stack.ss_sp = (char *) coro->stack + page;
+    coro->context.uc_stack.ss_size = sched->stack_size;
+    coro->context.uc_link = NULL;
+    makecontext(&coro->context, _coro_trampoline, 0);
+
+    pthread_mutex_lock(&sched->mutex);
+    sched->live++;
+    _coro_push(sched, coro);
+    int polling = sched->polling;
+    pthread_mutex_unlock(&sched->mutex);
+
+    // Every thread may be stuck polling, make sure someone picks it up
+    if (polling)
+        _coro_wake_poller(sched);
+    return 0;
+}
+
+void coro_wait_fd(int fd, int writing)
+{
+    struct CoroThread * thread = _coro_thread();
+    Coro * coro = thread->current;
+
+    if (coro == NULL)
+    {
+        struct pollfd pfd = { fd, writing ? POLLOUT : POLLIN, 0 };
+        poll(&pfd, 1, -1);
+        return;
+    }
+
+    coro->wait_fd = fd;
+    coro->wait_events = writing ? EPOLLOUT : EPOLLIN;
+    swapcontext(&coro->context, &thread->scheduler_context);
+    coro->wait_fd = -1;
+}
+
+void coro_yield(void)
+{
+    struct CoroThread * thread = _coro_thread();
+    Coro * coro = thread->current;
+
+    if (coro == NULL)
+    {
+        sched_yield();
+        return;
+    }
+
+    coro->yielding = 1;
+    swapcontext(&coro->context, &thread->scheduler_context);
+}
+
+void coro_trim_stack(void)
+{
+    size_t page = _coro_page_size();
+    Coro * coro = _coro_thread()->current;
+    uintptr_t low;
+
+    if (coro)
+        low = (uintptr_t) coro->stack + page;
+    else
+    {
+        pthread_attr_t attr;
+        void * addr;
+        size_t size;
+        if (pthread_getattr_np(pthread_self(), &attr) != 0)
+            return;
+        pthread_attr_getstack(&attr, &addr, &size);
+        pthread_attr_destroy(&attr);
+        low = (uintptr_t) addr;
+    }
+
+    // Pages below this frame are dead, but madvise itself needs a few bytes of stack
+    char here;
+    uintptr_t high = ((uintptr_t) &here - CORO_TRIM_MARGIN) & ~(uintptr_t) (page - 1);
+    if (high > low)
+        madvise((void *) low, high - low, MADV_DONTNEED);
+}
+
+void coro_stats(CoroScheduler * sched, size_t * live, size_t * queued, size_t * pooled_stacks)
+{
+    pthread_mutex_lock(&sched->mutex);
+    *live = sched->live;
+    *queued = sched->queued;
+    *pooled_stacks = sched->pooled_stacks;
+    pthread_mutex_unlock(&sched->mutex);
+}
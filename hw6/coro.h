@@ -0,0 +1,67 @@
+/*
+    Stackful coroutines scheduled M:N over a few OS threads.
+
+    Each coroutine runs on its own small stack, taken from a pool. When a
+    coroutine would block on a socket it parks itself with coro_wait_fd and
+    the OS thread moves on to another runnable coroutine. Parked coroutines
+    are woken up through epoll. Installing coro_wait_fd as the Rio wait hook
+    lets plain blocking-style code built on rio_readlineb/rio_writen run
+    unchanged inside a coroutine, as long as its descriptors are non-blocking.
+*/
+
+#ifndef CORO_H
+#define CORO_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define CORO_DEFAULT_STACK_SIZE (64 * 1024)
+
+typedef struct CoroScheduler CoroScheduler;
+
+/// Summary:
+///     Create a scheduler and start its OS threads
+/// Parameters:
+///     threads    : amount of OS threads running coroutines
+///     stack_size : size of every coroutine stack, in bytes
+/// Return:
+///     Scheduler object, or NULL if it could not be created
+CoroScheduler * coro_scheduler_create(int threads, size_t stack_size);
+
+/// Summary:
+///     Wait for every coroutine to finish, then stop the threads and free the scheduler
+void coro_scheduler_destroy(CoroScheduler * sched);
+
+/// Summary:
+///     OS thread of a scheduler, e.g. to pin it to a CPU
+/// Parameters:
+///     index : from 0 to the amount of threads given at creation, excluded
+pthread_t coro_scheduler_thread(CoroScheduler * sched, int index);
+
+/// Summary:
+///     Start a new coroutine running fn(arg)
+/// Return:
+///     0 on success, anything else if no stack could be allocated
+int coro_spawn(CoroScheduler * sched, void (*fn)(void *), void * arg);
+
+/// Summary:
+///     Suspend the current coroutine until fd is ready to read (or write). When
+///     called outside a coroutine it just blocks the calling thread until then.
+void coro_wait_fd(int fd, int writing);
+
+/// Summary:
+///     Let the other runnable coroutines run first, moving the current one to the
+///     back of the run queue. Outside a coroutine it yields the calling thread.
+void coro_yield(void);
+
+/// Summary:
+///     Give back to the kernel the stack pages below the caller's frame, left
+///     resident by deeper calls. Works on coroutine and thread stacks, for
+///     sessions about to wait idle for a long time.
+void coro_trim_stack(void);
+
+/// Summary:
+///     Amount of live coroutines, of those waiting in the run queue and of pooled stacks, for reports
+void coro_stats(CoroScheduler * sched, size_t * live, size_t * queued, size_t * pooled_stacks);
+
+#endif // CORO_H
@@ -23,6 +23,9 @@
  */
 /* $begin csapp.c */
 #include "csapp.h"
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 /************************** 
  * Error-handling functions
@@ -742,6 +745,20 @@ void V(sem_t *sem)
  * The Rio package - Robust I/O functions
  ****************************************/
 
+rio_wait_hook_t rio_wait_hook = NULL;
+
+/*
+ * rio_would_block - Wait for a non-blocking descriptor through
+ *    rio_wait_hook. Returns 1 if the operation should be retried.
+ */
+static int rio_would_block(int fd, int writing)
+{
+    if ((errno != EAGAIN && errno != EWOULDBLOCK) || rio_wait_hook == NULL)
+	return 0;
+    rio_wait_hook(fd, writing);
+    return 1;
+}
+
 /*
  * rio_readn - Robustly read n bytes (unbuffered)
  */
@@ -756,6 +773,8 @@ ssize_t rio_readn(int fd, void *usrbuf, size_t n)
 	if ((nread = read(fd, bufp, nleft)) < 0) {
 	    if (errno == EINTR) /* Interrupted by sig handler return */
 		nread = 0;      /* and call read() again */
+	    else if (rio_would_block(fd, 0))
+		nread = 0;      /* descriptor is ready now, read again */
 	    else
 		return -1;      /* errno set by read() */ 
 	} 
@@ -782,6 +801,8 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 	if ((nwritten = write(fd, bufp, nleft)) <= 0) {
 	    if (errno == EINTR)  /* Interrupted by sig handler return */
 		nwritten = 0;    /* and call write() again */
+	    else if (rio_would_block(fd, 1))
+		nwritten = 0;    /* descriptor is ready now, write again */
 	    else
 		return -1;       /* errno set by write() */
 	}
@@ -793,6 +814,28 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 /* $end rio_writen */
 
 
+/*
+ * rio_fill - Refill the internal buffer via a call to read() if it is
+ *    empty. Returns the number of unread bytes in the internal buffer,
+ *    0 on EOF and -1 on error.
+ */
+static ssize_t rio_fill(rio_t *rp)
+{
+    while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
+	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
+			   sizeof(rp->rio_buf));
+	if (rp->rio_cnt < 0) {
+	    if (errno != EINTR && !rio_would_block(rp->rio_fd, 0))
+		return -1;      /* not interrupted by sig handler nor would block */
+	}
+	else if (rp->rio_cnt == 0)  /* EOF */
+	    return 0;
+	else 
+	    rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
+    }
+    return rp->rio_cnt;
+}
+
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
@@ -805,19 +848,10 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 {
     int cnt;
+    ssize_t rc;
 
-    while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
-	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-			   sizeof(rp->rio_buf));
-	if (rp->rio_cnt < 0) {
-	    if (errno != EINTR) /* Interrupted by sig handler return */
-		return -1;
-	}
-	else if (rp->rio_cnt == 0)  /* EOF */
-	    return 0;
-	else 
-	    rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
-    }
+    if ((rc = rio_fill(rp)) <= 0)
+	return rc;
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;          
@@ -830,6 +864,33 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 }
 /* $end rio_read */
 
+/*
+ * rio_find_newline - Return a pointer to the first '\n' in the n bytes
+ *    at p, or NULL. Compares 32 (AVX2) or 16 (SSE2) bytes per step.
+ */
+static const char *rio_find_newline(const char *p, size_t n)
+{
+#if defined(__AVX2__)
+    const __m256i newline = _mm256_set1_epi8('\n');
+    for (; n >= 32; p += 32, n -= 32) {
+	unsigned mask = (unsigned)_mm256_movemask_epi8(
+	    _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), newline));
+	if (mask)
+	    return p + __builtin_ctz(mask);
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i newline16 = _mm_set1_epi8('\n');
+    for (; n >= 16; p += 16, n -= 16) {
+	unsigned mask = (unsigned)_mm_movemask_epi8(
+	    _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), newline16));
+	if (mask)
+	    return p + __builtin_ctz(mask);
+    }
+#endif
+    return memchr(p, '\n', n);
+}
+
 /*
  * rio_readinitb - Associate a descriptor with a read buffer and reset buffer
  */
@@ -865,31 +926,96 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 /* $end rio_readnb */
 
 /* 
- * rio_readlineb - Robustly read a text line (buffered)
+ * rio_readlineb - Robustly read a text line (buffered). The newline is
+ *    searched for across all buffered bytes at once and the line is
+ *    copied out in chunks, instead of one rio_read() per byte.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
-            }
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
+    size_t n = 0;
+    ssize_t rc;
+    char *bufp = usrbuf;
+
+    while (n + 1 < maxlen) {
+	if ((rc = rio_fill(rp)) < 0)
 	    return -1;	  /* Error */
+	if (rc == 0)
+	    break;        /* EOF */
+
+	/* Copy up to (and including) the newline, without overflowing usrbuf */
+	size_t cnt = rp->rio_cnt;
+	if (cnt > maxlen - 1 - n)
+	    cnt = maxlen - 1 - n;
+	const char *newline = rio_find_newline(rp->rio_bufptr, cnt);
+	if (newline)
+	    cnt = newline - rp->rio_bufptr + 1;
+
+	memcpy(bufp + n, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	n += cnt;
+	if (newline)
+	    break;
+    }
+    if (maxlen > 0)
+	bufp[n] = 0;
+    return n;
+}
+/* $end rio_readlineb */
+
+/*
+ * rio_readline_view - Read a text line (buffered) without copying it.
+ *    On success *line points to the line inside the internal buffer,
+ *    including the newline (no null terminator), and stays valid until
+ *    the next call on rp. A line longer than RIO_BUFSIZE is returned in
+ *    RIO_BUFSIZE pieces. Returns the line length, 0 on EOF, -1 on error.
+ */
+ssize_t rio_readline_view(rio_t *rp, char **line)
+{
+    size_t scanned = 0;   /* bytes already known not to contain a newline */
+
+    for (;;) {
+	if (rp->rio_cnt > 0) {
+	    const char *newline = rio_find_newline(rp->rio_bufptr + scanned, rp->rio_cnt - scanned);
+	    size_t cnt = newline ? (size_t)(newline - rp->rio_bufptr + 1) : (size_t)rp->rio_cnt;
+
+	    if (newline || cnt == sizeof(rp->rio_buf)) {
+		*line = rp->rio_bufptr;
+		rp->rio_bufptr += cnt;
+		rp->rio_cnt -= cnt;
+		return cnt;
+	    }
+	    scanned = cnt;
+
+	    /* Partial line: move it to the front to make room for the rest */
+	    if (rp->rio_bufptr != rp->rio_buf) {
+		memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+		rp->rio_bufptr = rp->rio_buf;
+	    }
+	}
+	else {
+	    rp->rio_bufptr = rp->rio_buf;
+	    rp->rio_cnt = 0;
+	}
+
+	ssize_t nread = read(rp->rio_fd, rp->rio_bufptr + rp->rio_cnt,
+			     sizeof(rp->rio_buf) - rp->rio_cnt);
+	if (nread < 0) {
+	    if (errno != EINTR && !rio_would_block(rp->rio_fd, 0))
+		return -1;
+	}
+	else if (nread == 0) {
+	    /* EOF: whatever is left is the last line */
+	    size_t cnt = rp->rio_cnt;
+	    *line = rp->rio_bufptr;
+	    rp->rio_bufptr += cnt;
+	    rp->rio_cnt = 0;
+	    return cnt;
+	}
+	else
+	    rp->rio_cnt += nread;
     }
-    *bufp = 0;
-    return n-1;
 }
 /* $end rio_readlineb */
 
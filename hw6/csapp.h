@@ -173,11 +173,22 @@ void P(sem_t *sem);
 void V(sem_t *sem);
 
 /* Rio (Robust I/O) package */
+
+/*
+ * If set, called by the Rio functions when a non-blocking descriptor
+ * would block (writing is nonzero when waiting to write). A user level
+ * scheduler can use it to park the caller until fd is ready; the
+ * operation is retried when the hook returns.
+ */
+typedef void (*rio_wait_hook_t)(int fd, int writing);
+extern rio_wait_hook_t rio_wait_hook;
+
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd); 
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t	rio_readline_view(rio_t *rp, char **line);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
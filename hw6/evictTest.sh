@@ -0,0 +1,85 @@
+#!/bin/bash
+#
+# Expiration and eviction test: variables assigned with "ttl <seconds>"
+# read as undefined once expired and are reclaimed in the background even
+# if nobody touches them again, and with --max-memory the variable table
+# stops growing and evicts instead.
+#
+
+PORT=16100
+REPL=$((PORT + 2))
+REPLICA=$((PORT + 3))
+DIR=$(mktemp -d /tmp/calcEvict.XXXXXX)
+. ./testlib.sh "$@"
+
+cleanup() {
+	stop_all
+	rm -rf "$DIR"
+}
+
+# a field of the table line of the "memory" command
+memory() {
+	ask $PORT "memory" | grep '^table_bytes=' | tr ' ' '\n' | grep "^$1=" | cut -d= -f2
+}
+
+start --metrics-port $((PORT + 1))
+check testAssignTtl "$(printf '5\n6\n5\n6')" "$(ask $PORT "a = 5 ttl 1" "b = a + 1 ttl 60" "a" "b")"
+check testInvalidTtl "Error" "$(ask $PORT "c = 1 ttl 0" | cut -d' ' -f1)"
+check testCompoundKeepsTtl "$(printf '6\n7')" "$(ask $PORT "a += 1" "b += 1")"
+sleep 1.2
+check testExpired "$(printf 'Error\n7')" "$(ask $PORT "a" "b" | cut -d' ' -f1)"
+check testReassigned "$(printf '1\n1')" "$(ask $PORT "a = 1" "a")"
+
+# never read again, removed by the background sweep alone, plus the first a
+lines=()
+for i in $(seq 1 50); do lines+=("v$(printf '%s' $i | tr 0-9 a-j) = $i ttl 1"); done
+ask $PORT "${lines[@]}" > /dev/null
+sleep 1.5
+check testSwept "51" "$(memory expired)"
+check testExpiredMetric "calc_expired_total 51" "$(scrape $((PORT + 1)) | grep '^calc_expired_total')"
+
+# namespaces are swept too
+ask $PORT "use tenant" "x = 1 ttl 1" "y = 2" > /dev/null
+sleep 1.5
+check testNamespaceSwept "1" "$(ask $PORT "namespaces" | grep -c '^tenant variables=1 ')"
+stop
+
+# the default table has 16 slots to start with and can't double
+start --max-memory 1000
+lines=()
+for i in $(seq 1 100); do lines+=("v$(printf '%s' $i | tr 0-9 a-j) = $i"); done
+check testEvictedNotRefused "0" "$(ask $PORT "${lines[@]}" | grep -c Error)"
+check testLastKept "100" "$(ask $PORT "vbaa")"
+check testTableCapped "$(memory max_memory)" "$(( $(memory table_bytes) <= 1000 ? 1000 : 0 ))"
+evicted=$(memory evicted)
+check testEvicted "1" "$(( evicted >= 88 && evicted < 100 ))"
+stop
+
+# removals are logged and replicated like assignments
+start --wal "$DIR/expire.wal" --repl-port $REPL
+primary=$pid
+start_on $REPLICA --replica-of 127.0.0.1:$REPL
+ask $PORT "a = 1 ttl 1" "b = 2" > /dev/null
+sleep 0.3
+check testReplicated "1 2" "$(ask $REPLICA "mget a b")"
+sleep 1.5
+check testExpiryReplicated "? 2" "$(ask $REPLICA "mget a b")"
+stop
+pid=$primary
+crash
+start --wal "$DIR/expire.wal"
+check testExpiryReplayed "? 2" "$(ask $PORT "mget a b")"
+stop
+
+names=()
+for i in $(seq 1 100); do names+=("v$(printf '%s' $i | tr 0-9 a-j)"); done
+start --wal "$DIR/evict.wal" --max-memory 1000
+ask $PORT "${lines[@]}" > /dev/null
+kept=$(ask $PORT "mget ${names[*]}")
+sleep 0.2
+crash
+start --wal "$DIR/evict.wal"
+check testEvictionsReplayed "$kept" "$(ask $PORT "mget ${names[*]}")"
+stop
+
+finish
@@ -0,0 +1,69 @@
+#include "expire.h"
+#include "logger.h"
+#include <pthread.h>
+#include <time.h>
+
+static pthread_mutex_t _expire_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _expire_stopped = PTHREAD_COND_INITIALIZER;
+static pthread_t _expire_thread;
+static int _expire_running = 0;
+static unsigned _expire_interval_ms = EXPIRE_DEFAULT_INTERVAL_MS;
+static expire_tick_fn _expire_tick = NULL;
+static void * _expire_ctx = NULL;
+
+static void * _expire_main(void * args)
+{
+    (void) args;
+    pthread_mutex_lock(&_expire_mutex);
+
+    while (_expire_running)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long) (_expire_interval_ms % 1000) * 1000000;
+        deadline.tv_sec += _expire_interval_ms / 1000 + deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&_expire_stopped, &_expire_mutex, &deadline);
+        if (!_expire_running)
+            break;
+
+        // The tick takes the calculator locks, stopping must not wait behind them
+        pthread_mutex_unlock(&_expire_mutex);
+        for (int round = 0; round < EXPIRE_MAX_ROUNDS && _expire_tick(_expire_ctx); round++)
+            ;
+        pthread_mutex_lock(&_expire_mutex);
+    }
+
+    pthread_mutex_unlock(&_expire_mutex);
+    return NULL;
+}
+
+// -- < Implementation > ---------------------------------------------------------
+
+int expire_start(unsigned interval_ms, expire_tick_fn tick, void * ctx)
+{
+    _expire_interval_ms = interval_ms > 0 ? interval_ms : 1;
+    _expire_tick = tick;
+    _expire_ctx = ctx;
+    _expire_running = 1;
+
+    if (pthread_create(&_expire_thread, NULL, _expire_main, NULL) != 0)
+    {
+        LOG_ERROR("Could not start the expiration thread\n");
+        _expire_running = 0;
+        return 1;
+    }
+    return 0;
+}
+
+void expire_stop(void)
+{
+    pthread_mutex_lock(&_expire_mutex);
+    int running = _expire_running;
+    _expire_running = 0;
+    pthread_cond_signal(&_expire_stopped);
+    pthread_mutex_unlock(&_expire_mutex);
+
+    if (running)
+        pthread_join(_expire_thread, NULL);
+}
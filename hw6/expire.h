@@ -0,0 +1,39 @@
+/*
+    Incremental removal of expired variables.
+
+    A variable given a TTL reads as undefined as soon as it expires, but
+    its slot is only reclaimed when a write finds it. A variable nobody
+    touches again would stay forever, so a background thread calls a
+    tick function once per interval. The tick removes expired variables
+    from a bounded amount of slots, continuing where the previous one
+    stopped, and tells if it found many: the thread then runs it again at
+    once, so a burst of expirations is cleared quickly while the lock the
+    tick takes is never held for a full scan of the table.
+*/
+
+#ifndef EXPIRE_H
+#define EXPIRE_H
+
+#define EXPIRE_DEFAULT_INTERVAL_MS 100  // Time between two ticks
+#define EXPIRE_MAX_ROUNDS 16            // Ticks run back to back before waiting again
+#define EXPIRE_TICK_SLOTS 1024          // Slots of a calculator looked at by one tick
+#define EXPIRE_REPEAT_PERCENT 25        // Expired share of those slots for another tick at once
+
+/// Removes expired variables from a few slots, returns nonzero to be called again at once
+typedef int (*expire_tick_fn)(void * ctx);
+
+/// Summary:
+///     Start the expiration thread
+/// Parameters:
+///     interval_ms : how often tick runs
+///     tick        : removes expired variables, must be thread safe
+///     ctx         : passed to tick
+/// Return:
+///     0 on success, anything else if the thread could not be started
+int expire_start(unsigned interval_ms, expire_tick_fn tick, void * ctx);
+
+/// Summary:
+///     Stop the expiration thread
+void expire_stop(void);
+
+#endif // EXPIRE_H
@@ -0,0 +1,227 @@
+/*
+	Turn a binary log written by the LOG_* macros (see logger_open_binary)
+	back into text.
+
+	Usage: logdecode <binary log> [-n]
+	  -n : don't color the output
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "colors.h"
+#include "logger.h"
+
+#define MAX_SITES 4096
+#define MAX_FIELD 4096
+
+struct Site
+{
+	int defined;
+	int level;
+	unsigned line;
+	char * file;
+	char * fmt;
+};
+
+static struct Site sites[MAX_SITES];
+static const char * colors[] = { WHITE, GREEN, YELLLOW, RED };
+
+static int read_exact(FILE * in, void * buf, size_t size)
+{
+	return fread(buf, 1, size, in) == size;
+}
+
+static char * read_string(FILE * in, size_t length)
+{
+	char * str = malloc(length + 1);
+	if (!read_exact(in, str, length))
+	{
+		free(str);
+		return NULL;
+	}
+	str[length] = '\0';
+	return str;
+}
+
+// Take an 8 byte argument from the payload, 0 if it ran out (the message was truncated)
+static int64_t take_value(const char ** p, const char * end)
+{
+	int64_t value = 0;
+	if (end - *p >= (long) sizeof(value))
+		memcpy(&value, *p, sizeof(value));
+	*p += sizeof(value);
+	return value;
+}
+
+// Print a message, re-applying every conversion of its format to the raw arguments
+static void print_message(FILE * out, const char * fmt, const char * p, const char * end)
+{
+	struct LogSpec spec;
+	const char * next;
+	char conversion[64];
+
+	while ((next = logger_next_spec(fmt, &spec)) != NULL)
+	{
+		fwrite(fmt, 1, spec.start - fmt, out);
+		fmt = next;
+
+		if (spec.type == LOG_ARG_NONE)
+		{
+			if (spec.length == 2 && spec.start[1] == '%')
+				fputc('%', out);
+			continue;
+		}
+
+		int stars[2] = { 0, 0 };
+		for (int i = 0; i < spec.stars && i < 2; i++)
+			stars[i] = (int) take_value(&p, end);
+
+		size_t length = spec.length < sizeof(conversion) ? spec.length : sizeof(conversion) - 1;
+		memcpy(conversion, spec.start, length);
+		conversion[length] = '\0';
+
+		if (spec.type == LOG_ARG_STRING)
+		{
+			uint16_t str_length = 0;
+			if (end - p >= (long) sizeof(str_length))
+				memcpy(&str_length, p, sizeof(str_length));
+			p += sizeof(str_length);
+
+			char * str = strndup(p < end ? p : end, p < end && end - p < str_length ? (size_t) (end - p) : str_length);
+			p += str_length;
+			if (spec.stars == 0)
+				fprintf(out, conversion, str);
+			else if (spec.stars == 1)
+				fprintf(out, conversion, stars[0], str);
+			else
+				fprintf(out, conversion, stars[0], stars[1], str);
+			free(str);
+			continue;
+		}
+
+		int64_t value = take_value(&p, end);
+		double real;
+		memcpy(&real, &value, sizeof(real));
+
+		// The conversion is the original one from the format, the compiler checked it against these types
+		switch (spec.type)
+		{
+		case LOG_ARG_INT:
+			if (spec.stars == 0) fprintf(out, conversion, (int) value);
+			else if (spec.stars == 1) fprintf(out, conversion, stars[0], (int) value);
+			else fprintf(out, conversion, stars[0], stars[1], (int) value);
+			break;
+		case LOG_ARG_LONG:
+			if (spec.stars == 0) fprintf(out, conversion, (long) value);
+			else if (spec.stars == 1) fprintf(out, conversion, stars[0], (long) value);
+			else fprintf(out, conversion, stars[0], stars[1], (long) value);
+			break;
+		case LOG_ARG_DOUBLE:
+			if (spec.stars == 0) fprintf(out, conversion, real);
+			else if (spec.stars == 1) fprintf(out, conversion, stars[0], real);
+			else fprintf(out, conversion, stars[0], stars[1], real);
+			break;
+		case LOG_ARG_POINTER:
+			fprintf(out, conversion, (void *) (intptr_t) value);
+			break;
+		default:
+			break;
+		}
+	}
+	fputs(fmt, out);
+}
+
+int main(int argc, char ** argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <binary log> [-n]\n", argv[0]);
+		return 1;
+	}
+	int color = !(argc > 2 && strcmp(argv[2], "-n") == 0);
+
+	FILE * in = fopen(argv[1], "rb");
+	if (in == NULL)
+	{
+		perror("Could not open the log");
+		return 1;
+	}
+
+	struct LogBinaryHeader header;
+	if (!read_exact(in, &header, sizeof(header)) || memcmp(header.magic, LOGGER_BINARY_MAGIC, sizeof(header.magic)) != 0)
+	{
+		fprintf(stderr, "Not a binary log\n");
+		return 1;
+	}
+	if (header.version != LOGGER_BINARY_VERSION)
+	{
+		fprintf(stderr, "Unsupported binary log version %u\n", header.version);
+		return 1;
+	}
+
+	char payload[MAX_FIELD];
+	uint8_t type;
+	while (read_exact(in, &type, sizeof(type)))
+	{
+		uint32_t id;
+		if (!read_exact(in, &id, sizeof(id)) || id >= MAX_SITES)
+			break;
+
+		if (type == LOG_ENTRY_FORMAT)
+		{
+			uint8_t level;
+			uint32_t line;
+			uint16_t file_length, fmt_length;
+			if (!read_exact(in, &level, sizeof(level)) || !read_exact(in, &line, sizeof(line)) ||
+				!read_exact(in, &file_length, sizeof(file_length)) || !read_exact(in, &fmt_length, sizeof(fmt_length)))
+				break;
+
+			struct Site * site = &sites[id];
+			site->level = level < 4 ? level : 0;
+			site->line = line;
+			site->file = read_string(in, file_length);
+			site->fmt = read_string(in, fmt_length);
+			if (site->file == NULL || site->fmt == NULL)
+				break;
+			site->defined = 1;
+		}
+		else if (type == LOG_ENTRY_MESSAGE)
+		{
+			uint64_t ticks;
+			uint16_t length;
+			if (!read_exact(in, &ticks, sizeof(ticks)) || !read_exact(in, &length, sizeof(length)) ||
+				length > sizeof(payload) || !read_exact(in, payload, length))
+				break;
+
+			struct Site * site = &sites[id];
+			if (!site->defined)
+			{
+				fprintf(stderr, "Message for unknown call site %u\n", id);
+				continue;
+			}
+
+			// Ticks are relative to the header, which pins them to the wall clock
+			int64_t ns = header.base_time_ns + (int64_t) ((int64_t) (ticks - header.base_ticks) / header.ticks_per_ns);
+			time_t seconds = ns / 1000000000LL;
+			struct tm info;
+			char time_str[32];
+			localtime_r(&seconds, &info);
+			strftime(time_str, sizeof(time_str), "%d-%m-%Y %H:%M:%S", &info);
+
+			printf("%s[%s.%06ld] %s:%u ", color ? colors[site->level] : "", time_str,
+				   (long) (ns % 1000000000LL) / 1000, site->file, site->line);
+			print_message(stdout, site->fmt, payload, payload + length);
+			if (color)
+				fputs(RESET, stdout);
+		}
+		else
+		{
+			fprintf(stderr, "Corrupted log entry\n");
+			return 1;
+		}
+	}
+
+	fclose(in);
+	return 0;
+}
@@ -1,23 +1,113 @@
+
 #include "logger.h"
 #include "assert.h"
 #include "colors.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define LOGGER_RING_SIZE (64 * 1024)        // Bytes of pending records per thread, power of two
+#define LOGGER_MAX_MESSAGE 1024             // Longer messages are truncated
+#define LOGGER_BATCH_SIZE (64 * 1024)       // Formatted output gathered before each write
+#define LOGGER_IDLE_WAIT_MS 10              // Writer sleep when every ring is empty
+#define LOGGER_RECORD_PADDING -1            // Record level marking the unused end of a ring
+#define LOGGER_MAX_SITES 4096               // LOG_* call sites registered for the binary format
+#define LOGGER_CALIBRATION_NS 20000000L     // Time spent measuring the timestamp counter rate
+
+/// Header of a message in a ring, followed by the message bytes
+struct LogRecord
+{
+    uint32_t size;                  // Bytes taken in the ring, header included, multiple of 8
+    int32_t level;                  // LogLevel, or LOGGER_RECORD_PADDING
+    int64_t time;                   // Seconds for text, timestamp counter for binary records
+    uint32_t length;
+    uint32_t site;                  // Call site id + 1 for binary records, 0 for text
+};
+
+/// A registered LOG_* call site
+struct LogSite
+{
+    const char * file;
+    const char * fmt;
+    int line;
+    int level;
+};
+
+/// Single producer, single consumer ring of records. The owning thread only
+/// moves head and the writer thread only moves tail, so no lock is needed.
+struct LogRing
+{
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    atomic_int closed;              // Owning thread exited, free once drained
+    struct LogRing * next;          // Registry link, protected by the registry mutex
+    char data[LOGGER_RING_SIZE];
+};
 
 // Logger struct definition
 typedef struct Logger {
     FILE * io_stream;
     FILE * error_io_stream;
 
+    pthread_t writer;
+    pthread_mutex_t wake_mutex;
+    pthread_cond_t wake;            // Signaled to make the writer drain right away
+    atomic_int running;
+    atomic_int policy;
+    atomic_size_t dropped;
+
+    FILE * binary_stream;           // Binary log, NULL when logging text
+    int sites_written;              // Format entries already in the binary log
+
 } Logger;
 
-// Logger instance definition
+// Logger instance definition. The storage is static so a thread still logging
+// while the Logger is destroyed never touches freed memory
+static Logger _logger_instance;
 static Logger * _logger = NULL;
 
+// Every thread ring, rings outlive a Logger so threads can keep using theirs
+static pthread_mutex_t _logger_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct LogRing * _logger_rings = NULL;
+static pthread_key_t _logger_ring_key;
+static pthread_once_t _logger_ring_key_once = PTHREAD_ONCE_INIT;
+static __thread struct LogRing * _logger_ring = NULL;
+
+int logger_level = LOG_LEVEL_TRACE;
+
+// Registered call sites, entries never change once published through the count
+static pthread_mutex_t _logger_sites_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct LogSite _logger_sites[LOGGER_MAX_SITES];
+static atomic_int _logger_site_count = 0;
+static atomic_int _logger_binary = 0;
+
+// Forward declaration for utility functions
+void * _logger_writer_main(void * args);
+size_t _logger_drain(Logger * logger, char * batch);
+void _logger_enqueue(Logger * logger, int level, uint32_t site, int64_t time, const char * msg, size_t length);
+void _logger_write_now(int level, const char * msg, size_t length);
+void _logger_vlog(enum LogLevel level, const char * fmt, va_list args);
+int _logger_register_site(int * site, enum LogLevel level, const char * file, int line, const char * fmt);
+size_t _logger_encode_args(const char * fmt, va_list args, char * buf, size_t size);
+uint64_t _logger_ticks(void);
+
 Logger * _new_logger(FILE * io_stream, FILE * error_io_stream)
 {
-    Logger * logger = malloc(sizeof(Logger));
+    Logger * logger = &_logger_instance;
+    memset(logger, 0, sizeof(Logger));
     logger -> error_io_stream = error_io_stream;
     logger -> io_stream = io_stream;
+    logger -> running = 1;
+    logger -> policy = LOGGER_FULL_BLOCK;
+    pthread_mutex_init(&logger->wake_mutex, NULL);
+    pthread_cond_init(&logger->wake, NULL);
+    pthread_create(&logger->writer, NULL, _logger_writer_main, logger);
     return logger;
 }
 
@@ -34,87 +124,606 @@ Logger * logger_get()
 // Destroy logger instance
 void logger_destroy()
 {
-    free(_logger);
+    Logger * logger = _logger;
+    if (logger == NULL)
+        return;
+
+    // The writer drains every ring once more before leaving
+    atomic_store(&logger->running, 0);
+    pthread_mutex_lock(&logger->wake_mutex);
+    pthread_cond_signal(&logger->wake);
+    pthread_mutex_unlock(&logger->wake_mutex);
+    pthread_join(logger->writer, NULL);
+
+    if (logger->binary_stream)
+    {
+        atomic_store(&_logger_binary, 0);
+        fclose(logger->binary_stream);
+    }
     _logger = NULL;
 }
 
-// Forward declaration for utility functions
-char * _logger_create_color_str(const char *msg, const char * ansi_color);
-void _logger_log_err(const char * msg);
-void _logger_log_msg(const char * msg);
+// Queue a formatted message
+void logger_log(enum LogLevel level, const char * fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    _logger_vlog(level, fmt, args);
+    va_end(args);
+}
 
-// log a warn message
-void logger_warn(const char * msg) 
-{   
-    char * new_msg = _logger_create_color_str(msg, YELLLOW);    
-    _logger_log_err(new_msg);
+// Queue a message from a LOG_* call site
+void logger_log_site(int * site, enum LogLevel level, const char * file, int line, const char * fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+
+    Logger * logger = _logger;
+    if (!atomic_load_explicit(&_logger_binary, memory_order_relaxed) || logger == NULL)
+    {
+        _logger_vlog(level, fmt, args);
+        va_end(args);
+        return;
+    }
+
+    // Registered once per site, the id is kept in the site static variable
+    int id = __atomic_load_n(site, __ATOMIC_ACQUIRE) - 1;
+    if (id < 0)
+        id = _logger_register_site(site, level, file, line, fmt);
+
+    if (id < 0)
+        _logger_vlog(level, fmt, args);
+    else
+    {
+        char payload[LOGGER_MAX_MESSAGE];
+        size_t length = _logger_encode_args(fmt, args, payload, sizeof(payload));
+        _logger_enqueue(logger, level, id + 1, _logger_ticks(), payload, length);
+    }
+    va_end(args);
+}
+
+void logger_set_level(enum LogLevel level)
+{
+    logger_level = level;
+}
+
+int logger_open_binary(const char * path)
+{
+    Logger * logger = logger_get();
+    FILE * stream = fopen(path, "wb");
+    if (stream == NULL)
+        return 1;
+
+    // Measure the timestamp counter against the wall clock, the decoder turns ticks back into time
+    struct timespec start_time, end_time, pause = { 0, LOGGER_CALIBRATION_NS };
+    clock_gettime(CLOCK_REALTIME, &start_time);
+    uint64_t start_ticks = _logger_ticks();
+    nanosleep(&pause, NULL);
+    clock_gettime(CLOCK_REALTIME, &end_time);
+    uint64_t end_ticks = _logger_ticks();
+
+    int64_t start_ns = start_time.tv_sec * 1000000000LL + start_time.tv_nsec;
+    int64_t end_ns = end_time.tv_sec * 1000000000LL + end_time.tv_nsec;
+
+    struct LogBinaryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LOGGER_BINARY_MAGIC, sizeof(header.magic));
+    header.version = LOGGER_BINARY_VERSION;
+    header.base_ticks = start_ticks;
+    header.base_time_ns = start_ns;
+    header.ticks_per_ns = (double) (end_ticks - start_ticks) / (end_ns - start_ns);
+
+    if (fwrite(&header, sizeof(header), 1, stream) != 1)
+    {
+        fclose(stream);
+        return 1;
+    }
+
+    // Only the writer thread touches the stream once binary mode is on
+    logger->binary_stream = stream;
+    atomic_store(&_logger_binary, 1);
+    return 0;
+}
+
+const char * logger_next_spec(const char * fmt, struct LogSpec * spec)
+{
+    const char * p = strchr(fmt, '%');
+    if (p == NULL)
+        return NULL;
+
+    spec->start = p++;
+    spec->stars = 0;
+    spec->type = LOG_ARG_NONE;
+
+    while (*p && strchr("-+ #0'", *p))
+        p++;
+    for (; *p == '*' || (*p >= '0' && *p <= '9'); p++)
+        spec->stars += *p == '*';
+    if (*p == '.')
+        for (p++; *p == '*' || (*p >= '0' && *p <= '9'); p++)
+            spec->stars += *p == '*';
+
+    int wide = 0;
+    while (*p && strchr("hlLqjzt", *p))
+        wide |= *p++ != 'h';
+
+    if (*p == '\0')
+    {
+        spec->length = p - spec->start;
+        return p;
+    }
+
+    if (strchr("diouxXc", *p))
+        spec->type = wide ? LOG_ARG_LONG : LOG_ARG_INT;
+    else if (strchr("feEgGaAF", *p))
+        spec->type = LOG_ARG_DOUBLE;
+    else if (*p == 's')
+        spec->type = LOG_ARG_STRING;
+    else if (*p == 'p')
+        spec->type = LOG_ARG_POINTER;
+
+    spec->length = ++p - spec->start;
+    return p;
+}
+
+pthread_t logger_writer_thread()
+{
+    return logger_get()->writer;
+}
+
+void logger_set_full_policy(enum LoggerFullPolicy policy)
+{
+    atomic_store(&logger_get()->policy, policy);
+}
+
+size_t logger_dropped()
+{
+    return _logger ? atomic_load(&_logger->dropped) : 0;
+}
 
-    free(new_msg);
+// log a warn message
+void logger_warn(const char * msg)
+{
+    logger_log(LOG_LEVEL_WARN, "%s", msg);
 }
 
 // Log an info message
 void logger_info(const char * msg)
 {
-    char * new_msg = _logger_create_color_str(msg, GREEN);    
-    _logger_log_msg(new_msg);
-
-    free(new_msg);
+    logger_log(LOG_LEVEL_INFO, "%s", msg);
 }
 
 // Log an error message
-void logger_error(const char * msg) 
-{ 
-    char * new_msg = _logger_create_color_str(msg, RED);    
-    
-    _logger_log_err(new_msg);
-
-    free(new_msg);
+void logger_error(const char * msg)
+{
+    logger_log(LOG_LEVEL_ERROR, "%s", msg);
 }
 
 // Log a regular message message
 void logger_trace(const char * msg)
-{ 
-    char * new_msg = _logger_create_color_str(msg, WHITE);    
-    _logger_log_msg(new_msg);
-    
-
-    free(new_msg);
+{
+    logger_log(LOG_LEVEL_TRACE, "%s", msg);
 }
 
 // -- < Utility functions > ------------------------------------------------------
 
-// Create a new color string
-char * _logger_create_color_str(const char *msg, const char * ansi_color)
+static const char * _logger_colors[] = { WHITE, GREEN, YELLLOW, RED };
+
+static size_t _logger_align(size_t size)
 {
-    size_t new_size = strlen(msg) + 100;
-    char * new_msg = (char *) malloc( (size_t) sizeof(char) * new_size);
-    
-    // Get time to print in format
-    time_t rawtime;
-    struct tm info;
-    char  time_str[100];
+    return (size + 7) & ~(size_t) 7;
+}
+
+// Called when a thread exits, its ring is freed by the writer once drained
+void _logger_ring_release(void * ptr)
+{
+    struct LogRing * ring = ptr;
+    atomic_store_explicit(&ring->closed, 1, memory_order_release);
+}
 
-    time(&rawtime);
+void _logger_ring_key_create(void)
+{
+    pthread_key_create(&_logger_ring_key, _logger_ring_release);
+}
+
+// Ring of the calling thread, registered on first use
+struct LogRing * _logger_thread_ring(void)
+{
+    if (_logger_ring)
+        return _logger_ring;
 
-    localtime_r(&rawtime, &info);
+    struct LogRing * ring = aligned_alloc(_Alignof(struct LogRing), sizeof(struct LogRing));
+    if (ring == NULL)
+        return NULL;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->closed, 0);
 
-    strftime(time_str, 100, "[%d-%m-%Y %H:%M:%S]", &info); 
+    pthread_once(&_logger_ring_key_once, _logger_ring_key_create);
+    pthread_setspecific(_logger_ring_key, ring);
 
-    sprintf(new_msg, "%s%s %s%s", ansi_color, time_str, msg ,RESET);
-    return new_msg;
+    pthread_mutex_lock(&_logger_rings_mutex);
+    ring->next = _logger_rings;
+    _logger_rings = ring;
+    pthread_mutex_unlock(&_logger_rings_mutex);
+
+    _logger_ring = ring;
+    return ring;
+}
+
+// A binary record can't be written as text, count it as dropped instead
+static void _logger_give_up(Logger * logger, int level, uint32_t site, const char * msg, size_t length)
+{
+    if (site)
+        atomic_fetch_add_explicit(&logger->dropped, 1, memory_order_relaxed);
+    else
+        _logger_write_now(level, msg, length);
+}
+
+// Copy a message into the calling thread ring, this is all the request path pays for
+void _logger_enqueue(Logger * logger, int level, uint32_t site, int64_t time, const char * msg, size_t length)
+{
+    struct LogRing * ring = _logger_thread_ring();
+    if (ring == NULL)
+    {
+        _logger_give_up(logger, level, site, msg, length);
+        return;
+    }
+
+    size_t need = _logger_align(sizeof(struct LogRecord) + length);
+    for (;;)
+    {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        size_t offset = head & (LOGGER_RING_SIZE - 1);
+        size_t contiguous = LOGGER_RING_SIZE - offset;
+
+        // Records never wrap, the end of the ring is skipped with a padding record instead
+        size_t total = need <= contiguous ? need : contiguous + need;
+        if (LOGGER_RING_SIZE - (head - tail) >= total)
+        {
+            if (need > contiguous)
+            {
+                struct LogRecord * padding = (struct LogRecord *) (ring->data + offset);
+                padding->size = contiguous;
+                padding->level = LOGGER_RECORD_PADDING;
+                offset = 0;
+            }
+
+            struct LogRecord * record = (struct LogRecord *) (ring->data + offset);
+            record->size = need;
+            record->level = level;
+            record->time = time;
+            record->length = length;
+            record->site = site;
+            memcpy(record + 1, msg, length);
+
+            atomic_store_explicit(&ring->head, head + total, memory_order_release);
+            return;
+        }
+
+        if (atomic_load_explicit(&logger->policy, memory_order_relaxed) == LOGGER_FULL_DROP)
+        {
+            atomic_fetch_add_explicit(&logger->dropped, 1, memory_order_relaxed);
+            return;
+        }
+
+        if (!atomic_load_explicit(&logger->running, memory_order_relaxed))
+        {
+            _logger_give_up(logger, level, site, msg, length);
+            return;
+        }
+
+        // Ring is full: hurry the writer up and wait for it to make room
+        pthread_mutex_lock(&logger->wake_mutex);
+        pthread_cond_signal(&logger->wake);
+        pthread_mutex_unlock(&logger->wake_mutex);
+        sched_yield();
+    }
+}
+
+// Append one colored, timestamped line to the batch, returns its new length
+size_t _logger_format(char * batch, size_t len, int level, time_t when, const char * msg, size_t length)
+{
+    // Every line in a burst shares the same second, format it once
+    static __thread time_t cached_time = -1;
+    static __thread char time_str[32];
+
+    if (when != cached_time)
+    {
+        struct tm info;
+        localtime_r(&when, &info);
+        strftime(time_str, sizeof(time_str), "[%d-%m-%Y %H:%M:%S]", &info);
+        cached_time = when;
+    }
+
+    return len + snprintf(batch + len, LOGGER_BATCH_SIZE - len, "%s%s %.*s%s",
+                          _logger_colors[level], time_str, (int) length, msg, RESET);
+}
+
+// Longest line _logger_format can produce
+static size_t _logger_max_line(void)
+{
+    return LOGGER_MAX_MESSAGE + 64;
+}
+
+void _logger_flush(Logger * logger, char * batch, size_t len)
+{
+    if (len == 0)
+        return;
+    fwrite(batch, 1, len, logger->io_stream);
+    fflush(logger->io_stream);
+}
+
+// Write the format entries of the sites registered since the last call
+static void _logger_write_sites(Logger * logger)
+{
+    int count = atomic_load_explicit(&_logger_site_count, memory_order_acquire);
+    for (; logger->sites_written < count; logger->sites_written++)
+    {
+        struct LogSite * site = &_logger_sites[logger->sites_written];
+        uint8_t type = LOG_ENTRY_FORMAT, level = site->level;
+        uint32_t id = logger->sites_written, line = site->line;
+        uint16_t file_length = strlen(site->file), fmt_length = strlen(site->fmt);
+
+        fwrite(&type, sizeof(type), 1, logger->binary_stream);
+        fwrite(&id, sizeof(id), 1, logger->binary_stream);
+        fwrite(&level, sizeof(level), 1, logger->binary_stream);
+        fwrite(&line, sizeof(line), 1, logger->binary_stream);
+        fwrite(&file_length, sizeof(file_length), 1, logger->binary_stream);
+        fwrite(&fmt_length, sizeof(fmt_length), 1, logger->binary_stream);
+        fwrite(site->file, 1, file_length, logger->binary_stream);
+        fwrite(site->fmt, 1, fmt_length, logger->binary_stream);
+    }
 }
 
-// Log msg to error stream
-void _logger_log_err(const char * msg)
+// Copy a binary record to the binary log, no formatting happens here either
+static void _logger_write_binary(Logger * logger, struct LogRecord * record)
 {
-    assert(_logger && "Logging not yet initialized");
-    fprintf(_logger->io_stream,"%s", msg);
+    // The site was published before the record was queued, so it is visible by now
+    if (record->site > (uint32_t) logger->sites_written)
+        _logger_write_sites(logger);
+
+    uint8_t type = LOG_ENTRY_MESSAGE;
+    uint32_t id = record->site - 1;
+    uint64_t ticks = record->time;
+    uint16_t length = record->length;
+
+    fwrite(&type, sizeof(type), 1, logger->binary_stream);
+    fwrite(&id, sizeof(id), 1, logger->binary_stream);
+    fwrite(&ticks, sizeof(ticks), 1, logger->binary_stream);
+    fwrite(&length, sizeof(length), 1, logger->binary_stream);
+    fwrite(record + 1, 1, length, logger->binary_stream);
 }
 
-// Log msg to io stream
-void _logger_log_msg(const char * msg)
+// Write every queued record, returns the amount of records written
+size_t _logger_drain(Logger * logger, char * batch)
 {
-    assert(_logger && "Logging not yet initialized");
-    fprintf(_logger->io_stream,"%s", msg);
+    size_t len = 0, records = 0;
+
+    pthread_mutex_lock(&_logger_rings_mutex);
+    struct LogRing ** link = &_logger_rings;
+    while (*link)
+    {
+        struct LogRing * ring = *link;
+        int closed = atomic_load_explicit(&ring->closed, memory_order_acquire);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        while (tail != head)
+        {
+            struct LogRecord * record = (struct LogRecord *) (ring->data + (tail & (LOGGER_RING_SIZE - 1)));
+            if (record->level != LOGGER_RECORD_PADDING && record->site)
+            {
+                _logger_write_binary(logger, record);
+                records++;
+            }
+            else if (record->level != LOGGER_RECORD_PADDING)
+            {
+                if (LOGGER_BATCH_SIZE - len < _logger_max_line())
+                {
+                    _logger_flush(logger, batch, len);
+                    len = 0;
+                }
+                len = _logger_format(batch, len, record->level, record->time, (const char *) (record + 1), record->length);
+                records++;
+            }
+            tail += record->size;
+
+            // Give room back as soon as possible, a producer may be waiting for it
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        }
+
+        if (closed)
+        {
+            *link = ring->next;
+            free(ring);
+        }
+        else
+            link = &ring->next;
+    }
+    pthread_mutex_unlock(&_logger_rings_mutex);
+
+    _logger_flush(logger, batch, len);
+    if (logger->binary_stream)
+        fflush(logger->binary_stream);
+    return records;
 }
 
+void * _logger_writer_main(void * args)
+{
+    Logger * logger = args;
+    char * batch = malloc(LOGGER_BATCH_SIZE);
+    size_t reported_drops = 0;
+
+    while (atomic_load(&logger->running))
+    {
+        size_t written = _logger_drain(logger, batch);
+
+        size_t dropped = atomic_load_explicit(&logger->dropped, memory_order_relaxed);
+        if (dropped != reported_drops)
+        {
+            char msg[64];
+            int length = snprintf(msg, sizeof(msg), "%lu log messages dropped\n", dropped - reported_drops);
+            _logger_write_now(LOG_LEVEL_WARN, msg, length);
+            reported_drops = dropped;
+        }
+
+        if (written > 0)
+            continue;
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOGGER_IDLE_WAIT_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&logger->wake_mutex);
+        if (atomic_load(&logger->running))
+            pthread_cond_timedwait(&logger->wake, &logger->wake_mutex, &deadline);
+        pthread_mutex_unlock(&logger->wake_mutex);
+    }
+
+    // Producers may still be running, but nothing queued before shutdown is lost
+    _logger_drain(logger, batch);
+    free(batch);
+    return NULL;
+}
+
+// Format a text message and queue it
+void _logger_vlog(enum LogLevel level, const char * fmt, va_list args)
+{
+    char msg[LOGGER_MAX_MESSAGE];
+    int length = vsnprintf(msg, sizeof(msg), fmt, args);
+
+    if (length < 0)
+        return;
+    if ((size_t) length >= sizeof(msg))
+        length = sizeof(msg) - 1;
+
+    Logger * logger = _logger;
+    if (logger && atomic_load_explicit(&logger->running, memory_order_relaxed))
+        _logger_enqueue(logger, level, 0, time(NULL), msg, length);
+    else
+        _logger_write_now(level, msg, length);
+}
+
+// Give a call site its id, returns -1 when there is no room left
+int _logger_register_site(int * site, enum LogLevel level, const char * file, int line, const char * fmt)
+{
+    pthread_mutex_lock(&_logger_sites_mutex);
+
+    // Another thread may have registered it while we waited
+    int id = __atomic_load_n(site, __ATOMIC_ACQUIRE) - 1;
+    int count = atomic_load_explicit(&_logger_site_count, memory_order_relaxed);
+    if (id < 0 && count < LOGGER_MAX_SITES)
+    {
+        _logger_sites[count].file = file;
+        _logger_sites[count].fmt = fmt;
+        _logger_sites[count].line = line;
+        _logger_sites[count].level = level;
+        atomic_store_explicit(&_logger_site_count, count + 1, memory_order_release);
+        __atomic_store_n(site, count + 1, __ATOMIC_RELEASE);
+        id = count;
+    }
+
+    pthread_mutex_unlock(&_logger_sites_mutex);
+    return id;
+}
+
+// Copy the raw arguments of a format, returns the amount of bytes used
+size_t _logger_encode_args(const char * fmt, va_list args, char * buf, size_t size)
+{
+    struct LogSpec spec;
+    size_t len = 0;
+
+    while ((fmt = logger_next_spec(fmt, &spec)) != NULL)
+    {
+        for (int i = 0; i < spec.stars; i++)
+        {
+            int64_t value = va_arg(args, int);
+            if (len + sizeof(value) > size)
+                return len;
+            memcpy(buf + len, &value, sizeof(value));
+            len += sizeof(value);
+        }
+
+        int64_t value = 0;
+        double real;
+        const char * str;
+        uint16_t str_length;
+
+        switch (spec.type)
+        {
+        case LOG_ARG_NONE:
+            continue;
+        case LOG_ARG_INT:
+            value = va_arg(args, int);
+            break;
+        case LOG_ARG_LONG:
+            value = va_arg(args, long);
+            break;
+        case LOG_ARG_POINTER:
+            value = (intptr_t) va_arg(args, void *);
+            break;
+        case LOG_ARG_DOUBLE:
+            real = va_arg(args, double);
+            memcpy(&value, &real, sizeof(value));
+            break;
+        case LOG_ARG_STRING:
+            str = va_arg(args, const char *);
+            if (str == NULL)
+                str = "(null)";
+            if (len + sizeof(str_length) > size)
+                return len;
+            str_length = strnlen(str, size - len - sizeof(str_length));
+            memcpy(buf + len, &str_length, sizeof(str_length));
+            memcpy(buf + len + sizeof(str_length), str, str_length);
+            len += sizeof(str_length) + str_length;
+            continue;
+        }
+
+        if (len + sizeof(value) > size)
+            return len;
+        memcpy(buf + len, &value, sizeof(value));
+        len += sizeof(value);
+    }
+
+    return len;
+}
+
+// Cheap monotonic timestamp, the counter rate is measured when the binary log is opened
+uint64_t _logger_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+#endif
+}
+
+// Log msg right away, used when no writer thread is running
+void _logger_write_now(int level, const char * msg, size_t length)
+{
+    char line[LOGGER_MAX_MESSAGE + 64];
+    size_t len;
+    FILE * stream = _logger ? _logger->io_stream : stdout;
+
+    // Same layout as the writer thread, through the stdio lock
+    time_t now = time(NULL);
+    struct tm info;
+    char time_str[32];
+    localtime_r(&now, &info);
+    strftime(time_str, sizeof(time_str), "[%d-%m-%Y %H:%M:%S]", &info);
+
+    len = snprintf(line, sizeof(line), "%s%s %.*s%s", _logger_colors[level], time_str, (int) length, msg, RESET);
+    if (len >= sizeof(line))
+        len = sizeof(line) - 1;
+    fwrite(line, 1, len, stream);
+    fflush(stream);
+}
@@ -6,23 +6,95 @@
 #ifndef LOGGER_H
 #define LOGGER_H
 
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 typedef struct Logger Logger;
 
+/// Severity of a log message
+enum LogLevel
+{
+    LOG_LEVEL_TRACE,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_OFF       // Only for logger_set_level, skips every message
+};
+
+/// What a thread does when its log ring has no room for a new message
+enum LoggerFullPolicy
+{
+    LOGGER_FULL_BLOCK,  // Wait for the writer thread to make room
+    LOGGER_FULL_DROP    // Discard the message and count it
+};
+
 /// Summary:
 ///     Use this function to get the current active function of the Logger. A Logger
-///     is lazily initialized.
+///     is lazily initialized, along with its background writer thread.
 /// Return:
 ///     Pointer to the Logger object
 Logger * logger_get();
 
 /// Summary:
-///     Destroy de logger object
+///     Write every pending message, stop the writer thread and destroy de logger object.
+///     Messages logged after this are written synchronously.
 void logger_destroy();
 
+/// Summary:
+///     Queue a printf-style message. The message is copied into a ring owned by the
+///     calling thread, the writer thread timestamps, colors and writes it later.
+///     Without an active Logger the message is written right away.
+/// Parameters:
+///     level : severity, selects the color
+///     fmt   : printf format followed by its arguments
+void logger_log(enum LogLevel level, const char * fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/// Summary:
+///     Background writer thread of the Logger, created if needed, e.g. to pin it to a CPU
+pthread_t logger_writer_thread();
+
+/// Summary:
+///     Choose what happens when a thread logs faster than the writer can keep up.
+///     Defaults to LOGGER_FULL_BLOCK.
+void logger_set_full_policy(enum LoggerFullPolicy policy);
+
+/// Summary:
+///     Amount of messages discarded because a ring was full
+size_t logger_dropped();
+
+/// Messages below this level are skipped by the LOG_* macros, before any other work
+extern int logger_level;
+
+/// Summary:
+///     Set the minimum level of the messages logged through the LOG_* macros
+void logger_set_level(enum LogLevel level);
+
+/// Summary:
+///     Switch the LOG_* macros to the binary format. Instead of formatted text only
+///     the call site id, a timestamp counter and the raw arguments are written to
+///     the given file; logdecode turns it back into text.
+/// Parameters:
+///     path : file to write the binary log to, truncated if it exists
+/// Return:
+///     0 on success, anything else if the file could not be opened
+int logger_open_binary(const char * path);
+
+/// Summary:
+///     Log a message from a LOG_* call site. The first call from a site registers it,
+///     in binary mode later calls only copy the arguments. Use the LOG_* macros
+///     instead of calling this directly.
+/// Parameters:
+///     site  : per call site storage for its id, starts at 0
+///     level : severity of the message
+///     file  : source file of the call site
+///     line  : source line of the call site
+///     fmt   : printf format followed by its arguments
+void logger_log_site(int * site, enum LogLevel level, const char * file, int line, const char * fmt, ...)
+    __attribute__((format(printf, 5, 6)));
+
 /// Summary:
 ///     Show a warning in yellow color
 /// Parameters:
@@ -52,19 +124,17 @@ void logger_trace(const char * msg);
 #define LOGGING
 #ifdef LOGGING
 
-#define _LOG_MSG(f, ...) {\
-        int size = snprintf(NULL, 0, __VA_ARGS__) + 1;\
-        char * buff = malloc(sizeof(char)*size); \
-        sprintf(buff,__VA_ARGS__); \
-        f(buff);\
-        if (1) \
-        free(buff);\
+#define _LOG_AT(level, ...) {\
+        if (__builtin_expect((level) >= logger_level, 1)) {\
+            static int _log_site = 0;\
+            logger_log_site(&_log_site, level, __FILE__, __LINE__, __VA_ARGS__);\
+        }\
     }
 
-#define LOG_WARN(...)  _LOG_MSG(logger_warn, __VA_ARGS__)
-#define LOG_INFO(...)  _LOG_MSG(logger_info, __VA_ARGS__)
-#define LOG_ERROR(...) _LOG_MSG(logger_error, __VA_ARGS__)
-#define LOG_TRACE(...) _LOG_MSG(logger_trace, __VA_ARGS__)
+#define LOG_WARN(...)  _LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...)  _LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_ERROR(...) _LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_TRACE(...) _LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
 
 #else
 
@@ -75,5 +145,62 @@ void logger_trace(const char * msg);
 
 #endif // Logging
 
+// -- < Binary log format > ------------------
+//
+// File header, then a stream of entries in host byte order:
+//   'F' u32 id, u8 level, u32 line, u16 file length, u16 format length, file, format
+//   'M' u32 id, u64 ticks, u16 arguments length, arguments
+// Every format entry comes before the first message using it. Arguments follow
+// the conversions of the format in order, a '*' width or precision first:
+// integers and pointers as 8 bytes, doubles as 8 bytes, strings as u16 length
+// and bytes.
+
+#define LOGGER_BINARY_MAGIC "CALCBLOG"
+#define LOGGER_BINARY_VERSION 1
+
+enum LogEntryType
+{
+    LOG_ENTRY_FORMAT = 'F',
+    LOG_ENTRY_MESSAGE = 'M'
+};
+
+enum LogArgType
+{
+    LOG_ARG_NONE,       // "%%", consumes nothing
+    LOG_ARG_INT,
+    LOG_ARG_LONG,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_STRING,
+    LOG_ARG_POINTER
+};
+
+struct LogBinaryHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t base_ticks;        // Timestamp counter when the file was opened
+    int64_t base_time_ns;       // Wall clock time at base_ticks
+    double ticks_per_ns;
+};
+
+/// A conversion specification in a printf format
+struct LogSpec
+{
+    const char * start;         // The '%'
+    size_t length;
+    int stars;                  // Extra int arguments for '*' width and precision
+    enum LogArgType type;
+};
+
+/// Summary:
+///     Find the next conversion specification of a printf format
+/// Parameters:
+///     fmt  : where to start looking
+///     spec : filled with the specification found
+/// Return:
+///     Pointer right after the specification, or NULL if there are no more
+const char * logger_next_spec(const char * fmt, struct LogSpec * spec);
+
 #endif // LOGER_H
 
@@ -0,0 +1,378 @@
+#include "metrics.h"
+#include "affinity.h"
+#include "logger.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define METRICS_LATENCY_BUCKETS 22      // Bucket i counts requests up to 2^i us, the last one is +Inf
+#define METRICS_POLL_TIMEOUT_MS 200     // So the admin thread notices it was stopped
+#define METRICS_REQUEST_SIZE 4096       // Longest HTTP request header accepted
+#define METRICS_CLIENT_TIMEOUT_S 1      // A scraper that stops sending is dropped after this
+
+/// Counters of one thread. Only the owning thread writes them.
+struct MetricsShard
+{
+    _Alignas(64) uint64_t counters[METRIC_COUNTERS];
+    uint64_t latency[METRICS_LATENCY_BUCKETS];
+    uint64_t latency_sum_ns;
+    int in_use;                         // Owned by a live thread, protected by the shards mutex
+    int node;                           // NUMA node of the thread that first wrote it
+    struct MetricsShard * next;
+};
+
+struct MetricsBuffer
+{
+    char * data;
+    size_t len;
+    size_t capacity;
+};
+
+int metrics_enabled = 0;
+
+static pthread_mutex_t _metrics_shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct MetricsShard * _metrics_shards = NULL;
+static pthread_key_t _metrics_shard_key;
+static pthread_once_t _metrics_shard_key_once = PTHREAD_ONCE_INIT;
+static __thread struct MetricsShard * _metrics_shard = NULL;
+
+static int _metrics_listen_fd = -1;
+static int _metrics_running = 0;
+static pthread_t _metrics_thread;
+static metrics_collect_fn _metrics_collect = NULL;
+static void * _metrics_collect_ctx = NULL;
+
+// -- < Shards > -----------------------------------------------------------------
+
+// Called when a thread exits, its counts stay and the shard goes to the next thread
+static void _metrics_shard_release(void * ptr)
+{
+    struct MetricsShard * shard = ptr;
+    pthread_mutex_lock(&_metrics_shards_mutex);
+    shard->in_use = 0;
+    pthread_mutex_unlock(&_metrics_shards_mutex);
+}
+
+static void _metrics_shard_key_create(void)
+{
+    pthread_key_create(&_metrics_shard_key, _metrics_shard_release);
+}
+
+static struct MetricsShard * _metrics_thread_shard(void)
+{
+    if (_metrics_shard)
+        return _metrics_shard;
+
+    pthread_once(&_metrics_shard_key_once, _metrics_shard_key_create);
+    pthread_mutex_lock(&_metrics_shards_mutex);
+
+    // Only take over a shard of the same node, its pages live where it was first written
+    int node = affinity_current_node();
+    struct MetricsShard * shard = _metrics_shards;
+    while (shard && (shard->in_use || shard->node != node))
+        shard = shard->next;
+
+    if (shard == NULL)
+    {
+        shard = aligned_alloc(_Alignof(struct MetricsShard), sizeof(struct MetricsShard));
+        if (shard == NULL)
+        {
+            pthread_mutex_unlock(&_metrics_shards_mutex);
+            return NULL;
+        }
+        memset(shard, 0, sizeof(struct MetricsShard));
+        shard->node = node;
+        shard->next = _metrics_shards;
+        _metrics_shards = shard;
+    }
+    shard->in_use = 1;
+
+    pthread_mutex_unlock(&_metrics_shards_mutex);
+    pthread_setspecific(_metrics_shard_key, shard);
+
+    _metrics_shard = shard;
+    return shard;
+}
+
+// Single writer, so a relaxed load and store is enough and there is no locked instruction
+static void _metrics_add(uint64_t * counter, uint64_t value)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static uint64_t _metrics_read(const uint64_t * counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// -- < HTTP > -------------------------------------------------------------------
+
+void metrics_printf(MetricsBuffer * out, const char * fmt, ...)
+{
+    va_list args;
+    for (;;)
+    {
+        va_start(args, fmt);
+        int n = vsnprintf(out->data + out->len, out->capacity - out->len, fmt, args);
+        va_end(args);
+
+        if (n < 0)
+            return;
+        if ((size_t) n < out->capacity - out->len)
+        {
+            out->len += n;
+            return;
+        }
+
+        char * data = realloc(out->data, out->capacity * 2 + n);
+        if (data == NULL)
+            return;
+        out->data = data;
+        out->capacity = out->capacity * 2 + n;
+    }
+}
+
+// Sum every shard into the response
+static void _metrics_write_shards(MetricsBuffer * out)
+{
+    uint64_t counters[METRIC_COUNTERS] = { 0 };
+    uint64_t latency[METRICS_LATENCY_BUCKETS] = { 0 };
+    uint64_t latency_sum_ns = 0;
+
+    pthread_mutex_lock(&_metrics_shards_mutex);
+    for (struct MetricsShard * shard = _metrics_shards; shard; shard = shard->next)
+    {
+        for (int i = 0; i < METRIC_COUNTERS; i++)
+            counters[i] += _metrics_read(&shard->counters[i]);
+        for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++)
+            latency[i] += _metrics_read(&shard->latency[i]);
+        latency_sum_ns += _metrics_read(&shard->latency_sum_ns);
+    }
+    pthread_mutex_unlock(&_metrics_shards_mutex);
+
+    metrics_printf(out, "# HELP calc_requests_total Lines handled by client sessions.\n"
+                        "# TYPE calc_requests_total counter\n"
+                        "calc_requests_total %lu\n", counters[METRIC_REQUESTS]);
+
+    metrics_printf(out, "# HELP calc_errors_total Expressions that failed to evaluate, by reason.\n"
+                        "# TYPE calc_errors_total counter\n");
+    for (int i = 0; i < CALC_ERROR_COUNT; i++)
+        metrics_printf(out, "calc_errors_total{kind=\"%s\"} %lu\n", calc_error_name(i), counters[METRIC_ERRORS + i]);
+
+    metrics_printf(out, "# HELP calc_sessions_total Client sessions opened.\n"
+                        "# TYPE calc_sessions_total counter\n"
+                        "calc_sessions_total %lu\n"
+                        "# HELP calc_sessions_active Client sessions currently open.\n"
+                        "# TYPE calc_sessions_active gauge\n"
+                        "calc_sessions_active %lu\n",
+                   counters[METRIC_SESSIONS_OPENED], counters[METRIC_SESSIONS_OPENED] - counters[METRIC_SESSIONS_CLOSED]);
+
+    metrics_printf(out, "# HELP calc_eval_ops_total Operations evaluated by client requests.\n"
+                        "# TYPE calc_eval_ops_total counter\n"
+                        "calc_eval_ops_total %lu\n"
+                        "# HELP calc_sched_yields_total Times a session used up its quantum and let the others run.\n"
+                        "# TYPE calc_sched_yields_total counter\n"
+                        "calc_sched_yields_total %lu\n",
+                   counters[METRIC_EVAL_OPS], counters[METRIC_SCHED_YIELDS]);
+
+    metrics_printf(out, "# HELP calc_rate_limited_total Requests rejected by a rate limit.\n"
+                        "# TYPE calc_rate_limited_total counter\n"
+                        "calc_rate_limited_total{scope=\"connection\"} %lu\n"
+                        "calc_rate_limited_total{scope=\"address\"} %lu\n"
+                        "# HELP calc_rate_delayed_total Requests delayed by a rate limit.\n"
+                        "# TYPE calc_rate_delayed_total counter\n"
+                        "calc_rate_delayed_total %lu\n",
+                   counters[METRIC_RATE_LIMITED_CONNECTION], counters[METRIC_RATE_LIMITED_ADDRESS], counters[METRIC_RATE_DELAYED]);
+
+    // Prometheus buckets are cumulative
+    uint64_t cumulative = 0;
+    metrics_printf(out, "# HELP calc_request_duration_seconds Time from reading a request to writing its response.\n"
+                        "# TYPE calc_request_duration_seconds histogram\n");
+    for (int i = 0; i < METRICS_LATENCY_BUCKETS - 1; i++)
+    {
+        cumulative += latency[i];
+        metrics_printf(out, "calc_request_duration_seconds_bucket{le=\"%.9g\"} %lu\n", (double) (1ul << i) / 1e6, cumulative);
+    }
+    cumulative += latency[METRICS_LATENCY_BUCKETS - 1];
+    metrics_printf(out, "calc_request_duration_seconds_bucket{le=\"+Inf\"} %lu\n"
+                        "calc_request_duration_seconds_sum %.9f\n"
+                        "calc_request_duration_seconds_count %lu\n",
+                   cumulative, latency_sum_ns / 1e9, cumulative);
+}
+
+static void _metrics_send(int fd, const char * data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        data += n;
+        len -= n;
+    }
+}
+
+static void _metrics_serve(int fd)
+{
+    char request[METRICS_REQUEST_SIZE];
+    size_t len = 0;
+
+    // Read the request header, the body (if any) is ignored
+    while (len < sizeof(request) - 1)
+    {
+        ssize_t n = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        len += n;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+            break;
+    }
+
+    if (strncmp(request, "GET /metrics ", 13) != 0 && strncmp(request, "GET /metrics?", 13) != 0)
+    {
+        const char * not_found = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        _metrics_send(fd, not_found, strlen(not_found));
+        return;
+    }
+
+    MetricsBuffer body = { malloc(4096), 0, 4096 };
+    if (body.data == NULL)
+        return;
+    _metrics_write_shards(&body);
+    if (_metrics_collect)
+        _metrics_collect(_metrics_collect_ctx, &body);
+
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %lu\r\nConnection: close\r\n\r\n", body.len);
+    _metrics_send(fd, header, header_len);
+    _metrics_send(fd, body.data, body.len);
+    free(body.data);
+}
+
+static void * _metrics_thread_main(void * args)
+{
+    (void) args;
+    struct pollfd pfd = { _metrics_listen_fd, POLLIN, 0 };
+
+    while (__atomic_load_n(&_metrics_running, __ATOMIC_ACQUIRE))
+    {
+        if (poll(&pfd, 1, METRICS_POLL_TIMEOUT_MS) <= 0)
+            continue;
+
+        int fd = accept(_metrics_listen_fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+
+        struct timeval timeout = { METRICS_CLIENT_TIMEOUT_S, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        _metrics_serve(fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+// -- < Implementation > ---------------------------------------------------------
+
+int metrics_start(const char * port, metrics_collect_fn collect, void * ctx)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return 1;
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    // Admin data is only for local scrapers
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(atoi(port));
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 16) != 0)
+    {
+        LOG_ERROR("Could not open metrics port %s: %s\n", port, strerror(errno));
+        close(fd);
+        return 1;
+    }
+
+    _metrics_listen_fd = fd;
+    _metrics_collect = collect;
+    _metrics_collect_ctx = ctx;
+    _metrics_running = 1;
+    metrics_enabled = 1;
+
+    if (pthread_create(&_metrics_thread, NULL, _metrics_thread_main, NULL) != 0)
+    {
+        metrics_enabled = 0;
+        _metrics_running = 0;
+        close(fd);
+        return 1;
+    }
+
+    LOG_INFO("Serving metrics on 127.0.0.1:%s/metrics\n", port);
+    return 0;
+}
+
+void metrics_stop(void)
+{
+    if (!_metrics_running)
+        return;
+
+    metrics_enabled = 0;
+    __atomic_store_n(&_metrics_running, 0, __ATOMIC_RELEASE);
+    pthread_join(_metrics_thread, NULL);
+    close(_metrics_listen_fd);
+    _metrics_listen_fd = -1;
+}
+
+void metrics_count(enum MetricCounter counter)
+{
+    struct MetricsShard * shard = _metrics_thread_shard();
+    if (shard)
+        _metrics_add(&shard->counters[counter], 1);
+}
+
+void metrics_add(enum MetricCounter counter, uint64_t value)
+{
+    struct MetricsShard * shard = _metrics_thread_shard();
+    if (shard)
+        _metrics_add(&shard->counters[counter], value);
+}
+
+void metrics_observe_latency(uint64_t ns)
+{
+    struct MetricsShard * shard = _metrics_thread_shard();
+    if (shard == NULL)
+        return;
+
+    // Smallest bucket whose bound, 2^i us, is >= the duration
+    uint64_t us = (ns + 999) / 1000;
+    size_t bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if (bucket >= METRICS_LATENCY_BUCKETS)
+        bucket = METRICS_LATENCY_BUCKETS - 1;
+
+    _metrics_add(&shard->latency[bucket], 1);
+    _metrics_add(&shard->latency_sum_ns, ns);
+}
+
+uint64_t metrics_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
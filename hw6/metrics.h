@@ -0,0 +1,78 @@
+/*
+    Server metrics in the Prometheus text exposition format.
+
+    Counters and the request latency histogram are sharded per thread: a
+    session only touches its own thread's shard, with plain relaxed stores,
+    so recording never contends with other sessions. The shards are summed
+    by a separate admin thread when /metrics is scraped, on a port bound to
+    localhost only.
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "calc.h"
+
+/// Counters kept by every shard
+enum MetricCounter
+{
+    METRIC_REQUESTS,
+    METRIC_SESSIONS_OPENED,
+    METRIC_SESSIONS_CLOSED,
+    METRIC_EVAL_OPS,                // Cost of the requests, see calc_last_cost
+    METRIC_SCHED_YIELDS,            // Sessions that used up their quantum and let others go first
+    METRIC_RATE_LIMITED_CONNECTION, // Requests rejected by the limit of their connection
+    METRIC_RATE_LIMITED_ADDRESS,    // Requests rejected by the limit of their source address
+    METRIC_RATE_DELAYED,            // Requests that waited for a token
+    METRIC_ERRORS,                  // Followed by one counter per calc_error
+    METRIC_COUNTERS = METRIC_ERRORS + CALC_ERROR_COUNT
+};
+
+/// Text of a /metrics response being built
+typedef struct MetricsBuffer MetricsBuffer;
+
+/// Extra metrics appended to every scrape by the server, e.g. gauges
+typedef void (*metrics_collect_fn)(void * ctx, MetricsBuffer * out);
+
+/// Nonzero when the admin listener is running, recording is skipped otherwise
+extern int metrics_enabled;
+
+/// Summary:
+///     Open the admin listener on 127.0.0.1 and start serving /metrics from its own thread
+/// Parameters:
+///     port    : port to listen to
+///     collect : called on every scrape to append server metrics, may be NULL
+///     ctx     : passed to collect
+/// Return:
+///     0 on success, anything else if the port could not be opened
+int metrics_start(const char * port, metrics_collect_fn collect, void * ctx);
+
+/// Summary:
+///     Stop the admin listener
+void metrics_stop(void);
+
+/// Summary:
+///     Add one to a counter of the calling thread shard
+void metrics_count(enum MetricCounter counter);
+
+/// Summary:
+///     Add value to a counter of the calling thread shard
+void metrics_add(enum MetricCounter counter, uint64_t value);
+
+/// Summary:
+///     Record the duration of a request in the latency histogram
+/// Parameters:
+///     ns : time from reading the request to writing its response
+void metrics_observe_latency(uint64_t ns);
+
+/// Summary:
+///     Monotonic time in nanoseconds, for measuring requests
+uint64_t metrics_now(void);
+
+/// Summary:
+///     Append printf-style text to a response
+void metrics_printf(MetricsBuffer * out, const char * fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif // METRICS_H
@@ -0,0 +1,49 @@
+#!/bin/bash
+#
+# Multi-key test: "mget" answers every value in one line ("?" for an
+# undefined variable) and "mset" assigns every pair, reporting "Ok" or
+# "Error" per pair, in the default calculator and in namespaces, logged
+# and replicated like single assignments.
+#
+
+PORT=16200
+REPL=$((PORT + 2))
+REPLICA=$((PORT + 3))
+DIR=$(mktemp -d)
+. ./testlib.sh "$@"
+
+cleanup() {
+	stop_all
+	rm -rf "$DIR"
+}
+
+start_on $PORT --wal "$DIR/multi.wal" --repl-port $REPL
+start_on $REPLICA --replica-of 127.0.0.1:$REPL
+check testMset "Ok Ok Ok" "$(ask $PORT "mset a=1 b=-2 c=3")"
+check testMget "1 -2 ? 3" "$(ask $PORT "mget a b d c")"
+check testPartial "Ok Error Error Error Ok" "$(ask $PORT "mset d=4 e=x f= toolongnameforavariable=1 g=7")"
+check testExpressions "10" "$(ask $PORT "a + b + d + g")"
+check testUsage "$(printf 'Error usage: mget <name> ...\nError usage: mset <name>=<value> ...')" "$(ask $PORT "mget " "mset  ")"
+check testNoTransaction "$(printf 'Ok\nError mget and mset are not supported in transactions or cluster mode')" "$(ask $PORT "begin" "mget a")"
+
+# an answer longer than a line buffer, for names set over a few requests
+names=$(printf 'v%s ' $(seq 1 120 | tr 0-9 a-j))
+for first in 1 41 81; do
+	pairs=$(printf 'v%s=-1000000000 ' $(seq $first $((first + 39)) | tr 0-9 a-j))
+	check testManyNames$first "40" "$(ask $PORT "mset $pairs" | tr ' ' '\n' | grep -c '^Ok$')"
+done
+check testManyValues "120" "$(ask $PORT "mget $names" | tr ' ' '\n' | grep -c '^-1000000000$')"
+
+check testNamespace "$(printf 'Ok\nOk Ok\n5 6\nOk\n1 -2')" "$(ask $PORT "use tenant" "mset a=5 b=6" "mget a b" "use default" "mget a b")"
+
+sleep 0.3
+check testReplicated "1 -2 4 7" "$(ask $REPLICA "mget a b d g")"
+check testReplicaReadOnly "Error read-only" "$(ask $REPLICA "mset a=2")"
+stop_all
+
+# assignments of a batch are logged and replayed
+start_on $PORT --wal "$DIR/multi.wal"
+check testReplayed "1 -2 3 4 7" "$(ask $PORT "mget a b c d g")"
+stop
+
+finish
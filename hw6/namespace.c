@@ -0,0 +1,291 @@
+#include "namespace.h"
+#include "calc.h"
+#include "logger.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/// A part of the registry
+struct NamespaceShard
+{
+    _Alignas(64) pthread_mutex_t mutex;     // Protects the list and the users of its namespaces
+    Namespace * head;
+};
+
+struct NamespaceTable
+{
+    struct NamespaceShard shards[NAMESPACE_SHARDS];
+    size_t max;
+    size_t alive;                           // Updated atomically
+    uint64_t evicted;                       // Likewise
+    uint64_t idle_ns;
+
+    pthread_t sweeper;
+    pthread_mutex_t sweeper_mutex;          // Protects running
+    pthread_cond_t stopped;
+    int running;
+};
+
+static uint64_t _namespace_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// FNV-1a, to spread names over the shards
+static struct NamespaceShard * _namespace_shard(NamespaceTable * table, const char * name)
+{
+    uint32_t h = 2166136261u;
+    for (const char * c = name; *c; c++)
+        h = (h ^ (unsigned char) *c) * 16777619u;
+    return &table->shards[h & (NAMESPACE_SHARDS - 1)];
+}
+
+static void _namespace_free(Namespace * ns)
+{
+    calc_destroy(ns->calc);
+    stat_rwlock_destroy(&ns->lock);
+    free(ns);
+}
+
+// Destroy the namespaces of every shard nobody used for the idle timeout
+static void _namespace_sweep(NamespaceTable * table)
+{
+    uint64_t now = _namespace_now();
+
+    for (size_t i = 0; i < NAMESPACE_SHARDS; i++)
+    {
+        struct NamespaceShard * shard = &table->shards[i];
+        Namespace * idle = NULL;
+
+        // Unlinked under the mutex, so no session can take them anymore
+        pthread_mutex_lock(&shard->mutex);
+        for (Namespace ** link = &shard->head; *link;)
+        {
+            Namespace * ns = *link;
+            if (ns->users == 0 && now - ns->last_used_ns >= table->idle_ns)
+            {
+                *link = ns->next;
+                ns->next = idle;
+                idle = ns;
+            }
+            else
+                link = &ns->next;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+
+        while (idle)
+        {
+            Namespace * next = idle->next;
+            LOG_INFO("Evicting idle namespace %s\n", idle->name);
+            _namespace_free(idle);
+            __atomic_sub_fetch(&table->alive, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&table->evicted, 1, __ATOMIC_RELAXED);
+            idle = next;
+        }
+    }
+}
+
+static void * _namespace_sweeper_main(void * args)
+{
+    NamespaceTable * table = args;
+
+    // Checking twice per timeout keeps a namespace at most half a timeout longer
+    uint64_t period_ns = table->idle_ns / 2;
+
+    pthread_mutex_lock(&table->sweeper_mutex);
+    while (table->running)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        uint64_t nsec = deadline.tv_nsec + period_ns;
+        deadline.tv_sec += nsec / 1000000000ull;
+        deadline.tv_nsec = nsec % 1000000000ull;
+        pthread_cond_timedwait(&table->stopped, &table->sweeper_mutex, &deadline);
+        if (!table->running)
+            break;
+
+        pthread_mutex_unlock(&table->sweeper_mutex);
+        _namespace_sweep(table);
+        pthread_mutex_lock(&table->sweeper_mutex);
+    }
+    pthread_mutex_unlock(&table->sweeper_mutex);
+
+    return NULL;
+}
+
+// -- < Implementation > ---------------------------------------------------------
+
+NamespaceTable * namespace_table_create(size_t max, unsigned idle_s)
+{
+    NamespaceTable * table = aligned_alloc(_Alignof(NamespaceTable), sizeof(NamespaceTable));
+    memset(table, 0, sizeof(NamespaceTable));
+    for (size_t i = 0; i < NAMESPACE_SHARDS; i++)
+        pthread_mutex_init(&table->shards[i].mutex, NULL);
+    table->max = max;
+    table->idle_ns = idle_s * 1000000000ull;
+    pthread_mutex_init(&table->sweeper_mutex, NULL);
+    pthread_cond_init(&table->stopped, NULL);
+
+    if (idle_s > 0)
+    {
+        table->running = 1;
+        if (pthread_create(&table->sweeper, NULL, _namespace_sweeper_main, table) != 0)
+        {
+            LOG_ERROR("Could not start the namespace sweeper\n");
+            free(table);
+            return NULL;
+        }
+    }
+    return table;
+}
+
+void namespace_table_destroy(NamespaceTable * table)
+{
+    pthread_mutex_lock(&table->sweeper_mutex);
+    int running = table->running;
+    table->running = 0;
+    pthread_cond_signal(&table->stopped);
+    pthread_mutex_unlock(&table->sweeper_mutex);
+
+    if (running)
+        pthread_join(table->sweeper, NULL);
+
+    for (size_t i = 0; i < NAMESPACE_SHARDS; i++)
+    {
+        Namespace * ns = table->shards[i].head;
+        while (ns)
+        {
+            Namespace * next = ns->next;
+            _namespace_free(ns);
+            ns = next;
+        }
+        pthread_mutex_destroy(&table->shards[i].mutex);
+    }
+
+    pthread_mutex_destroy(&table->sweeper_mutex);
+    pthread_cond_destroy(&table->stopped);
+    free(table);
+}
+
+int namespace_valid_name(const char * name)
+{
+    size_t length = strlen(name);
+    if (length == 0 || length >= NAMESPACE_NAME_SIZE)
+        return 0;
+
+    return strspn(name, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-") == length;
+}
+
+Namespace * namespace_acquire(NamespaceTable * table, const char * name)
+{
+    if (!namespace_valid_name(name))
+        return NULL;
+
+    struct NamespaceShard * shard = _namespace_shard(table, name);
+    pthread_mutex_lock(&shard->mutex);
+
+    Namespace * ns = shard->head;
+    while (ns && strcmp(ns->name, name) != 0)
+        ns = ns->next;
+
+    if (ns == NULL)
+    {
+        if (__atomic_add_fetch(&table->alive, 1, __ATOMIC_RELAXED) > table->max)
+        {
+            __atomic_sub_fetch(&table->alive, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&shard->mutex);
+            LOG_WARN("Could not create namespace %s, there are too many\n", name);
+            return NULL;
+        }
+
+        ns = calloc(1, sizeof(Namespace));
+        strcpy(ns->name, name);
+        ns->calc = calc_create();
+        stat_rwlock_init(&ns->lock, ns->name);
+        ns->next = shard->head;
+        shard->head = ns;
+        LOG_INFO("Created namespace %s\n", name);
+    }
+    ns->users++;
+
+    pthread_mutex_unlock(&shard->mutex);
+    return ns;
+}
+
+void namespace_release(NamespaceTable * table, Namespace * ns)
+{
+    struct NamespaceShard * shard = _namespace_shard(table, ns->name);
+
+    pthread_mutex_lock(&shard->mutex);
+    if (--ns->users == 0)
+        ns->last_used_ns = _namespace_now();
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+void namespace_count(Namespace * ns, size_t ops, int failed)
+{
+    __atomic_add_fetch(&ns->requests, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ns->ops, ops, __ATOMIC_RELAXED);
+    if (failed)
+        __atomic_add_fetch(&ns->errors, 1, __ATOMIC_RELAXED);
+}
+
+void namespace_foreach(NamespaceTable * table, void (*fn)(void * ctx, const NamespaceStats * stats), void * ctx)
+{
+    uint64_t now = _namespace_now();
+
+    for (size_t i = 0; i < NAMESPACE_SHARDS; i++)
+    {
+        struct NamespaceShard * shard = &table->shards[i];
+
+        // A namespace held by the shard mutex can't be evicted, its calc only changes under its lock
+        pthread_mutex_lock(&shard->mutex);
+        for (Namespace * ns = shard->head; ns; ns = ns->next)
+        {
+            NamespaceStats stats;
+            stats.name = ns->name;
+            stats.requests = __atomic_load_n(&ns->requests, __ATOMIC_RELAXED);
+            stats.ops = __atomic_load_n(&ns->ops, __ATOMIC_RELAXED);
+            stats.errors = __atomic_load_n(&ns->errors, __ATOMIC_RELAXED);
+            stats.users = ns->users;
+            stats.idle_ns = ns->users ? 0 : now - ns->last_used_ns;
+
+            stat_rwlock_rdlock(&ns->lock);
+            stats.variables = calc_count(ns->calc);
+            stats.bytes = calc_memory(ns->calc);
+            stat_rwlock_unlock(&ns->lock);
+
+            fn(ctx, &stats);
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+size_t namespace_expire(NamespaceTable * table, size_t slots)
+{
+    size_t removed = 0;
+
+    for (size_t i = 0; i < NAMESPACE_SHARDS; i++)
+    {
+        struct NamespaceShard * shard = &table->shards[i];
+
+        pthread_mutex_lock(&shard->mutex);
+        for (Namespace * ns = shard->head; ns; ns = ns->next)
+        {
+            stat_rwlock_wrlock(&ns->lock);
+            removed += calc_expire(ns->calc, slots);
+            stat_rwlock_unlock(&ns->lock);
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+    return removed;
+}
+
+void namespace_table_stats(NamespaceTable * table, size_t * alive, uint64_t * evicted)
+{
+    *alive = __atomic_load_n(&table->alive, __ATOMIC_RELAXED);
+    *evicted = __atomic_load_n(&table->evicted, __ATOMIC_RELAXED);
+}
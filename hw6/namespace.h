@@ -0,0 +1,106 @@
+/*
+    Named calculators, one per tenant.
+
+    A session switches to a namespace with "use <name>", and from then on
+    its expressions run on that namespace's own Calc under its own lock,
+    so tenants never wait for each other's writers. A namespace is created
+    on demand the first time it is used.
+
+    The registry is split in shards, each one a list behind its own mutex,
+    and a name always maps to the same shard. Sessions of different
+    tenants only meet on a shard mutex when they switch namespaces, never
+    while evaluating.
+
+    A namespace no session has selected for the idle timeout is destroyed,
+    with its variables, by a sweeper thread. Namespaces live in memory
+    only: they are not logged, saved, replicated nor clustered like the
+    default calculator of the server.
+*/
+
+#ifndef NAMESPACE_H
+#define NAMESPACE_H
+
+#include "statmutex.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define NAMESPACE_NAME_SIZE 32              // Including the terminator
+#define NAMESPACE_SHARDS 16                 // Registry shards, a power of two
+#define NAMESPACE_DEFAULT_MAX 1024          // Namespaces alive at once
+#define NAMESPACE_DEFAULT_IDLE_S 300        // Seconds unused before a namespace is evicted
+
+/// A calculator and its statistics
+typedef struct Namespace
+{
+    char name[NAMESPACE_NAME_SIZE];
+    struct Calc * calc;
+    StatRwLock lock;                        // Same use as the calc lock of the server
+    uint64_t requests;                      // Updated atomically by the sessions using it
+    uint64_t ops;
+    uint64_t errors;
+    size_t users;                           // Sessions that selected it, protected by the shard mutex
+    uint64_t last_used_ns;                  // When the last user left, likewise
+    struct Namespace * next;
+} Namespace;
+
+/// Statistics of a namespace, as reported
+typedef struct NamespaceStats
+{
+    const char * name;
+    size_t variables;
+    size_t bytes;                           // Memory taken by the variables
+    uint64_t requests;
+    uint64_t ops;
+    uint64_t errors;
+    size_t users;
+    uint64_t idle_ns;                       // Time since the last user left, 0 while in use
+} NamespaceStats;
+
+typedef struct NamespaceTable NamespaceTable;
+
+/// Summary:
+///     Create an empty registry and start its sweeper
+/// Parameters:
+///     max    : namespaces alive at once
+///     idle_s : seconds unused before a namespace is evicted, 0 to keep them
+/// Return:
+///     The registry, or NULL if the sweeper could not start
+NamespaceTable * namespace_table_create(size_t max, unsigned idle_s);
+
+/// Summary:
+///     Stop the sweeper and destroy every namespace, none may be in use
+void namespace_table_destroy(NamespaceTable * table);
+
+/// Summary:
+///     Tell if a name can be used: letters, digits, '_' and '-'
+int namespace_valid_name(const char * name);
+
+/// Summary:
+///     Take a namespace for a session, creating it if needed
+/// Return:
+///     The namespace, or NULL if the name is invalid or there are too many namespaces
+Namespace * namespace_acquire(NamespaceTable * table, const char * name);
+
+/// Summary:
+///     Give back a namespace taken with namespace_acquire
+void namespace_release(NamespaceTable * table, Namespace * ns);
+
+/// Summary:
+///     Count a request evaluated on a namespace
+void namespace_count(Namespace * ns, size_t ops, int failed);
+
+/// Summary:
+///     Call fn with the statistics of every namespace, a shard at a time
+void namespace_foreach(NamespaceTable * table, void (*fn)(void * ctx, const NamespaceStats * stats), void * ctx);
+
+/// Summary:
+///     Remove the expired variables from the next slots of every namespace
+/// Return:
+///     The amount of variables removed
+size_t namespace_expire(NamespaceTable * table, size_t slots);
+
+/// Summary:
+///     Amount of namespaces alive and evicted so far, for metrics
+void namespace_table_stats(NamespaceTable * table, size_t * alive, uint64_t * evicted);
+
+#endif // NAMESPACE_H
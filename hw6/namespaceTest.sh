@@ -0,0 +1,49 @@
+#!/bin/bash
+#
+# Namespace test: "use <name>" gives a session a calculator of its own,
+# shared with the other sessions using the same name and separate from
+# the default one, and idle namespaces are evicted.
+#
+
+PORT=16000
+. ./testlib.sh "$@"
+
+start --metrics-port $((PORT + 1))
+ask $PORT "x = 1" > /dev/null
+
+# the same name in two namespaces, and in the default calculator
+check testSeparate "$(printf 'Ok\n10\nOk\n20\nOk\n1')" "$(ask $PORT "use alpha" "x = 10" "use beta" "x = 20" "use default" "x")"
+check testShared "$(printf 'Ok\n11')" "$(ask $PORT "use alpha" "x += 1")"
+check testOwnTransaction "$(printf 'Ok\nOk\n22\nOk 22')" "$(ask $PORT "use beta" "begin" "x = x + 2" "commit")"
+check testCas "$(printf 'Ok\n1\n5')" "$(ask $PORT "use beta" "cas x 22 5" "x")"
+check testInvalidName "Error invalid namespace or too many namespaces" "$(ask $PORT "use a.b")"
+check testNoWatch "$(printf 'Ok\nError watch is not supported in namespaces')" "$(ask $PORT "use alpha" "watch x")"
+
+report=$(ask $PORT "x" "namespaces")
+check testReportAlpha "1" "$(echo "$report" | grep -c '^alpha variables=1 bytes=[0-9]* requests=2 ops=[0-9]* errors=0 sessions=0')"
+check testReportSummary "namespaces=2 evicted=0" "$(echo "$report" | tail -n 1)"
+check testRequestsMetric 'calc_namespace_requests_total{namespace="beta"} 4' "$(scrape $((PORT + 1)) | grep 'requests_total{namespace="beta"')"
+stop
+
+# unused for a second, gone after the next sweep with its variables
+start --namespace-idle 1
+ask $PORT "use gamma" "y = 3" > /dev/null
+sleep 1.8
+check testEvicted "namespaces=0 evicted=1" "$(ask $PORT "namespaces")"
+check testRecreatedEmpty "$(printf 'Ok\nError')" "$(ask $PORT "use gamma" "y")"
+stop
+
+# a namespace in use is kept
+start --namespace-idle 1
+exec 4<>/dev/tcp/127.0.0.1/$PORT
+printf 'use delta\nz = 4\n' >&4
+sleep 1.8
+check testKeptInUse "namespaces=1 evicted=0" "$(ask $PORT "namespaces" | tail -n 1)"
+exec 4<&-
+stop
+
+start --max-namespaces 1
+check testTooMany "$(printf 'Ok\nError invalid namespace or too many namespaces')" "$(ask $PORT "use one" "use two")"
+stop
+
+finish
@@ -0,0 +1,141 @@
+#include "pool.h"
+#include "logger.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+#define SLAB_ALIGNMENT 16
+
+/// Free objects keep the next free one in their first bytes
+struct FreeObject
+{
+    struct FreeObject * next;
+};
+
+/// Header of a slab, followed by its objects
+struct Slab
+{
+    struct Slab * next;
+    char padding[SLAB_ALIGNMENT - sizeof(struct Slab *)];
+};
+
+struct SlabPool
+{
+    pthread_mutex_t mutex;
+    size_t object_size;
+    size_t slab_objects;
+    size_t in_use;
+    size_t slabs;
+    struct Slab * slab_list;
+    struct FreeObject * free_list;
+};
+
+// -- < Slabs > ------------------------------------------------------------------
+
+// Allocate a slab and put its objects on the free list. Called with the pool locked.
+static int _slab_add(SlabPool * pool)
+{
+    struct Slab * slab = malloc(sizeof(struct Slab) + pool->slab_objects * pool->object_size);
+    if (slab == NULL)
+    {
+        LOG_ERROR("Could not allocate a slab of %lu objects\n", pool->slab_objects);
+        return 1;
+    }
+
+    slab->next = pool->slab_list;
+    pool->slab_list = slab;
+    pool->slabs++;
+
+    // Pushed backwards so objects are handed out in address order
+    char * objects = (char *) (slab + 1);
+    for (size_t i = pool->slab_objects; i > 0; i--)
+    {
+        struct FreeObject * object = (struct FreeObject *) (objects + (i - 1) * pool->object_size);
+        object->next = pool->free_list;
+        pool->free_list = object;
+    }
+    return 0;
+}
+
+// -- < Implementation > ---------------------------------------------------------
+
+SlabPool * slab_pool_create(size_t object_size, size_t slab_objects, size_t preallocated)
+{
+    SlabPool * pool = calloc(1, sizeof(SlabPool));
+    if (pool == NULL)
+        return NULL;
+
+    if (object_size < sizeof(struct FreeObject))
+        object_size = sizeof(struct FreeObject);
+    pool->object_size = (object_size + SLAB_ALIGNMENT - 1) / SLAB_ALIGNMENT * SLAB_ALIGNMENT;
+    pool->slab_objects = slab_objects > 0 ? slab_objects : 1;
+    pthread_mutex_init(&pool->mutex, NULL);
+
+    while (pool->slabs * pool->slab_objects < preallocated)
+    {
+        if (_slab_add(pool) != 0)
+        {
+            slab_pool_destroy(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+void slab_pool_destroy(SlabPool * pool)
+{
+    if (pool == NULL)
+        return;
+
+    if (pool->in_use > 0)
+        LOG_WARN("Destroying a slab pool with %lu objects in use\n", pool->in_use);
+
+    while (pool->slab_list)
+    {
+        struct Slab * slab = pool->slab_list;
+        pool->slab_list = slab->next;
+        free(slab);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+void * slab_alloc(SlabPool * pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+
+    if (pool->free_list == NULL && _slab_add(pool) != 0)
+    {
+        pthread_mutex_unlock(&pool->mutex);
+        return NULL;
+    }
+
+    struct FreeObject * object = pool->free_list;
+    pool->free_list = object->next;
+    pool->in_use++;
+
+    pthread_mutex_unlock(&pool->mutex);
+    return object;
+}
+
+void slab_free(SlabPool * pool, void * object)
+{
+    if (object == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->mutex);
+    struct FreeObject * free_object = (struct FreeObject *) object;
+    free_object->next = pool->free_list;
+    pool->free_list = free_object;
+    pool->in_use--;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void slab_pool_stats(SlabPool * pool, SlabPoolStats * stats)
+{
+    pthread_mutex_lock(&pool->mutex);
+    stats->object_size = pool->object_size;
+    stats->in_use = pool->in_use;
+    stats->capacity = pool->slabs * pool->slab_objects;
+    stats->slabs = pool->slabs;
+    pthread_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,59 @@
+/*
+    Slab pools of fixed-size objects.
+
+    Objects are carved out of slabs, big allocations holding a fixed amount
+    of them, and freed objects go back to a free list instead of to malloc.
+    A pool can be preallocated so the objects it will need are reserved at
+    startup, and it grows one slab at a time past that. Slabs are only
+    released when the pool is destroyed.
+
+    The server keeps the state of every connection in one pool and the I/O
+    buffers, which a connection only holds while a request is in flight,
+    in another one shared by every connection.
+*/
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+typedef struct SlabPool SlabPool;
+
+/// Occupation of a pool, for reports
+typedef struct SlabPoolStats
+{
+    size_t object_size;             // Bytes taken by every object, padding included
+    size_t in_use;                  // Objects handed out
+    size_t capacity;                // Objects in every slab, free or not
+    size_t slabs;
+} SlabPoolStats;
+
+/// Summary:
+///     Create a pool
+/// Parameters:
+///     object_size   : bytes of every object
+///     slab_objects  : objects in every slab
+///     preallocated  : objects to reserve now, rounded up to whole slabs
+/// Return:
+///     Pool object, or NULL if the preallocated slabs could not be allocated
+SlabPool * slab_pool_create(size_t object_size, size_t slab_objects, size_t preallocated);
+
+/// Summary:
+///     Free the pool and every slab, objects still in use included
+void slab_pool_destroy(SlabPool * pool);
+
+/// Summary:
+///     Take an object from the pool, adding a slab if every object is in use
+/// Return:
+///     Uninitialized object, or NULL if no slab could be added
+void * slab_alloc(SlabPool * pool);
+
+/// Summary:
+///     Give an object back to the pool it came from
+void slab_free(SlabPool * pool, void * object);
+
+/// Summary:
+///     Read the occupation of a pool
+void slab_pool_stats(SlabPool * pool, SlabPoolStats * stats);
+
+#endif // POOL_H
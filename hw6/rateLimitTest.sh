@@ -0,0 +1,59 @@
+#!/bin/bash
+#
+# Rate limit test: requests over the limit of a connection or of its
+# address are rejected, or delayed in delay mode without holding up the
+# other sessions of a coroutine thread.
+#
+
+PORT=15900
+. ./testlib.sh "$@"
+
+# a burst of 3, then one request per second
+start --rate-limit 1:3 --metrics-port $((PORT + 1))
+check testBurst "$(printf '1\n2\n3\nError rate-limited\nError rate-limited')" "$(ask $PORT 1 2 3 4 5)"
+check testRejectedMetric 'calc_rate_limited_total{scope="connection"} 2' "$(scrape $((PORT + 1)) | grep 'scope="connection"} 2')"
+stop
+
+# connections from the same address share its bucket
+start --ip-rate-limit 1:2
+check testAddressFirst "$(printf '1\n2')" "$(ask $PORT 1 2)"
+check testAddressShared "Error rate-limited" "$(ask $PORT 3)"
+stop
+
+# a request rejected for its address keeps its connection token
+start --rate-limit 1:3 --ip-rate-limit 10:1
+exec 4<>/dev/tcp/127.0.0.1/$PORT
+answers=()
+for requests in "1 2" 3 4; do
+	printf '%s\n' $requests >&4
+	for _ in $requests; do
+		read -r -t 2 -u 4 answer
+		answers+=("$answer")
+	done
+	sleep 0.15
+done
+exec 4<&-
+check testAddressRefund "1,Error rate-limited,3,4" "$(IFS=,; echo "${answers[*]}")"
+stop
+
+# over the limit requests wait for their token instead
+start --rate-limit 10:1 --rate-limit-mode delay
+begin=$(date +%s%N)
+check testDelayed "$(printf '1\n2\n3')" "$(ask $PORT 1 2 3)"
+elapsed=$(( ($(date +%s%N) - begin) / 1000000 ))
+check testDelayPaced "1" "$([ $elapsed -ge 180 ] && echo 1 || echo "$elapsed ms")"
+stop
+
+# a waiting session does not hold up the others
+start --rate-limit 5:1 --rate-limit-mode delay --coro-threads 1
+ask $PORT 1 2 3 4 5 > /dev/null &
+waiting=$!
+sleep 0.1
+begin=$(date +%s%N)
+check testOthersServed "7" "$(ask $PORT 7)"
+elapsed=$(( ($(date +%s%N) - begin) / 1000000 ))
+check testOthersFast "1" "$([ $elapsed -lt 150 ] && echo 1 || echo "$elapsed ms")"
+wait $waiting 2> /dev/null
+stop
+
+finish
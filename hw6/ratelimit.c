@@ -0,0 +1,129 @@
+#include "ratelimit.h"
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+struct RateTable
+{
+    size_t mask;
+    RateBucket * buckets;
+};
+
+// FNV-1a, to spread addresses over the table
+static uint32_t _rate_hash(const unsigned char * data, size_t length)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+        h = (h ^ data[i]) * 16777619u;
+    return h;
+}
+
+// -- < Implementation > ---------------------------------------------------------
+
+int rate_limit_parse(const char * text, RateLimitMode mode, RateLimit * limit)
+{
+    char * end;
+    double rate = strtod(text, &end);
+
+    if (end == text || !(rate > 0) || rate > 1e9)
+        return 1;
+
+    // One second of requests, rounded up
+    double burst = (double) (uint64_t) rate < rate ? (double) ((uint64_t) rate + 1) : rate;
+    if (*end == ':')
+    {
+        text = end + 1;
+        burst = strtod(text, &end);
+        if (end == text || burst < 1 || burst > 1e6 || burst != (double) (uint64_t) burst)
+            return 1;
+    }
+    if (*end != '\0')
+        return 1;
+
+    memset(limit, 0, sizeof(*limit));
+    limit->rate = rate;
+    limit->burst = (unsigned) burst;
+    limit->interval_ns = (uint64_t) (1e9 / rate);
+    limit->tolerance_ns = limit->interval_ns * (limit->burst - 1);
+    limit->mode = mode;
+    return 0;
+}
+
+int rate_limit_parse_mode(const char * text, RateLimitMode * mode)
+{
+    if (strcmp(text, "reject") == 0)
+        *mode = RATE_LIMIT_REJECT;
+    else if (strcmp(text, "delay") == 0)
+        *mode = RATE_LIMIT_DELAY;
+    else
+        return 1;
+    return 0;
+}
+
+int64_t rate_limit_take(const RateLimit * limit, RateBucket * bucket, uint64_t now_ns)
+{
+    // Requests waiting for their token may take the bucket up to burst more intervals ahead
+    uint64_t queue_ns = limit->mode == RATE_LIMIT_DELAY ? limit->interval_ns * limit->burst : 0;
+    uint64_t full_at = __atomic_load_n(&bucket->full_at, __ATOMIC_RELAXED);
+
+    for (;;)
+    {
+        uint64_t start = full_at > now_ns ? full_at : now_ns;
+        uint64_t ahead = start - now_ns;
+        if (ahead > limit->tolerance_ns + queue_ns)
+            return -1;
+
+        if (__atomic_compare_exchange_n(&bucket->full_at, &full_at, start + limit->interval_ns, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return ahead > limit->tolerance_ns ? (int64_t) (ahead - limit->tolerance_ns) : 0;
+    }
+}
+
+void rate_limit_give_back(const RateLimit * limit, RateBucket * bucket)
+{
+    uint64_t full_at = __atomic_load_n(&bucket->full_at, __ATOMIC_RELAXED);
+
+    for (;;)
+    {
+        uint64_t earlier = full_at > limit->interval_ns ? full_at - limit->interval_ns : 0;
+        if (__atomic_compare_exchange_n(&bucket->full_at, &full_at, earlier, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return;
+    }
+}
+
+RateTable * rate_table_create(size_t size)
+{
+    size_t buckets = 1;
+    while (buckets < size)
+        buckets *= 2;
+
+    RateTable * table = malloc(sizeof(RateTable));
+    table->mask = buckets - 1;
+    table->buckets = calloc(buckets, sizeof(RateBucket));
+    return table;
+}
+
+void rate_table_destroy(RateTable * table)
+{
+    free(table->buckets);
+    free(table);
+}
+
+RateBucket * rate_table_bucket(RateTable * table, const struct sockaddr * addr, socklen_t length)
+{
+    uint32_t h = 0;
+
+    if (addr->sa_family == AF_INET && length >= sizeof(struct sockaddr_in))
+    {
+        const struct sockaddr_in * in = (const struct sockaddr_in *) addr;
+        h = _rate_hash((const unsigned char *) &in->sin_addr, sizeof(in->sin_addr));
+    }
+    else if (addr->sa_family == AF_INET6 && length >= sizeof(struct sockaddr_in6))
+    {
+        const struct sockaddr_in6 * in6 = (const struct sockaddr_in6 *) addr;
+        h = _rate_hash((const unsigned char *) &in6->sin6_addr, sizeof(in6->sin6_addr));
+    }
+
+    // Anything else (e.g. a Unix socket) shares the first bucket
+    return &table->buckets[h & table->mask];
+}
@@ -0,0 +1,95 @@
+/*
+    Token bucket rate limits, checked without locks.
+
+    A bucket is kept as a single word, the time at which it will be full
+    again (the generic cell rate algorithm): every request pushes that time
+    one interval further, and a request is over the limit when it would
+    push it more than the burst beyond now. This is the same as a bucket of
+    burst tokens refilled at rate tokens per second, but taking a token is
+    one compare-and-swap, so a bucket shared by many sessions needs no lock
+    and an idle one needs no refill.
+
+    Over the limit a request is either rejected or, in delay mode, queued:
+    it takes the next token ahead of time and waits until it is due, with
+    up to burst requests waiting per bucket before the next are rejected.
+
+    Buckets of source addresses live in a fixed table indexed by a hash of
+    the address. Addresses that collide share a bucket, which only makes
+    their limit stricter; with the default size that is rare.
+*/
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define RATE_TABLE_DEFAULT_SIZE 4096    // Buckets of source addresses
+
+/// What happens to requests over the limit
+typedef enum RateLimitMode
+{
+    RATE_LIMIT_REJECT,
+    RATE_LIMIT_DELAY
+} RateLimitMode;
+
+/// A rate and a burst
+typedef struct RateLimit
+{
+    double rate;                    // Requests per second, 0 for no limit
+    unsigned burst;                 // Requests allowed at once after being idle
+    uint64_t interval_ns;           // Time to earn one token
+    uint64_t tolerance_ns;          // How far ahead of now a bucket may be full again
+    RateLimitMode mode;
+} RateLimit;
+
+/// State of a bucket, zero initialized means full
+typedef struct RateBucket
+{
+    uint64_t full_at;               // Monotonic time at which the bucket is full again
+} RateBucket;
+
+typedef struct RateTable RateTable;
+
+/// Summary:
+///     Parse "<rate>[:<burst>]", the burst being one second of requests if missing
+/// Return:
+///     0 on success, anything else if the text is not a valid limit
+int rate_limit_parse(const char * text, RateLimitMode mode, RateLimit * limit);
+
+/// Summary:
+///     Parse "reject" or "delay"
+/// Return:
+///     0 on success, anything else if the text is not a mode
+int rate_limit_parse_mode(const char * text, RateLimitMode * mode);
+
+/// Summary:
+///     Take a token from a bucket. Safe to call concurrently on the same bucket.
+/// Parameters:
+///     now_ns : monotonic time of the request
+/// Return:
+///     0 if the request may go on now, the nanoseconds it must wait in delay
+///     mode, or -1 if it is rejected. A request that waits keeps its token.
+int64_t rate_limit_take(const RateLimit * limit, RateBucket * bucket, uint64_t now_ns);
+
+/// Summary:
+///     Give back a token taken by rate_limit_take, for a request that another limit
+///     rejected. Safe to call concurrently on the same bucket.
+void rate_limit_give_back(const RateLimit * limit, RateBucket * bucket);
+
+/// Summary:
+///     Create a table of buckets for source addresses
+/// Parameters:
+///     size : amount of buckets, rounded up to a power of two
+RateTable * rate_table_create(size_t size);
+
+/// Summary:
+///     Free a table, no bucket of it may be in use
+void rate_table_destroy(RateTable * table);
+
+/// Summary:
+///     Bucket of the address of a peer, ports are ignored
+RateBucket * rate_table_bucket(RateTable * table, const struct sockaddr * addr, socklen_t length);
+
+#endif // RATELIMIT_H
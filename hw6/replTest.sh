@@ -0,0 +1,49 @@
+#!/bin/bash
+#
+# Multi-process replication test: starts a primary and two replicas on
+# localhost, writes through the primary and checks the replicas catch up,
+# including a replica that joins late, one that is restarted and a
+# restarted primary.
+#
+
+PRIMARY=15000
+REPL=16000
+REPLICA1=15001
+REPLICA2=15002
+. ./testlib.sh "$@"
+
+start_on $PRIMARY --repl-port $REPL
+start_on $REPLICA1 --replica-of 127.0.0.1:$REPL
+
+ask $PRIMARY "a = 4" "b = a" "c = 7" > /dev/null
+sleep 0.3
+check testStream "$(printf '4\n4\n7')" "$(ask $REPLICA1 a b c)"
+check testReadOnly "Error read-only" "$(ask $REPLICA1 'a = 1')"
+
+# a replica joining late catches up from the log
+start_on $REPLICA2 --replica-of 127.0.0.1:$REPL
+check testCatchUp "$(printf '4\n4\n7')" "$(ask $REPLICA2 a b c)"
+
+# lag is reported once the replica acknowledges
+sleep 1.2
+check testLagReport "lag=0" "$(ask $PRIMARY replinfo | grep -o 'lag=0' | sort -u)"
+
+# restarted replica syncs again
+kill ${pids[1]}
+ask $PRIMARY "a = 10" > /dev/null
+start_on $REPLICA1 --replica-of 127.0.0.1:$REPL
+check testResync "10" "$(ask $REPLICA1 a)"
+
+# a restarted primary starts its sequence over, replicas must load it whole
+# rather than take the entries past the seq they had
+pid=${pids[0]}
+crash
+start_on $PRIMARY --repl-port $REPL
+ask $PRIMARY "d = 1" "d = 2" "d = 3" "d = 4" "d = 5" > /dev/null
+for _ in $(seq 30); do
+	[ "$(ask $REPLICA1 d)" == "5" ] && break
+	sleep 0.1
+done
+check testPrimaryRestart "$(printf 'Error\n5')" "$(ask $REPLICA1 a d)"
+
+finish
@@ -0,0 +1,617 @@
+#include "replication.h"
+#include "csapp.h"
+#include "logger.h"
+#include <assert.h>
+#include <stdint.h>
+#include <poll.h>
+#include <time.h>
+
+#define REPL_LOG_SIZE 4096          // Assignments kept in memory for replicas catching up
+#define REPL_MAX_REPLICAS 16        // Max amount of simultaneous replicas
+#define REPL_LINE_SIZE 128          // Max size of a protocol line
+#define REPL_BATCH_SIZE 256         // Max amount of log entries sent in a single write
+#define REPL_WAIT_MS 100            // Time a sender sleeps waiting for new entries
+#define REPL_PING_MS 1000           // Time between heartbeats when there is nothing to send
+#define REPL_RETRY_SECONDS 1        // Time a replica waits before reconnecting
+
+enum { REPL_PRIMARY, REPL_REPLICA };
+
+/// An assignment in the replication log
+struct ReplEntry
+{
+    uint64_t seq;
+    char name[CALC_KEY_SIZE];
+    int value;
+    int deleted;                    // A removal rather than an assignment
+};
+
+/// Primary side view of a connected replica
+struct ReplicaLink
+{
+    struct Replication * repl;
+    int used;
+    int fd;
+    pthread_t thread;
+    uint64_t sent_seq;              // Last sequence number sent, protected by the repl mutex
+    uint64_t acked_seq;             // Last sequence number acknowledged by the replica, likewise
+    struct timespec last_ack;       // When the last ACK was received, likewise
+    char addr[64];                  // Peer address, for reports
+    char ack_buf[REPL_LINE_SIZE];   // Partial ACK line received so far
+    size_t ack_len;
+};
+
+struct Replication
+{
+    int role;
+    struct Calc * calc;
+    StatRwLock * calc_lock;
+    pthread_mutex_t mutex;          // Protects everything below
+    pthread_cond_t appended;        // Signaled when an entry is added to the log
+    volatile int running;
+    pthread_t thread;               // Acceptor (primary) or applier (replica) thread
+
+    uint64_t id;                    // Replication id of the primary's history, 0 if a replica has none yet
+
+    // Primary state
+    int listen_fd;
+    struct ReplEntry log[REPL_LOG_SIZE];
+    uint64_t head_seq;              // Sequence number of the last entry, 0 if empty
+    struct ReplicaLink replicas[REPL_MAX_REPLICAS];
+
+    // Replica state
+    char host[64];
+    char port[8];
+    int primary_fd;
+    int connected;
+    uint64_t applied_seq;           // Last sequence number applied to calc
+    uint64_t primary_seq;           // Last head sequence number announced by the primary
+    struct timespec last_contact;   // When the last line from the primary was received
+};
+
+// -- < Utility functions > ------------------------------------------------------
+
+static long _repl_ms_since(const struct timespec * t)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+// Oldest sequence number still available in the log
+static uint64_t _repl_oldest_seq(Replication * repl)
+{
+    return repl->head_seq >= REPL_LOG_SIZE ? repl->head_seq - REPL_LOG_SIZE + 1 : 1;
+}
+
+// A new replication id, different on every start of a primary so replicas can tell restarts apart
+static uint64_t _repl_new_id(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    // splitmix64 finalizer over the start time and pid
+    uint64_t id = ((uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec) ^ ((uint64_t) getpid() << 32);
+    id = (id ^ (id >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    id = (id ^ (id >> 27)) * 0x94d049bb133111ebULL;
+    id ^= id >> 31;
+    return id ? id : 1;
+}
+
+static Replication * _repl_new(int role, struct Calc * calc, StatRwLock * calc_lock)
+{
+    Replication * repl = calloc(1, sizeof(Replication));
+    repl->role = role;
+    repl->calc = calc;
+    repl->calc_lock = calc_lock;
+    repl->running = 1;
+    repl->listen_fd = -1;
+    repl->primary_fd = -1;
+    pthread_mutex_init(&repl->mutex, NULL);
+    pthread_cond_init(&repl->appended, NULL);
+    return repl;
+}
+
+// -- < Primary > ----------------------------------------------------------------
+
+/// Buffer used to collect a snapshot of the calculator
+struct ReplSnapshot
+{
+    char * data;
+    size_t len;
+    size_t cap;
+    size_t count;
+};
+
+static void _repl_snapshot_add(void * ctx, const char * name, int value)
+{
+    struct ReplSnapshot * snap = ctx;
+
+    if (snap->cap - snap->len < REPL_LINE_SIZE)
+    {
+        snap->cap = snap->cap * 2 + REPL_LINE_SIZE;
+        snap->data = realloc(snap->data, snap->cap);
+    }
+
+    snap->len += snprintf(snap->data + snap->len, snap->cap - snap->len, "%s %d\n", name, value);
+    snap->count++;
+}
+
+// Send a full copy of the calculator and store the sequence number it corresponds to in seq_out
+static int _repl_send_snapshot(struct ReplicaLink * link, uint64_t * seq_out)
+{
+    Replication * repl = link->repl;
+    struct ReplSnapshot snap = { NULL, 0, 0, 0 };
+    uint64_t seq;
+
+    // Shared is enough: with replication on, assignments and removals are appended with calc_lock
+    // held exclusively, so the table and head_seq are consistent here
+    stat_rwlock_rdlock(repl->calc_lock);
+    calc_foreach(repl->calc, _repl_snapshot_add, &snap);
+    pthread_mutex_lock(&repl->mutex);
+    seq = repl->head_seq;
+    pthread_mutex_unlock(&repl->mutex);
+    stat_rwlock_unlock(repl->calc_lock);
+
+    LOG_INFO("Sending snapshot at seq %lu with %lu variables to replica %s\n", seq, snap.count, link->addr);
+
+    char header[REPL_LINE_SIZE];
+    int len = snprintf(header, sizeof(header), "SNAPSHOT %016lx %lu %lu\n", repl->id, seq, snap.count);
+    int ok = rio_writen(link->fd, header, len) == len &&
+             (snap.len == 0 || rio_writen(link->fd, snap.data, snap.len) == (ssize_t) snap.len);
+
+    free(snap.data);
+    *seq_out = seq;
+    return ok;
+}
+
+// Read every ACK available without blocking
+static void _repl_read_acks(struct ReplicaLink * link)
+{
+    ssize_t n;
+    while ((n = recv(link->fd, link->ack_buf + link->ack_len, sizeof(link->ack_buf) - link->ack_len - 1, MSG_DONTWAIT)) > 0)
+    {
+        link->ack_len += n;
+        link->ack_buf[link->ack_len] = '\0';
+
+        char * line = link->ack_buf;
+        char * newline;
+        while ((newline = strchr(line, '\n')) != NULL)
+        {
+            unsigned long seq;
+            if (sscanf(line, "ACK %lu", &seq) == 1)
+            {
+                pthread_mutex_lock(&link->repl->mutex);
+                link->acked_seq = seq;
+                clock_gettime(CLOCK_MONOTONIC, &link->last_ack);
+                pthread_mutex_unlock(&link->repl->mutex);
+            }
+            line = newline + 1;
+        }
+
+        // Keep the incomplete tail, drop it if a line does not fit at all
+        link->ack_len = strlen(line);
+        if (link->ack_len >= sizeof(link->ack_buf) - 1)
+            link->ack_len = 0;
+        memmove(link->ack_buf, line, link->ack_len);
+    }
+}
+
+// Stream the log to a single replica
+static void * _repl_sender_thread(void * args)
+{
+    struct ReplicaLink * link = args;
+    Replication * repl = link->repl;
+    rio_t in;
+    char line[REPL_LINE_SIZE];
+    char batch[REPL_BATCH_SIZE * REPL_LINE_SIZE];
+    unsigned long id = 0;
+    unsigned long from = 0;
+
+    // The first line tells us which history the replica follows and where it is in it
+    rio_readinitb(&in, link->fd);
+    if (rio_readlineb(&in, line, sizeof(line)) <= 0 || sscanf(line, "SYNC %lx %lu", &id, &from) != 2)
+    {
+        LOG_WARN("Replica %s did not send a valid SYNC line\n", link->addr);
+        goto done;
+    }
+
+    LOG_INFO("Replica %s connected, id: %016lx, last applied seq: %lu\n", link->addr, id, from);
+    int resync = id != repl->id;
+    pthread_mutex_lock(&repl->mutex);
+    link->acked_seq = from;
+    clock_gettime(CLOCK_MONOTONIC, &link->last_ack);
+    pthread_mutex_unlock(&repl->mutex);
+
+    uint64_t next = from + 1;
+    struct timespec last_send;
+    clock_gettime(CLOCK_MONOTONIC, &last_send);
+
+    while (repl->running)
+    {
+        pthread_mutex_lock(&repl->mutex);
+
+        // Replica follows another history (e.g. of this primary before a restart), or is too far
+        // behind: start over from a snapshot
+        if (resync || next < _repl_oldest_seq(repl) || next > repl->head_seq + 1)
+        {
+            pthread_mutex_unlock(&repl->mutex);
+            uint64_t seq;
+            if (!_repl_send_snapshot(link, &seq))
+                break;
+            resync = 0;
+            next = seq + 1;
+            pthread_mutex_lock(&repl->mutex);
+            link->sent_seq = seq;
+            pthread_mutex_unlock(&repl->mutex);
+            continue;
+        }
+
+        if (next > repl->head_seq)
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += REPL_WAIT_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&repl->appended, &repl->mutex, &deadline);
+        }
+
+        // Format pending entries while holding the lock, they could be overwritten otherwise
+        size_t len = 0;
+        size_t count = 0;
+        uint64_t head = repl->head_seq;
+        if (next >= _repl_oldest_seq(repl))
+        {
+            for (; next <= head && count < REPL_BATCH_SIZE; next++, count++)
+            {
+                struct ReplEntry * entry = &repl->log[next % REPL_LOG_SIZE];
+                if (entry->deleted)
+                    len += snprintf(batch + len, sizeof(batch) - len, "DEL %lu %s\n", entry->seq, entry->name);
+                else
+                    len += snprintf(batch + len, sizeof(batch) - len, "SET %lu %s %d\n", entry->seq, entry->name, entry->value);
+            }
+        }
+        pthread_mutex_unlock(&repl->mutex);
+
+        // Nothing new for a while: let the replica know we are alive and where the head is
+        if (count == 0 && _repl_ms_since(&last_send) >= REPL_PING_MS)
+            len = snprintf(batch, sizeof(batch), "PING %lu\n", head);
+
+        if (len > 0)
+        {
+            if (rio_writen(link->fd, batch, len) != (ssize_t) len)
+                break;
+            clock_gettime(CLOCK_MONOTONIC, &last_send);
+            pthread_mutex_lock(&repl->mutex);
+            link->sent_seq = next - 1;
+            pthread_mutex_unlock(&repl->mutex);
+        }
+
+        _repl_read_acks(link);
+    }
+
+done:
+    LOG_INFO("Replica %s disconnected\n", link->addr);
+    close(link->fd);
+
+    pthread_mutex_lock(&repl->mutex);
+    link->used = 0;
+    pthread_mutex_unlock(&repl->mutex);
+    return NULL;
+}
+
+// Accept replicas and start a sender for each one
+static void * _repl_acceptor_thread(void * args)
+{
+    Replication * repl = args;
+
+    while (repl->running)
+    {
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        int fd = accept(repl->listen_fd, (SA *) &addr, &addr_len);
+        if (fd < 0)
+        {
+            if (errno != EINTR && repl->running)
+                LOG_ERROR("Error accepting replica connection: %s\n", strerror(errno));
+            continue;
+        }
+
+        pthread_mutex_lock(&repl->mutex);
+        struct ReplicaLink * link = NULL;
+        for (size_t i = 0; i < REPL_MAX_REPLICAS && !link; i++)
+            if (!repl->replicas[i].used)
+                link = &repl->replicas[i];
+
+        if (!link)
+        {
+            pthread_mutex_unlock(&repl->mutex);
+            LOG_WARN("Too many replicas, rejecting connection\n");
+            close(fd);
+            continue;
+        }
+
+        memset(link, 0, sizeof(*link));
+        link->repl = repl;
+        link->used = 1;
+        link->fd = fd;
+        char port[8];
+        if (getnameinfo((SA *) &addr, addr_len, link->addr, sizeof(link->addr) - sizeof(port), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+        {
+            strcat(link->addr, ":");
+            strcat(link->addr, port);
+        }
+        pthread_mutex_unlock(&repl->mutex);
+
+        pthread_create(&link->thread, NULL, _repl_sender_thread, link);
+        pthread_detach(link->thread);
+    }
+
+    return NULL;
+}
+
+Replication * repl_primary_start(const char * port, struct Calc * calc, StatRwLock * calc_lock)
+{
+    int fd = open_listenfd((char *) port);
+    if (fd < 0)
+    {
+        LOG_ERROR("Could not open replication port %s\n", port);
+        return NULL;
+    }
+
+    Replication * repl = _repl_new(REPL_PRIMARY, calc, calc_lock);
+    repl->listen_fd = fd;
+    repl->id = _repl_new_id();
+
+    LOG_INFO("Replication primary %016lx listening on port %s\n", repl->id, port);
+    pthread_create(&repl->thread, NULL, _repl_acceptor_thread, repl);
+    return repl;
+}
+
+static void _repl_primary_log(Replication * repl, const char * name, int value, int deleted)
+{
+    assert(repl->role == REPL_PRIMARY && "Only primaries have a replication log");
+
+    pthread_mutex_lock(&repl->mutex);
+    struct ReplEntry * entry = &repl->log[++repl->head_seq % REPL_LOG_SIZE];
+    entry->seq = repl->head_seq;
+    strncpy(entry->name, name, CALC_KEY_SIZE - 1);
+    entry->name[CALC_KEY_SIZE - 1] = '\0';
+    entry->value = value;
+    entry->deleted = deleted;
+    pthread_cond_broadcast(&repl->appended);
+    pthread_mutex_unlock(&repl->mutex);
+}
+
+void repl_primary_append(Replication * repl, const char * name, int value)
+{
+    _repl_primary_log(repl, name, value, 0);
+}
+
+void repl_primary_delete(Replication * repl, const char * name)
+{
+    _repl_primary_log(repl, name, 0, 1);
+}
+
+// -- < Replica > ----------------------------------------------------------------
+
+// Read a snapshot body and replace the local state with it
+static int _repl_apply_snapshot(Replication * repl, rio_t * in, uint64_t id, uint64_t seq, size_t count)
+{
+    char line[REPL_LINE_SIZE];
+    char (* names)[CALC_KEY_SIZE] = malloc(count * CALC_KEY_SIZE + 1);
+    int * values = malloc(count * sizeof(int) + 1);
+    size_t read = 0;
+
+    // Read it all before locking, so sessions are not blocked by the network
+    for (; read < count; read++)
+    {
+        if (rio_readlineb(in, line, sizeof(line)) <= 0 ||
+            sscanf(line, "%19s %d", names[read], &values[read]) != 2)
+            break;
+    }
+
+    if (read == count)
+    {
+        stat_rwlock_wrlock(repl->calc_lock);
+        calc_clear(repl->calc);
+        for (size_t i = 0; i < count; i++)
+            calc_set(repl->calc, names[i], values[i]);
+        stat_rwlock_unlock(repl->calc_lock);
+
+        pthread_mutex_lock(&repl->mutex);
+        repl->id = id;
+        repl->applied_seq = seq;
+        pthread_mutex_unlock(&repl->mutex);
+        LOG_INFO("Loaded snapshot of %016lx at seq %lu with %lu variables\n", id, seq, count);
+    }
+
+    free(names);
+    free(values);
+    return read == count;
+}
+
+// Follow the primary, reconnecting when the connection is lost
+static void * _repl_replica_thread(void * args)
+{
+    Replication * repl = args;
+    char line[REPL_LINE_SIZE];
+
+    while (repl->running)
+    {
+        int fd = open_clientfd(repl->host, repl->port);
+        if (fd < 0)
+        {
+            LOG_WARN("Could not connect to primary %s:%s, retrying\n", repl->host, repl->port);
+            sleep(REPL_RETRY_SECONDS);
+            continue;
+        }
+
+        pthread_mutex_lock(&repl->mutex);
+        repl->primary_fd = fd;
+        repl->connected = 1;
+        clock_gettime(CLOCK_MONOTONIC, &repl->last_contact);
+        int len = snprintf(line, sizeof(line), "SYNC %016lx %lu\n", repl->id, repl->applied_seq);
+        pthread_mutex_unlock(&repl->mutex);
+
+        LOG_INFO("Connected to primary %s:%s\n", repl->host, repl->port);
+
+        rio_t in;
+        rio_readinitb(&in, fd);
+        int ok = rio_writen(fd, line, len) == len;
+
+        while (ok && repl->running && rio_readlineb(&in, line, sizeof(line)) > 0)
+        {
+            unsigned long id, seq, count;
+            char name[CALC_KEY_SIZE];
+            int value;
+
+            pthread_mutex_lock(&repl->mutex);
+            clock_gettime(CLOCK_MONOTONIC, &repl->last_contact);
+            pthread_mutex_unlock(&repl->mutex);
+
+            int deleted = sscanf(line, "DEL %lu %19s", &seq, name) == 2;
+            if (deleted || sscanf(line, "SET %lu %19s %d", &seq, name, &value) == 3)
+            {
+                stat_rwlock_wrlock(repl->calc_lock);
+                if (deleted)
+                    calc_delete(repl->calc, name);
+                else
+                    calc_set(repl->calc, name, value);
+                stat_rwlock_unlock(repl->calc_lock);
+
+                pthread_mutex_lock(&repl->mutex);
+                repl->applied_seq = seq;
+                if (seq > repl->primary_seq)
+                    repl->primary_seq = seq;
+                pthread_mutex_unlock(&repl->mutex);
+            }
+            else if (sscanf(line, "SNAPSHOT %lx %lu %lu", &id, &seq, &count) == 3)
+            {
+                ok = _repl_apply_snapshot(repl, &in, id, seq, count);
+                pthread_mutex_lock(&repl->mutex);
+                if (seq > repl->primary_seq)
+                    repl->primary_seq = seq;
+                pthread_mutex_unlock(&repl->mutex);
+            }
+            else if (sscanf(line, "PING %lu", &seq) == 1)
+            {
+                pthread_mutex_lock(&repl->mutex);
+                repl->primary_seq = seq;
+                pthread_mutex_unlock(&repl->mutex);
+            }
+            else
+                LOG_WARN("Unknown replication line: %s", line);
+
+            // Acknowledge once the buffered batch is fully applied
+            if (ok && in.rio_cnt <= 0)
+            {
+                pthread_mutex_lock(&repl->mutex);
+                len = snprintf(line, sizeof(line), "ACK %lu\n", repl->applied_seq);
+                pthread_mutex_unlock(&repl->mutex);
+                ok = rio_writen(fd, line, len) == len;
+            }
+        }
+
+        pthread_mutex_lock(&repl->mutex);
+        repl->connected = 0;
+        repl->primary_fd = -1;
+        pthread_mutex_unlock(&repl->mutex);
+        close(fd);
+
+        if (repl->running)
+        {
+            LOG_WARN("Lost connection with primary, reconnecting\n");
+            sleep(REPL_RETRY_SECONDS);
+        }
+    }
+
+    return NULL;
+}
+
+Replication * repl_replica_start(const char * host, const char * port, struct Calc * calc, StatRwLock * calc_lock)
+{
+    Replication * repl = _repl_new(REPL_REPLICA, calc, calc_lock);
+    snprintf(repl->host, sizeof(repl->host), "%s", host);
+    snprintf(repl->port, sizeof(repl->port), "%s", port);
+
+    LOG_INFO("Starting replica of %s:%s\n", host, port);
+    pthread_create(&repl->thread, NULL, _repl_replica_thread, repl);
+    return repl;
+}
+
+// -- < Common > -----------------------------------------------------------------
+
+int repl_is_replica(Replication * repl)
+{
+    return repl->role == REPL_REPLICA;
+}
+
+void repl_info(Replication * repl, char * buf, size_t size)
+{
+    size_t len = 0;
+
+    pthread_mutex_lock(&repl->mutex);
+    if (repl->role == REPL_PRIMARY)
+    {
+        len += snprintf(buf + len, size - len, "role=primary id=%016lx seq=%lu oldest=%lu\n", repl->id, repl->head_seq, _repl_oldest_seq(repl));
+        for (size_t i = 0; i < REPL_MAX_REPLICAS && len < size; i++)
+        {
+            struct ReplicaLink * link = &repl->replicas[i];
+            if (!link->used)
+                continue;
+            len += snprintf(buf + len, size - len, "replica=%s sent=%lu acked=%lu lag=%lu last_ack_ms=%ld\n",
+                            link->addr, link->sent_seq, link->acked_seq,
+                            repl->head_seq - link->acked_seq, _repl_ms_since(&link->last_ack));
+        }
+    }
+    else
+    {
+        snprintf(buf, size, "role=replica primary=%s:%s id=%016lx connected=%d applied=%lu primary_seq=%lu lag=%lu last_contact_ms=%ld\n",
+                 repl->host, repl->port, repl->id, repl->connected, repl->applied_seq, repl->primary_seq,
+                 repl->primary_seq > repl->applied_seq ? repl->primary_seq - repl->applied_seq : 0,
+                 repl->connected ? _repl_ms_since(&repl->last_contact) : -1);
+    }
+    pthread_mutex_unlock(&repl->mutex);
+}
+
+void repl_stop(Replication * repl)
+{
+    LOG_INFO("Stopping replication\n");
+    repl->running = 0;
+
+    // Wake up threads blocked on the network
+    pthread_mutex_lock(&repl->mutex);
+    if (repl->listen_fd >= 0)
+        shutdown(repl->listen_fd, SHUT_RDWR);
+    if (repl->primary_fd >= 0)
+        shutdown(repl->primary_fd, SHUT_RDWR);
+    for (size_t i = 0; i < REPL_MAX_REPLICAS; i++)
+        if (repl->replicas[i].used)
+            shutdown(repl->replicas[i].fd, SHUT_RDWR);
+    pthread_cond_broadcast(&repl->appended);
+    pthread_mutex_unlock(&repl->mutex);
+
+    pthread_join(repl->thread, NULL);
+
+    // Senders are detached, wait until all of them are gone
+    for (int busy = 1; busy; )
+    {
+        busy = 0;
+        pthread_mutex_lock(&repl->mutex);
+        for (size_t i = 0; i < REPL_MAX_REPLICAS; i++)
+            busy |= repl->replicas[i].used;
+        pthread_mutex_unlock(&repl->mutex);
+        if (busy)
+            usleep(10000);
+    }
+
+    if (repl->listen_fd >= 0)
+        close(repl->listen_fd);
+    pthread_mutex_destroy(&repl->mutex);
+    pthread_cond_destroy(&repl->appended);
+    free(repl);
+}
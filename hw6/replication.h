@@ -0,0 +1,74 @@
+/*
+    Primary/replica replication of the calculator variable store.
+
+    The primary keeps an ordered log of assignments and removals (of
+    variables that expired or were evicted), each one tagged with a
+    sequence number, and streams it over TCP to every connected replica.
+    Replicas apply the stream to their local Calc and serve read-only
+    expressions from it.
+
+    Sequence numbers start over when the primary restarts, so every start
+    draws a new replication id, sent in hex with each snapshot. A replica
+    syncing with an id other than the primary's (0 before its first
+    snapshot) gets a snapshot rather than the log. The protocol is line based:
+
+        replica -> primary:  SYNC <id> <last applied seq>
+                             ACK <last applied seq>
+        primary -> replica:  SNAPSHOT <id> <seq> <count>  followed by <count> "<name> <value>" lines
+                             SET <seq> <name> <value>
+                             DEL <seq> <name>
+                             PING <head seq>
+*/
+
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "calc.h"
+#include "statmutex.h"
+
+typedef struct Replication Replication;
+
+/// Summary:
+///     Start replication in primary mode, accepting replicas on the given port
+/// Parameters:
+///     port       : port where replicas will connect to
+///     calc       : calculator whose assignments are replicated
+///     calc_lock : lock protecting calc, held shared while taking snapshots
+/// Return:
+///     Replication object, or NULL if the port could not be opened
+Replication * repl_primary_start(const char * port, struct Calc * calc, StatRwLock * calc_lock);
+
+/// Summary:
+///     Start replication in replica mode, following the given primary
+/// Parameters:
+///     host, port : address of the primary replication port
+///     calc       : local calculator where the stream is applied
+///     calc_lock : lock protecting calc, held exclusively while applying the stream
+/// Return:
+///     Replication object
+Replication * repl_replica_start(const char * host, const char * port, struct Calc * calc, StatRwLock * calc_lock);
+
+/// Summary:
+///     Append an assignment to the primary log. Must be called with calc_lock
+///     held exclusively, so the log order matches the order in which assignments were applied
+void repl_primary_append(Replication * repl, const char * name, int value);
+
+/// Summary:
+///     Append the removal of a variable to the primary log, with calc_lock held exclusively
+void repl_primary_delete(Replication * repl, const char * name);
+
+/// Summary:
+///     Tells if this replication object is a replica (read only)
+int repl_is_replica(Replication * repl);
+
+/// Summary:
+///     Write a report of sequence numbers and replica lag into buf
+void repl_info(Replication * repl, char * buf, size_t size);
+
+/// Summary:
+///     Stop replication threads and free the object
+void repl_stop(Replication * repl);
+
+#endif // REPLICATION_H
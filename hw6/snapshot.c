@@ -0,0 +1,375 @@
+#include "snapshot.h"
+#include "logger.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SNAPSHOT_MAGIC "CALCSNP1"
+#define SNAPSHOT_MAGIC_SIZE 8
+#define SNAPSHOT_WRITE_BUFFER (64 * 1024)
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+/// Buffered output of the child process, hashing what goes through it
+struct SnapshotWriter
+{
+    int fd;
+    int failed;
+    uint32_t hash;
+    size_t length;
+    char buffer[SNAPSHOT_WRITE_BUFFER];
+};
+
+static pthread_mutex_t _snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;  // Protects everything below
+static pthread_cond_t _snapshot_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t _snapshot_thread;
+static int _snapshot_running = 0;
+static int _snapshot_requested = 0;
+static SnapshotStats _snapshot_stats;
+
+static struct Calc * _snapshot_calc;
+static StatRwLock * _snapshot_lock;
+static const char * _snapshot_path;
+static unsigned _snapshot_interval_s;
+static snapshot_fork_fn _snapshot_forking = NULL;
+static snapshot_saved_fn _snapshot_saved = NULL;
+static void * _snapshot_hooks_ctx = NULL;
+
+static uint64_t _snapshot_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint32_t _snapshot_hash(uint32_t hash, const unsigned char * data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ data[i]) * FNV_PRIME;
+    return hash;
+}
+
+// -- < Child process > ----------------------------------------------------------
+
+// Only raw system calls from here on: other threads may have held stdio or logger locks at fork
+
+static void _snapshot_flush(struct SnapshotWriter * out)
+{
+    size_t written = 0;
+    while (written < out->length && !out->failed)
+    {
+        ssize_t n = write(out->fd, out->buffer + written, out->length - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            out->failed = 1;
+        else
+            written += n;
+    }
+    out->length = 0;
+}
+
+static void _snapshot_put(struct SnapshotWriter * out, const void * data, size_t length)
+{
+    out->hash = _snapshot_hash(out->hash, data, length);
+    if (out->length + length > SNAPSHOT_WRITE_BUFFER)
+        _snapshot_flush(out);
+    memcpy(out->buffer + out->length, data, length);
+    out->length += length;
+}
+
+static void _snapshot_put_uint(struct SnapshotWriter * out, uint64_t value, size_t bytes)
+{
+    unsigned char encoded[8];
+    for (size_t i = 0; i < bytes; i++)
+        encoded[i] = (unsigned char) (value >> (8 * i));
+    _snapshot_put(out, encoded, bytes);
+}
+
+static void _snapshot_put_variable(void * ctx, const char * name, int value)
+{
+    struct SnapshotWriter * out = (struct SnapshotWriter *) ctx;
+    unsigned char length = (unsigned char) strlen(name);
+
+    _snapshot_put(out, &length, 1);
+    _snapshot_put(out, name, length);
+    _snapshot_put_uint(out, (uint32_t) value, 4);
+}
+
+static void _snapshot_count_variable(void * ctx, const char * name, int value)
+{
+    (void) name;
+    (void) value;
+    (*(size_t *) ctx)++;
+}
+
+// Write the whole table next to the snapshot, then replace it
+static int _snapshot_write(struct Calc * calc, const char * path)
+{
+    char tmp[PATH_MAX];
+    if ((size_t) snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp))
+        return 1;
+
+    static struct SnapshotWriter out;
+    out.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out.fd < 0)
+        return 1;
+    out.failed = 0;
+    out.hash = FNV_OFFSET;
+    out.length = 0;
+
+    // Expired variables are left out, so calc_count may be too many
+    size_t variables = 0;
+    calc_foreach(calc, _snapshot_count_variable, &variables);
+
+    _snapshot_put(&out, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE);
+    _snapshot_put_uint(&out, variables, 8);
+    calc_foreach(calc, _snapshot_put_variable, &out);
+    _snapshot_put_uint(&out, out.hash, 4);
+    _snapshot_flush(&out);
+
+    if (out.failed || fsync(out.fd) != 0 || close(out.fd) != 0 || rename(tmp, path) != 0)
+    {
+        unlink(tmp);
+        return 1;
+    }
+
+    // The rename itself must be durable before anything relies on the new snapshot
+    char dir[PATH_MAX];
+    const char * slash = strrchr(path, '/');
+    snprintf(dir, sizeof(dir), "%.*s", slash ? (int) (slash - path) + 1 : 1, slash ? path : ".");
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0)
+    {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    return 0;
+}
+
+// -- < Snapshot thread > --------------------------------------------------------
+
+// Fork a child writing the snapshot and wait for it
+static void _snapshot_save(void)
+{
+    uint64_t start = _snapshot_now();
+
+    // Shared is enough for a consistent image: assignments are exclusive
+    stat_rwlock_rdlock(_snapshot_lock);
+    size_t variables = calc_count(_snapshot_calc);
+    if (_snapshot_forking)
+        _snapshot_forking(_snapshot_hooks_ctx);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // Signals meant for the server must not run its handlers in the child
+        signal(SIGINT, SIG_DFL);
+        signal(SIGALRM, SIG_DFL);
+        _exit(_snapshot_write(_snapshot_calc, _snapshot_path));
+    }
+    stat_rwlock_unlock(_snapshot_lock);
+    uint64_t fork_ns = _snapshot_now() - start;
+
+    int status = 1;
+    if (pid < 0)
+    {
+        LOG_ERROR("Could not fork to save a snapshot: %s\n", strerror(errno));
+    }
+    else
+    {
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+            ;
+        if (status != 0)
+            LOG_ERROR("Could not write the snapshot %s\n", _snapshot_path);
+    }
+
+    pthread_mutex_lock(&_snapshot_mutex);
+    if (pid >= 0)
+    {
+        _snapshot_stats.last_fork_ns = fork_ns;
+        _snapshot_stats.total_fork_ns += fork_ns;
+        if (fork_ns > _snapshot_stats.max_fork_ns)
+            _snapshot_stats.max_fork_ns = fork_ns;
+    }
+    if (status == 0)
+    {
+        _snapshot_stats.saves++;
+        _snapshot_stats.last_duration_ns = _snapshot_now() - start;
+        _snapshot_stats.last_variables = variables;
+    }
+    else
+        _snapshot_stats.failures++;
+    pthread_mutex_unlock(&_snapshot_mutex);
+
+    if (_snapshot_saved)
+        _snapshot_saved(_snapshot_hooks_ctx, status == 0);
+
+    if (status == 0)
+        LOG_INFO("Saved %lu variables to %s, fork took %lu us\n", variables, _snapshot_path, fork_ns / 1000);
+}
+
+static void * _snapshot_main(void * args)
+{
+    (void) args;
+    pthread_mutex_lock(&_snapshot_mutex);
+
+    struct timespec next;
+    clock_gettime(CLOCK_REALTIME, &next);
+    next.tv_sec += _snapshot_interval_s;
+
+    while (_snapshot_running)
+    {
+        int timed_out = 0;
+        if (_snapshot_requested)
+            ;
+        else if (_snapshot_interval_s > 0)
+            timed_out = pthread_cond_timedwait(&_snapshot_cond, &_snapshot_mutex, &next) == ETIMEDOUT;
+        else
+            pthread_cond_wait(&_snapshot_cond, &_snapshot_mutex);
+
+        if (!_snapshot_running || !(_snapshot_requested || timed_out))
+            continue;
+
+        _snapshot_requested = 0;
+        _snapshot_stats.saving = 1;
+        pthread_mutex_unlock(&_snapshot_mutex);
+
+        _snapshot_save();
+
+        pthread_mutex_lock(&_snapshot_mutex);
+        _snapshot_stats.saving = 0;
+        clock_gettime(CLOCK_REALTIME, &next);
+        next.tv_sec += _snapshot_interval_s;
+    }
+
+    pthread_mutex_unlock(&_snapshot_mutex);
+    return NULL;
+}
+
+// -- < Implementation > ---------------------------------------------------------
+
+long snapshot_load(struct Calc * calc, const char * path)
+{
+    FILE * file = fopen(path, "rb");
+    if (file == NULL)
+        return errno == ENOENT ? 0 : -1;
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+
+    unsigned char * data = size > 0 ? malloc(size) : NULL;
+    int read_ok = data && fread(data, 1, size, file) == (size_t) size;
+    fclose(file);
+
+    // Magic, count and hash at least
+    if (!read_ok || size < SNAPSHOT_MAGIC_SIZE + 12 || memcmp(data, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) != 0)
+        goto invalid;
+
+    size_t end = size - 4;
+    uint32_t hash = 0;
+    for (size_t i = 0; i < 4; i++)
+        hash |= (uint32_t) data[end + i] << (8 * i);
+    if (_snapshot_hash(FNV_OFFSET, data, end) != hash)
+        goto invalid;
+
+    uint64_t count = 0;
+    for (size_t i = 0; i < 8; i++)
+        count |= (uint64_t) data[SNAPSHOT_MAGIC_SIZE + i] << (8 * i);
+
+    size_t offset = SNAPSHOT_MAGIC_SIZE + 8;
+    for (uint64_t n = 0; n < count; n++)
+    {
+        if (offset + 1 > end || data[offset] >= CALC_KEY_SIZE || offset + 1 + data[offset] + 4 > end)
+            goto invalid;
+
+        char name[CALC_KEY_SIZE];
+        size_t length = data[offset++];
+        memcpy(name, data + offset, length);
+        name[length] = '\0';
+        offset += length;
+
+        uint32_t value = 0;
+        for (size_t i = 0; i < 4; i++)
+            value |= (uint32_t) data[offset + i] << (8 * i);
+        offset += 4;
+
+        calc_set(calc, name, (int) value);
+    }
+
+    free(data);
+    return (long) count;
+
+invalid:
+    free(data);
+    return -1;
+}
+
+void snapshot_set_hooks(snapshot_fork_fn forking, snapshot_saved_fn saved, void * ctx)
+{
+    _snapshot_forking = forking;
+    _snapshot_saved = saved;
+    _snapshot_hooks_ctx = ctx;
+}
+
+int snapshot_start(struct Calc * calc, StatRwLock * lock, const char * path, unsigned interval_s)
+{
+    _snapshot_calc = calc;
+    _snapshot_lock = lock;
+    _snapshot_path = path;
+    _snapshot_interval_s = interval_s;
+    _snapshot_requested = 0;
+    _snapshot_running = 1;
+
+    if (pthread_create(&_snapshot_thread, NULL, _snapshot_main, NULL) != 0)
+    {
+        LOG_ERROR("Could not start the snapshot thread\n");
+        _snapshot_running = 0;
+        return 1;
+    }
+    return 0;
+}
+
+void snapshot_stop(int final_save)
+{
+    pthread_mutex_lock(&_snapshot_mutex);
+    int running = _snapshot_running;
+    _snapshot_running = 0;
+    pthread_cond_signal(&_snapshot_cond);
+    pthread_mutex_unlock(&_snapshot_mutex);
+
+    if (!running)
+        return;
+    pthread_join(_snapshot_thread, NULL);
+
+    if (final_save)
+        _snapshot_save();
+}
+
+int snapshot_request(void)
+{
+    pthread_mutex_lock(&_snapshot_mutex);
+    int busy = _snapshot_requested || _snapshot_stats.saving;
+    if (!busy)
+    {
+        _snapshot_requested = 1;
+        pthread_cond_signal(&_snapshot_cond);
+    }
+    pthread_mutex_unlock(&_snapshot_mutex);
+    return busy;
+}
+
+void snapshot_stats(SnapshotStats * stats)
+{
+    pthread_mutex_lock(&_snapshot_mutex);
+    *stats = _snapshot_stats;
+    pthread_mutex_unlock(&_snapshot_mutex);
+}
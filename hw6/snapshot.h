@@ -0,0 +1,87 @@
+/*
+    Background snapshots of the variable table.
+
+    A save forks the server: the child process gets a copy-on-write image
+    of the calculator and writes it to a temporary file, which is synced
+    and renamed over the snapshot once complete, so a crash mid-save leaves
+    the previous snapshot in place. The parent only waits for fork itself,
+    holding the store lock shared so no assignment is half applied in the
+    image; reads and counter updates carry on meanwhile. That wait is the
+    whole stall a save causes, and is reported as the fork time.
+
+    Saves run from a snapshot thread, on request ("save") and optionally
+    every few seconds, one at a time. The thread also reaps the child.
+
+    File format, integers little endian:
+        "CALCSNP1"                      magic and format version
+        u64 count
+        count x { u8 length, name, i32 value }
+        u32 FNV-1a hash of everything before it
+*/
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "calc.h"
+#include "statmutex.h"
+
+/// Save statistics, for reports
+typedef struct SnapshotStats
+{
+    int saving;                     // A child is writing a snapshot
+    unsigned long saves;            // Snapshots written
+    unsigned long failures;         // Saves that could not fork or whose child failed
+    uint64_t last_fork_ns;          // Time the store lock was held to fork, last save
+    uint64_t max_fork_ns;
+    uint64_t total_fork_ns;
+    uint64_t last_duration_ns;      // From fork to the snapshot being in place, last save
+    size_t last_variables;          // Variables in the store when the last save forked
+} SnapshotStats;
+
+/// Summary:
+///     Load a snapshot into a calculator, keeping variables it does not mention
+/// Return:
+///     Amount of variables loaded, 0 if the file does not exist, -1 if it is not a valid snapshot
+long snapshot_load(struct Calc * calc, const char * path);
+
+/// Called just before every fork, with the store lock held shared
+typedef void (*snapshot_fork_fn)(void * ctx);
+
+/// Called once the child of a save is done, saved being nonzero if the snapshot is in place
+typedef void (*snapshot_saved_fn)(void * ctx, int saved);
+
+/// Summary:
+///     Set the functions called around every save, e.g. to truncate a log the
+///     snapshot makes unnecessary. Must be called before snapshot_start.
+void snapshot_set_hooks(snapshot_fork_fn forking, snapshot_saved_fn saved, void * ctx);
+
+/// Summary:
+///     Start the snapshot thread
+/// Parameters:
+///     calc       : calculator to save
+///     lock       : lock of the calculator, held shared while forking
+///     path       : snapshot file
+///     interval_s : seconds between periodic saves, 0 to only save on request
+/// Return:
+///     0 on success, anything else if the thread could not be started
+int snapshot_start(struct Calc * calc, StatRwLock * lock, const char * path, unsigned interval_s);
+
+/// Summary:
+///     Stop the snapshot thread, after waiting for a save in progress
+/// Parameters:
+///     final_save : nonzero to save once more before returning, e.g. on shutdown
+void snapshot_stop(int final_save);
+
+/// Summary:
+///     Ask the snapshot thread for a save
+/// Return:
+///     0 if a save will start, 1 if one is already in progress or requested
+int snapshot_request(void);
+
+/// Summary:
+///     Read the save statistics
+void snapshot_stats(SnapshotStats * stats);
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,59 @@
+#!/bin/bash
+#
+# Snapshot test: saves on request, on shutdown and periodically, each
+# checked by killing the server and loading the snapshot on a new one.
+# Also checks that a damaged snapshot is refused.
+#
+
+PORT=15500
+SNAPSHOT=$(mktemp -u /tmp/calcSnapshot.XXXXXX)
+. ./testlib.sh "$@"
+
+# wait until the server reports the given amount of saves
+wait_saves() {
+	for _ in $(seq 50); do
+		ask $PORT saveinfo | grep -q "saving=0 saves=$1 " && return 0
+		sleep 0.1
+	done
+	return 1
+}
+
+cleanup() {
+	stop_all
+	rm -f "$SNAPSHOT" "$SNAPSHOT.tmp"
+}
+
+start
+check testDisabled "Error snapshots are disabled" "$(ask $PORT save)"
+crash
+
+start --snapshot "$SNAPSHOT"
+ask $PORT "a = 1" "b = 0 - 7" > /dev/null
+check testSave "Ok" "$(ask $PORT save)"
+wait_saves 1
+ask $PORT "c = 3" > /dev/null
+crash
+start --snapshot "$SNAPSHOT"
+check testLoaded "$(printf '1\n-7')" "$(ask $PORT a b)"
+check testNotSaved "Error" "$(ask $PORT c)"
+
+# a clean shutdown saves once more
+ask $PORT "c = 3" shutdown > /dev/null 2>&1
+wait $pid 2> /dev/null
+start --snapshot "$SNAPSHOT"
+check testShutdownSave "3" "$(ask $PORT c)"
+crash
+
+start --snapshot "$SNAPSHOT" --save-interval 1
+ask $PORT "d = 4" > /dev/null
+wait_saves 1
+crash
+start --snapshot "$SNAPSHOT"
+check testPeriodicSave "4" "$(ask $PORT d)"
+crash
+
+truncate -s -1 "$SNAPSHOT"
+./calcServer $PORT --snapshot "$SNAPSHOT" > /dev/null 2>&1
+check testDamaged "1" "$?"
+
+finish
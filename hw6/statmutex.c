@@ -0,0 +1,285 @@
+#define _GNU_SOURCE            // pthread_rwlockattr_setkind_np
+#include "statmutex.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Writers are preferred, so a stream of readers can't starve them
+static int _stat_rwlock_init_raw(pthread_rwlock_t * lock)
+{
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    int error = pthread_rwlock_init(lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    return error;
+}
+
+#ifdef STAT_MUTEX
+
+// Every initialized StatMutex and StatRwLock, for reports
+static pthread_mutex_t _stat_mutex_registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static StatMutex * _stat_mutex_registry = NULL;
+static StatRwLock * _stat_rwlock_registry = NULL;
+
+static uint64_t _stat_mutex_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static size_t _stat_mutex_bucket(uint64_t ns)
+{
+    size_t bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    return bucket < STAT_MUTEX_BUCKETS ? bucket : STAT_MUTEX_BUCKETS - 1;
+}
+
+int stat_mutex_init(StatMutex * mutex, const char * name)
+{
+    memset(mutex, 0, sizeof(StatMutex));
+    mutex->name = name;
+    mutex->stats.name = name;
+
+    int error = pthread_mutex_init(&mutex->mutex, NULL);
+    if (error)
+        return error;
+
+    pthread_mutex_lock(&_stat_mutex_registry_mutex);
+    mutex->next = _stat_mutex_registry;
+    _stat_mutex_registry = mutex;
+    pthread_mutex_unlock(&_stat_mutex_registry_mutex);
+    return 0;
+}
+
+int stat_mutex_destroy(StatMutex * mutex)
+{
+    pthread_mutex_lock(&_stat_mutex_registry_mutex);
+    for (StatMutex ** link = &_stat_mutex_registry; *link; link = &(*link)->next)
+        if (*link == mutex)
+        {
+            *link = mutex->next;
+            break;
+        }
+    pthread_mutex_unlock(&_stat_mutex_registry_mutex);
+
+    return pthread_mutex_destroy(&mutex->mutex);
+}
+
+int stat_mutex_lock(StatMutex * mutex)
+{
+    // Uncontended acquisitions don't pay for a clock read before locking
+    uint64_t wait = 0;
+    int contended = 0;
+    int error = pthread_mutex_trylock(&mutex->mutex);
+    if (error == EBUSY)
+    {
+        contended = 1;
+        uint64_t start = _stat_mutex_now();
+        error = pthread_mutex_lock(&mutex->mutex);
+        mutex->acquired_at = _stat_mutex_now();
+        wait = mutex->acquired_at - start;
+    }
+    else
+        mutex->acquired_at = _stat_mutex_now();
+
+    if (error)
+        return error;
+
+    StatMutexSnapshot * stats = &mutex->stats;
+    stats->acquisitions++;
+    stats->contended += contended;
+    stats->wait_ns += wait;
+    stats->wait_histogram[_stat_mutex_bucket(wait)]++;
+    return 0;
+}
+
+int stat_mutex_unlock(StatMutex * mutex)
+{
+    uint64_t hold = _stat_mutex_now() - mutex->acquired_at;
+    mutex->stats.hold_ns += hold;
+    mutex->stats.hold_histogram[_stat_mutex_bucket(hold)]++;
+    return pthread_mutex_unlock(&mutex->mutex);
+}
+
+int stat_rwlock_init(StatRwLock * lock, const char * name)
+{
+    memset(lock, 0, sizeof(StatRwLock));
+    lock->stats.name = name;
+    lock->stats.rwlock = 1;
+
+    int error = _stat_rwlock_init_raw(&lock->lock);
+    if (error)
+        return error;
+
+    pthread_mutex_lock(&_stat_mutex_registry_mutex);
+    lock->next = _stat_rwlock_registry;
+    _stat_rwlock_registry = lock;
+    pthread_mutex_unlock(&_stat_mutex_registry_mutex);
+    return 0;
+}
+
+int stat_rwlock_destroy(StatRwLock * lock)
+{
+    pthread_mutex_lock(&_stat_mutex_registry_mutex);
+    for (StatRwLock ** link = &_stat_rwlock_registry; *link; link = &(*link)->next)
+        if (*link == lock)
+        {
+            *link = lock->next;
+            break;
+        }
+    pthread_mutex_unlock(&_stat_mutex_registry_mutex);
+
+    return pthread_rwlock_destroy(&lock->lock);
+}
+
+int stat_rwlock_rdlock(StatRwLock * lock)
+{
+    int error = pthread_rwlock_tryrdlock(&lock->lock);
+    if (error != EBUSY)
+        return error;
+
+    // Only waits are counted, readers share the lock and must not share a counter too
+    uint64_t start = _stat_mutex_now();
+    error = pthread_rwlock_rdlock(&lock->lock);
+    __atomic_add_fetch(&lock->stats.shared_contended, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&lock->stats.shared_wait_ns, _stat_mutex_now() - start, __ATOMIC_RELAXED);
+    return error;
+}
+
+int stat_rwlock_wrlock(StatRwLock * lock)
+{
+    uint64_t wait = 0;
+    int contended = 0;
+    int error = pthread_rwlock_trywrlock(&lock->lock);
+    if (error == EBUSY)
+    {
+        contended = 1;
+        uint64_t start = _stat_mutex_now();
+        error = pthread_rwlock_wrlock(&lock->lock);
+        lock->acquired_at = _stat_mutex_now();
+        wait = lock->acquired_at - start;
+    }
+    else
+        lock->acquired_at = _stat_mutex_now();
+
+    if (error)
+        return error;
+
+    // acquired_at is 0 while no writer holds the lock, that's how unlock tells the two apart
+    lock->acquired_at |= 1;
+    StatMutexSnapshot * stats = &lock->stats;
+    stats->acquisitions++;
+    stats->contended += contended;
+    stats->wait_ns += wait;
+    stats->wait_histogram[_stat_mutex_bucket(wait)]++;
+    return 0;
+}
+
+int stat_rwlock_unlock(StatRwLock * lock)
+{
+    // Readers can't be holding the lock at the same time as a writer, so this is not racy
+    if (lock->acquired_at)
+    {
+        uint64_t hold = _stat_mutex_now() - lock->acquired_at;
+        lock->acquired_at = 0;
+        lock->stats.hold_ns += hold;
+        lock->stats.hold_histogram[_stat_mutex_bucket(hold)]++;
+    }
+    return pthread_rwlock_unlock(&lock->lock);
+}
+
+void stat_mutex_foreach(void (*fn)(void * ctx, const StatMutexSnapshot * stats), void * ctx)
+{
+    StatMutexSnapshot snapshot;
+
+    pthread_mutex_lock(&_stat_mutex_registry_mutex);
+    for (StatMutex * mutex = _stat_mutex_registry; mutex; mutex = mutex->next)
+    {
+        // Copied with the raw lock, so taking a snapshot doesn't show up in it
+        pthread_mutex_lock(&mutex->mutex);
+        snapshot = mutex->stats;
+        pthread_mutex_unlock(&mutex->mutex);
+        fn(ctx, &snapshot);
+    }
+    for (StatRwLock * lock = _stat_rwlock_registry; lock; lock = lock->next)
+    {
+        pthread_rwlock_wrlock(&lock->lock);
+        snapshot = lock->stats;
+        pthread_rwlock_unlock(&lock->lock);
+        fn(ctx, &snapshot);
+    }
+    pthread_mutex_unlock(&_stat_mutex_registry_mutex);
+}
+
+#else
+
+int stat_rwlock_init(StatRwLock * lock, const char * name)
+{
+    (void) name;
+    return _stat_rwlock_init_raw(lock);
+}
+
+void stat_mutex_foreach(void (*fn)(void * ctx, const StatMutexSnapshot * stats), void * ctx)
+{
+    (void) fn;
+    (void) ctx;
+}
+
+#endif // STAT_MUTEX
+
+uint64_t stat_mutex_quantile(const uint64_t * histogram, double quantile)
+{
+    uint64_t total = 0;
+    for (size_t i = 0; i < STAT_MUTEX_BUCKETS; i++)
+        total += histogram[i];
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t) (quantile * total), seen = 0;
+    for (size_t i = 0; i < STAT_MUTEX_BUCKETS; i++)
+    {
+        seen += histogram[i];
+        if (seen > rank)
+            return i ? 1ull << i : 0;
+    }
+    return 1ull << (STAT_MUTEX_BUCKETS - 1);
+}
+
+/// Output buffer of stat_mutex_report
+struct StatMutexReport
+{
+    char * buf;
+    size_t size;
+    size_t len;
+};
+
+static void _stat_mutex_report_one(void * ctx, const StatMutexSnapshot * stats)
+{
+    struct StatMutexReport * report = ctx;
+    if (report->len >= report->size)
+        return;
+
+    report->len += snprintf(report->buf + report->len, report->size - report->len,
+                            "lock=%s acquired=%lu contended=%lu wait_ns=%lu hold_ns=%lu "
+                            "wait_p50_ns=%lu wait_p99_ns=%lu hold_p50_ns=%lu hold_p99_ns=%lu\n",
+                            stats->name, stats->acquisitions, stats->contended, stats->wait_ns, stats->hold_ns,
+                            stat_mutex_quantile(stats->wait_histogram, 0.5),
+                            stat_mutex_quantile(stats->wait_histogram, 0.99),
+                            stat_mutex_quantile(stats->hold_histogram, 0.5),
+                            stat_mutex_quantile(stats->hold_histogram, 0.99));
+
+    // Same line, the counters above were exclusive acquisitions
+    if (stats->rwlock && report->len > 0 && report->len < report->size)
+        report->len += snprintf(report->buf + report->len - 1, report->size - report->len + 1,
+                                " shared_contended=%lu shared_wait_ns=%lu\n",
+                                stats->shared_contended, stats->shared_wait_ns) - 1;
+}
+
+void stat_mutex_report(char * buf, size_t size)
+{
+    struct StatMutexReport report = { buf, size, 0 };
+    buf[0] = '\0';
+    stat_mutex_foreach(_stat_mutex_report_one, &report);
+}
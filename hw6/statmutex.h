@@ -0,0 +1,136 @@
+/*
+    Mutex wrapper recording contention statistics.
+
+    Every StatMutex counts its acquisitions and how many of them had to
+    wait, and keeps log2 histograms of wait and hold times in nanoseconds.
+    The statistics are updated while holding the lock, so they cost two
+    clock reads per acquisition and no atomic operations.
+
+    StatRwLock does the same for a reader-writer lock. Exclusive
+    acquisitions are recorded like a mutex; shared ones only count when
+    they had to wait, so the common uncontended read path stays a plain
+    pthread_rwlock_rdlock.
+
+    Built without STAT_MUTEX defined, a StatMutex is a plain pthread_mutex_t,
+    a StatRwLock a plain pthread_rwlock_t, and every function below is the
+    matching pthread call.
+*/
+
+#ifndef STAT_MUTEX_H
+#define STAT_MUTEX_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define STAT_MUTEX_BUCKETS 40       // Bucket i counts durations in [2^(i-1), 2^i) ns, bucket 0 counts 0 ns
+
+/// Statistics of a lock at some point in time
+typedef struct StatMutexSnapshot
+{
+    const char * name;
+    uint64_t acquisitions;
+    uint64_t contended;             // Acquisitions that found the lock taken
+    uint64_t wait_ns;               // Total time spent waiting for the lock
+    uint64_t hold_ns;               // Total time the lock was held
+    uint64_t wait_histogram[STAT_MUTEX_BUCKETS];
+    uint64_t hold_histogram[STAT_MUTEX_BUCKETS];
+    int rwlock;                     // Taken from a StatRwLock, the fields above count exclusive acquisitions
+    uint64_t shared_contended;      // Shared acquisitions that found the lock taken
+    uint64_t shared_wait_ns;        // Total time they waited
+} StatMutexSnapshot;
+
+#ifdef STAT_MUTEX
+
+typedef struct StatMutex
+{
+    pthread_mutex_t mutex;
+    const char * name;
+    uint64_t acquired_at;           // When the current holder got the lock
+    StatMutexSnapshot stats;        // Written with the lock held
+    struct StatMutex * next;        // Registry link
+} StatMutex;
+
+/// Summary:
+///     Initialize a mutex and register it for reports
+/// Parameters:
+///     name : tag shown in reports, must outlive the mutex
+/// Return:
+///     0 on success, an error number otherwise
+int stat_mutex_init(StatMutex * mutex, const char * name);
+
+/// Summary:
+///     Unregister and destroy a mutex
+int stat_mutex_destroy(StatMutex * mutex);
+
+int stat_mutex_lock(StatMutex * mutex);
+int stat_mutex_unlock(StatMutex * mutex);
+
+/// Summary:
+///     Underlying pthread mutex, e.g. for pthread_cond_wait. Waits done directly
+///     on it are not recorded.
+#define stat_mutex_raw(m) (&(m)->mutex)
+
+typedef struct StatRwLock
+{
+    pthread_rwlock_t lock;
+    uint64_t acquired_at;           // When the current writer got the lock
+    StatMutexSnapshot stats;        // Exclusive counters written with the write lock, shared ones atomically
+    struct StatRwLock * next;       // Registry link
+} StatRwLock;
+
+/// Summary:
+///     Initialize a reader-writer lock preferring writers, and register it for reports
+/// Parameters:
+///     name : tag shown in reports, must outlive the lock
+/// Return:
+///     0 on success, an error number otherwise
+int stat_rwlock_init(StatRwLock * lock, const char * name);
+
+/// Summary:
+///     Unregister and destroy a reader-writer lock
+int stat_rwlock_destroy(StatRwLock * lock);
+
+int stat_rwlock_rdlock(StatRwLock * lock);
+int stat_rwlock_wrlock(StatRwLock * lock);
+int stat_rwlock_unlock(StatRwLock * lock);
+
+#else
+
+typedef pthread_mutex_t StatMutex;
+
+#define stat_mutex_init(m, name) pthread_mutex_init(m, NULL)
+#define stat_mutex_destroy(m) pthread_mutex_destroy(m)
+#define stat_mutex_lock(m) pthread_mutex_lock(m)
+#define stat_mutex_unlock(m) pthread_mutex_unlock(m)
+#define stat_mutex_raw(m) (m)
+
+typedef pthread_rwlock_t StatRwLock;
+
+int stat_rwlock_init(StatRwLock * lock, const char * name);
+#define stat_rwlock_destroy(l) pthread_rwlock_destroy(l)
+#define stat_rwlock_rdlock(l) pthread_rwlock_rdlock(l)
+#define stat_rwlock_wrlock(l) pthread_rwlock_wrlock(l)
+#define stat_rwlock_unlock(l) pthread_rwlock_unlock(l)
+
+#endif // STAT_MUTEX
+
+/// Summary:
+///     Call fn with a snapshot of every registered mutex. Does nothing when statistics
+///     are compiled out.
+void stat_mutex_foreach(void (*fn)(void * ctx, const StatMutexSnapshot * stats), void * ctx);
+
+/// Summary:
+///     Duration below which a fraction of the histogram samples fall
+/// Parameters:
+///     histogram : one of the snapshot histograms
+///     quantile  : between 0 and 1
+/// Return:
+///     Upper bound of the bucket holding the quantile, in nanoseconds
+uint64_t stat_mutex_quantile(const uint64_t * histogram, double quantile);
+
+/// Summary:
+///     Write one line per registered mutex with its counters and wait/hold percentiles
+void stat_mutex_report(char * buf, size_t size);
+
+#endif // STAT_MUTEX_H
@@ -0,0 +1,41 @@
+#!/bin/bash
+#
+# Store test: variables kept in a memory mapped file survive a clean
+# shutdown and a crash, a store growing past its first size reopens with
+# everything in it, and a damaged or conflicting setup is refused.
+#
+
+PORT=15700
+STORE=$(mktemp -u /tmp/calcStore.XXXXXX)
+. ./testlib.sh "$@"
+
+cleanup() {
+	stop_all
+	rm -f "$STORE" "$STORE.tmp"
+}
+
+start --store "$STORE"
+ask $PORT "a = 1" "b = 0 - 7" > /dev/null
+ask $PORT shutdown > /dev/null 2>&1
+wait $pid 2> /dev/null
+start --store "$STORE"
+check testReopen "$(printf '1\n-7')" "$(ask $PORT a b)"
+
+# writes reach the mapping right away, a killed server loses nothing
+letters=({a..z})
+names=()
+for i in $(seq 100); do names+=("v${letters[i % 26]}${letters[i / 26]} = $i"); done
+ask $PORT "${names[@]}" "c = 3" > /dev/null
+crash
+start --store "$STORE"
+check testCrash "$(printf '3\n100')" "$(ask $PORT c vwd)"
+crash
+
+./calcServer $PORT --store "$STORE" --snapshot "$STORE.snp" > /dev/null 2>&1
+check testSnapshotRefused "1" "$?"
+
+truncate -s -1 "$STORE"
+./calcServer $PORT --store "$STORE" > /dev/null 2>&1
+check testDamaged "1" "$?"
+
+finish
@@ -23,9 +23,16 @@
  */
 
 #include <signal.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
 #include "tctest.h"
 
+#define TCTEST_BENCH_MAX_ITERATIONS 1000000000L
+
 typedef struct {
 	int signum;
 	const char *msg;
@@ -48,6 +55,15 @@ int tctest_num_executed;
 const char *tctest_testname_to_execute;
 void (*tctest_on_test_executed)(const char *testname, int passed);
 void (*tctest_on_complete)(int num_passed, int num_executed);
+long tctest_bench_min_ns = 1000000000L;
+unsigned long (*tctest_bench_alloc_count)(void);
+void (*tctest_on_bench_executed)(const tctest_bench_result *result);
+
+/* State of the benchmark run in progress */
+static long long tctest_bench_start_ns;
+static unsigned long tctest_bench_start_allocs;
+static long long tctest_bench_start_instructions;
+static int tctest_bench_instructions_fd = -2;	/* -2 until opened, -1 if unavailable */
 
 /*
  * Workaround for the stdio functions not being
@@ -115,3 +131,77 @@ void tctest_register_signal_handlers(void) {
 		sigaction(tctest_signal_list[i].signum, &sa, NULL);
 	}
 }
+
+static long long tctest_bench_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*
+ * Instructions retired in user space by the calling thread, or -1 if
+ * perf_event_open is not available (or not allowed).
+ */
+static long long tctest_bench_instructions(void) {
+#ifdef __linux__
+	if (tctest_bench_instructions_fd == -2) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		tctest_bench_instructions_fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (tctest_bench_instructions_fd < 0) {
+			tctest_bench_instructions_fd = -1;
+		}
+	}
+
+	long long count;
+	if (tctest_bench_instructions_fd >= 0 &&
+	    read(tctest_bench_instructions_fd, &count, sizeof(count)) == sizeof(count)) {
+		return count;
+	}
+#endif
+	return -1;
+}
+
+long tctest_bench_next(tctest_bench_result *result, long iterations) {
+	if (iterations > 0) {
+		long long elapsed = tctest_bench_now() - tctest_bench_start_ns;
+		long long instructions = tctest_bench_instructions();
+
+		if (elapsed >= tctest_bench_min_ns || iterations >= TCTEST_BENCH_MAX_ITERATIONS) {
+			result->iterations = iterations;
+			result->ns_per_op = (double)elapsed / iterations;
+			result->allocs_per_op = tctest_bench_alloc_count ?
+				(double)(tctest_bench_alloc_count() - tctest_bench_start_allocs) / iterations : -1;
+			result->instructions_per_op = instructions >= 0 && tctest_bench_start_instructions >= 0 ?
+				(double)(instructions - tctest_bench_start_instructions) / iterations : -1;
+
+			printf("%ld iterations, %.1f ns/op", iterations, result->ns_per_op);
+			if (result->allocs_per_op >= 0) {
+				printf(", %.2f allocs/op", result->allocs_per_op);
+			}
+			if (result->instructions_per_op >= 0) {
+				printf(", %.0f instructions/op", result->instructions_per_op);
+			}
+			printf("\n");
+			return 0;
+		}
+
+		/* aim 20% past the minimum duration, growing at least 2x and at most 100x */
+		double target = elapsed > 0 ? 1.2 * iterations * tctest_bench_min_ns / elapsed : 100.0 * iterations;
+		long next = target < 2.0 * iterations ? 2 * iterations :
+		            target > 100.0 * iterations ? 100 * iterations : (long)target;
+		iterations = next < TCTEST_BENCH_MAX_ITERATIONS ? next : TCTEST_BENCH_MAX_ITERATIONS;
+	} else {
+		iterations = 1;
+	}
+
+	tctest_bench_start_allocs = tctest_bench_alloc_count ? tctest_bench_alloc_count() : 0;
+	tctest_bench_start_instructions = tctest_bench_instructions();
+	tctest_bench_start_ns = tctest_bench_now();
+	return iterations;
+}
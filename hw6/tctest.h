@@ -110,6 +110,78 @@ extern void (*tctest_on_complete)(int num_passed, int num_executed);
 	siglongjmp(tctest_env, 1); \
 } while (0)
 
+/*
+ * Benchmarks.  A benchmark function has the same signature as a test
+ * function plus an iteration count:
+ *
+ *   void func(TestObjs *objs, long iterations)
+ *
+ * and must run the operation being measured that many times.
+ * BENCH(func) calls it with growing iteration counts until one run
+ * takes at least tctest_bench_min_ns nanoseconds, prints the cost per
+ * operation of that run, and passes it to tctest_on_bench_executed.
+ * An ASSERT failing inside a benchmark counts as a test failure.
+ */
+typedef struct {
+	const char *name;
+	long iterations;
+	double ns_per_op;
+	double allocs_per_op;		/* -1 if tctest_bench_alloc_count is not set */
+	double instructions_per_op;	/* -1 if hardware counters are unavailable */
+} tctest_bench_result;
+
+/* Minimum duration of the reported run, one second by default */
+extern long tctest_bench_min_ns;
+
+/*
+ * If this function pointer is set to a non-null value, it must return
+ * the number of allocations made so far by the calling thread, and
+ * benchmarks report allocations per operation.
+ */
+extern unsigned long (*tctest_bench_alloc_count)(void);
+
+/*
+ * If this function pointer is set to a non-null value, it will be
+ * called after every benchmark that completed.
+ */
+extern void (*tctest_on_bench_executed)(const tctest_bench_result *result);
+
+/*
+ * Drives the iteration counts of BENCH: ends the run of the previous
+ * count (0 on the first call), and returns the next count to run, or
+ * 0 once a run was long enough.
+ */
+long tctest_bench_next(tctest_bench_result *result, long iterations);
+
+#define BENCH(func) do { \
+	if (!tctest_testname_to_execute || strcmp(tctest_testname_to_execute, #func) == 0) { \
+		tctest_num_executed++; \
+		tctest_assertion_line = -1; \
+		if (sigsetjmp(tctest_env, 1) == 0) { \
+			TestObjs *t = setup(); \
+			tctest_bench_result result = { #func, 0, 0, 0, 0 }; \
+			long iterations = 0; \
+			printf("%s...", #func); \
+			fflush(stdout); \
+			while ((iterations = tctest_bench_next(&result, iterations)) > 0) { \
+				func(t, iterations); \
+			} \
+			cleanup(t); \
+			if (tctest_on_test_executed) { \
+				tctest_on_test_executed(#func, 1); \
+			} \
+			if (tctest_on_bench_executed) { \
+				tctest_on_bench_executed(&result); \
+			} \
+		} else { \
+			tctest_failures++; \
+			if (tctest_on_test_executed) { \
+				tctest_on_test_executed(#func, 0); \
+			} \
+		} \
+	} \
+} while (0)
+
 #define TEST_FINI() do { \
 	if (tctest_failures == 0) { \
 		printf("All tests passed!\n"); \
@@ -0,0 +1,87 @@
+#!/bin/bash
+#
+# Helpers of the server test scripts, sourced with the script arguments:
+#
+#     PORT=15200
+#     . ./testlib.sh "$@"
+#
+# Those arguments go to every server the script starts, e.g.
+# "./txnTest.sh --coro-threads 2". A script ends with finish, and may
+# replace cleanup to remove its files, calling stop_all itself.
+#
+
+failures=0
+pid=
+pids=()
+extra=("$@")
+
+# send lines to a server and print its answers
+ask() {
+	local port=$1; shift
+	exec 3<>/dev/tcp/127.0.0.1/$port || return 1
+	for line in "$@"; do printf '%s\n' "$line" >&3; done
+	printf 'quit\n' >&3
+	timeout 3 cat <&3
+	exec 3<&-
+}
+
+check() {
+	local name=$1 expected=$2 actual=$3
+	if [ "$expected" == "$actual" ]; then
+		echo "$name...passed!"
+	else
+		echo "$name...failed: expected '$expected', got '$actual'"
+		failures=$((failures + 1))
+	fi
+}
+
+# start a server on PORT, its pid goes to pid
+start() {
+	start_on $PORT "$@"
+}
+
+start_on() {
+	./calcServer "$@" "${extra[@]}" > /dev/null 2>&1 &
+	pid=$!
+	pids+=($pid)
+	sleep 0.3
+}
+
+# stop the last server started, cleanly or without any chance to save
+stop() {
+	kill $pid 2> /dev/null
+	wait $pid 2> /dev/null
+}
+
+crash() {
+	kill -9 $pid 2> /dev/null
+	wait $pid 2> /dev/null
+}
+
+stop_all() {
+	kill "${pids[@]}" 2> /dev/null
+	wait "${pids[@]}" 2> /dev/null
+	pids=()
+}
+
+# metrics scraped over plain bash
+scrape() {
+	exec 5<>/dev/tcp/127.0.0.1/$1 || return 1
+	printf 'GET /metrics HTTP/1.0\r\n\r\n' >&5
+	timeout 2 cat <&5
+	exec 5<&-
+}
+
+cleanup() {
+	stop_all
+}
+trap 'exec 4<&- 2> /dev/null; cleanup' EXIT
+
+finish() {
+	if [ $failures -eq 0 ]; then
+		echo "All tests passed!"
+	else
+		echo "$failures test(s) failed"
+	fi
+	exit $failures
+}
@@ -0,0 +1,182 @@
+#include "trace.h"
+#include "logger.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define TRACE_BUFFER_SPANS 4096         // Spans kept per thread, the oldest are overwritten
+
+/// A recorded span
+struct TraceEvent
+{
+    uint64_t request;
+    uint64_t start_ns;
+    uint32_t duration_ns;
+    uint32_t session;
+    uint32_t kind;
+};
+
+/// Spans recorded by one thread. A buffer outlives its thread, so a dump still
+/// shows what exited sessions did, and is handed over to the next new thread.
+struct TraceBuffer
+{
+    pthread_mutex_t mutex;          // Only contended while dumping
+    size_t next;                    // Total spans recorded, next slot is next % TRACE_BUFFER_SPANS
+    int in_use;                     // Owned by a live thread, protected by the registry mutex
+    struct TraceBuffer * next_buffer;
+    struct TraceEvent events[TRACE_BUFFER_SPANS];
+};
+
+unsigned trace_sample_every = 0;
+
+static const char * _trace_span_names[TRACE_SPAN_KINDS] = { "read", "parse", "lock-wait", "eval", "write" };
+
+static atomic_uint_fast64_t _trace_next_request = 1;
+static pthread_mutex_t _trace_buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct TraceBuffer * _trace_buffers = NULL;
+static pthread_key_t _trace_buffer_key;
+static pthread_once_t _trace_buffer_key_once = PTHREAD_ONCE_INIT;
+static __thread struct TraceBuffer * _trace_buffer = NULL;
+
+// -- < Buffers > ----------------------------------------------------------------
+
+// Called when a thread exits, its spans stay around for the next thread
+static void _trace_buffer_release(void * ptr)
+{
+    struct TraceBuffer * buffer = ptr;
+    pthread_mutex_lock(&_trace_buffers_mutex);
+    buffer->in_use = 0;
+    pthread_mutex_unlock(&_trace_buffers_mutex);
+}
+
+static void _trace_buffer_key_create(void)
+{
+    pthread_key_create(&_trace_buffer_key, _trace_buffer_release);
+}
+
+// Buffer of the calling thread, reusing one left by an exited thread if possible
+static struct TraceBuffer * _trace_thread_buffer(void)
+{
+    if (_trace_buffer)
+        return _trace_buffer;
+
+    pthread_once(&_trace_buffer_key_once, _trace_buffer_key_create);
+    pthread_mutex_lock(&_trace_buffers_mutex);
+
+    struct TraceBuffer * buffer = _trace_buffers;
+    while (buffer && buffer->in_use)
+        buffer = buffer->next_buffer;
+
+    if (buffer == NULL)
+    {
+        buffer = calloc(1, sizeof(struct TraceBuffer));
+        if (buffer == NULL)
+        {
+            pthread_mutex_unlock(&_trace_buffers_mutex);
+            return NULL;
+        }
+        pthread_mutex_init(&buffer->mutex, NULL);
+        buffer->next_buffer = _trace_buffers;
+        _trace_buffers = buffer;
+    }
+    buffer->in_use = 1;
+
+    pthread_mutex_unlock(&_trace_buffers_mutex);
+    pthread_setspecific(_trace_buffer_key, buffer);
+
+    _trace_buffer = buffer;
+    return buffer;
+}
+
+// -- < Implementation > ---------------------------------------------------------
+
+void trace_set_sample(unsigned every)
+{
+    trace_sample_every = every;
+}
+
+void trace_session_init(TraceContext * ctx, uint32_t session)
+{
+    ctx->request = 0;
+    ctx->session = session;
+    ctx->last = 0;
+
+    // Spread sampled requests of different sessions instead of sampling them all at once
+    ctx->countdown = 1 + (trace_sample_every ? session % trace_sample_every : 0);
+}
+
+uint64_t trace_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+void trace_begin_request(TraceContext * ctx)
+{
+    unsigned every = trace_sample_every;
+    ctx->countdown = every ? every : 1;
+    if (every == 0)
+        return;
+
+    ctx->request = atomic_fetch_add_explicit(&_trace_next_request, 1, memory_order_relaxed);
+    ctx->last = trace_now();
+}
+
+void trace_record(TraceContext * ctx, enum TraceSpanKind kind)
+{
+    uint64_t start = ctx->last;
+    uint64_t end = trace_now();
+    ctx->last = end;
+
+    // A coroutine may record spans of one request from several threads, that is fine
+    struct TraceBuffer * buffer = _trace_thread_buffer();
+    if (buffer == NULL)
+        return;
+
+    pthread_mutex_lock(&buffer->mutex);
+    struct TraceEvent * event = &buffer->events[buffer->next++ % TRACE_BUFFER_SPANS];
+    event->request = ctx->request;
+    event->start_ns = start;
+    event->duration_ns = end - start > UINT32_MAX ? UINT32_MAX : end - start;
+    event->session = ctx->session;
+    event->kind = kind;
+    pthread_mutex_unlock(&buffer->mutex);
+}
+
+long trace_dump(const char * path)
+{
+    FILE * out = fopen(path, "w");
+    if (out == NULL)
+        return -1;
+
+    long spans = 0;
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    pthread_mutex_lock(&_trace_buffers_mutex);
+    for (struct TraceBuffer * buffer = _trace_buffers; buffer; buffer = buffer->next_buffer)
+    {
+        pthread_mutex_lock(&buffer->mutex);
+        size_t count = buffer->next < TRACE_BUFFER_SPANS ? buffer->next : TRACE_BUFFER_SPANS;
+        for (size_t i = buffer->next - count; i < buffer->next; i++)
+        {
+            struct TraceEvent * event = &buffer->events[i % TRACE_BUFFER_SPANS];
+            fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                         "\"pid\":1,\"tid\":%u,\"args\":{\"request\":%lu}}",
+                    spans ? "," : "", _trace_span_names[event->kind], event->start_ns / 1000.0,
+                    event->duration_ns / 1000.0, event->session, (unsigned long) event->request);
+            spans++;
+        }
+        pthread_mutex_unlock(&buffer->mutex);
+    }
+    pthread_mutex_unlock(&_trace_buffers_mutex);
+
+    fprintf(out, "\n]}\n");
+    if (fclose(out) != 0)
+        return -1;
+
+    LOG_INFO("Wrote %ld trace spans to %s\n", spans, path);
+    return spans;
+}
@@ -0,0 +1,100 @@
+/*
+    Sampled per-request tracing.
+
+    A sampled request records one span per phase (read, parse, lock wait,
+    eval, write) into a buffer owned by the recording thread, oldest spans
+    being overwritten. trace_dump writes every buffer as Chrome trace_event
+    JSON, to be opened in chrome://tracing or Perfetto. Requests that are
+    not sampled pay a single branch per phase.
+
+    Usage:
+        trace_start(&ctx);                      // decides if this request is sampled
+        ... read the request ...
+        trace_span(&ctx, TRACE_READ);           // records the time since trace_start
+        ... evaluate it ...
+        trace_span(&ctx, TRACE_EVAL);           // records the time since the last span
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Phases of a request
+enum TraceSpanKind
+{
+    TRACE_READ,
+    TRACE_PARSE,
+    TRACE_LOCK_WAIT,
+    TRACE_EVAL,
+    TRACE_WRITE,
+    TRACE_SPAN_KINDS
+};
+
+/// Tracing state of a session
+typedef struct TraceContext
+{
+    uint64_t request;               // Id of the request being traced, 0 if not sampled
+    uint32_t session;               // Shown as the thread id, so a session is one track
+    uint32_t countdown;             // Requests left until the next sampled one
+    uint64_t last;                  // End of the last span, in nanoseconds
+} TraceContext;
+
+/// Trace 1 out of this many requests, 0 disables tracing
+extern unsigned trace_sample_every;
+
+/// Summary:
+///     Set how often requests are traced, can be changed at any time
+/// Parameters:
+///     every : trace 1 out of every requests, 0 to stop tracing
+void trace_set_sample(unsigned every);
+
+/// Summary:
+///     Prepare the tracing state of a new session
+void trace_session_init(TraceContext * ctx, uint32_t session);
+
+/// Summary:
+///     Current time in nanoseconds, on the clock used by spans
+uint64_t trace_now(void);
+
+/// Summary:
+///     Give a sampled request its id and restart the countdown, use trace_start instead
+void trace_begin_request(TraceContext * ctx);
+
+/// Summary:
+///     Store a span ending now in the calling thread buffer, use trace_span instead
+void trace_record(TraceContext * ctx, enum TraceSpanKind kind);
+
+/// Summary:
+///     Start a new request, deciding whether it is traced
+static inline void trace_start(TraceContext * ctx)
+{
+    ctx->request = 0;
+    if (__builtin_expect(trace_sample_every == 0 || --ctx->countdown > 0, 1))
+        return;
+    trace_begin_request(ctx);
+}
+
+/// Summary:
+///     Record a span of the current request, from the end of the previous span (or the
+///     start of the request) until now. Does nothing if the request is not traced.
+/// Parameters:
+///     ctx  : session tracing state, may be NULL
+///     kind : phase the span covers
+static inline void trace_span(TraceContext * ctx, enum TraceSpanKind kind)
+{
+    if (__builtin_expect(ctx == NULL || ctx->request == 0, 1))
+        return;
+    trace_record(ctx, kind);
+}
+
+/// Summary:
+///     Write every recorded span as Chrome trace_event JSON
+/// Parameters:
+///     path : file to write, replaced if it exists
+/// Return:
+///     Amount of spans written, or -1 if the file could not be written
+long trace_dump(const char * path);
+
+#endif // TRACE_H
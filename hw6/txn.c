@@ -0,0 +1,235 @@
+#include "txn.h"
+#include "logger.h"
+#include <stdlib.h>
+#include <string.h>
+
+/// Variables of a transaction
+struct TxnNames
+{
+    size_t count;
+    char names[TXN_MAX_NAMES][CALC_KEY_SIZE];
+};
+
+struct Txn
+{
+    struct Calc * store;
+    StatRwLock * store_lock;
+    unsigned long snapshot;
+    struct Calc * scratch;          // Snapshot values read so far plus the transaction assignments
+    int doomed;                     // A read found its snapshot value lost, commit must replay
+    int overflow;                   // An assignment did not fit in writes
+    struct TxnNames reads;          // Read from the store, validated at commit
+    struct TxnNames writes;         // Assigned, applied at commit
+    size_t statement_count;
+    char * statements[TXN_MAX_STATEMENTS];
+    TxnResult results[TXN_MAX_STATEMENTS];
+};
+
+/// Names of a statement, before they are read from the snapshot
+struct TxnStatementNames
+{
+    Txn * txn;
+    int overflow;
+    struct TxnNames pending;
+};
+
+static int _txn_find(const struct TxnNames * names, const char * name)
+{
+    for (size_t i = 0; i < names->count; i++)
+        if (strcmp(names->names[i], name) == 0)
+            return 1;
+    return 0;
+}
+
+static int _txn_add(struct TxnNames * names, const char * name)
+{
+    if (_txn_find(names, name))
+        return 0;
+    if (names->count == TXN_MAX_NAMES)
+        return 1;
+    strcpy(names->names[names->count++], name);
+    return 0;
+}
+
+// Only names read before being assigned by the transaction come from the snapshot
+static void _txn_collect_read(void * ctx, const char * name, int assigned)
+{
+    struct TxnStatementNames * statement = ctx;
+    Txn * txn = statement->txn;
+
+    if (assigned || _txn_find(&txn->writes, name) || _txn_find(&txn->reads, name))
+        return;
+    statement->overflow |= _txn_add(&statement->pending, name);
+}
+
+static void _txn_collect_write(void * ctx, const char * name, int value)
+{
+    Txn * txn = ctx;
+    (void) value;
+    txn->overflow |= _txn_add(&txn->writes, name);
+}
+
+// Open a new snapshot with an empty scratch calculator
+static void _txn_open(Txn * txn)
+{
+    txn->scratch = calc_create_scratch();
+    calc_set_assign_hook(txn->scratch, _txn_collect_write, txn);
+    txn->doomed = 0;
+    txn->overflow = 0;
+    txn->reads.count = 0;
+    txn->writes.count = 0;
+
+    stat_rwlock_wrlock(txn->store_lock);
+    txn->snapshot = calc_snapshot_open(txn->store);
+    stat_rwlock_unlock(txn->store_lock);
+}
+
+static void _txn_close(Txn * txn)
+{
+    stat_rwlock_wrlock(txn->store_lock);
+    calc_snapshot_close(txn->store, txn->snapshot);
+    stat_rwlock_unlock(txn->store_lock);
+
+    calc_destroy(txn->scratch);
+    txn->scratch = NULL;
+}
+
+// Evaluate a statement on the scratch calculator, reading what it needs from the snapshot first
+static int _txn_run(Txn * txn, const char * expr, int * result)
+{
+    struct TxnStatementNames statement;
+    statement.txn = txn;
+    statement.overflow = 0;
+    statement.pending.count = 0;
+    calc_names(expr, _txn_collect_read, &statement);
+
+    if (statement.overflow || txn->reads.count + statement.pending.count > TXN_MAX_NAMES)
+    {
+        LOG_ERROR("Too many variables in a single transaction\n");
+        return FAILURE;
+    }
+
+    // calc_get_at only reads, and no counter update runs atomically while a snapshot is open
+    stat_rwlock_rdlock(txn->store_lock);
+    for (size_t i = 0; i < statement.pending.count; i++)
+    {
+        const char * name = statement.pending.names[i];
+        int value;
+        int found = calc_get_at(txn->store, name, txn->snapshot, &value);
+
+        if (found == SUCCESS)
+            calc_set(txn->scratch, name, value);
+        else if (found == CALC_SNAPSHOT_LOST)
+            txn->doomed = 1;
+        _txn_add(&txn->reads, name);
+    }
+    stat_rwlock_unlock(txn->store_lock);
+
+    int status = calc_eval(txn->scratch, expr, result);
+    if (txn->overflow)
+    {
+        LOG_ERROR("Too many variables in a single transaction\n");
+        return FAILURE;
+    }
+    return status;
+}
+
+static void _txn_free(Txn * txn)
+{
+    for (size_t i = 0; i < txn->statement_count; i++)
+        free(txn->statements[i]);
+    free(txn);
+}
+
+// -- < Implementation > ---------------------------------------------------------
+
+Txn * txn_begin(struct Calc * store, StatRwLock * store_lock)
+{
+    Txn * txn = malloc(sizeof(Txn));
+    if (txn == NULL)
+        return NULL;
+
+    txn->store = store;
+    txn->store_lock = store_lock;
+    txn->statement_count = 0;
+    _txn_open(txn);
+    return txn;
+}
+
+int txn_eval(Txn * txn, const char * expr, int * result)
+{
+    if (txn->statement_count == TXN_MAX_STATEMENTS)
+    {
+        LOG_ERROR("Too many statements in a single transaction\n");
+        return FAILURE;
+    }
+
+    TxnResult * statement = &txn->results[txn->statement_count];
+    statement->status = _txn_run(txn, expr, &statement->value);
+    txn->statements[txn->statement_count++] = strdup(expr);
+
+    *result = statement->value;
+    return statement->status;
+}
+
+int txn_commit(Txn * txn, TxnResult results[TXN_MAX_STATEMENTS], size_t * count, int * retries)
+{
+    int attempt = 0;
+    int committed = 0;
+
+    // Assignments that did not fit are lost, replaying would lose them again
+    while (!txn->overflow)
+    {
+        // Read only transactions saw a consistent snapshot, nothing to validate
+        int conflict = txn->doomed;
+        stat_rwlock_wrlock(txn->store_lock);
+        for (size_t i = 0; !conflict && txn->writes.count > 0 && i < txn->reads.count; i++)
+            conflict = calc_version_of(txn->store, txn->reads.names[i]) > txn->snapshot;
+
+        for (size_t i = 0; !conflict && i < txn->writes.count; i++)
+        {
+            int value;
+            if (calc_get(txn->scratch, txn->writes.names[i], &value))
+                calc_assign(txn->store, txn->writes.names[i], value);
+        }
+        stat_rwlock_unlock(txn->store_lock);
+        _txn_close(txn);
+
+        if (!conflict)
+        {
+            committed = 1;
+            break;
+        }
+        if (attempt == TXN_MAX_RETRIES)
+            break;
+
+        // Replay every statement on a fresh snapshot
+        attempt++;
+        _txn_open(txn);
+        for (size_t i = 0; i < txn->statement_count; i++)
+            txn->results[i].status = _txn_run(txn, txn->statements[i], &txn->results[i].value);
+    }
+
+    if (results)
+        memcpy(results, txn->results, txn->statement_count * sizeof(TxnResult));
+    if (count)
+        *count = txn->statement_count;
+    if (retries)
+        *retries = attempt;
+
+    if (!committed)
+    {
+        LOG_WARN("Transaction aborted after %d retries\n", attempt);
+        if (txn->scratch)
+            _txn_close(txn);
+    }
+
+    _txn_free(txn);
+    return committed ? 0 : 1;
+}
+
+void txn_abort(Txn * txn)
+{
+    _txn_close(txn);
+    _txn_free(txn);
+}
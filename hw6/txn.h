@@ -0,0 +1,71 @@
+/*
+    Multi-statement transactions with optimistic concurrency control.
+
+    A transaction opens a snapshot of the shared calculator and evaluates
+    its statements on a private scratch calculator: variables are read from
+    the snapshot the first time a statement needs them, and assignments
+    only land on the scratch copy. Reading takes the store lock, shared,
+    for one statement at a time and never waits for other transactions,
+    and writers don't wait for open snapshots either: overwritten values
+    are kept by the calculator for as long as a snapshot can read them.
+
+    Commit validates the read set: if any variable read was changed after
+    the snapshot, the statements are replayed against a fresh snapshot, up
+    to TXN_MAX_RETRIES times, before the transaction is aborted. Otherwise
+    the assignments are applied with calc_assign, so the assign hook (and
+    replication) sees them, all under one exclusive hold of the store lock.
+*/
+
+#ifndef TXN_H
+#define TXN_H
+
+#include <stddef.h>
+#include "calc.h"
+#include "statmutex.h"
+
+#define TXN_MAX_STATEMENTS 64       // Statements in one transaction
+#define TXN_MAX_NAMES 128           // Distinct variables read or written by one transaction
+#define TXN_MAX_RETRIES 3           // Replays on conflict before aborting
+
+typedef struct Txn Txn;
+
+/// Result of a committed statement
+typedef struct TxnResult
+{
+    int status;                     // SUCCESS or FAILURE, as returned by calc_eval
+    int value;
+} TxnResult;
+
+/// Summary:
+///     Start a transaction on a snapshot of the current store
+/// Parameters:
+///     store       : shared calculator
+///     store_lock : lock protecting store
+/// Return:
+///     Transaction object, or NULL if out of memory
+Txn * txn_begin(struct Calc * store, StatRwLock * store_lock);
+
+/// Summary:
+///     Evaluate a statement of the transaction, seeing the snapshot plus its own assignments
+/// Return:
+///     SUCCESS or FAILURE like calc_eval. Also FAILURE when the transaction has too many
+///     statements or variables
+int txn_eval(Txn * txn, const char * expr, int * result);
+
+/// Summary:
+///     Validate and apply the transaction, replaying it on conflict. The transaction
+///     is freed either way.
+/// Parameters:
+///     results : filled with the result of every statement as committed, may be NULL
+///     count   : amount of statements, may be NULL
+///     retries : replays that were needed, may be NULL
+/// Return:
+///     0 if committed, anything else if it was aborted because of conflicts or because
+///     it assigned too many variables
+int txn_commit(Txn * txn, TxnResult results[TXN_MAX_STATEMENTS], size_t * count, int * retries);
+
+/// Summary:
+///     Discard the transaction and free it
+void txn_abort(Txn * txn);
+
+#endif // TXN_H
@@ -0,0 +1,49 @@
+#!/bin/bash
+#
+# Transaction test: two sessions on one server, one inside begin/commit
+# and the other writing concurrently. Checks snapshot reads, replay on
+# conflict, abort and that a session left open does not leak its writes.
+#
+
+PORT=15200
+. ./testlib.sh "$@"
+
+# send one line on the long lived session (fd 4) and print the answer
+say() {
+	local answer
+	printf '%s\n' "$1" >&4
+	read -r -t 2 -u 4 answer
+	printf '%s' "$answer"
+}
+
+start
+ask $PORT "a = 1" > /dev/null
+exec 4<>/dev/tcp/127.0.0.1/$PORT
+
+# the transaction keeps reading its snapshot while another session writes
+say begin > /dev/null
+check testSnapshotRead "1" "$(say a)"
+ask $PORT "a = 10" > /dev/null
+check testSnapshotRepeatable "1" "$(say a)"
+check testOwnWrites "2" "$(say 'b = a * 2')"
+check testUncommittedHidden "Error" "$(ask $PORT b)"
+
+# a was changed after the snapshot, so commit replays on a fresh one
+check testReplayOnConflict "Ok 10 10 20" "$(say commit)"
+check testCommitted "20" "$(ask $PORT b)"
+
+say begin > /dev/null
+say "c = 5" > /dev/null
+check testAbort "Ok" "$(say abort)"
+check testAborted "Error" "$(ask $PORT c)"
+
+say begin > /dev/null
+say a > /dev/null
+check testReadOnly "Ok 10" "$(say commit)"
+check testNoTransaction "Error no transaction" "$(say commit)"
+
+# a transaction left open by a closed session is dropped
+ask $PORT begin "d = 1" > /dev/null
+check testDisconnect "Error" "$(ask $PORT d)"
+
+finish
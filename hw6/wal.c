@@ -0,0 +1,550 @@
+#include "wal.h"
+#include "logger.h"
+#include "coro.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WAL_INITIAL_BUFFER (64 * 1024)
+#define WAL_RECORD_MAX (1 + CALC_KEY_SIZE + 4 + 4)
+#define WAL_NO_ROTATION ((size_t) -1)
+#define WAL_MAX_POOLED_WAKE_FDS 64      // eventfds kept for the next waiters
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+/// Records waiting for the log writer
+struct WalBuffer
+{
+    char * data;
+    size_t length;
+    size_t capacity;
+};
+
+/// Session parked in wal_wait until the writer is done with its records
+struct WalWaiter
+{
+    uint64_t appended;              // Last record of the session
+    int wake_fd;                    // eventfd written by the log writer
+    int done;
+    struct WalWaiter * next;
+};
+
+struct Wal
+{
+    pthread_mutex_t mutex;          // Protects everything below but the writer's own fields
+    pthread_cond_t pending_cond;    // Signaled when records are appended in commit mode, or on close
+    pthread_cond_t written_cond;    // Broadcast after every batch, for wal_checkpoint
+    struct WalBuffer pending;
+    uint64_t appended;              // Records appended so far, the last one's sequence number
+    uint64_t written;               // Records written, and synced unless the mode is none
+    size_t flushing;                // Bytes of the batch the writer is busy with
+    size_t rotate_at;               // Offset in pending where the new file starts, WAL_NO_ROTATION if none
+    int has_old;                    // <path>.old exists, or will once the writer rotates
+    int rotating;                   // The writer is moving to a new file
+    int running;
+    int failed;                     // A batch could not be written or synced, nothing is written after it
+    struct WalWaiter * waiters;
+    int wake_fds[WAL_MAX_POOLED_WAKE_FDS];
+    size_t pooled_wake_fds;
+    WalStats stats;
+
+    // Log writer fields
+    struct WalBuffer writing;
+    int fd;
+    pthread_t thread;
+
+    WalSync sync;
+    unsigned interval_ms;
+    char path[PATH_MAX];
+    char old_path[PATH_MAX];
+};
+
+// Last record appended by this thread, for wal_wait
+static __thread uint64_t _wal_appended_here = 0;
+
+static uint64_t _wal_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint32_t _wal_hash(const unsigned char * data, size_t length)
+{
+    uint32_t hash = FNV_OFFSET;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ data[i]) * FNV_PRIME;
+    return hash;
+}
+
+static uint32_t _wal_get_u32(const unsigned char * data)
+{
+    return data[0] | (uint32_t) data[1] << 8 | (uint32_t) data[2] << 16 | (uint32_t) data[3] << 24;
+}
+
+static void _wal_put_u32(unsigned char * data, uint32_t value)
+{
+    for (size_t i = 0; i < 4; i++)
+        data[i] = (unsigned char) (value >> (8 * i));
+}
+
+// -- < Replay > -----------------------------------------------------------------
+
+// Apply the valid records of a log file
+// Return: length of the valid prefix, -1 if the file could not be read
+static long _wal_replay_file(const char * path, struct Calc * calc, uint64_t * records)
+{
+    FILE * file = fopen(path, "rb");
+    if (file == NULL)
+        return errno == ENOENT ? 0 : -1;
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+
+    unsigned char * data = malloc(size > 0 ? size : 1);
+    if (data == NULL || fread(data, 1, size, file) != (size_t) size)
+    {
+        free(data);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    long offset = 0;
+    while (offset < size)
+    {
+        int deleted = (data[offset] & WAL_DELETE_FLAG) != 0;
+        size_t length = data[offset] & ~WAL_DELETE_FLAG;
+        size_t record = 1 + length + (deleted ? 0 : 4) + 4;
+        if (length == 0 || length >= CALC_KEY_SIZE || (size_t) (size - offset) < record)
+            break;
+        if (_wal_hash(data + offset, record - 4) != _wal_get_u32(data + offset + record - 4))
+            break;
+
+        char name[CALC_KEY_SIZE];
+        memcpy(name, data + offset + 1, length);
+        name[length] = '\0';
+        if (deleted)
+            calc_delete(calc, name);
+        else
+            calc_set(calc, name, (int) _wal_get_u32(data + offset + 1 + length));
+
+        offset += record;
+        (*records)++;
+    }
+
+    if (offset < size)
+        LOG_WARN("Log %s ends with %ld bytes of an incomplete record, ignored\n", path, size - offset);
+
+    free(data);
+    return offset;
+}
+
+// -- < Log writer > -------------------------------------------------------------
+
+// Return: 0 on success, -1 if the records could not all be written
+static int _wal_write(Wal * wal, const char * data, size_t length)
+{
+    size_t written = 0;
+    while (written < length)
+    {
+        ssize_t n = write(wal->fd, data + written, length - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            LOG_ERROR("Could not write the log %s: %s\n", wal->path, n < 0 ? strerror(errno) : "nothing written");
+            return -1;
+        }
+        written += n;
+    }
+    return 0;
+}
+
+// Return: 0 on success, -1 if the records may not be on disk
+static int _wal_sync(Wal * wal, uint64_t * sync_ns)
+{
+    uint64_t start = _wal_now();
+    int res = fdatasync(wal->fd);
+    *sync_ns = _wal_now() - start;
+    if (res != 0)
+        LOG_ERROR("Could not sync the log %s: %s\n", wal->path, strerror(errno));
+    return res != 0 ? -1 : 0;
+}
+
+// Close the current file as <path>.old and start a new one
+// Return: 0 on success, -1 if the records of the current file may not be on disk or there is no new file
+static int _wal_switch_file(Wal * wal)
+{
+    int res = fdatasync(wal->fd);
+    if (res != 0)
+        LOG_ERROR("Could not sync the log %s: %s\n", wal->path, strerror(errno));
+    close(wal->fd);
+    if (rename(wal->path, wal->old_path) != 0)
+        LOG_ERROR("Could not rotate the log %s: %s\n", wal->path, strerror(errno));
+    wal->fd = open(wal->path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (wal->fd < 0)
+        LOG_ERROR("Could not open the log %s: %s\n", wal->path, strerror(errno));
+    return res != 0 || wal->fd < 0 ? -1 : 0;
+}
+
+// Write a batch, and sync it unless the mode is none
+// Return: 0 on success, -1 if some record of it may be lost
+static int _wal_flush(Wal * wal, const struct WalBuffer * batch, size_t rotate_at, uint64_t * sync_ns, int * synced)
+{
+    if (rotate_at != WAL_NO_ROTATION)
+    {
+        if (_wal_write(wal, batch->data, rotate_at) != 0 || _wal_switch_file(wal) != 0 ||
+            _wal_write(wal, batch->data + rotate_at, batch->length - rotate_at) != 0)
+            return -1;
+    }
+    else if (batch->length > 0 && _wal_write(wal, batch->data, batch->length) != 0)
+        return -1;
+
+    if (wal->sync != WAL_SYNC_NONE && batch->length > 0)
+    {
+        *synced = 1;
+        return _wal_sync(wal, sync_ns);
+    }
+    return 0;
+}
+
+// Wake the sessions whose records are written, or will never be. Called with the mutex held.
+static void _wal_wake_waiters(Wal * wal)
+{
+    struct WalWaiter ** link = &wal->waiters;
+    while (*link)
+    {
+        struct WalWaiter * waiter = *link;
+        if (waiter->appended > wal->written && !wal->failed)
+        {
+            link = &waiter->next;
+            continue;
+        }
+
+        *link = waiter->next;
+        waiter->done = 1;
+        uint64_t one = 1;
+        if (write(waiter->wake_fd, &one, sizeof(one)) < 0)
+            LOG_ERROR("Could not wake a session waiting for the log: %s\n", strerror(errno));
+    }
+}
+
+static void * _wal_main(void * args)
+{
+    Wal * wal = (Wal *) args;
+    pthread_mutex_lock(&wal->mutex);
+
+    while (wal->running || wal->pending.length > 0 || wal->rotate_at != WAL_NO_ROTATION)
+    {
+        if (wal->running && wal->sync == WAL_SYNC_COMMIT)
+        {
+            while (wal->running && wal->pending.length == 0 && wal->rotate_at == WAL_NO_ROTATION)
+                pthread_cond_wait(&wal->pending_cond, &wal->mutex);
+        }
+        else if (wal->running)
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (long) (wal->interval_ms % 1000) * 1000000;
+            deadline.tv_sec += wal->interval_ms / 1000 + deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            pthread_cond_timedwait(&wal->pending_cond, &wal->mutex, &deadline);
+        }
+
+        // Take every record appended so far, sessions go on appending to the other buffer
+        struct WalBuffer batch = wal->pending;
+        wal->pending = wal->writing;
+        wal->pending.length = 0;
+        wal->writing = batch;
+        size_t rotate_at = wal->rotate_at;
+        wal->rotate_at = WAL_NO_ROTATION;
+        wal->rotating = rotate_at != WAL_NO_ROTATION;
+        uint64_t appended = wal->appended;
+        wal->flushing = batch.length;
+        pthread_mutex_unlock(&wal->mutex);
+
+        // After a failure the file may end with part of a batch, records after it would be lost on replay anyway
+        uint64_t sync_ns = 0;
+        int synced = 0;
+        int failed = wal->failed || _wal_flush(wal, &batch, rotate_at, &sync_ns, &synced) != 0;
+
+        pthread_mutex_lock(&wal->mutex);
+        if (failed)
+        {
+            if (!wal->failed)
+                LOG_ERROR("Log %s failed, records from now on are not written\n", wal->path);
+            __atomic_store_n(&wal->failed, 1, __ATOMIC_RELAXED);
+        }
+        else
+            wal->written = appended;
+        wal->flushing = 0;
+        wal->rotating = 0;
+        wal->stats.written_bytes += failed ? 0 : batch.length;
+        wal->stats.writes += batch.length > 0 && !failed;
+        wal->stats.syncs += synced;
+        wal->stats.sync_ns += sync_ns;
+        _wal_wake_waiters(wal);
+        pthread_cond_broadcast(&wal->written_cond);
+    }
+
+    pthread_mutex_unlock(&wal->mutex);
+    return NULL;
+}
+
+// -- < Implementation > ---------------------------------------------------------
+
+int wal_parse_sync(const char * name, WalSync * sync)
+{
+    if (strcmp(name, "none") == 0)
+        *sync = WAL_SYNC_NONE;
+    else if (strcmp(name, "interval") == 0)
+        *sync = WAL_SYNC_INTERVAL;
+    else if (strcmp(name, "commit") == 0)
+        *sync = WAL_SYNC_COMMIT;
+    else
+        return 1;
+    return 0;
+}
+
+Wal * wal_open(const char * path, WalSync sync, unsigned interval_ms, struct Calc * calc)
+{
+    Wal * wal = calloc(1, sizeof(Wal));
+    if (wal == NULL)
+        return NULL;
+
+    wal->sync = sync;
+    wal->interval_ms = interval_ms > 0 ? interval_ms : 1;
+    wal->rotate_at = WAL_NO_ROTATION;
+    if ((size_t) snprintf(wal->path, PATH_MAX, "%s", path) >= PATH_MAX ||
+        (size_t) snprintf(wal->old_path, PATH_MAX, "%s.old", path) >= PATH_MAX)
+    {
+        LOG_ERROR("Log path too long: %s\n", path);
+        free(wal);
+        return NULL;
+    }
+
+    // Replay, the records of the rotated file first
+    uint64_t start = _wal_now();
+    long old_length = _wal_replay_file(wal->old_path, calc, &wal->stats.replayed);
+    long length = _wal_replay_file(wal->path, calc, &wal->stats.replayed);
+    wal->stats.replay_ns = _wal_now() - start;
+    wal->has_old = old_length > 0 || access(wal->old_path, F_OK) == 0;
+    if (old_length < 0 || length < 0)
+    {
+        LOG_ERROR("Could not read the log %s: %s\n", path, strerror(errno));
+        free(wal);
+        return NULL;
+    }
+
+    // New records go after the last valid one, a torn record is cut off
+    struct stat st;
+    wal->fd = open(wal->path, O_WRONLY | O_CREAT, 0644);
+    if (wal->fd < 0 || fstat(wal->fd, &st) != 0 || (st.st_size > length && ftruncate(wal->fd, length) != 0) ||
+        lseek(wal->fd, 0, SEEK_END) < 0)
+    {
+        LOG_ERROR("Could not open the log %s: %s\n", path, strerror(errno));
+        if (wal->fd >= 0)
+            close(wal->fd);
+        free(wal);
+        return NULL;
+    }
+
+    wal->pending.capacity = wal->writing.capacity = WAL_INITIAL_BUFFER;
+    wal->pending.data = malloc(WAL_INITIAL_BUFFER);
+    wal->writing.data = malloc(WAL_INITIAL_BUFFER);
+    pthread_mutex_init(&wal->mutex, NULL);
+    pthread_cond_init(&wal->pending_cond, NULL);
+    pthread_cond_init(&wal->written_cond, NULL);
+    wal->running = 1;
+
+    if (wal->pending.data == NULL || wal->writing.data == NULL ||
+        pthread_create(&wal->thread, NULL, _wal_main, wal) != 0)
+    {
+        LOG_ERROR("Could not start the log writer\n");
+        close(wal->fd);
+        free(wal->pending.data);
+        free(wal->writing.data);
+        free(wal);
+        return NULL;
+    }
+
+    LOG_INFO("Replayed %lu records from %s in %lu us\n", wal->stats.replayed, path, wal->stats.replay_ns / 1000);
+    return wal;
+}
+
+void wal_close(Wal * wal)
+{
+    if (wal == NULL)
+        return;
+
+    pthread_mutex_lock(&wal->mutex);
+    wal->running = 0;
+    pthread_cond_signal(&wal->pending_cond);
+    pthread_mutex_unlock(&wal->mutex);
+    pthread_join(wal->thread, NULL);
+
+    // Records written in none mode are synced at least on a clean close
+    fdatasync(wal->fd);
+    close(wal->fd);
+    for (size_t i = 0; i < wal->pooled_wake_fds; i++)
+        close(wal->wake_fds[i]);
+    pthread_mutex_destroy(&wal->mutex);
+    pthread_cond_destroy(&wal->pending_cond);
+    pthread_cond_destroy(&wal->written_cond);
+    free(wal->pending.data);
+    free(wal->writing.data);
+    free(wal);
+}
+
+// Add a framed record to the pending buffer
+static void _wal_append_record(Wal * wal, const unsigned char * record, size_t size, const char * name, size_t payload)
+{
+    pthread_mutex_lock(&wal->mutex);
+
+    // The buffer grows while the writer is busy, appending never waits for the disk
+    if (wal->pending.length + size > wal->pending.capacity)
+    {
+        size_t capacity = wal->pending.capacity * 2;
+        char * data = realloc(wal->pending.data, capacity);
+        if (data == NULL)
+        {
+            pthread_mutex_unlock(&wal->mutex);
+            LOG_ERROR("Log buffer full, record of %s lost\n", name);
+            return;
+        }
+        wal->pending.data = data;
+        wal->pending.capacity = capacity;
+    }
+
+    memcpy(wal->pending.data + wal->pending.length, record, size);
+    wal->pending.length += size;
+    _wal_appended_here = ++wal->appended;
+    wal->stats.records++;
+    wal->stats.payload_bytes += payload;
+
+    if (wal->sync == WAL_SYNC_COMMIT)
+        pthread_cond_signal(&wal->pending_cond);
+    pthread_mutex_unlock(&wal->mutex);
+}
+
+void wal_append(Wal * wal, const char * name, int value)
+{
+    size_t length = strlen(name);
+    unsigned char record[WAL_RECORD_MAX];
+    record[0] = (unsigned char) length;
+    memcpy(record + 1, name, length);
+    _wal_put_u32(record + 1 + length, (uint32_t) value);
+    _wal_put_u32(record + 1 + length + 4, _wal_hash(record, 1 + length + 4));
+    _wal_append_record(wal, record, 1 + length + 8, name, length + 4);
+}
+
+void wal_append_delete(Wal * wal, const char * name)
+{
+    size_t length = strlen(name);
+    unsigned char record[WAL_RECORD_MAX];
+    record[0] = (unsigned char) (length | WAL_DELETE_FLAG);
+    memcpy(record + 1, name, length);
+    _wal_put_u32(record + 1 + length, _wal_hash(record, 1 + length));
+    _wal_append_record(wal, record, 1 + length + 4, name, length);
+}
+
+int wal_wait(Wal * wal)
+{
+    uint64_t appended = _wal_appended_here;
+    _wal_appended_here = 0;
+    if (wal == NULL || appended == 0)
+        return 0;
+    if (wal->sync != WAL_SYNC_COMMIT)
+        return __atomic_load_n(&wal->failed, __ATOMIC_RELAXED) ? -1 : 0;
+
+    // Parked on an eventfd rather than the mutex, so a coroutine lets the others of its thread run
+    pthread_mutex_lock(&wal->mutex);
+    struct WalWaiter waiter = { appended, -1, 0, NULL };
+    if (wal->written < appended && !wal->failed)
+    {
+        waiter.wake_fd = wal->pooled_wake_fds > 0 ? wal->wake_fds[--wal->pooled_wake_fds]
+                                                  : eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (waiter.wake_fd < 0)
+        {
+            LOG_ERROR("Could not wait for the log: %s\n", strerror(errno));
+            pthread_mutex_unlock(&wal->mutex);
+            return -1;
+        }
+        waiter.next = wal->waiters;
+        wal->waiters = &waiter;
+    }
+
+    while (waiter.wake_fd >= 0 && !waiter.done)
+    {
+        pthread_mutex_unlock(&wal->mutex);
+        coro_wait_fd(waiter.wake_fd, 0);
+        pthread_mutex_lock(&wal->mutex);
+    }
+
+    if (waiter.wake_fd >= 0)
+    {
+        uint64_t count;
+        if (read(waiter.wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            LOG_ERROR("Could not reset a log wake up: %s\n", strerror(errno));
+        if (wal->pooled_wake_fds < WAL_MAX_POOLED_WAKE_FDS)
+            wal->wake_fds[wal->pooled_wake_fds++] = waiter.wake_fd;
+        else
+            close(waiter.wake_fd);
+    }
+    int res = wal->written < appended ? -1 : 0;
+    pthread_mutex_unlock(&wal->mutex);
+    return res;
+}
+
+void wal_rotate(Wal * wal)
+{
+    pthread_mutex_lock(&wal->mutex);
+    if (!wal->has_old && wal->rotate_at == WAL_NO_ROTATION)
+    {
+        wal->rotate_at = wal->pending.length;
+        wal->has_old = 1;
+        pthread_cond_signal(&wal->pending_cond);
+    }
+    pthread_mutex_unlock(&wal->mutex);
+}
+
+void wal_checkpoint(Wal * wal, int saved)
+{
+    if (!saved)
+        return;
+
+    // The rotated file must be complete before it goes
+    pthread_mutex_lock(&wal->mutex);
+    while ((wal->rotate_at != WAL_NO_ROTATION || wal->rotating) && wal->running)
+        pthread_cond_wait(&wal->written_cond, &wal->mutex);
+    if (wal->has_old && wal->rotate_at == WAL_NO_ROTATION && !wal->rotating)
+    {
+        if (unlink(wal->old_path) == 0 || errno == ENOENT)
+            wal->has_old = 0;
+        else
+        {
+            LOG_ERROR("Could not delete the rotated log %s: %s\n", wal->old_path, strerror(errno));
+        }
+    }
+    pthread_mutex_unlock(&wal->mutex);
+}
+
+void wal_stats(Wal * wal, WalStats * stats)
+{
+    pthread_mutex_lock(&wal->mutex);
+    *stats = wal->stats;
+    stats->pending_records = wal->appended - wal->written;
+    stats->pending_bytes = wal->pending.length + wal->flushing;
+    stats->failed = wal->failed;
+    pthread_mutex_unlock(&wal->mutex);
+}
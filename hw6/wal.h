@@ -0,0 +1,122 @@
+/*
+    Write-ahead log of assignments, with group commit.
+
+    Sessions append records to an in-memory buffer while they hold the
+    store lock, so records are in the order the assignments happened. A
+    log writer thread takes the whole buffer at once and writes it with a
+    single write, followed by a single fdatasync, so every session that
+    appended meanwhile shares one sync. How long a client may wait for
+    that is the durability mode:
+
+        none     : written every interval, never synced, so the OS decides
+        interval : written and synced every interval, a crash loses at
+                   most the last interval
+        commit   : written and synced as soon as there is something to
+                   sync, and sessions wait for their records to be synced
+                   before answering
+
+    Records are { u8 length, name, i32 value, u32 FNV-1a hash } with
+    little endian integers. The removal of a variable, which expired or was
+    evicted, is { u8 length | WAL_DELETE_FLAG, name, u32 FNV-1a hash }. Replay stops at the first record that does not
+    hash right, which is how a write cut short by a crash looks, and the
+    log is truncated there before new records are appended.
+
+    A batch that can't be written or synced fails the log: nothing is
+    written after it, since replay would stop at a torn batch anyway, and
+    wal_wait reports the failure so sessions answer Error.
+
+    Snapshots make older records unnecessary: before a snapshot forks, the
+    log is rotated so later records go to a new file, and the previous one
+    (<path>.old) is deleted once the snapshot is in place. Replay reads
+    <path>.old, if there is one, then <path>.
+*/
+
+#ifndef WAL_H
+#define WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "calc.h"
+
+#define WAL_DEFAULT_INTERVAL_MS 10  // Group commit interval
+#define WAL_DELETE_FLAG 0x80        // Set in the length byte of a removal record
+
+/// When records are synced, and whether sessions wait for it
+typedef enum WalSync
+{
+    WAL_SYNC_NONE,
+    WAL_SYNC_INTERVAL,
+    WAL_SYNC_COMMIT
+} WalSync;
+
+typedef struct Wal Wal;
+
+/// Log statistics, for reports
+typedef struct WalStats
+{
+    uint64_t records;               // Records appended
+    uint64_t payload_bytes;         // Bytes of names and values appended
+    uint64_t written_bytes;         // Bytes written to the log, framing included
+    uint64_t writes;                // Batches written
+    uint64_t syncs;                 // fdatasync calls
+    uint64_t sync_ns;               // Time spent in fdatasync
+    uint64_t replayed;              // Records replayed when the log was opened
+    uint64_t replay_ns;
+    uint64_t pending_records;       // Records appended but not written yet, or not synced unless the mode is none
+    uint64_t pending_bytes;         // Bytes of those records
+    int failed;                     // A batch could not be written or synced, nothing is written since
+} WalStats;
+
+/// Summary:
+///     Parse a durability mode name: none, interval or commit
+/// Return:
+///     0 on success, anything else if the name is unknown
+int wal_parse_sync(const char * name, WalSync * sync);
+
+/// Summary:
+///     Replay a log into a calculator, then open it for appending and start the log writer
+/// Parameters:
+///     path        : log file, created if it does not exist
+///     sync        : durability mode
+///     interval_ms : group commit interval of the none and interval modes
+///     calc        : calculator the records are replayed into
+/// Return:
+///     Log object, or NULL if the log could not be opened
+Wal * wal_open(const char * path, WalSync sync, unsigned interval_ms, struct Calc * calc);
+
+/// Summary:
+///     Write and sync every record appended, stop the log writer and close the log
+void wal_close(Wal * wal);
+
+/// Summary:
+///     Append an assignment. Must be called with the store lock held exclusively.
+void wal_append(Wal * wal, const char * name, int value);
+
+/// Summary:
+///     Append the removal of a variable. Must be called with the store lock held exclusively.
+void wal_append_delete(Wal * wal, const char * name);
+
+/// Summary:
+///     In commit mode, wait until the records appended by the calling thread are synced.
+///     Called after releasing the store lock and before answering the client. Inside a
+///     coroutine only the coroutine waits, the others of its thread go on running.
+/// Return:
+///     0 on success, -1 if the log failed before the records were written, in any mode
+int wal_wait(Wal * wal);
+
+/// Summary:
+///     Send the records appended from now on to a new file, unless the previous one
+///     is still waiting for a snapshot. Must be called with the store lock held.
+void wal_rotate(Wal * wal);
+
+/// Summary:
+///     Delete the rotated file once a snapshot taken after wal_rotate is in place
+/// Parameters:
+///     saved : nonzero if the snapshot was written, the file is kept otherwise
+void wal_checkpoint(Wal * wal, int saved);
+
+/// Summary:
+///     Read the log statistics
+void wal_stats(Wal * wal, WalStats * stats);
+
+#endif // WAL_H
@@ -0,0 +1,203 @@
+/*
+	Write-ahead log benchmark.
+
+	Appender threads assign variables under one mutex, standing for the
+	store lock, and wait for their record like a session does, for a few
+	seconds in each durability mode. Then the log is replayed into a new
+	calculator. Reports, as one JSON object per mode:
+	  - records per second appended, and per group commit (fdatasync)
+	  - write amplification: bytes written to the log per payload byte
+	    (name and value), and bytes the kernel sent to storage per payload
+	    byte, from /proc/self/io, which counts the pages synced again
+	    because a later record landed on them
+	  - replay time and records replayed per second
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "calc.h"
+#include "logger.h"
+#include "wal.h"
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_SECONDS 2
+#define DEFAULT_VARIABLES 1000
+
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int running;
+static unsigned variables = DEFAULT_VARIABLES;
+
+struct Appender
+{
+	pthread_t thread;
+	Wal * wal;
+	unsigned id;
+	uint64_t records;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+// Bytes this process caused to be written to storage, -1 if unknown
+static long long storage_bytes(void)
+{
+	FILE * io = fopen("/proc/self/io", "r");
+	if (io == NULL)
+		return -1;
+
+	char line[128];
+	long long bytes = -1;
+	while (fgets(line, sizeof(line), io))
+		if (sscanf(line, "write_bytes: %lld", &bytes) == 1)
+			break;
+	fclose(io);
+	return bytes;
+}
+
+static void * append(void * args)
+{
+	struct Appender * appender = (struct Appender *) args;
+	char name[CALC_KEY_SIZE];
+	uint64_t i = 0;
+
+	while (running)
+	{
+		snprintf(name, sizeof(name), "var%lu", (i * 7919 + appender->id) % variables);
+		pthread_mutex_lock(&store_lock);
+		wal_append(appender->wal, name, (int) i);
+		pthread_mutex_unlock(&store_lock);
+		wal_wait(appender->wal);
+		i++;
+	}
+
+	appender->records = i;
+	return NULL;
+}
+
+static int run(const char * dir, const char * mode, int threads, unsigned seconds, unsigned interval_ms)
+{
+	char path[512];
+	snprintf(path, sizeof(path), "%s/walBench.%d.wal", dir, getpid());
+	WalSync sync;
+	wal_parse_sync(mode, &sync);
+
+	struct Calc * calc = calc_create();
+	Wal * wal = wal_open(path, sync, interval_ms, calc);
+	calc_destroy(calc);
+	if (wal == NULL)
+		return 1;
+
+	struct Appender * appenders = calloc(threads, sizeof(struct Appender));
+	long long storage_start = storage_bytes();
+	uint64_t start = now_ns();
+	running = 1;
+	for (int i = 0; i < threads; i++)
+	{
+		appenders[i].wal = wal;
+		appenders[i].id = i;
+		pthread_create(&appenders[i].thread, NULL, append, &appenders[i]);
+	}
+	sleep(seconds);
+	running = 0;
+
+	uint64_t records = 0;
+	for (int i = 0; i < threads; i++)
+	{
+		pthread_join(appenders[i].thread, NULL);
+		records += appenders[i].records;
+	}
+	double elapsed = (now_ns() - start) / 1e9;
+
+	WalStats stats;
+	wal_stats(wal, &stats);
+	wal_close(wal);
+	long long storage = storage_start < 0 ? -1 : storage_bytes() - storage_start;
+
+	// Recovery of everything just written
+	calc = calc_create();
+	uint64_t replay_start = now_ns();
+	wal = wal_open(path, sync, interval_ms, calc);
+	double replay = (now_ns() - replay_start) / 1e9;
+	WalStats replayed;
+	wal_stats(wal, &replayed);
+	wal_close(wal);
+	calc_destroy(calc);
+	unlink(path);
+	free(appenders);
+
+	printf("{\"mode\":\"%s\",\"threads\":%d,\"records\":%lu,\"records_per_s\":%.1f,\"syncs\":%lu,",
+		   mode, threads, records, records / elapsed, stats.syncs);
+	if (stats.syncs)
+		printf("\"records_per_sync\":%.2f,\"sync_us\":%.1f,", (double) stats.records / stats.syncs, stats.sync_ns / 1e3 / stats.syncs);
+	else
+		printf("\"records_per_sync\":null,\"sync_us\":null,");
+	printf("\"bytes_per_record\":%.2f,\"write_amplification\":%.3f,",
+		   (double) stats.written_bytes / stats.records, (double) stats.written_bytes / stats.payload_bytes);
+	if (storage >= 0)
+		printf("\"storage_amplification\":%.3f,", (double) storage / stats.payload_bytes);
+	else
+		printf("\"storage_amplification\":null,");
+	printf("\"replayed\":%lu,\"replay_ms\":%.2f,\"replay_records_per_s\":%.1f}\n",
+		   replayed.replayed, replay * 1e3, replayed.replayed / replay);
+	return 0;
+}
+
+static void usage(const char * program)
+{
+	fprintf(stderr, "Usage: %s [-d <dir>] [-c <threads>] [-t <seconds>] [-i <interval ms>] [-k <variables>] [mode ...]\n"
+					"  modes are none, interval and commit, all of them by default\n", program);
+	exit(1);
+}
+
+int main(int argc, char ** argv)
+{
+	const char * dir = ".";
+	int threads = DEFAULT_THREADS;
+	unsigned seconds = DEFAULT_SECONDS;
+	unsigned interval_ms = WAL_DEFAULT_INTERVAL_MS;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:c:t:i:k:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'd': dir = optarg; break;
+			case 'c': threads = atoi(optarg); break;
+			case 't': seconds = strtoul(optarg, NULL, 10); break;
+			case 'i': interval_ms = strtoul(optarg, NULL, 10); break;
+			case 'k': variables = strtoul(optarg, NULL, 10); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (threads < 1 || seconds < 1 || variables < 1)
+		usage(argv[0]);
+
+	static const char * modes[] = { "none", "interval", "commit" };
+	Logger * log = logger_get();
+	logger_set_level(LOG_LEVEL_WARN);
+
+	WalSync sync;
+	for (int i = optind; i < argc; i++)
+		if (wal_parse_sync(argv[i], &sync) != 0)
+			usage(argv[0]);
+
+	int status = 0;
+	if (optind == argc)
+		for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+			status |= run(dir, modes[i], threads, seconds, interval_ms);
+	else
+		for (int i = optind; i < argc; i++)
+			status |= run(dir, argv[i], threads, seconds, interval_ms);
+
+	logger_destroy(log);
+	return status;
+}
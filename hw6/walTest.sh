@@ -0,0 +1,106 @@
+#!/bin/bash
+#
+# Write-ahead log test: assignments of every kind are replayed by a
+# server started on the log of one that was killed, in each durability
+# mode. Also checks a torn record at the end of the log and the rotation
+# of the log by snapshots.
+#
+
+PORT=15600
+DIR=$(mktemp -d /tmp/calcWal.XXXXXX)
+. ./testlib.sh "$@"
+
+cleanup() {
+	stop_all
+	rm -rf "$DIR"
+}
+
+start
+check testDisabled "Error the write-ahead log is disabled" "$(ask $PORT walinfo)"
+crash
+
+# every way of assigning is logged
+start --wal "$DIR/interval.wal" --wal-interval 10
+ask $PORT "a = 1" "b = a + 1" "c = 5" "c += 2" "cas a 1 7" begin "d = b * 3" commit > /dev/null
+sleep 0.2
+crash
+start --wal "$DIR/interval.wal"
+check testReplayInterval "$(printf '7\n2\n7\n6')" "$(ask $PORT a b c d)"
+crash
+
+# in commit mode an answer means the record is on disk
+start --wal "$DIR/commit.wal" --wal-sync commit
+ask $PORT "x = 42" > /dev/null
+crash
+start --wal "$DIR/commit.wal" --wal-sync commit
+check testReplayCommit "42" "$(ask $PORT x)"
+crash
+
+start --wal "$DIR/none.wal" --wal-sync none --wal-interval 10
+ask $PORT "y = 3" > /dev/null
+sleep 0.2
+crash
+start --wal "$DIR/none.wal" --wal-sync none
+check testReplayNone "3" "$(ask $PORT y)"
+crash
+
+# records waiting for the writer are reported until it takes them
+start --wal "$DIR/pending.wal" --wal-sync none --wal-interval 1500 --metrics-port $((PORT + 1))
+ask $PORT "w = 1" "w = 2" > /dev/null
+check testPendingRecords "calc_wal_pending_records 2" "$(scrape $((PORT + 1)) | grep '^calc_wal_pending_records')"
+sleep 2
+check testNoPendingRecords "calc_wal_pending_bytes 0" "$(scrape $((PORT + 1)) | grep '^calc_wal_pending_bytes')"
+crash
+
+# sessions of one coroutine thread share the group commits
+start --wal "$DIR/coro.wal" --wal-sync commit --coro-threads 1
+letters=({a..z})
+sessions=()
+for i in 1 2 3 4; do
+	ask $PORT "k${letters[i]} = $i" "k${letters[i]} += 1" > "$DIR/coro.$i" &
+	sessions+=($!)
+done
+wait "${sessions[@]}"
+check testCoroutineCommits "2 3 4 5" "$(for i in 1 2 3 4; do tail -n 1 "$DIR/coro.$i"; done | paste -sd' ')"
+crash
+
+# a log that can't be written fails the assignments waiting for it
+start --wal /dev/full --wal-sync commit --metrics-port $((PORT + 1))
+check testWriteFailed "$(printf 'Error\n0')" "$(ask $PORT "f = 1" "f = 1" | head -n 1; ask $PORT "mset g=1" | grep -c Ok)"
+check testFailedReported "failed=1" "$(ask $PORT walinfo | grep -o 'failed=[0-9]*')"
+check testFailedCounted "$(printf 'calc_errors_total{kind="other"} 0\ncalc_errors_total{kind="log"} 3')" \
+	"$(scrape $((PORT + 1)) | grep -E '^calc_errors_total\{kind="(other|log)"\}')"
+crash
+
+start --wal /dev/full --wal-interval 10
+ask $PORT "f = 1" > /dev/null
+sleep 0.2
+check testFailedInterval "Error" "$(ask $PORT "f = 2" | cut -d' ' -f1)"
+crash
+
+# a record cut short is dropped, and what follows it is kept
+printf '\005ab' >> "$DIR/commit.wal"
+start --wal "$DIR/commit.wal" --wal-sync commit
+check testTornRecord "42" "$(ask $PORT x)"
+ask $PORT "z = 1" > /dev/null
+crash
+start --wal "$DIR/commit.wal" --wal-sync commit
+check testAfterTorn "$(printf '42\n1')" "$(ask $PORT x z)"
+crash
+
+# a snapshot makes the log it covers unnecessary
+start --wal "$DIR/snap.wal" --snapshot "$DIR/snap.snapshot"
+ask $PORT "p = 1" "q = 2" save > /dev/null
+for _ in $(seq 50); do
+	ask $PORT saveinfo | grep -q "saving=0 saves=1 " && break
+	sleep 0.1
+done
+ask $PORT "q = 3" > /dev/null
+sleep 0.2
+check testRotated "no" "$([ -e "$DIR/snap.wal.old" ] && echo yes || echo no)"
+crash
+start --wal "$DIR/snap.wal" --snapshot "$DIR/snap.snapshot"
+check testSnapshotAndLog "$(printf '1\n3')" "$(ask $PORT p q)"
+check testLogAfterSnapshot "replayed=1" "$(ask $PORT walinfo | grep -o 'replayed=[0-9]*')"
+
+finish
@@ -0,0 +1,324 @@
+#include "watch.h"
+#include "calc.h"
+#include "csapp.h"
+#include "logger.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define WATCH_LINE_SIZE (CALC_KEY_SIZE + 16)
+
+/// A variable watched by at least one subscriber
+struct WatchedVar
+{
+    char name[CALC_KEY_SIZE];
+    size_t watchers;
+    uint64_t seq;                   // Changes seen by the dispatcher, 0 until the first read
+    int defined;
+    int value;
+    char line[WATCH_LINE_SIZE];     // "<name>=<value>\n", encoded once per change
+    size_t line_len;
+    struct WatchedVar * next;
+};
+
+/// A watch of one subscriber
+struct WatchEntry
+{
+    struct WatchedVar * var;
+    uint64_t sent_seq;              // Last change copied to the subscriber buffer
+};
+
+struct WatchSubscriber
+{
+    int fd;
+    int busy;                       // Socket taken by the session or by the dispatcher
+    size_t count;
+    struct WatchEntry entries[WATCH_MAX_PER_SESSION];
+    size_t pending;                 // Bytes of buffer not sent yet
+    char buffer[WATCH_BUFFER_SIZE];
+    struct WatchSubscriber * next;
+};
+
+// Registry of watched variables and subscribers, the dispatcher holds it for a whole tick
+static pthread_mutex_t _watch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _watch_stopped = PTHREAD_COND_INITIALIZER;
+static struct WatchedVar * _watch_vars = NULL;
+static WatchSubscriber * _watch_subscribers = NULL;
+
+static pthread_t _watch_thread;
+static int _watch_running = 0;
+static unsigned _watch_interval_ms = WATCH_DEFAULT_INTERVAL_MS;
+static watch_read_fn _watch_read = NULL;
+static void * _watch_read_ctx = NULL;
+
+// -- < Registry > ---------------------------------------------------------------
+
+static int _watch_try_acquire(WatchSubscriber * sub)
+{
+    return __atomic_exchange_n(&sub->busy, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+static void _watch_release(WatchSubscriber * sub)
+{
+    __atomic_store_n(&sub->busy, 0, __ATOMIC_RELEASE);
+}
+
+// Drop a watcher of a variable, freeing it with the last one. Called with the registry locked.
+static void _watch_var_release(struct WatchedVar * var)
+{
+    if (--var->watchers > 0)
+        return;
+
+    for (struct WatchedVar ** link = &_watch_vars; *link; link = &(*link)->next)
+    {
+        if (*link == var)
+        {
+            *link = var->next;
+            break;
+        }
+    }
+    free(var);
+}
+
+// -- < Dispatcher > -------------------------------------------------------------
+
+// Read every watched variable and encode the ones that changed
+static void _watch_poll(void)
+{
+    for (struct WatchedVar * var = _watch_vars; var; var = var->next)
+    {
+        int value = 0;
+        int defined = _watch_read(_watch_read_ctx, var->name, &value) == SUCCESS;
+
+        if (var->seq > 0 && defined == var->defined && (!defined || value == var->value))
+            continue;
+
+        var->seq++;
+        var->defined = defined;
+        var->value = value;
+        if (defined)
+            var->line_len = snprintf(var->line, WATCH_LINE_SIZE, "%s=%d\n", var->name, value);
+        else
+            var->line_len = snprintf(var->line, WATCH_LINE_SIZE, "%s=?\n", var->name);
+    }
+}
+
+// Copy the changes the subscriber has not got yet, as long as they fit
+static void _watch_fill(WatchSubscriber * sub)
+{
+    for (size_t i = 0; i < sub->count; i++)
+    {
+        struct WatchEntry * entry = &sub->entries[i];
+        struct WatchedVar * var = entry->var;
+
+        if (var->seq == 0 || entry->sent_seq == var->seq)
+            continue;
+        if (sub->pending + var->line_len > WATCH_BUFFER_SIZE)
+            return;
+
+        memcpy(sub->buffer + sub->pending, var->line, var->line_len);
+        sub->pending += var->line_len;
+        entry->sent_seq = var->seq;
+    }
+}
+
+// Send what the socket takes without blocking
+static void _watch_flush(WatchSubscriber * sub)
+{
+    size_t sent = 0;
+    while (sent < sub->pending)
+    {
+        ssize_t n = send(sub->fd, sub->buffer + sent, sub->pending - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+
+    memmove(sub->buffer, sub->buffer + sent, sub->pending - sent);
+    sub->pending -= sent;
+}
+
+static void * _watch_main(void * args)
+{
+    (void) args;
+    pthread_mutex_lock(&_watch_mutex);
+
+    while (_watch_running)
+    {
+        _watch_poll();
+
+        // A subscriber whose session is writing a response gets its changes next tick
+        for (WatchSubscriber * sub = _watch_subscribers; sub; sub = sub->next)
+        {
+            if (!_watch_try_acquire(sub))
+                continue;
+            _watch_fill(sub);
+            _watch_flush(sub);
+            _watch_fill(sub);
+            _watch_release(sub);
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long) (_watch_interval_ms % 1000) * 1000000;
+        deadline.tv_sec += _watch_interval_ms / 1000 + deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&_watch_stopped, &_watch_mutex, &deadline);
+    }
+
+    pthread_mutex_unlock(&_watch_mutex);
+    return NULL;
+}
+
+// -- < Implementation > ---------------------------------------------------------
+
+int watch_start(unsigned interval_ms, watch_read_fn read, void * ctx)
+{
+    _watch_interval_ms = interval_ms > 0 ? interval_ms : 1;
+    _watch_read = read;
+    _watch_read_ctx = ctx;
+    _watch_running = 1;
+
+    if (pthread_create(&_watch_thread, NULL, _watch_main, NULL) != 0)
+    {
+        LOG_ERROR("Could not start the watch dispatcher\n");
+        _watch_running = 0;
+        return 1;
+    }
+    return 0;
+}
+
+void watch_stop(void)
+{
+    pthread_mutex_lock(&_watch_mutex);
+    int running = _watch_running;
+    _watch_running = 0;
+    pthread_cond_signal(&_watch_stopped);
+    pthread_mutex_unlock(&_watch_mutex);
+
+    if (running)
+        pthread_join(_watch_thread, NULL);
+}
+
+WatchSubscriber * watch_subscribe(int fd)
+{
+    WatchSubscriber * sub = calloc(1, sizeof(WatchSubscriber));
+    if (sub == NULL)
+        return NULL;
+    sub->fd = fd;
+
+    pthread_mutex_lock(&_watch_mutex);
+    sub->next = _watch_subscribers;
+    _watch_subscribers = sub;
+    pthread_mutex_unlock(&_watch_mutex);
+    return sub;
+}
+
+void watch_unsubscribe(WatchSubscriber * sub)
+{
+    pthread_mutex_lock(&_watch_mutex);
+    for (WatchSubscriber ** link = &_watch_subscribers; *link; link = &(*link)->next)
+    {
+        if (*link == sub)
+        {
+            *link = sub->next;
+            break;
+        }
+    }
+    for (size_t i = 0; i < sub->count; i++)
+        _watch_var_release(sub->entries[i].var);
+    pthread_mutex_unlock(&_watch_mutex);
+
+    free(sub);
+}
+
+int watch_add(WatchSubscriber * sub, const char * name)
+{
+    int status = 0;
+    pthread_mutex_lock(&_watch_mutex);
+
+    for (size_t i = 0; i < sub->count; i++)
+        if (strcmp(sub->entries[i].var->name, name) == 0)
+            goto done;
+
+    if (sub->count == WATCH_MAX_PER_SESSION)
+    {
+        status = 1;
+        goto done;
+    }
+
+    struct WatchedVar * var = _watch_vars;
+    while (var && strcmp(var->name, name) != 0)
+        var = var->next;
+
+    if (var == NULL)
+    {
+        var = calloc(1, sizeof(struct WatchedVar));
+        if (var == NULL)
+        {
+            status = 1;
+            goto done;
+        }
+        strncpy(var->name, name, CALC_KEY_SIZE - 1);
+        var->next = _watch_vars;
+        _watch_vars = var;
+    }
+
+    // sent_seq 0 never matches a read variable, so the current value goes out on the next tick
+    var->watchers++;
+    sub->entries[sub->count].var = var;
+    sub->entries[sub->count].sent_seq = 0;
+    sub->count++;
+
+done:
+    pthread_mutex_unlock(&_watch_mutex);
+    return status;
+}
+
+int watch_remove(WatchSubscriber * sub, const char * name)
+{
+    int status = 1;
+    pthread_mutex_lock(&_watch_mutex);
+
+    for (size_t i = 0; i < sub->count; i++)
+    {
+        if (strcmp(sub->entries[i].var->name, name) == 0)
+        {
+            _watch_var_release(sub->entries[i].var);
+            sub->entries[i] = sub->entries[--sub->count];
+            status = 0;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&_watch_mutex);
+    return status;
+}
+
+void watch_output_begin(WatchSubscriber * sub)
+{
+    if (sub == NULL)
+        return;
+
+    // The dispatcher only holds a subscriber for a few non-blocking sends
+    while (!_watch_try_acquire(sub))
+        sched_yield();
+
+    // A line the dispatcher could only send in part is completed before the response
+    if (sub->pending > 0)
+    {
+        rio_writen(sub->fd, sub->buffer, sub->pending);
+        sub->pending = 0;
+    }
+}
+
+void watch_output_end(WatchSubscriber * sub)
+{
+    if (sub != NULL)
+        _watch_release(sub);
+}
@@ -0,0 +1,80 @@
+/*
+    Variable watches with server-push notifications.
+
+    A session subscribes to variables with "watch <name>" and receives
+    "<name>=<value>" lines when they change ("<name>=?" once undefined).
+    A dispatcher thread reads every watched variable once per interval and
+    compares it with the value it saw last, so changes between two ticks
+    are coalesced into the latest value and every write path is covered,
+    including atomic counter updates and replicated writes.
+
+    A changed variable is encoded once, whatever the amount of watchers,
+    and copied into each subscriber output buffer. Buffers are flushed with
+    non-blocking sends. When a client does not read, its buffer stays full
+    and the subscriber is skipped: it remembers which change it last got
+    for every watch and catches up with only the latest values once its
+    buffer drains, so a slow client never holds more than one buffer.
+
+    Pushes and the responses of the session share the socket. The session
+    brackets each request with watch_output_begin/end, so the two never
+    interleave inside a line.
+*/
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stddef.h>
+
+#define WATCH_DEFAULT_INTERVAL_MS 100   // Coalescing interval
+#define WATCH_MAX_PER_SESSION 64        // Variables one session can watch
+#define WATCH_BUFFER_SIZE 4096          // Pending output of one subscriber
+
+typedef struct WatchSubscriber WatchSubscriber;
+
+/// Reads the current value of a variable for the dispatcher, returns SUCCESS or FAILURE
+typedef int (*watch_read_fn)(void * ctx, const char * name, int * value);
+
+/// Summary:
+///     Start the dispatcher thread
+/// Parameters:
+///     interval_ms : how often watched variables are checked
+///     read        : reads a variable, must be thread safe
+///     ctx         : passed to read
+/// Return:
+///     0 on success, anything else if the thread could not be started
+int watch_start(unsigned interval_ms, watch_read_fn read, void * ctx);
+
+/// Summary:
+///     Stop the dispatcher and drop every subscriber
+void watch_stop(void);
+
+/// Summary:
+///     Create a subscriber pushing to a session socket
+WatchSubscriber * watch_subscribe(int fd);
+
+/// Summary:
+///     Stop pushing to a subscriber and free it. Must be called before closing its socket.
+void watch_unsubscribe(WatchSubscriber * sub);
+
+/// Summary:
+///     Watch a variable. Its current value is pushed on the next tick.
+/// Return:
+///     0 on success, anything else if the subscriber watches too many variables
+int watch_add(WatchSubscriber * sub, const char * name);
+
+/// Summary:
+///     Stop watching a variable
+/// Return:
+///     0 on success, anything else if it was not watched
+int watch_remove(WatchSubscriber * sub, const char * name);
+
+/// Summary:
+///     Take the socket of the subscriber for a response, writing out pending pushes first.
+///     Does nothing if sub is NULL.
+void watch_output_begin(WatchSubscriber * sub);
+
+/// Summary:
+///     Give the socket back to the dispatcher
+void watch_output_end(WatchSubscriber * sub);
+
+#endif // WATCH_H
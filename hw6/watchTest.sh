@@ -0,0 +1,56 @@
+#!/bin/bash
+#
+# Watch test: one session watches variables while other sessions change
+# them. Checks the initial value, pushes on change, coalescing of changes
+# within an interval, undefined variables and unwatch.
+#
+
+PORT=15300
+. ./testlib.sh "$@"
+
+# send one line on the watching session (fd 4) and print the answer
+say() {
+	printf '%s\n' "$1" >&4
+	next
+}
+
+# print the next line pushed on the watching session, empty after the timeout
+next() {
+	local line
+	read -r -t ${1:-2} -u 4 line
+	printf '%s' "$line"
+}
+
+start --watch-interval 300
+ask $PORT "a = 1" > /dev/null
+exec 4<>/dev/tcp/127.0.0.1/$PORT
+
+check testWatch "Ok" "$(say 'watch a')"
+check testInitialValue "a=1" "$(next)"
+
+ask $PORT "a = 5" > /dev/null
+check testPushOnChange "a=5" "$(next)"
+
+ask $PORT "a += 2" > /dev/null
+check testCounterUpdate "a=7" "$(next)"
+
+# changes within one interval are pushed as the latest value
+ask $PORT "a = 8" "a = 9" "a = 10" > /dev/null
+check testCoalesced "a=10" "$(next)"
+check testCoalescedOnce "" "$(next 0.7)"
+
+# responses are not mixed with pushes
+check testResponse "20" "$(say 'a * 2')"
+
+check testWatchUndefined "Ok" "$(say 'watch b')"
+check testUndefined "b=?" "$(next)"
+ask $PORT "b = 3" > /dev/null
+check testDefined "b=3" "$(next)"
+
+check testUnwatch "Ok" "$(say 'unwatch a')"
+ask $PORT "a = 11" > /dev/null
+check testUnwatched "" "$(next 0.7)"
+check testUnwatchUnknown "Error" "$(say 'unwatch a')"
+check testUsage "Error usage: watch <name> | unwatch <name>" "$(say 'watch 1')"
+
+finish